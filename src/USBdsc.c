@@ -22,6 +22,9 @@
 
 */
 #include <stdint.h>
+#ifdef HOST_BUILD
+#include <stddef.h>
+#endif
 #include "USBdsc.h"
 
 #define STRING_INDEX_MANUFACTURER  1
@@ -35,24 +38,23 @@
 
 const uint16_t USB_VENDOR_ID  = IBM;
 const uint16_t USB_PRODUCT_ID = IBM_SK_8845B;
-const uint16_t USB_PRODUCT_VERSION = 0x0122; // Increment this (vv.rr) each time your device's firmware changes significantly
+const uint16_t USB_PRODUCT_VERSION = 0x0300; // Increment this (vv.rr, as VERSION in capslock.h) each time your device's firmware changes significantly
 const uint8_t  USB_BUS_POWERED = 0x80;       // D7    Reserved, must be set to 1
 const uint8_t  USB_SELF_POWERED = 0xC0;      // D7+D6 Self Powered
 const uint8_t  USB_REMOTE_WAKEUP = 0xA0;     // D7+D5 Remote wakeup (device can wake up host)
 
 const uint8_t  USB_MAX_POWER  = 50;          // Bus power required in units of 2 mA
 const uint8_t  USB_TRANSFER_TYPE = 0x03;     // 0x03 = Interrupt transfers
-const uint8_t  EP_IN_INTERVAL = 5;           // Measured in frame counts i.e. 1 ms units for Low Speed (1.5 Mbps) or Full Speed (12 Mbps), and 125 us units for High Speed (480 Mbps)
+const uint8_t  EP_IN_INTERVAL = EP_IN_INTERVAL_MS;   // (see POLLING_PROFILE) Measured in frame counts i.e. 1 ms units for Low Speed (1.5 Mbps) or Full Speed (12 Mbps), and 125 us units for High Speed (480 Mbps)
                                              // This device supports either Low Speed (FSEN=0, 6 MHz USB clock) or Full Speed (FSEN=1, 48 MHz USB clock) mode.
                                              // n x 1 millisecond units (for USB Low/Full Speed devices)
                                              // 2**(n-1) x 125 microsecond units (for USB2 High Speed devices)
                                              // The Host will interrupt the PIC for keyboard input this often.
 
-const uint8_t  EP_OUT_INTERVAL = 5;          // n x 1 millisecond units (for USB Low/Full Speed devices)
+const uint8_t  EP_OUT_INTERVAL = EP_OUT_INTERVAL_MS; // (see POLLING_PROFILE) n x 1 millisecond units (for USB Low/Full Speed devices)
                                              // 2**(n-1) x 125 microsecond units (for USB2 High Speed devices)
                                              // The Host will interrupt the PIC for LED status output at most this often (if LED status change is pending).
 
-const uint8_t  USB_INTERRUPT = 1;
 const uint8_t  USB_HID_EP = 1;               // End Point number
 
 /* Device Descriptor */
@@ -74,13 +76,13 @@ const struct
     uint8_t  bNumConfigurations;    // bNumConfigurations - Number of possible configurations
 } device_dsc = 
   {
-      18,                           // bLength
+      sizeof device_dsc,            // bLength
       0x01,                         // bDescriptorType
       0x0110,                       // bcdUSB   (USB 1.10)
       0x00,                         // bDeviceClass
       0x00,                         // bDeviceSubClass
       0x00,                         // bDeviceProtocol
-      8,                            // bMaxPacketSize0
+      EP0_PACKET_SIZE,              // bMaxPacketSize0
       USB_VENDOR_ID,                // idVendor
       USB_PRODUCT_ID,               // idProduct
       USB_PRODUCT_VERSION,          // bcdDevice
@@ -116,9 +118,18 @@ const struct
     |    |    |    |    |    |SCRL|CAPL|NUML| OUT: NumLock,CapsLock,ScrollLock - and 5 unused pad bits
     '---------------------------------------'
 
-  Mouse Input Report (PIC --> Host) 2 bytes as follows:
+  Feature Report (PIC <-> Host) 8 bytes on endpoint 0, to interface 1 (the
+  vendor interface): a vendor command (SET_REPORT) or the reply to the last
+  one (GET_REPORT), see telemetry.h
+
+  Mouse Input Report (PIC --> Host) 3 bytes on endpoint 3, from interface 2
+  (MOUSE_INTERFACE builds only). The keepalive sends it with every field 0:
     .---------------------------------------.
+    |    |    |    |    |    | MID|RGHT|LEFT| IN: Buttons - and 5 unused pad bits
+    |---------------------------------------|
     |                 X                     | IN: Relative movement along the X-axis
+    |---------------------------------------|
+    |                 Y                     | IN: Relative movement along the Y-axis
     '---------------------------------------'
 */
 
@@ -132,52 +143,146 @@ const struct
   0x19, 0xE0,                  /*   (LOCAL)  USAGE_MINIMUM      0x000700E0 Keyboard Left Control (DV=Dynamic Value) */ \
   0x29, 0xE7,                  /*   (LOCAL)  USAGE_MAXIMUM      0x000700E7 Keyboard Right GUI (DV=Dynamic Value) */ \
   0x25, 0x01,                  /*   (GLOBAL) LOGICAL_MAXIMUM    0x01 (1) */ \
-  0x75, 0x01,                  /*   (GLOBAL) REPORT_SIZE        0x01 (1) Number of bits per field */ \
-  0x95, 0x08,                  /*   (GLOBAL) REPORT_COUNT       0x08 (8) Number of fields */ \
+  0x75, IN_MODIFIERS_BITS,      /*   (GLOBAL) REPORT_SIZE        0x01 (1) Number of bits per field */ \
+  0x95, IN_MODIFIERS_COUNT,     /*   (GLOBAL) REPORT_COUNT       0x08 (8) Number of fields */ \
   0x81, 0x02,                  /*   (MAIN)   INPUT              0x00000002 (8 fields x 1 bit) 0=Data 1=Variable 0=Absolute 0=NoWrap 0=Linear 0=PrefState 0=NoNull 0=NonVolatile 0=Bitmap */ \
-  0x75, 0x08,                  /*   (GLOBAL) REPORT_SIZE        0x08 (8) Number of bits per field */ \
-  0x95, 0x01,                  /*   (GLOBAL) REPORT_COUNT       0x01 (1) Number of fields */ \
+  0x75, IN_RESERVED_BITS,       /*   (GLOBAL) REPORT_SIZE        0x08 (8) Number of bits per field */ \
+  0x95, IN_RESERVED_COUNT,      /*   (GLOBAL) REPORT_COUNT       0x01 (1) Number of fields */ \
   0x81, 0x03,                  /*   (MAIN)   INPUT              0x00000003 (1 field x 8 bits) 1=Constant 1=Variable 0=Absolute 0=NoWrap 0=Linear 0=PrefState 0=NoNull 0=NonVolatile 0=Bitmap */ \
   0x26, 0xFF, 0x00,            /*   (GLOBAL) LOGICAL_MAXIMUM    0x00FF (255) */ \
   0x19, 0x00,                  /*   (LOCAL)  USAGE_MINIMUM      0x00070000 Keyboard No event indicated (Sel=Selector) <-- Redundant: USAGE_MINIMUM is already 0x0000 */ \
   0x2A, 0xFF, 0x00,            /*   (LOCAL)  USAGE_MAXIMUM      0x000700FF */ \
-  0x95, 0x06,                  /*   (GLOBAL) REPORT_COUNT       0x06 (1) Number of fields */ \
+  0x75, IN_KEYS_BITS,           /*   (GLOBAL) REPORT_SIZE        0x08 (8) Number of bits per field (not left to the pad byte's IN_RESERVED_BITS) */ \
+  0x95, IN_KEYS_COUNT,          /*   (GLOBAL) REPORT_COUNT       0x06 (6) Number of fields */ \
   0x81, 0x00,                  /*   (MAIN)   INPUT              0x00000000 (6 fields x 8 bits) 0=Data 0=Array 0=Absolute 0=Ignored 0=Ignored 0=PrefState 0=NoNull */ \
 \
-  0x75, 0x01,                  /*   (GLOBAL) REPORT_SIZE        0x01 (1) Number of bits per field */ \
-  0x95, 0x03,                  /*   (GLOBAL) REPORT_COUNT       0x03 (3) Number of fields */ \
+  0x75, OUT_LEDS_BITS,          /*   (GLOBAL) REPORT_SIZE        0x01 (1) Number of bits per field */ \
+  0x95, OUT_LEDS_COUNT,         /*   (GLOBAL) REPORT_COUNT       0x03 (3) Number of fields */ \
   0x05, 0x08,                  /*   (GLOBAL) USAGE_PAGE         0x0008 LED Indicator Page */ \
   0x19, 0x01,                  /*   (LOCAL)  USAGE_MINIMUM      0x00080001 Num Lock (OOC=On/Off Control) */ \
   0x29, 0x03,                  /*   (LOCAL)  USAGE_MAXIMUM      0x00080003 Scroll Lock (OOC=On/Off Control) */ \
   0x25, 0x01,                  /*   (GLOBAL) LOGICAL_MAXIMUM    0x01 (1) */ \
   0x91, 0x02,                  /*   (MAIN)   OUTPUT             0x00000002 (3 fields x 1 bit) 0=Data 1=Variable 0=Absolute 0=NoWrap 0=Linear 0=PrefState 0=NoNull 0=NonVolatile 0=Bitmap */ \
-  0x75, 0x05,                  /*   (GLOBAL) REPORT_SIZE        0x05 (5) Number of bits per field */ \
-  0x95, 0x01,                  /*   (GLOBAL) REPORT_COUNT       0x01 (1) Number of fields */ \
+  0x75, OUT_PAD_BITS,           /*   (GLOBAL) REPORT_SIZE        0x05 (5) Number of bits per field */ \
+  0x95, OUT_PAD_COUNT,          /*   (GLOBAL) REPORT_COUNT       0x01 (1) Number of fields */ \
   0x91, 0x03,                  /*   (MAIN)   OUTPUT             0x00000003 (1 field x 5 bits) 1=Constant 1=Variable 0=Absolute 0=NoWrap 0=Linear 0=PrefState 0=NoNull 0=NonVolatile 0=Bitmap */ \
   0xC0,                        /* (MAIN)   END_COLLECTION     Application */ \
 
-REPORT_DESCRIPTOR(hid_rpt_desc);  // Build the HID report descriptor structure (it MUST be called hid_rpt_desc)
-const uint8_t  USB_HID_RPT_SIZE = sizeof hid_rpt_desc; // This constant MUST be defined
+REPORT_DESCRIPTOR(hid_rpt_desc);  // Build the HID report descriptor
+
+// The vendor interface's report descriptor: one feature report and nothing
+// else, so no host driver takes the interface for itself
+#undef STRING
+#define STRING \
+  0x06, 0x00, 0xFF,            /* (GLOBAL) USAGE_PAGE         0xFF00 Vendor-defined Page */ \
+  0x09, 0x01,                  /* (LOCAL)  USAGE              0xFF000001 Vendor commands (CA=Application Collection) */ \
+  0xA1, 0x01,                  /* (MAIN)   COLLECTION         0x01 Application (Usage=0xFF000001: Page=Vendor-defined Page, Type=CA) */ \
+  0x09, 0x01,                  /*   (LOCAL)  USAGE              0xFF000001 Vendor command or reply (see telemetry.h) */ \
+  0x15, 0x00,                  /*   (GLOBAL) LOGICAL_MINIMUM    0x00 (0) */ \
+  0x26, 0xFF, 0x00,            /*   (GLOBAL) LOGICAL_MAXIMUM    0x00FF (255) */ \
+  0x75, FEATURE_BITS,          /*   (GLOBAL) REPORT_SIZE        0x08 (8) Number of bits per field */ \
+  0x95, FEATURE_COUNT,         /*   (GLOBAL) REPORT_COUNT       0x08 (8) Number of fields */ \
+  0xB1, 0x02,                  /*   (MAIN)   FEATURE            0x00000002 (8 fields x 8 bits) 0=Data 1=Variable 0=Absolute 0=NoWrap 0=Linear 0=PrefState 0=NoNull 0=NonVolatile 0=Bitmap */ \
+  0xC0,                        /* (MAIN)   END_COLLECTION     Application */ \
+
+REPORT_DESCRIPTOR(vendor_rpt_desc);  // Build the vendor interface's report descriptor
+
+#if MOUSE_INTERFACE
+#undef STRING
+#define STRING \
+  0x05, 0x01,                  /* (GLOBAL) USAGE_PAGE         0x0001 Generic Desktop Page */ \
+  0x09, 0x02,                  /* (LOCAL)  USAGE              0x00010002 Mouse (CA=Application Collection) */ \
+  0xA1, 0x01,                  /* (MAIN)   COLLECTION         0x01 Application (Usage=0x00010002: Page=Generic Desktop Page, Usage=Mouse, Type=CA) */ \
+  0x09, 0x01,                  /*   (LOCAL)  USAGE              0x00010001 Pointer (CP=Physical Collection) */ \
+  0xA1, 0x00,                  /*   (MAIN)   COLLECTION         0x00 Physical (Usage=0x00010001: Page=Generic Desktop Page, Usage=Pointer, Type=CP) */ \
+  0x05, 0x09,                  /*     (GLOBAL) USAGE_PAGE         0x0009 Button Page */ \
+  0x19, 0x01,                  /*     (LOCAL)  USAGE_MINIMUM      0x00090001 Button 1 Primary/trigger (MULTI=Selector, On/Off, Momentary, or One Shot) */ \
+  0x29, 0x03,                  /*     (LOCAL)  USAGE_MAXIMUM      0x00090003 Button 3 Tertiary (MULTI=Selector, On/Off, Momentary, or One Shot) */ \
+  0x15, 0x00,                  /*     (GLOBAL) LOGICAL_MINIMUM    0x00 (0) */ \
+  0x25, 0x01,                  /*     (GLOBAL) LOGICAL_MAXIMUM    0x01 (1) */ \
+  0x75, MOUSE_BUTTONS_BITS,    /*     (GLOBAL) REPORT_SIZE        0x01 (1) Number of bits per field */ \
+  0x95, MOUSE_BUTTONS_COUNT,   /*     (GLOBAL) REPORT_COUNT       0x03 (3) Number of fields */ \
+  0x81, 0x02,                  /*     (MAIN)   INPUT              0x00000002 (3 fields x 1 bit) 0=Data 1=Variable 0=Absolute 0=NoWrap 0=Linear 0=PrefState 0=NoNull 0=NonVolatile 0=Bitmap */ \
+  0x75, MOUSE_PAD_BITS,        /*     (GLOBAL) REPORT_SIZE        0x05 (5) Number of bits per field */ \
+  0x95, MOUSE_PAD_COUNT,       /*     (GLOBAL) REPORT_COUNT       0x01 (1) Number of fields */ \
+  0x81, 0x03,                  /*     (MAIN)   INPUT              0x00000003 (1 field x 5 bits) 1=Constant 1=Variable 0=Absolute 0=NoWrap 0=Linear 0=PrefState 0=NoNull 0=NonVolatile 0=Bitmap */ \
+  0x05, 0x01,                  /*     (GLOBAL) USAGE_PAGE         0x0001 Generic Desktop Page */ \
+  0x09, 0x30,                  /*     (LOCAL)  USAGE              0x00010030 X (DV=Dynamic Value) */ \
+  0x09, 0x31,                  /*     (LOCAL)  USAGE              0x00010031 Y (DV=Dynamic Value) */ \
+  0x15, 0x81,                  /*     (GLOBAL) LOGICAL_MINIMUM    0x81 (-127) */ \
+  0x25, 0x7F,                  /*     (GLOBAL) LOGICAL_MAXIMUM    0x7F (127) */ \
+  0x75, MOUSE_AXES_BITS,       /*     (GLOBAL) REPORT_SIZE        0x08 (8) Number of bits per field */ \
+  0x95, MOUSE_AXES_COUNT,      /*     (GLOBAL) REPORT_COUNT       0x02 (2) Number of fields */ \
+  0x81, 0x06,                  /*     (MAIN)   INPUT              0x00000006 (2 fields x 8 bits) 0=Data 1=Variable 1=Relative 0=NoWrap 0=Linear 0=PrefState 0=NoNull 0=NonVolatile 0=Bitmap */ \
+  0xC0,                        /*   (MAIN)   END_COLLECTION     Physical */ \
+  0xC0,                        /* (MAIN)   END_COLLECTION     Application */ \
+
+REPORT_DESCRIPTOR(mouse_rpt_desc);  // Build the mouse's report descriptor
+
+STATIC_ASSERT(mouse_report_bytes, HID_MOUSE_REPORT_BITS % 8 == 0);
+#endif
+
+STATIC_ASSERT(report_descriptor_size, sizeof hid_rpt_desc <= 255);           // (hosts read it in one control transfer)
+STATIC_ASSERT(input_report_bytes, HID_INPUT_REPORT_BITS % 8 == 0);
+STATIC_ASSERT(output_report_bytes, HID_OUTPUT_REPORT_BITS % 8 == 0);
+STATIC_ASSERT(feature_report_packet, HID_FEATURE_REPORT_SIZE == EP0_PACKET_SIZE); // (usb.c takes SET_REPORT data in one packet)
+STATIC_ASSERT(ep_out_packet, EP_OUT_PACKET_SIZE >= HID_OUTPUT_REPORT_SIZE && EP_OUT_PACKET_SIZE <= 64);
+STATIC_ASSERT(ep_in_packet, EP_IN_PACKET_SIZE <= 64);                        // Full speed interrupt endpoint limit
 
 /* Configuration 1 Descriptor */
-const uint8_t configDescriptor1[] =
+typedef struct
 {
-    // Configuration Descriptor
-    0x09,                   // bLength             - Descriptor size in bytes
-    0x02,                   // bDescriptorType     - The constant CONFIGURATION (02h)
-    WORD(41),               // wTotalLength        - The number of bytes in the configuration descriptor and all of its subordinate descriptors
-    1,                      // bNumInterfaces      - Number of interfaces in the configuration
+  t_configurationDsc config;
+  t_interfaceDsc     keyboard;
+  t_hidDsc           keyboardHid;
+  t_endpointDsc      keyboardIn;
+  t_endpointDsc      keyboardOut;
+  t_interfaceDsc     vendor;
+  t_hidDsc           vendorHid;
+  t_endpointDsc      vendorIn;
+#if MOUSE_INTERFACE
+  t_interfaceDsc     mouse;
+  t_hidDsc           mouseHid;
+  t_endpointDsc      mouseIn;
+#endif
+} t_configuration1;
+
+#define CONFIG1_INTERFACES    USB_INTERFACES
+#define KEYBOARD_ENDPOINTS    2
+#define VENDOR_ENDPOINTS      1
+#define MOUSE_ENDPOINTS       1
+
+// Fail the build if a descriptor is added to t_configuration1 without
+// updating the counts above (or a layout is not its standard size)
+STATIC_ASSERT(config1_layout, sizeof (t_configuration1) ==
+  sizeof (t_configurationDsc) +
+  CONFIG1_INTERFACES * (sizeof (t_interfaceDsc) + sizeof (t_hidDsc)) +
+  (KEYBOARD_ENDPOINTS + VENDOR_ENDPOINTS + MOUSE_INTERFACE * MOUSE_ENDPOINTS) * sizeof (t_endpointDsc));
+STATIC_ASSERT(config_dsc_size, sizeof (t_configurationDsc) == 9);
+STATIC_ASSERT(interface_dsc_size, sizeof (t_interfaceDsc) == 9);
+STATIC_ASSERT(hid_dsc_size, sizeof (t_hidDsc) == 9);
+STATIC_ASSERT(endpoint_dsc_size, sizeof (t_endpointDsc) == 7);
+STATIC_ASSERT(device_dsc_size, sizeof device_dsc == 18);
+
+const t_configuration1 configDescriptor1 =
+{
+  // Configuration Descriptor: wTotalLength is the size of t_configuration1
+  CONFIGURATION_DSC(t_configuration1,
+    CONFIG1_INTERFACES,     // bNumInterfaces      - Number of interfaces in the configuration
     1,                      // bConfigurationValue - Identifier for Set Configuration and Get Configuration requests
     STRING_INDEX_CONFIG,    // iConfiguration      - Index of string descriptor for the configuration (0 means no descriptor)
+#if REMOTE_WAKEUP
+    USB_REMOTE_WAKEUP,      // bmAttributes        - Self/bus power and remote wakeup settings
+#else
     USB_BUS_POWERED,        // bmAttributes        - Self/bus power and remote wakeup settings
-    USB_MAX_POWER,          // bMaxPower           - Bus power required in units of 2 mA
+#endif
+    USB_MAX_POWER),         // bMaxPower           - Bus power required in units of 2 mA
 
-    // Interface Descriptor
-    0x09,                   // bLength - Descriptor size in bytes (09h)
-    0x04,                   // bDescriptorType - The constant Interface (04h)
+  // Interface Descriptor
+  INTERFACE_DSC(
     0,                      // bInterfaceNumber - Number identifying this interface
     0,                      // bAlternateSetting - A number that identifies a descriptor with alternate settings for this bInterfaceNumber.
-    2,                      // bNumEndpoint - Number of endpoints supported not counting endpoint zero
+    KEYBOARD_ENDPOINTS,     // bNumEndpoint - Number of endpoints supported not counting endpoint zero
     0x03,                   // bInterfaceClass - Class code  (0x03 = HID)
     1,                      // bInterfaceSubclass - Subclass code (0x00 = No Subclass)
     1,                      // bInterfaceProtocol - Protocol code (0x00 = No protocol)
@@ -192,57 +297,128 @@ const uint8_t configDescriptor1[] =
                             //   3       1       2     Class=HID, Subclass=BOOT device, Protocol=mouse
                             // The above information is documented in Appendix E.3 "Interface Descriptor (Keyboard)"
                             // of the "Device Class Definition for Human Interface Devices (HID) v1.11" document (HID1_11.pdf) from www.usb.org
-    STRING_INDEX_PRODUCT,   // iInterface - Interface string index
+    STRING_INDEX_PRODUCT),  // iInterface - Interface string index
 
-    // HID Class-Specific Descriptor
-    0x09,                   // bLength - Descriptor size in bytes.
-    0x21,                   // bDescriptorType - This descriptor's type: 21h to indicate the HID class.
-    WORD(0x0110),           // bcdHID - HID specification release number (BCD) 01.10
+  // HID Class-Specific Descriptor: one report descriptor, hid_rpt_desc
+  HID_DSC(
+    0x0110,                 // bcdHID - HID specification release number (BCD) 01.10
     0x00,                   // bCountryCode - Numeric expression identifying the country for localized hardware (BCD) or 00h.
-    1,                      // bNumDescriptors - Number of subordinate report and physical descriptors.
-    0x22,                   // bDescriptorType - The type of a class-specific descriptor that follows
-    WORD(USB_HID_RPT_SIZE), // wDescriptorLength - Total length of the descriptor identified above
+    hid_rpt_desc),          // wDescriptorLength - Total length of the report descriptor
 
-    // Endpoint Descriptor - Inbound to host (i.e. key press codes)
-    0x07,                   // bLength - Descriptor size in bytes (07h)
-    0x05,                   // bDescriptorType - The constant Endpoint (05h)
+  // Endpoint Descriptor - Inbound to host (i.e. key press codes)
+  ENDPOINT_DSC(
     USB_HID_EP | 0x80,      // bEndpointAddress - Endpoint number (0x01) and direction (0x80 = IN to host)
     USB_TRANSFER_TYPE,      // bmAttributes - Transfer type and supplementary information
-    WORD(8),                // wMaxPacketSize - Maximum packet size supported
+    EP_IN_PACKET_SIZE,      // wMaxPacketSize - Maximum packet size supported (one input report)
                             // This determines the size of the transmission time slot allocated to this device
-    EP_IN_INTERVAL,         // bInterval - Service interval or NAK rate
+    EP_IN_INTERVAL),        // bInterval - Service interval or NAK rate
 
-    // Endpoint Descriptor - Outbound from host (i.e. LED indicator status bits)
-    0x07,                   // bLength - Descriptor size in bytes (07h)
-    0x05,                   // bDescriptorType - The constant Endpoint (05h)
+  // Endpoint Descriptor - Outbound from host (i.e. LED indicator status bits)
+  ENDPOINT_DSC(
     USB_HID_EP,             // bEndpointAddress - Endpoint number (0x01) and direction (0x00 = OUT from host)
     USB_TRANSFER_TYPE,      // bmAttributes - Transfer type and supplementary information
-    WORD(8),                // wMaxPacketSize - Maximum packet size supported
+    EP_OUT_PACKET_SIZE,     // wMaxPacketSize - Maximum packet size supported
                             // This determines the size of the transmission time slot allocated to this device
-    EP_OUT_INTERVAL         // bInterval - Service interval or NAK rate
+    EP_OUT_INTERVAL),       // bInterval - Service interval or NAK rate
+
+  // Interface Descriptor - the vendor commands of telemetry.h, as feature reports on endpoint 0
+  INTERFACE_DSC(
+    USB_VENDOR_INTERFACE,   // bInterfaceNumber - Number identifying this interface
+    0,                      // bAlternateSetting
+    VENDOR_ENDPOINTS,       // bNumEndpoint - (HID requires an interrupt IN endpoint)
+    0x03,                   // bInterfaceClass - Class code  (0x03 = HID)
+    0,                      // bInterfaceSubclass - Subclass code (0x00 = No Subclass)
+    0,                      // bInterfaceProtocol - Protocol code (0x00 = No protocol)
+    0),                     // iInterface - Interface string index (0 means none)
+
+  // HID Class-Specific Descriptor: one report descriptor, vendor_rpt_desc
+  HID_DSC(
+    0x0110,                 // bcdHID - HID specification release number (BCD) 01.10
+    0x00,                   // bCountryCode - Not localized
+    vendor_rpt_desc),       // wDescriptorLength - Total length of the report descriptor
+
+  // Endpoint Descriptor - Inbound to host, but it never has anything to send
+  // (usb.c only ever answers it with NAK)
+  ENDPOINT_DSC(
+    EP2_IN_ADDRESS,         // bEndpointAddress - Endpoint number (0x02) and direction (0x80 = IN to host)
+    USB_TRANSFER_TYPE,      // bmAttributes - Transfer type and supplementary information
+    EP0_PACKET_SIZE,        // wMaxPacketSize - (no packet is ever sent)
+    255)                    // bInterval - As seldom as the host allows
+#if MOUSE_INTERFACE
+  ,
+  // Interface Descriptor - a mouse that only ever reports no movement (the KEEPALIVE_MOUSE keepalive)
+  INTERFACE_DSC(
+    USB_MOUSE_INTERFACE,    // bInterfaceNumber - Number identifying this interface
+    0,                      // bAlternateSetting
+    MOUSE_ENDPOINTS,        // bNumEndpoint - Number of endpoints supported not counting endpoint zero
+    0x03,                   // bInterfaceClass - Class code  (0x03 = HID)
+    0,                      // bInterfaceSubclass - Subclass code (0x00 = No Subclass: no boot protocol)
+    0,                      // bInterfaceProtocol - Protocol code (0x00 = No protocol)
+    0),                     // iInterface - Interface string index (0 means none)
+
+  // HID Class-Specific Descriptor: one report descriptor, mouse_rpt_desc
+  HID_DSC(
+    0x0110,                 // bcdHID - HID specification release number (BCD) 01.10
+    0x00,                   // bCountryCode - Not localized
+    mouse_rpt_desc),        // wDescriptorLength - Total length of the report descriptor
+
+  // Endpoint Descriptor - Inbound to host (one report per keepalive)
+  ENDPOINT_DSC(
+    EP3_IN_ADDRESS,         // bEndpointAddress - Endpoint number (0x03) and direction (0x80 = IN to host)
+    USB_TRANSFER_TYPE,      // bmAttributes - Transfer type and supplementary information
+    EP_MOUSE_PACKET_SIZE,   // wMaxPacketSize - Maximum packet size supported (one input report)
+    EP_IN_INTERVAL)         // bInterval - Service interval or NAK rate
+#endif
 };
 
 
 
-#undef STRING
-#define STRING 0x0409
-STRING_DESCRIPTOR(Language);      // Build the language code string descriptor
+LANGUAGE_DESCRIPTOR(Language, 0x0409);  // Build the language code string descriptor (US English)
 
 #undef STRING
 #define STRING 'L','i','t','e','-','O','n',' ','T','e','c','h','n','o','l','o','g','y',' ','C','o','r','p','.'
-STRING_DESCRIPTOR(Manufacturer);  // Build the manufacturer string descriptor
+STRING_DESCRIPTOR(Manufacturer, "Lite-On Technology Corp.");  // Build the manufacturer string descriptor
 
 #undef STRING
 #define STRING 'T','h','i','n','k','P','a','d',' ','U','S','B',' ','K','e','y','b','o','a','r','d',' ','w','i','t','h',' ','T','r','a','c','k','P','o','i','n','t'
-STRING_DESCRIPTOR(Product);       // Build the product string descriptor
+STRING_DESCRIPTOR(Product, "ThinkPad USB Keyboard with TrackPoint");  // Build the product string descriptor
 
-const uint8_t * USB_config_dsc_ptr[1];  // Array of configuration descriptors
-const uint8_t * USB_string_dsc_ptr[3];  // Array of string descriptors
+// The descriptor directory is in ROM too, so nothing needs setting up at run time
+const t_usbDescriptor usbDescriptors[] =
+{
+  {0x01, 0,                         (const uint8_t *) &device_dsc,                    sizeof device_dsc},
+  {0x02, 0,                         (const uint8_t *) &configDescriptor1,             sizeof configDescriptor1},
+  {0x03, 0,                         (const uint8_t *) &Language,                      sizeof Language},     // String index 0 is the language id
+  {0x03, STRING_INDEX_MANUFACTURER, (const uint8_t *) &Manufacturer,                  sizeof Manufacturer},
+  {0x03, STRING_INDEX_PRODUCT,      (const uint8_t *) &Product,                       sizeof Product},
+  {0x21, 0,                         (const uint8_t *) &configDescriptor1.keyboardHid, sizeof (t_hidDsc)},      // HID and report descriptors: index = interface
+  {0x22, 0,                         hid_rpt_desc,                                     sizeof hid_rpt_desc},
+  {0x21, USB_VENDOR_INTERFACE,      (const uint8_t *) &configDescriptor1.vendorHid,   sizeof (t_hidDsc)},
+  {0x22, USB_VENDOR_INTERFACE,      vendor_rpt_desc,                                  sizeof vendor_rpt_desc}
+#if MOUSE_INTERFACE
+  ,
+  {0x21, USB_MOUSE_INTERFACE,       (const uint8_t *) &configDescriptor1.mouseHid,    sizeof (t_hidDsc)},
+  {0x22, USB_MOUSE_INTERFACE,       mouse_rpt_desc,                                   sizeof mouse_rpt_desc}
+#endif
+};
+const uint8_t USB_DESCRIPTORS = sizeof usbDescriptors / sizeof usbDescriptors[0];
 
-void USB_Init_Desc()
+#ifdef HOST_BUILD
+#define PIC_POINTER_SIZE 2  // mikroC pointers to program memory
+
+const t_dscFootprint usbDscFootprint[] =
 {
-  USB_config_dsc_ptr[0] = &configDescriptor1;
-  USB_string_dsc_ptr[0]                         = (const uint8_t *) &Language;    // Index 0 MUST be the language code array pointer
-  USB_string_dsc_ptr[STRING_INDEX_MANUFACTURER] = (const uint8_t *) &Manufacturer;
-  USB_string_dsc_ptr[STRING_INDEX_PRODUCT]      = (const uint8_t *) &Product;
-}
\ No newline at end of file
+  {"device",        (const uint8_t *) &device_dsc,        sizeof device_dsc,        0},
+  {"configuration", (const uint8_t *) &configDescriptor1, sizeof configDescriptor1, 0},
+  {"report",        hid_rpt_desc,                         sizeof hid_rpt_desc,      0},
+  {"vendor report", vendor_rpt_desc,                      sizeof vendor_rpt_desc,   0},
+#if MOUSE_INTERFACE
+  {"mouse report",  mouse_rpt_desc,                       sizeof mouse_rpt_desc,    0},
+#endif
+  {"language",      (const uint8_t *) &Language,          sizeof Language,          0},
+  {"manufacturer",  (const uint8_t *) &Manufacturer,      sizeof Manufacturer,      0},
+  {"product",       (const uint8_t *) &Product,           sizeof Product,           0},
+  {"directory",     NULL, sizeof usbDescriptors / sizeof usbDescriptors[0] * (2 + PIC_POINTER_SIZE + 2), 0},
+  {NULL, NULL, 0, 0}
+};
+#endif
@@ -1,31 +1,214 @@
+// Set REMOTE_WAKEUP to 1 to advertise remote wakeup in the configuration
+// descriptor and to let the keepalive wake a suspended host
+#ifndef REMOTE_WAKEUP
+#define REMOTE_WAKEUP 0
+#endif
+
+// Set MOUSE_INTERFACE to 1 to add a mouse (interface 2) for the
+// KEEPALIVE_MOUSE keepalive payload (see capslock.h). It only ever reports
+// no movement and no buttons.
+#ifndef MOUSE_INTERFACE
+#define MOUSE_INTERFACE 0
+#endif
+
+// Set POLLING_PROFILE to choose how often the host polls the keyboard
+// endpoints (bInterval of both endpoint descriptors):
+//   POLLING_STANDARD     5 ms
+//   POLLING_LOW_LATENCY  1 ms - the LED follows CapsLock within a frame
+//   POLLING_QUIET       32 ms - fewer transactions on a shared hub. Hosts
+//                        round full speed intervals down to a power of 2
+//                        (up to 32 ms), so this one is granted as is.
+// The host decides in the end: POLL_CMD_MEASURE (see telemetry.h) reports
+// the polling period it actually granted.
+#define POLLING_STANDARD     0
+#define POLLING_LOW_LATENCY  1
+#define POLLING_QUIET        2
+#ifndef POLLING_PROFILE
+#define POLLING_PROFILE      POLLING_STANDARD
+#endif
+
+#if POLLING_PROFILE == POLLING_LOW_LATENCY
+#define EP_IN_INTERVAL_MS    1
+#define EP_OUT_INTERVAL_MS   1
+#elif POLLING_PROFILE == POLLING_QUIET
+#define EP_IN_INTERVAL_MS    32
+#define EP_OUT_INTERVAL_MS   32
+#elif POLLING_PROFILE == POLLING_STANDARD
+#define EP_IN_INTERVAL_MS    5
+#define EP_OUT_INTERVAL_MS   5
+#else
+#error Unknown POLLING_PROFILE
+#endif
+
 #define LO(x) ((uint8_t) (x))
-#define HI(x) ((uint8_t) ((uint16_t)(x)) >> 8)
+#define HI(x) ((uint8_t) (((uint16_t)(x)) >> 8))
 #define WORD(x) LO(x), HI(x)
 
+// Fails the build if cond is false (the array would have a negative size)
+#define STATIC_ASSERT(name, cond) typedef char assert_##name[(cond) ? 1 : -1]
+
+
+// Keyboard report fields (REPORT_SIZE bits x REPORT_COUNT fields). The report
+// descriptor is built from these, and so are the report and packet sizes.
+#define IN_MODIFIERS_BITS      1   // Ctrl/Shift/Alt/GUI
+#define IN_MODIFIERS_COUNT     8
+#define IN_RESERVED_BITS       8   // Pad byte
+#define IN_RESERVED_COUNT      1
+#define IN_KEYS_BITS           8   // Key usage codes
+#define IN_KEYS_COUNT          6
+#define OUT_LEDS_BITS          1   // NumLock, CapsLock, ScrollLock
+#define OUT_LEDS_COUNT         3
+#define OUT_PAD_BITS           5
+#define OUT_PAD_COUNT          1
+#define FEATURE_BITS           8   // Vendor commands and their replies (see telemetry.h)
+#define FEATURE_COUNT          8
+#define MOUSE_BUTTONS_BITS     1   // Left, right and middle buttons
+#define MOUSE_BUTTONS_COUNT    3
+#define MOUSE_PAD_BITS         5
+#define MOUSE_PAD_COUNT        1
+#define MOUSE_AXES_BITS        8   // Relative X and Y movement
+#define MOUSE_AXES_COUNT       2
+
+#define HID_INPUT_REPORT_BITS  (IN_MODIFIERS_BITS * IN_MODIFIERS_COUNT + IN_RESERVED_BITS * IN_RESERVED_COUNT + IN_KEYS_BITS * IN_KEYS_COUNT)
+#define HID_OUTPUT_REPORT_BITS (OUT_LEDS_BITS * OUT_LEDS_COUNT + OUT_PAD_BITS * OUT_PAD_COUNT)
+#define HID_INPUT_REPORT_SIZE  (HID_INPUT_REPORT_BITS / 8)  // Bytes
+#define HID_OUTPUT_REPORT_SIZE (HID_OUTPUT_REPORT_BITS / 8) // Bytes
+#define HID_FEATURE_REPORT_SIZE (FEATURE_BITS * FEATURE_COUNT / 8) // Bytes
+#define HID_MOUSE_REPORT_BITS  (MOUSE_BUTTONS_BITS * MOUSE_BUTTONS_COUNT + MOUSE_PAD_BITS * MOUSE_PAD_COUNT + MOUSE_AXES_BITS * MOUSE_AXES_COUNT)
+#define HID_MOUSE_REPORT_SIZE  (HID_MOUSE_REPORT_BITS / 8)  // Bytes
+
+#define EP0_PACKET_SIZE        8
+#define EP_IN_PACKET_SIZE      HID_INPUT_REPORT_SIZE
+#define EP_OUT_PACKET_SIZE     8   // Vendor commands (see telemetry.h) are longer than the LED report
+#define EP_MOUSE_PACKET_SIZE   HID_MOUSE_REPORT_SIZE
+
+#define USB_KEYBOARD_INTERFACE 0
+#define USB_VENDOR_INTERFACE   1   // The vendor commands' feature report (see telemetry.h)
+#define EP2_IN_ADDRESS         0x82 // The vendor interface's interrupt IN endpoint (never sends anything)
+#define USB_MOUSE_INTERFACE    2   // (MOUSE_INTERFACE builds only)
+#define EP3_IN_ADDRESS         0x83 // The mouse's interrupt IN endpoint
+#define USB_INTERFACES         (2 + MOUSE_INTERFACE)
+
+
+// Standard descriptor layouts. Words are stored as byte pairs so that no
+// compiler pads them, and each descriptor's bLength is the size of its
+// layout. The *_DSC macros below initialise them.
+typedef struct
+{
+  uint8_t  bLength;
+  uint8_t  bDescriptorType;     // 0x02
+  uint8_t  wTotalLength[2];
+  uint8_t  bNumInterfaces;
+  uint8_t  bConfigurationValue;
+  uint8_t  iConfiguration;
+  uint8_t  bmAttributes;
+  uint8_t  bMaxPower;
+} t_configurationDsc;           // 9
+
+typedef struct
+{
+  uint8_t  bLength;
+  uint8_t  bDescriptorType;     // 0x04
+  uint8_t  bInterfaceNumber;
+  uint8_t  bAlternateSetting;
+  uint8_t  bNumEndpoints;
+  uint8_t  bInterfaceClass;
+  uint8_t  bInterfaceSubClass;
+  uint8_t  bInterfaceProtocol;
+  uint8_t  iInterface;
+} t_interfaceDsc;               // 9
+
+typedef struct
+{
+  uint8_t  bLength;
+  uint8_t  bDescriptorType;     // 0x21
+  uint8_t  bcdHID[2];
+  uint8_t  bCountryCode;
+  uint8_t  bNumDescriptors;
+  uint8_t  bReportDescriptorType; // 0x22
+  uint8_t  wDescriptorLength[2];
+} t_hidDsc;                     // 9
+
+typedef struct
+{
+  uint8_t  bLength;
+  uint8_t  bDescriptorType;     // 0x05
+  uint8_t  bEndpointAddress;
+  uint8_t  bmAttributes;
+  uint8_t  wMaxPacketSize[2];
+  uint8_t  bInterval;
+} t_endpointDsc;                // 7
 
+// type is the whole configuration (this descriptor and all that follow it)
+#define CONFIGURATION_DSC(type, nInterfaces, value, iConfiguration, attributes, maxPower) \
+  { sizeof (t_configurationDsc), 0x02, {WORD(sizeof (type))}, nInterfaces, value, iConfiguration, attributes, maxPower }
+
+#define INTERFACE_DSC(number, alternate, nEndpoints, class, subclass, protocol, iInterface) \
+  { sizeof (t_interfaceDsc), 0x04, number, alternate, nEndpoints, class, subclass, protocol, iInterface }
+
+#define HID_DSC(bcdHID, country, report) \
+  { sizeof (t_hidDsc), 0x21, {WORD(bcdHID)}, country, 1, 0x22, {WORD(sizeof report)} }
+
+#define ENDPOINT_DSC(address, attributes, maxPacketSize, interval) \
+  { sizeof (t_endpointDsc), 0x05, address, attributes, {WORD(maxPacketSize)}, interval }
+
+
+// The report descriptor is the bytes listed by the STRING macro
 #define REPORT_DESCRIPTOR(array) \
-uint16_t t##array[] = {STRING}; /* This array will be optimised away because it is never referenced at execution time. */ \
-                                /* It is used only to compute the length of the string specified by the STRING macro.  */ \
-const struct  \
+const uint8_t array[] = {STRING}
+
+// A string descriptor holds the characters listed by the STRING macro. The
+// same text as a literal sizes it: a STRING with more characters than text
+// fails to compile.
+#define STRING_DESCRIPTOR(array, text) \
+typedef struct \
 { \
-  uint8_t report[sizeof t##array / sizeof t##array[0]]; \
-} array = \
+  uint8_t  bLength; \
+  uint8_t  bDscType; \
+  uint16_t string[sizeof text - 1]; \
+} t_##array; \
+const t_##array array = \
   { \
-    {STRING} \
+    sizeof (t_##array), /* bLength:  Size of this structure in bytes (including bLength and bDscType fields) */ \
+    0x03,               /* bDscType: 0x03 means this is a String descriptor */ \
+    {STRING}            /* string:   This is the array of 2-byte "characters" comprising the string */ \
   }
 
-
-#define STRING_DESCRIPTOR(array) \
-uint16_t t##array[] = {STRING}; /* This array will be optimised away because it is never referenced at execution time. */ \
-                             /* It is used only to compute the length of the string specified by the STRING macro.  */ \
-const struct \
+// The language descriptor holds one 2-byte language id
+#define LANGUAGE_DESCRIPTOR(array, langid) \
+typedef struct \
 { \
   uint8_t  bLength; \
   uint8_t  bDscType; \
-  uint16_t string[sizeof t##array / sizeof t##array[0]]; \
-} array = \
-  { \
-    2+sizeof t##array, /* bLength:  Size of this structure in bytes (including bLength and bDscType fields) */ \
-    0x03,              /* bDscType: 0x03 means this is a String descriptor */ \
-    {STRING}           /* string:   This is the array of 2-byte "characters" comprising the string */ \
-  }
\ No newline at end of file
+  uint16_t wLangId; \
+} t_##array; \
+const t_##array array = {sizeof (t_##array), 0x03, langid}
+
+// Where each descriptor is, for GET_DESCRIPTOR (see usb.c): type, index
+// (of a string, or the interface of a HID or report descriptor), address
+// and length
+typedef struct
+{
+  uint8_t        bType;
+  uint8_t        bIndex;
+  const uint8_t *p;
+  uint16_t       nLength;
+} t_usbDescriptor;
+
+extern const t_usbDescriptor usbDescriptors[];
+extern const uint8_t USB_DESCRIPTORS;
+
+#ifdef HOST_BUILD
+// ROM and RAM taken by each descriptor on the PIC (see the simulator's
+// descriptors scenario). mikroC keeps const data in program memory, one
+// RETLW instruction per byte. The list ends with a NULL name.
+typedef struct
+{
+  const char    *name;
+  const uint8_t *p;             // The descriptor (NULL for RAM-only entries)
+  unsigned       nRom;
+  unsigned       nRam;
+} t_dscFootprint;
+
+extern const t_dscFootprint usbDscFootprint[];
+#endif
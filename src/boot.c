@@ -0,0 +1,542 @@
+/*
+  CAP! CapsLock Light
+  Copyright (C) 2017 Andrew J. Armstrong
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+  02111-1307  USA
+
+  Author:
+  Andrew J. Armstrong <androidarmstrong@gmail.com>
+
+*/
+
+/*
+-------------------------------------------------------------------------------
+
+NAME     - CAP! bootloader
+
+FUNCTION - Resident USB HID bootloader for the CapsLock dongle. It lives in
+           program memory 0x0000-0x07FF (build it with boot.mcppi, and
+           program boot.hex once with a PICkit) and runs the firmware at
+           BOOT_APP_START unless there is none or the firmware has asked for
+           the bootloader. tools/capslock-flash then writes capslock.hex over
+           USB, one row per 64-byte report. See boot.h for the memory map and
+           the protocol.
+
+           The bootloader polls the USB module and never enables interrupts:
+           its interrupt vector belongs to the firmware.
+
+HISTORY  - Date     Ver   By  Reason (most recent at the top please)
+           -------- ----- --- -------------------------------------------------
+           20261017 1.00  AJA Initial version
+
+-------------------------------------------------------------------------------
+*/
+#include <stdint.h>
+#include "hal.h"
+#include "USBdsc.h"
+#include "usb.h"
+#include "boot.h"
+
+#define TRUE  1
+#define FALSE 0
+
+// USB RAM: four buffer descriptors without ping-pong (UCFG.PPB=00), then
+// their buffers. It fills the general purpose RAM of banks 0 and 1.
+#define BOOT_BD_EP0_OUT      0
+#define BOOT_BD_EP0_IN       1
+#define BOOT_BD_EP1_OUT      2
+#define BOOT_BD_EP1_IN       3
+#define BOOT_EP0_OUT_BUFFER  (USB_BDT + 0x10)
+#define BOOT_EP0_IN_BUFFER   (USB_BDT + 0x18)
+#define BOOT_EP1_OUT_BUFFER  (USB_BDT + 0x20)
+#define BOOT_EP1_IN_BUFFER   (USB_BDT + 0x60)
+#define BOOT_USB_RAM_END     (USB_BDT + 0xA0)
+
+#define UCFG_BOOT            0b00010100 // UPUEN, FSEN, no ping-pong buffers
+#define BOOT_OSCCON          0b11111100 // PLL on, 3x, 16 MHz HFINTOSC, SCS=00: Fosc = 48 MHz PLL output
+#define PCON_RI              0x04       // 0 = RESET instruction
+
+#define BD_STAT(n)           HAL_LINEAR(USB_BDT + ((n) << 2))
+
+#define REPLY_STALL          0xFF
+
+STATIC_ASSERT(boot_usb_ram, BOOT_USB_RAM_END - USB_BDT == 160); // Linear 0x2000 to 0x209F: banks 0 and 1
+STATIC_ASSERT(boot_report, BOOT_REPORT_SIZE == 64 && 2 + BOOT_PACKED_SIZE <= BOOT_REPORT_SIZE);
+
+HAL_USB_RAM(80);
+HAL_USB_RAM_BANK1(80);
+HAL_BOOT_REQUEST;
+
+// Descriptors: a vendor-defined HID device with 64-byte reports each way
+
+const uint8_t bootDeviceDsc[] =
+{
+  18, 0x01,                    // bLength, bDescriptorType (device)
+  WORD(0x0110),                // bcdUSB
+  0x00, 0x00, 0x00,            // bDeviceClass, bDeviceSubClass, bDeviceProtocol (see the interface)
+  EP0_PACKET_SIZE,             // bMaxPacketSize0
+  WORD(BOOT_VENDOR_ID),        // idVendor
+  WORD(BOOT_PRODUCT_ID),       // idProduct
+  WORD(BOOT_VERSION),          // bcdDevice
+  0, 1, 0,                     // iManufacturer, iProduct, iSerialNumber
+  1                            // bNumConfigurations
+};
+
+#undef STRING
+#define STRING \
+  0x06, 0x00, 0xFF,            /* (GLOBAL) USAGE_PAGE         0xFF00 Vendor-defined */ \
+  0x09, 0x01,                  /* (LOCAL)  USAGE              0xFF000001 */ \
+  0xA1, 0x01,                  /* (MAIN)   COLLECTION         0x01 Application */ \
+  0x15, 0x00,                  /*   (GLOBAL) LOGICAL_MINIMUM    0x00 (0) */ \
+  0x26, 0xFF, 0x00,            /*   (GLOBAL) LOGICAL_MAXIMUM    0x00FF (255) */ \
+  0x75, 0x08,                  /*   (GLOBAL) REPORT_SIZE        0x08 (8) Number of bits per field */ \
+  0x95, BOOT_REPORT_SIZE,      /*   (GLOBAL) REPORT_COUNT       0x40 (64) Number of fields */ \
+  0x09, 0x01,                  /*   (LOCAL)  USAGE              0xFF000001 */ \
+  0x81, 0x02,                  /*   (MAIN)   INPUT              0x00000002 (64 fields x 8 bits) 0=Data 1=Variable 0=Absolute */ \
+  0x09, 0x01,                  /*   (LOCAL)  USAGE              0xFF000001 */ \
+  0x91, 0x02,                  /*   (MAIN)   OUTPUT             0x00000002 (64 fields x 8 bits) 0=Data 1=Variable 0=Absolute */ \
+  0xC0,                        /* (MAIN)   END_COLLECTION     Application */ \
+
+REPORT_DESCRIPTOR(bootReportDsc);
+
+typedef struct
+{
+  t_configurationDsc config;
+  t_interfaceDsc     boot;
+  t_hidDsc           bootHid;
+  t_endpointDsc      bootIn;
+  t_endpointDsc      bootOut;
+} t_bootConfiguration;
+
+STATIC_ASSERT(boot_config_layout, sizeof (t_bootConfiguration) == 9 + 9 + 9 + 7 + 7);
+
+const t_bootConfiguration bootConfigDsc =
+{
+  CONFIGURATION_DSC(t_bootConfiguration, 1, 1, 0, 0x80, 50), // Bus powered, 100 mA
+  INTERFACE_DSC(0, 0, 2, 0x03, 0, 0, 0),                     // HID, no subclass or protocol
+  HID_DSC(0x0111, 0x00, bootReportDsc),
+  ENDPOINT_DSC(0x81, 0x03, BOOT_REPORT_SIZE, 1),             // Interrupt IN, every frame
+  ENDPOINT_DSC(0x01, 0x03, BOOT_REPORT_SIZE, 1)              // Interrupt OUT, every frame
+};
+
+LANGUAGE_DESCRIPTOR(bootLanguage, 0x0409);
+
+#undef STRING
+#define STRING 'C','A','P','!',' ','b','o','o','t','l','o','a','d','e','r'
+STRING_DESCRIPTOR(bootProduct, "CAP! bootloader");
+
+// Only set once the bootloader has decided to stay, so that none of them
+// overwrite the firmware's persistent variables before it runs
+uint8_t nCtrlStage;            // CTRL_IDLE, CTRL_DATA_IN or CTRL_STATUS_IN
+uint8_t nCtrlDts;              // Data toggle (BD_DTS) of the next endpoint 0 IN packet
+uint8_t bCtrlZlp;              // End the reply with an empty packet
+uint8_t nCtrlRemaining;        // Bytes of a reply from ROM still to send...
+const uint8_t * pCtrlData;     // ...from here
+uint8_t nNewAddress;
+volatile uint8_t nConfiguration; // (declared in usb.h)
+uint8_t nInDts;                // Data toggle of the next EP1 IN report
+uint8_t nOutDts;               // Data toggle of the next EP1 OUT report
+uint8_t bCommand;              // A command is waiting in the EP1 OUT buffer
+uint16_t row[BOOT_ROW_WORDS];
+
+void bootArm(uint8_t nBD, uint16_t nBuffer, uint8_t nCount, uint8_t nStat)
+{
+  uint8_t * pBD;
+
+  pBD = BD_STAT(nBD);
+  pBD[1] = nCount;
+  pBD[2] = Lo(nBuffer);
+  pBD[3] = Hi(nBuffer);
+  pBD[0] = nStat;              // Last, because BD_UOWN hands it over
+}
+
+void bootArmEp1Out()
+{
+  bootArm(BOOT_BD_EP1_OUT, BOOT_EP1_OUT_BUFFER, BOOT_REPORT_SIZE, BD_UOWN | BD_DTSEN | nOutDts);
+  nOutDts ^= BD_DTS;
+}
+
+void bootReset()               // The host has reset the bus
+{
+  uint8_t i;
+
+  UEP1 = 0;
+  for (i = BOOT_BD_EP0_IN; i <= BOOT_BD_EP1_IN; i++)
+  {
+    *BD_STAT(i) = 0;
+  }
+  while (TRNIF_bit)
+  {
+    TRNIF_bit = 0;
+  }
+  UADDR = 0;
+  nConfiguration = 0;
+  nNewAddress = 0;
+  bCommand = FALSE;
+  nCtrlStage = CTRL_IDLE;
+  UEP0 = UEP_CONTROL;
+  bootArm(BOOT_BD_EP0_OUT, BOOT_EP0_OUT_BUFFER, EP0_PACKET_SIZE, BD_UOWN | BD_DTSEN);
+  PKTDIS_bit = 0;
+}
+
+void bootSendChunk()           // Send the next packet of a reply from ROM
+{
+  uint8_t i;
+  uint8_t n;
+  uint8_t * pBuffer;
+
+  n = EP0_PACKET_SIZE;
+  if (nCtrlRemaining < EP0_PACKET_SIZE)
+  {
+    n = nCtrlRemaining;
+  }
+  pBuffer = HAL_LINEAR(BOOT_EP0_IN_BUFFER);
+  for (i = 0; i < n; i++)
+  {
+    pBuffer[i] = pCtrlData[i];
+  }
+  pCtrlData += n;
+  nCtrlRemaining -= n;
+  bootArm(BOOT_BD_EP0_IN, BOOT_EP0_IN_BUFFER, n, BD_UOWN | BD_DTSEN | nCtrlDts);
+  nCtrlDts ^= BD_DTS;
+}
+
+void bootSetup()               // Answer the SETUP packet in the endpoint 0 OUT buffer
+{
+  uint8_t * pSetup;
+  uint8_t * pReply;
+  uint8_t nReply;
+  uint8_t bROM;
+
+  pSetup = HAL_LINEAR(BOOT_EP0_OUT_BUFFER);
+  pReply = HAL_LINEAR(BOOT_EP0_IN_BUFFER);
+  *BD_STAT(BOOT_BD_EP0_IN) = 0;
+  nCtrlStage = CTRL_IDLE;
+  nReply = REPLY_STALL;
+  bROM = FALSE;
+
+  if ((pSetup[0] & 0x80) && pSetup[1] == USB_GET_DESCRIPTOR)
+  {
+    bROM = TRUE;
+    switch (pSetup[3])         // wValue high byte: the descriptor type
+    {
+      case 0x01:
+        pCtrlData = bootDeviceDsc;
+        nReply = sizeof bootDeviceDsc;
+        break;
+      case 0x02:
+        pCtrlData = (const uint8_t *) &bootConfigDsc;
+        nReply = sizeof bootConfigDsc;
+        break;
+      case 0x03:               // The language id, or the product name (there are no other strings)
+        pCtrlData = pSetup[2] ? (const uint8_t *) &bootProduct : (const uint8_t *) &bootLanguage;
+        nReply = pSetup[2] ? sizeof bootProduct : sizeof bootLanguage;
+        break;
+      case 0x21:
+        pCtrlData = (const uint8_t *) &bootConfigDsc.bootHid;
+        nReply = sizeof (t_hidDsc);
+        break;
+      case 0x22:
+        pCtrlData = bootReportDsc;
+        nReply = sizeof bootReportDsc;
+        break;
+    }
+  }
+  else if (pSetup[0] & 0x80)   // GET_STATUS, GET_CONFIGURATION...
+  {
+    pReply[0] = pSetup[1] == USB_GET_CONFIGURATION ? nConfiguration : 0;
+    pReply[1] = 0;             // (bus powered, no remote wakeup, nothing halted)
+    nReply = pSetup[1] == USB_GET_STATUS ? 2 : 1;
+  }
+  else if (pSetup[1] == USB_SET_ADDRESS && pSetup[0] == 0x00)
+  {
+    nNewAddress = pSetup[2];
+    nReply = 0;
+  }
+  else if (pSetup[1] == USB_SET_CONFIGURATION && pSetup[0] == 0x00 && pSetup[2] <= 1)
+  {
+    nConfiguration = pSetup[2];
+    UEP1 = nConfiguration ? UEP_INTERRUPT : 0;
+    nInDts = 0;
+    nOutDts = 0;
+    bCommand = FALSE;
+    *BD_STAT(BOOT_BD_EP1_IN) = 0;
+    if (nConfiguration)
+    {
+      bootArmEp1Out();
+    }
+    nReply = 0;
+  }
+  else if (pSetup[1] == HID_SET_IDLE && pSetup[0] == 0x21)
+  {
+    nReply = 0;                // (the bootloader only answers commands, so there is nothing to repeat)
+  }
+
+  if (nReply == REPLY_STALL)
+  {
+    bootArm(BOOT_BD_EP0_IN, BOOT_EP0_IN_BUFFER, 0, BD_UOWN | BD_BSTALL);
+    bootArm(BOOT_BD_EP0_OUT, BOOT_EP0_OUT_BUFFER, EP0_PACKET_SIZE, BD_UOWN | BD_BSTALL);
+  }
+  else if (nReply == 0)
+  {
+    nCtrlStage = CTRL_STATUS_IN;
+    bootArm(BOOT_BD_EP0_IN, BOOT_EP0_IN_BUFFER, 0, BD_UOWN | BD_DTSEN | BD_DTS);
+    bootArm(BOOT_BD_EP0_OUT, BOOT_EP0_OUT_BUFFER, EP0_PACKET_SIZE, BD_UOWN | BD_DTSEN);
+  }
+  else
+  {
+    nCtrlStage = CTRL_DATA_IN;
+    nCtrlDts = BD_DTS;
+    if (pSetup[7] == 0 && nReply > pSetup[6])
+    {
+      nReply = pSetup[6];      // Only as much as the host asked for
+    }
+    bCtrlZlp = (pSetup[7] || nReply < pSetup[6]) && (nReply & (EP0_PACKET_SIZE - 1)) == 0;
+    if (bROM)
+    {
+      nCtrlRemaining = nReply;
+      bootSendChunk();
+    }
+    else
+    {
+      nCtrlRemaining = 0;
+      bootArm(BOOT_BD_EP0_IN, BOOT_EP0_IN_BUFFER, nReply, BD_UOWN | BD_DTSEN | BD_DTS);
+      nCtrlDts = 0;
+    }
+    bootArm(BOOT_BD_EP0_OUT, BOOT_EP0_OUT_BUFFER, EP0_PACKET_SIZE, BD_UOWN | BD_DTS);
+  }
+  PKTDIS_bit = 0;
+}
+
+void bootService()             // Handle a bus reset or one transaction
+{
+  uint8_t nUstat;
+
+  if (URSTIF_bit)
+  {
+    bootReset();
+    URSTIF_bit = 0;
+    return;
+  }
+  if (!TRNIF_bit)
+  {
+    return;
+  }
+  nUstat = USTAT;
+  TRNIF_bit = 0;
+
+  if (nUstat & 0b01111000)     // EP1
+  {
+    if (!(nUstat & 0b00000100))
+    {
+      bCommand = TRUE;         // (its buffer stays ours until bootCommand() has answered it)
+    }
+  }
+  else if (nUstat & 0b00000100) // EP0 IN
+  {
+    if (nCtrlStage == CTRL_DATA_IN && (nCtrlRemaining || bCtrlZlp))
+    {
+      if (!nCtrlRemaining)
+      {
+        bCtrlZlp = FALSE;
+      }
+      bootSendChunk();
+    }
+    else if (nCtrlStage == CTRL_STATUS_IN)
+    {
+      if (nNewAddress)
+      {
+        UADDR = nNewAddress;
+        nNewAddress = 0;
+      }
+      nCtrlStage = CTRL_IDLE;
+    }
+  }
+  else if (BD_PID(*BD_STAT(BOOT_BD_EP0_OUT)) == PID_SETUP)
+  {
+    bootSetup();
+  }
+  else                         // EP0 OUT: the status packet ending a reply
+  {
+    *BD_STAT(BOOT_BD_EP0_IN) = 0;
+    nCtrlStage = CTRL_IDLE;
+    bootArm(BOOT_BD_EP0_OUT, BOOT_EP0_OUT_BUFFER, EP0_PACKET_SIZE, BD_UOWN | BD_DTSEN);
+  }
+}
+
+uint8_t bootAppPresent()       // The firmware's first row is not erased
+{
+  HAL_FLASH_READ_SFR(BOOT_APP_START);
+  return PMDATH != 0x3F || PMDATL != 0xFF;
+}
+
+uint8_t bootWrite(uint8_t nRow, uint8_t * pPacked) // Erase, write and verify a row (BOOT_STATUS_xxx)
+{
+  uint16_t nAddress;
+  uint16_t nWord;
+  uint16_t nBit;               // (up to 434)
+  uint8_t nShift;
+  uint8_t * p;
+  uint8_t i;
+
+  if (nRow < BOOT_FIRST_ROW || nRow >= BOOT_END_ROW)
+  {
+    return BOOT_STATUS_BAD_ROW;
+  }
+  nBit = 0;
+  for (i = 0; i < BOOT_ROW_WORDS; i++) // Unpack 14 bits at a time
+  {
+    p = &pPacked[nBit >> 3];
+    nShift = nBit & 7;
+    Lo(nWord) = p[0];
+    Hi(nWord) = p[1];
+    nWord >>= nShift;
+    if (nShift > 2)            // (the word reaches into a third byte)
+    {
+      nWord |= (uint16_t) p[2] << (16 - nShift);
+    }
+    row[i] = nWord & 0x3FFF;
+    nBit += 14;
+  }
+  nAddress = (uint16_t) nRow * BOOT_ROW_WORDS;
+  FLASH_Erase(nAddress);       // (the CPU stalls while the row is erased and written)
+  FLASH_Write(nAddress, row);
+  for (i = 0; i < BOOT_ROW_WORDS; i++)
+  {
+    if (FLASH_Read(nAddress + i) != row[i])
+    {
+      return BOOT_STATUS_VERIFY;
+    }
+  }
+  return BOOT_STATUS_OK;
+}
+
+uint8_t bootCommand()          // Answer the command in the EP1 OUT buffer (TRUE to run the firmware)
+{
+  uint8_t * pCommand;
+  uint8_t * pReply;
+  uint8_t i;
+  uint8_t bRun;
+
+  pCommand = HAL_LINEAR(BOOT_EP1_OUT_BUFFER);
+  pReply = HAL_LINEAR(BOOT_EP1_IN_BUFFER);
+  for (i = 0; i < BOOT_REPORT_SIZE; i++)
+  {
+    pReply[i] = 0;
+  }
+  pReply[0] = pCommand[0];
+  bRun = FALSE;
+  switch (pCommand[0])
+  {
+    case BOOT_CMD_QUERY:
+      pReply[2] = BOOT_STATUS_OK;
+      pReply[3] = BOOT_VERSION;
+      pReply[4] = BOOT_FIRST_ROW;
+      pReply[5] = BOOT_END_ROW;
+      pReply[6] = BOOT_ROW_WORDS;
+      break;
+    case BOOT_CMD_WRITE:
+      pReply[1] = pCommand[1];
+      pReply[2] = bootWrite(pCommand[1], &pCommand[2]);
+      break;
+    case BOOT_CMD_RUN:
+      bRun = bootAppPresent();
+      pReply[2] = bRun ? BOOT_STATUS_OK : BOOT_STATUS_NO_APP;
+      break;
+    default:
+      pReply[2] = BOOT_STATUS_UNKNOWN;
+      break;
+  }
+  bootArm(BOOT_BD_EP1_IN, BOOT_EP1_IN_BUFFER, BOOT_REPORT_SIZE, BD_UOWN | BD_DTSEN | nInDts);
+  nInDts ^= BD_DTS;
+  bootArmEp1Out();             // Ready for the next command
+  return bRun;
+}
+
+#ifdef HOST_BUILD
+void interrupt()               // (hal_host.c calls it, but the bootloader never enables interrupts)
+{
+}
+#else
+// The interrupt vector goes straight on to the firmware's interrupt()
+// (BOOT_APP_INTERRUPT): an interrupt() here would first run mikroC's
+// context-saving code, and the firmware's own does that again
+void bootInterruptVector() org 0x0004
+{
+  HAL_RUN_APP_INTERRUPT();
+}
+#endif
+
+void main()
+{
+  // Run the firmware straight away unless it asked for the bootloader (a
+  // RESET instruction with the boot request set) or it is not there. Only
+  // SFRs are used until then, and PCON is left as the reset set it.
+  if ((PCON & PCON_RI) || nBootRequest[0] != BOOT_REQUEST_MAGIC || nBootRequest[1] != (uint8_t) ~BOOT_REQUEST_MAGIC)
+  {
+    if (bootAppPresent())
+    {
+      HAL_RUN_APP();
+    }
+  }
+  nBootRequest[0] = 0;         // Next time, run the firmware
+  PCON |= PCON_RI;
+
+  ANSELA = 0;
+  ANSELC = 0;
+  OSCCON = BOOT_OSCCON;        // 48 MHz, as the USB module needs
+  while (!HFIOFS_bit);
+  while (!PLLRDY_bit);
+  ACTEN_bit = 0;
+  ACTSRC_bit = 1;              // Tune HFINTOSC to the host's USB clock
+  ACTEN_bit = 1;
+
+  UCFG = UCFG_BOOT;
+  UEP1 = 0;
+  *BD_STAT(BOOT_BD_EP0_OUT) = 0;
+  *BD_STAT(BOOT_BD_EP0_IN) = 0;
+  *BD_STAT(BOOT_BD_EP1_OUT) = 0;
+  *BD_STAT(BOOT_BD_EP1_IN) = 0;
+  USBEN_bit = 1;               // Connect the pull-up: the host resets the bus and enumerates us
+
+  while (1)
+  {
+    CPU_CLRWDT();
+    if (URSTIF_bit || TRNIF_bit)
+    {
+      bootService();
+    }
+    else if (bCommand && !(*BD_STAT(BOOT_BD_EP1_IN) & BD_UOWN)) // (once the host has taken the last reply)
+    {
+      bCommand = FALSE;
+      if (bootCommand())
+      {
+        while (*BD_STAT(BOOT_BD_EP1_IN) & BD_UOWN) // Let the host have the reply...
+        {
+          CPU_CLRWDT();
+          if (URSTIF_bit) break;
+          HAL_SPIN();
+        }
+        USBEN_bit = 0;         // ...then detach, and run the firmware from a clean reset
+        CPU_RESET();
+      }
+    }
+    else
+    {
+      HAL_IDLE();
+    }
+  }
+}
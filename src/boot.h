@@ -0,0 +1,101 @@
+/*
+  CAP! CapsLock Light
+  Copyright (C) 2017 Andrew J. Armstrong
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+  02111-1307  USA
+
+  Author:
+  Andrew J. Armstrong <androidarmstrong@gmail.com>
+
+*/
+
+/*
+  Bootloader protocol (shared by the bootloader, the firmware and
+  tools/capslock-flash)
+
+  Program memory:
+
+    0x0000-0x07FF  The bootloader (boot.c). CONFIG2 WRT=10 write-protects
+                   0x0000-0x01FF, which holds its reset and interrupt
+                   vectors, and it never writes below BOOT_APP_START.
+    0x0800-0x080F  The firmware's reset vector and interrupt(). The firmware
+                   is linked above them (BOOTLOADER in capslock.h) and
+                   capslock-flash moves them from 0x0000-0x000F of
+                   capslock.hex up here. The bootloader's interrupt vector
+                   jumps to 0x0804 with PCLATH at 0x08, so interrupt()'s
+                   own jumps, which leave out the page, stay in this one.
+    0x0810-0x1F7F  The rest of the firmware.
+    0x1F80-0x1FFF  High-endurance flash (the settings), which the
+                   bootloader leaves alone.
+
+  The bootloader runs the firmware unless the firmware's first row is
+  erased or the firmware asked for the bootloader: it does that on
+  BOOT_CMD_ENTER (see telemetry.h) by leaving BOOT_REQUEST_MAGIC and its
+  complement at BOOT_REQUEST_ADDRESS and executing RESET. capslock-flash
+  erases the first row before anything else and writes it last, so an
+  interrupted update leaves the dongle in the bootloader.
+
+  The bootloader is a vendor-defined HID device with its own product id and
+  64-byte reports on EP1 IN and OUT:
+
+  Host --> PIC: byte 0 is the command:
+
+                BOOT_CMD_QUERY   Describe the bootloader
+
+                BOOT_CMD_WRITE   Erase, write and verify a row
+                  byte 1      Row number (word address / BOOT_ROW_WORDS)
+                  bytes 2-57  The row's BOOT_ROW_WORDS 14-bit words, packed
+                              least significant bit first (word 0 is bits
+                              0-13 of bytes 2-3, word 1 starts at bit 6 of
+                              byte 3...)
+
+                BOOT_CMD_RUN     Detach and run the firmware
+
+  PIC --> Host: byte 0 is the command answered, byte 1 its row (or 0) and
+                byte 2 a BOOT_STATUS_* code. BOOT_CMD_QUERY also returns:
+                  byte 3    BOOT_VERSION
+                  byte 4    First row the bootloader will write
+                  byte 5    First row past the end of the firmware
+                  byte 6    BOOT_ROW_WORDS
+*/
+
+#define BOOT_VERSION           1
+
+#define BOOT_VENDOR_ID         0x04B3     // USB_VENDOR_ID in USBdsc.c
+#define BOOT_PRODUCT_ID        0x301A     // The bootloader's own idProduct
+#define BOOT_REPORT_SIZE       64
+
+#define BOOT_APP_START         0x0800     // The firmware's relocated reset vector...
+#define BOOT_APP_INTERRUPT     0x0804     // ...and interrupt vector
+#define BOOT_APP_VECTORS       16         // Words moved from 0x0000 to BOOT_APP_START
+#define BOOT_APP_END           0x1F80     // The HEF block
+#define BOOT_ROW_WORDS         32
+#define BOOT_FIRST_ROW         (BOOT_APP_START / BOOT_ROW_WORDS)
+#define BOOT_END_ROW           (BOOT_APP_END / BOOT_ROW_WORDS)
+#define BOOT_PACKED_SIZE       (BOOT_ROW_WORDS * 14 / 8) // 56 bytes
+
+#define BOOT_REQUEST_ADDRESS   0x16E      // In bank 2, clear of the bootloader's USB RAM (both programs place nBootRequest here)
+#define BOOT_REQUEST_MAGIC     0xB0
+
+#define BOOT_CMD_QUERY         0x51 // 'Q'
+#define BOOT_CMD_WRITE         0x57 // 'W'
+#define BOOT_CMD_RUN           0x58 // 'X'
+
+#define BOOT_STATUS_OK         0
+#define BOOT_STATUS_BAD_ROW    1    // Outside BOOT_FIRST_ROW to BOOT_END_ROW-1
+#define BOOT_STATUS_VERIFY     2    // The row read back differently
+#define BOOT_STATUS_NO_APP     3    // (BOOT_CMD_RUN) The firmware's first row is erased
+#define BOOT_STATUS_UNKNOWN    4    // Unknown command
@@ -37,7 +37,7 @@ FUNCTION - This is a USB capslock-light-on-a-stick that lights up when the
 
            The SCROLL LOCK light, present on many older keyboards, will flash
            to indicate the keystroke injection is active. The LED on this
-           device will also briefly blink for each keystroke injection.
+           device will also briefly fade for each keystroke injection.
 
 
 FEATURES - 1. Absolutely NO HOST DRIVERS required.
@@ -46,18 +46,18 @@ PIN USAGE -                     PIC16F1455
                            .------------------.
             Vdd +5V    --- | RE3  1    14 RB7 | --- Vss 0V -------.
                    n/c --- | RA5  2    13 RA0 | <-- USB D+        |
-            LED        <-- | RA4  3    12 RA1 | <-- USB D-        |
+                   LED <-- | RA4  3    12 RA1 | <-- USB D-        |
            ~MCLR       --> | RA3  4    11 RB4 | --- Vusb -----||--' 2 x 100 nF
-                   n/c --- | RC5  5    10 RC0 | <-- PGD
+ LED (LED_PWM1 boards) <-- | RC5  5    10 RC0 | <-- PGD
                    n/c --- | RC4  6     9 RC1 | <-- PGC
-                   n/c --- | RC3  7     8 RC2 | --- n/c
+        ScrollLock LED <-- | RC3  7     8 RC2 | --> NumLock LED (both optional)
                            '------------------'
 
 
 CONFIG    - The PIC16F1455 configuration fuses should be set as follows (items
             marked with '*' are essential for this program to operate correctly):
 
-            CONFIG1  3EA4 0011111010100100
+            CONFIG1  3EB4 0011111010110100
                           xx               =  Unimplemented
                             x              =  FCMEM:     1=Fail-Safe Clock Monitor is enabled
                              x             =  IESO:      1=Internal/External Switchover mode is enabled
@@ -67,7 +67,7 @@ CONFIG    - The PIC16F1455 configuration fuses should be set as follows (items
                                   x        =  ~CP:       1=Program memory code protection is disabled
                                    x       = *MCLRE:     0=MCLR internally disabled
                                     x      =  ~PWRTE:    1=Power-Up Timer disabled
-                                     xx    =  WDTE:      00=Watchdog Timer disabled
+                                     xx    = *WDTE:      10=Watchdog Timer enabled while running and disabled in Sleep
                                        xxx = *FOSC:      100=INTOSC oscillator: I/O function on OSC1 pin
 
             CONFIG2  1EC3 0001111011000011
@@ -107,6 +107,18 @@ AUTHORS  - Init Name                 Email
 
 HISTORY  - Date     Ver   By  Reason (most recent at the top please)
            -------- ----- --- -------------------------------------------------
+           20261017 3.00  AJA Reworked for low power and host control (bcdDevice 0x0300, which the tools check):
+                              - usb.c replaces the mikroC HID library (ping-pong EP1 buffers, SET_IDLE and
+                                SET_PROTOCOL honoured, suspend and optional remote wakeup, computed descriptors)
+                              - main() takes events and timers from interrupt(), which queues the reports,
+                                owns the LED and stops its 1 ms tick while idle; the CPU runs at 16 MHz once
+                                enumerated, and the watchdog recovers a hang
+                              - Keepalive payloads (KEEPALIVE_PAYLOAD), a zero-movement mouse report among
+                                them with MOUSE_INTERFACE, and settings the host can change, kept in HEF
+                              - Vendor commands on a second HID interface (telemetry.h): telemetry, settings,
+                                polling measurement, typing stored strings and entering the bootloader
+                              - LED brightness and keepalive fade (RA4, or PWM1 on RC5 with LED_PWM1), and
+                                optional NumLock and ScrollLock indicators
            20171219 2.01  AJA Converted to a BOOT keyboard and removed mouse
            20171102 2.00  AJA Removed button from the PCB
            20170413 1.01  AJA Added micro mouse movements too
@@ -115,54 +127,440 @@ HISTORY  - Date     Ver   By  Reason (most recent at the top please)
 -------------------------------------------------------------------------------
 */
 #include <stdint.h>
-#include <built_in.h>
+#include "hal.h"
 #include "USBdsc.h"
+#include "telemetry.h"
+#include "usb.h"
+#include "boot.h"
 #include "capslock.h"
 
+#if BOOTLOADER
+#ifndef HOST_BUILD
+#pragma orgall 0x0810            // Link everything above the bootloader and the relocated vectors (see boot.h)
+#endif
+STATIC_ASSERT(boot_orgall, BOOT_APP_START + BOOT_APP_VECTORS == 0x0810);
+#endif
 
-void enableUSB()
+STATIC_ASSERT(input_report, sizeof usbToHost == HID_INPUT_REPORT_SIZE);   // The report descriptor and the reports
+STATIC_ASSERT(vendor_command, sizeof usbFromHost == EP_OUT_PACKET_SIZE);  // sent and received must agree
+STATIC_ASSERT(led_levels, LED_LEVELS == SETTINGS_BRIGHTNESS_MAX + 1);
+STATIC_ASSERT(indicator_budget, INDICATORS == 2 && NUMLOCK_SLOTS <= INDICATOR_SLOTS / 2 &&
+                                SCROLLLOCK_SLOTS <= INDICATOR_SLOTS / 2);
+
+const uint8_t ledGamma[LED_LEVELS] =     // PWM1DCH for each LED level: 250 x (level/31)^2.2, so that
+{                                        // each level looks about as much brighter as the last
+    0,   1,   2,   3,   4,   5,   7,   9,  13,  16,  21,  26,  31,  37,  43,  51,
+   58,  67,  76,  85,  95, 106, 118, 130, 142, 156, 170, 184, 200, 216, 233, 250
+};
+
+const char textStrings[] = TEXT_STRINGS; // Text that TEXT_CMD_TYPE can type (see capslock.h)
+
+const uint8_t textUsages['~' - ' ' + 1] = // The usage that types each printable ASCII character on a
+{                                        // US keyboard, plus TEXT_SHIFT if it needs Shift
+  0x2C, 0x9E, 0xB4, 0xA0, 0xA1, 0xA2, 0xA4, 0x34, 0xA6, 0xA7, 0xA5, 0xAE, 0x36, 0x2D, 0x37, 0x38, //  !"#$%&'()*+,-./
+  0x27, 0x1E, 0x1F, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0xB3, 0x33, 0xB6, 0x2E, 0xB7, 0xB8, // 0123456789:;<=>?
+  0x9F, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8A, 0x8B, 0x8C, 0x8D, 0x8E, 0x8F, 0x90, 0x91, 0x92, // @ABCDEFGHIJKLMNO
+  0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A, 0x9B, 0x9C, 0x9D, 0x2F, 0x31, 0x30, 0xA3, 0xAD, // PQRSTUVWXYZ[\]^_
+  0x35, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0x10, 0x11, 0x12, // `abcdefghijklmno
+  0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1A, 0x1B, 0x1C, 0x1D, 0xAF, 0xB1, 0xB0, 0xB5        // pqrstuvwxyz{|}~
+};
+
+#if INDICATOR_LEDS
+const uint8_t indicatorLed[INDICATORS]   = {LED_NUMLOCK, LED_SCROLLLOCK};     // Host LED bit...
+const uint8_t indicatorPin[INDICATORS]   = {NUMLOCK_PIN, SCROLLLOCK_PIN};     // ...the pin showing it...
+const uint8_t indicatorSlots[INDICATORS] = {NUMLOCK_SLOTS, SCROLLLOCK_SLOTS}; // ...and for how many of its slots
+#endif
+
+uint32_t getMillis()                     // Take a consistent snapshot of the millisecond clock
+{
+  uint32_t nNow;
+
+  do
+  {
+    nNow = nMillis;
+  } while (nNow != nMillis);             // Read again if interrupt() updated it meanwhile
+  return nNow;
+}
+
+void stopTimer (uint8_t nTimer)
+{
+  if (nTimerSeq[nTimer] & 1)
+  {
+    nTimerSeq[nTimer]++;                 // Even: interrupt() ignores the timer
+  }
+}
+
+void startTimer (uint8_t nTimer, uint32_t nDelay)
+{
+  uint8_t nSeq;
+
+  stopTimer(nTimer);                     // Stop interrupt() looking at the deadline while it changes
+  nTimerDeadline[nTimer] = getMillis() + nDelay;
+  nSeq = nTimerSeq[nTimer] + 1;
+  if (nSeq == nTimerExpired[nTimer])     // (after 128 restarts without expiring)
+  {
+    nSeq += 2;                           // Not to be taken for the run that last expired
+  }
+  HAL_BARRIER();
+  nTimerSeq[nTimer] = nSeq;              // Odd: running
+  WAKE_TICK();                           // (a tickless interrupt() works out when to wake again)
+}
+
+uint8_t timerRunning (uint8_t nTimer)
+{
+  return (nTimerSeq[nTimer] & 1) && nTimerSeq[nTimer] != nTimerExpired[nTimer];
+}
+
+uint8_t takeEvent (uint8_t nMask)        // Take an event posted by interrupt(), if it is pending
+{
+  if (!EVENT_PENDING(nMask)) return FALSE;
+  HAL_BARRIER();                         // (main() has finished with what the event delivered)
+  cEventsTaken ^= nMask;
+  return TRUE;
+}
+
+uint8_t takeTimerEvent (uint8_t nMask)
+{
+  if (!TIMER_EVENT_PENDING(nMask)) return FALSE;
+  cTimerEventsTaken ^= nMask;
+  return TRUE;
+}
+
+void flushReports()                     // Only call this while the USB interface is disabled
 {
+  nReportTail = nReportHead;            // (interrupt() leaves the queue alone, and forgets its probes, until then)
+  nTextNext = TEXT_IDLE;                // Stop typing too
+}
+
+uint8_t queueKeys (uint8_t modifiers, uint8_t * pKeys, uint8_t nKeys) // Queue a report holding down up to TEXT_KEYS keys
+{
+  uint8_t nNext;
   uint8_t i;
+  uint8_t * pReport;
 
-  usbToHost[0] = 0;                      // No modifiers
-  usbToHost[1] = 0;                      // Reserved for OEM
-  usbToHost[2] = 0;                      // No key pressed
-  usbToHost[3] = 0;                      // No key pressed
-  usbToHost[4] = 0;                      // No key pressed
-  usbToHost[5] = 0;                      // No key pressed
-  usbToHost[6] = 0;                      // No key pressed
-  usbToHost[7] = 0;                      // No key pressed
-  bUSBReady = FALSE;
+  nNext = (nReportTail + 1) & (REPORT_QUEUE_SIZE - 1);
+  if (nNext == nReportHead) return FALSE; // Queue is full (the slot at the head may be in flight)
+  pReport = reportQueue[nReportTail];
+  pReport[0] = modifiers;                 // Key modifier usages
+  pReport[1] = 0;                         // Reserved
+  for (i = 0; i < TEXT_KEYS; i++)
+  {
+    pReport[2 + i] = i < nKeys ? pKeys[i] : 0; // Key usage codes (0 = no key pressed)
+  }
+  HAL_BARRIER();
+  nReportTail = nNext;                    // Publish the report to interrupt() (it is sent within 1 ms)
+  WAKE_TICK();
+  return TRUE;
+}
+
+uint8_t queueReport (uint8_t modifiers, uint8_t key)
+{
+  return queueKeys(modifiers, &key, 1);
+}
+
+uint8_t reportQueueFree()
+{
+  return (nReportHead - nReportTail - 1) & (REPORT_QUEUE_SIZE - 1);
+}
 
-  while (!bUSBReady)
+uint8_t acceptCommand (uint8_t bFeature) // Number the command that is about to be answered (see telemetry.h)
+{
+  if (bFeature)
   {
-    HID_Enable(&usbFromHost, &usbToHost);
-    for (i=0; !bUSBReady && i < 50; i++) // Keep trying for up to 50 x 100 ms = 5 seconds
-    {
-      Delay_ms(100);
-      CAPSLOCK_LED = ON;
-      bUSBReady = HID_Write(&usbToHost, sizeof usbToHost) != 0; // Copy to USB buffer and try to send
-      CAPSLOCK_LED = OFF;
-    }
-    if (!bUSBReady)
+    nFeatureCommands++;                   // (only for a command that will get a reply)
+  }
+  return nFeatureCommands;
+}
+
+uint8_t * startReply (uint8_t bFeature, uint8_t nCommand, uint8_t nTag) // Where to build a reply to a vendor command (0 = the queue is full)
+{
+  uint8_t * pReport;
+
+  if (bFeature)                           // The command was a feature report, so the reply is one too...
+  {
+    pReport = usbFeature[nUsbFeature ^ 1]; // ...built where GET_REPORT is not looking
+    pReport[0] = nCommand;                // Which command it answers (see acceptCommand())
+  }
+  else
+  {
+    if (((nReportTail + 1) & (REPORT_QUEUE_SIZE - 1)) == nReportHead) return 0;
+    pReport = reportQueue[nReportTail];
+    pReport[0] = 0;                       // No modifiers
+  }
+  pReport[1] = nTag;
+  pReport[2] = TELEMETRY_MARKER;          // Keyboard drivers ignore this report
+  return pReport;
+}
+
+void sendReply (uint8_t bFeature)        // Hand over the reply that startReply() began
+{
+  HAL_BARRIER();
+  if (bFeature)
+  {
+    nUsbFeature ^= 1;                     // GET_REPORT(Feature) answers with it from now on
+  }
+  else
+  {
+    nReportTail = (nReportTail + 1) & (REPORT_QUEUE_SIZE - 1);
+    WAKE_TICK();
+  }
+}
+
+#if TELEMETRY
+uint8_t queueTelemetry (uint8_t nChunk, uint8_t bFeature, uint8_t nCommand) // Send one chunk of the telemetry block (see telemetry.h)
+{
+  uint8_t nSeq;
+  uint8_t nOffset;
+  uint8_t i;
+  uint8_t * pReport;
+  uint8_t * pTelemetry;
+  uint8_t * pSnapshot;
+
+  pReport = startReply(bFeature, nCommand, nChunk);
+  if (!pReport) return FALSE;
+  if (nChunk == 0)                        // Chunk 0 snapshots the whole block, so that a field
+  {                                       // split across two chunks is read in one piece
+    telemetry.nUptimeMillis = getMillis();
+    pTelemetry = (uint8_t *) &telemetry;
+    pSnapshot = (uint8_t *) &telemetrySnapshot;
+    do
     {
-      HID_Disable();
-      Delay_ms(5000);
-    }
+      nSeq = nTelemetrySeq;
+      HAL_BARRIER();
+      for (i = 0; i < TELEMETRY_SIZE; i++)
+      {
+        pSnapshot[i] = pTelemetry[i];
+      }
+      HAL_BARRIER();
+    } while (nSeq != nTelemetrySeq);      // Copy again if interrupt() updated a counter meanwhile
+  }
+  pSnapshot = (uint8_t *) &telemetrySnapshot;
+  for (i = 0, nOffset = nChunk * TELEMETRY_CHUNK_SIZE; i < TELEMETRY_CHUNK_SIZE; i++, nOffset++)
+  {
+    pReport[3+i] = nOffset < TELEMETRY_SIZE ? pSnapshot[nOffset] : 0;
+  }
+  sendReply(bFeature);
+  return TRUE;
+}
+#endif
+
+void holdTick()                          // Keep interrupt() ticking while main() changes Timer1 or the CPU clock
+{
+  bHoldTick = TRUE;                      // Don't stop the tick...
+  WAKE_TICK();
+  while (bTickless)                      // ...and restart it (interrupt() is keeping time with Timer1)
+  {
+    HAL_SPIN();
+  }
+}
+
+void setCpuClock(uint8_t bSlow)          // Run the CPU at 16 MHz (bSlow) or 48 MHz: USB stays at 48 MHz either way
+{
+  if (bSlow == bSlowClock) return;
+  holdTick();                            // (a tickless interrupt() counts Timer1 at the 16 MHz rate)
+  if (bSlow)
+  {
+    OSCCON = OSCCON_SLOW;                // Fosc = HFINTOSC (the PLL it feeds keeps running for USB)...
+    T2CON = T2CON_TICK_SLOW;             // ...so Timer2 needs a 1:1 postscaler for a 1 ms tick
+  }
+  else
+  {
+    OSCCON = OSCCON_FAST;                // Fosc = PLL output...
+    T2CON = T2CON_TICK;                  // ...so Timer2 needs a 1:3 postscaler for a 1 ms tick
   }
-  Delay_ms(250);
+  bSlowClock = bSlow;                    // (Timer1 ticks are 3x longer while slow: interrupt() allows for that)
+  bHoldTick = FALSE;
 }
 
-void disableUSB()
+void enableUSB()                         // Start attaching to the host (interrupt() posts the outcome)
 {
-  HID_Disable();
+  setCpuClock(FALSE);                    // Enumerate at full speed
   bUSBReady = FALSE;
+  flushReports();                        // (while detached, interrupt() forgot the last report, so the probe below goes)
+
+  usbAttach();                           // (the bus reset that follows sets the idle rate and protocol)
+  nFeatureCommands = 0;                  // (usbAttach() has cleared the feature report)
+#if TELEMETRY
+  telemetry.nAttaches++;
+  nAttachMillis = getMillis();           // interrupt() times the first LED report from here...
+  HAL_BARRIER();
+  nAttachSeq++;                          // ...once it sees this
+#endif
+  IDLEIE_bit = 1;                        // Interrupt when the bus has been idle for 3 ms (i.e. suspended)
+  bUSBEnabled = TRUE;                    // Allow the interrupt routine to service the USB module and send keyboard reports
+  nUSBState = USB_STATE_ATTACHING;
+  startTimer(TIMER_USB, USB_ATTACH_MS);  // Give the host this long to configure us
+  queueReport(0, 0);                     // Probe the host with a "no key pressed" report
+}
+
+void disableUSB()                        // Detach from the host and retry after a backoff delay
+{
+  bUSBEnabled = FALSE;                   // Stop the interrupt routine using the USB interface first
+  usbDetach();
+  flushReports();
+  bUSBReady = FALSE;
+  setCpuClock(TRUE);                     // Nothing to do until the backoff delay expires
+  nUSBState = USB_STATE_DETACHED;
+  startTimer(TIMER_USB, nBackoffMillis); // Reattach after the backoff delay...
+  if (nBackoffMillis < USB_BACKOFF_MAX_MS)
+  {
+    nBackoffMillis <<= 1;                // ...which doubles each consecutive time it fails
+  }
+}
+
+#if BOOTLOADER
+void enterBootloader()                   // Detach and restart in the bootloader (does not return)
+{
+  GIE_bit = 0;                           // Nothing may use the USB module from here on
+  bUSBEnabled = FALSE;
+  usbDetach();                           // The host sees us go, then the bootloader arrive
+  nBootRequest[0] = BOOT_REQUEST_MAGIC;
+  nBootRequest[1] = (uint8_t) ~BOOT_REQUEST_MAGIC;
+  CPU_RESET();
+}
+#endif
+
+void reattachUSB()                       // The host has reset the bus, so it is enumerating us again
+{
+  bUSBReady = FALSE;                     // (interrupt() stopped measuring the host's polls at the reset)
+  nTextNext = TEXT_IDLE;                 // Stop typing (the new host has been sent none of it)
+  setCpuClock(FALSE);                    // Enumerate at full speed
+  nUSBState = USB_STATE_ATTACHING;
+  startTimer(TIMER_USB, USB_ATTACH_MS);
+  queueReport(0, 0);                     // Probe the host again (usbService() handles the enumeration)
+}
+
+void loadSettings()                      // Read the keepalive and LED settings from HEF (or use the defaults)
+{
+  uint8_t i;
+  uint8_t nSum;
+
+  for (i = 0, nSum = 0; i < SETTINGS_WORDS; i++)
+  {
+    flashRow[i] = FLASH_Read(HEF_ADDRESS + i) & 0xFF;
+    nSum += flashRow[i];
+  }
+  bKeepAlive = 1;                        // Enable "keep alive" keystroke injection
+  nKeepAliveSeconds = KEEPALIVE_INTERVAL;
+  nKeepAlivePayload = KEEPALIVE_PAYLOAD;
+  nLedBrightness = LED_BRIGHTNESS;
+  if (flashRow[0] == SETTINGS_MAGIC && nSum == 0 &&        // If the host has saved settings
+      (flashRow[2] | flashRow[3]) != 0 && flashRow[4] <= KEEPALIVE_LAST &&
+      flashRow[5] != 0 && flashRow[5] < LED_LEVELS)
+  {
+    bKeepAlive = (flashRow[1] & SETTINGS_ENABLED) != 0;
+    nKeepAliveSeconds = flashRow[2] | (flashRow[3] << 8);
+    nKeepAlivePayload = flashRow[4];
+    nLedBrightness = flashRow[5];
+  }
+}
+
+void saveSettings()                      // Write the keepalive and LED settings to HEF
+{
+  uint8_t i;
+
+  for (i = 0; i < FLASH_ROW_WORDS; i++)
+  {
+    flashRow[i] = 0x3FFF;                // Leave the rest of the row erased
+  }
+  flashRow[0] = SETTINGS_MAGIC;
+  flashRow[1] = bKeepAlive ? SETTINGS_ENABLED : 0;
+  flashRow[2] = Lo(nKeepAliveSeconds);
+  flashRow[3] = Hi(nKeepAliveSeconds);
+  flashRow[4] = nKeepAlivePayload;
+  flashRow[5] = nLedBrightness;
+  flashRow[6] = -(uint8_t)(flashRow[0] + flashRow[1] + flashRow[2] + flashRow[3] + flashRow[4] + flashRow[5]) & 0xFF;
+  GIE_bit = 0;                           // The CPU stalls for a few ms while the row is erased and written...
+  FLASH_Erase(HEF_ADDRESS);
+  FLASH_Write(HEF_ADDRESS, flashRow);
+  GIE_bit = 1;                           // ...so the millisecond clock loses a few ticks
+}
+
+uint8_t queueSettings (uint8_t bFeature, uint8_t nCommand) // Tell the host the keepalive and LED settings now in effect
+{
+  uint8_t * pReport;
+
+  pReport = startReply(bFeature, nCommand, SETTINGS_TAG);
+  if (!pReport) return FALSE;
+  pReport[3] = bKeepAlive ? SETTINGS_ENABLED : 0;
+  pReport[4] = Lo(nKeepAliveSeconds);
+  pReport[5] = Hi(nKeepAliveSeconds);
+  pReport[6] = nKeepAlivePayload;
+  pReport[7] = nLedBrightness;
+  sendReply(bFeature);
+  return TRUE;
+}
+
+uint8_t queuePollReport (uint8_t nTag, uint8_t bFeature, uint8_t nCommand) // Queue a POLL_CMD_MEASURE probe (POLL_PROBE_TAG, never a feature report) or its result (POLL_TAG)
+{
+  uint8_t * pReport;
+
+  pReport = startReply(bFeature, nCommand, nTag);
+  if (!pReport) return FALSE;
+  pReport[3] = EP_IN_INTERVAL_MS;         // What we asked for...
+  pReport[4] = 0;
+  pReport[5] = 0;
+  pReport[6] = 0;
+  pReport[7] = 0;
+  if (nTag == POLL_TAG)
+  {
+    pReport[4] = nPollMin;                // ...and what the host granted
+    pReport[5] = nPollMax;
+    pReport[6] = (nPollSum + POLL_SAMPLES / 2) / POLL_SAMPLES;
+    pReport[7] = POLL_SAMPLES;
+  }
+  sendReply(bFeature);
+  return TRUE;
 }
 
+void changeSettings()                    // Apply (and save) settings sent by the host
+{
+  uint8_t bEnable;
+  uint16_t nSeconds;
+  uint8_t nBrightness;
 
+  bEnable = (hostCommand[1] & SETTINGS_ENABLED) != 0;
+  nSeconds = hostCommand[2] | (hostCommand[3] << 8);
+  nBrightness = hostCommand[5] ? hostCommand[5] : nLedBrightness; // (0 = unchanged)
+  if (nSeconds == 0 || hostCommand[4] > KEEPALIVE_LAST || nBrightness >= LED_LEVELS) return; // Ignore nonsense
+  if (bEnable != bKeepAlive || nSeconds != nKeepAliveSeconds || hostCommand[4] != nKeepAlivePayload ||
+      nBrightness != nLedBrightness)
+  {
+    bKeepAlive = bEnable;
+    nKeepAliveSeconds = nSeconds;
+    nKeepAlivePayload = hostCommand[4];
+    nLedBrightness = nBrightness;        // (interrupt() shows it from its next tick)
+    WAKE_TICK();
+    saveSettings();                      // (only when they change: HEF endures about 100,000 writes)
+  }
+  takeTimerEvent(EV_KEEPALIVE);
+  if (bKeepAlive)
+  {
+    startTimer(TIMER_KEEPALIVE, SECONDS(nKeepAliveSeconds)); // Count the new interval from now
+  }
+  else
+  {
+    stopTimer(TIMER_KEEPALIVE);
+  }
+}
 
 void Prolog()
 {
+  uint8_t i;
+  uint8_t bWarmStart;
+#if TELEMETRY
+  uint8_t * p;
+#endif
+
+  // A watchdog or stack reset (rather than power-on, brown-out or MCLR)
+  // leaves the persistent state intact, so carry on from where we were
+  bWarmStart = (PCON & (PCON_POR | PCON_BOR | PCON_RMCLR)) == (PCON_POR | PCON_BOR | PCON_RMCLR) &&
+               (!(PCON & PCON_RWDT) || (PCON & (PCON_STKOVF | PCON_STKUNF))) &&
+               nPersistMagic[0] == PERSIST_MAGIC && nPersistMagic[1] == (uint8_t) ~PERSIST_MAGIC;
+  PCON = PCON_REARM;      // Reset the flags so that the cause of the next reset can be told
+  nPersistMagic[0] = 0;   // The persistent state is not valid again until Prolog() has finished
+  WDTCON = WDTCON_PERIOD; // Reset if main() stops feeding the watchdog (see waitForEvent())
+
   ANSELA = 0b00000000;    // Configure all PORTA bits as digital
   ANSELC = 0b00000000;    // Configure all PORTC bits as digital
 
@@ -188,8 +586,13 @@ void Prolog()
 //            x             = SPLLMULT: 1=3x PLL is enabled
 //             xxxx         = IRCF:     1111=16 MHz or 48 MHz
 //                 xx       = SCS:      00=Clock determined by FOSC in Configuration Words
+// setCpuClock() switches SCS to 1x (Fosc = 16 MHz HFINTOSC) once the host has
+// configured us, and back to 00 whenever the host enumerates us again.
 
-  while (!HFIOFS_bit);    // Wait for HFINTOSC to stabilise
+  if (!bWarmStart)        // (HFINTOSC kept running through a watchdog or stack reset)
+  {
+    while (!HFIOFS_bit);  // Wait for HFINTOSC to stabilise
+  }
   while(!PLLRDY_bit);     // Wait for PLL to lock
 
   ACTEN_bit = 0;          // Disable Active Clock Tuning, then...
@@ -197,94 +600,1040 @@ void Prolog()
   ACTEN_bit = 1;          // Enable Active Clock Tuning
 //  while (!ACTLOCK_bit);   // Wait until HFINTOSC is successfully tuned
 
-  cFlags = 0;             // Reset all flags
-  bKeepAlive = 1;         // Enable "keep alive" keystroke injection
+  cFlags.byte = 0;        // Reset all flags
+  cIsrFlags.byte = 0;
+  cEvents = 0;            // No events pending
+  cEventsTaken = 0;
+  nReportHead = 0;        // No reports queued
+  nReportTail = 0;
+  nTextNext = TEXT_IDLE;  // Not typing
+  nStalledMillis = 0;
+  nIdleMillis = 0;
+  nPollStarts = nPollRequests;
+  loadSettings();         // Keepalive enabled, interval and payload
+#if TELEMETRY
+  if (bWarmStart)
+  {
+    telemetry.nWarmStarts++;
+  }
+  else
+  {
+    p = (uint8_t *) &telemetry;
+    for (i = 0; i < sizeof telemetry; i++)
+    {
+      p[i] = 0;           // Start counting from power-on
+    }
+  }
+  telemetry.nVersion = TELEMETRY_VERSION;
+  nAttachSeq = 0;         // (enableUSB() makes it 1, so the first LED report is timed)
+  nLedAttachSeq = 0;
+#endif
 
   // Set up USB (only do this while the USB module is disabled)
-  UPUEN_bit = 1;          // USB On-chip pull-up enable
-  FSEN_bit = 1;           // 1 = USB Full Speed enabled (requires 48 MHz USB clock)
-                          // 0 = USB Full Speed disabled (requires 6 MHz USB clock)
+  UCFG = UCFG_FULL_SPEED; // UPUEN=1: USB On-chip pull-up enable
+                          // FSEN=1:  USB Full Speed enabled (requires 48 MHz USB clock)
+                          // PPB=11:  Even/odd buffers on EP1 IN and OUT (see usb.h)
 
-// Timer1 is used for human-scale delays (Timer1 is not always enabled)
-  T1CON   = 0b00110010;
+// Timer1 runs freely for timestamps, keeps time while interrupt() is tickless,
+// and counts LFINTOSC to keep time while suspended
+  T1CON   = T1CON_ACTIVE;
+//          0b00110010
 //            xx             TMR1CS:  00=Timer1 clock source is instruction clock (Fosc/4)
 //              xx           T1CKPS:  11=Timer1 prescale value is 1:8
 //                x          T1OSCEN: 0=Low Power oscillator circuit disabled
 //                 x        ~T1SYNC:  0=Synchronize asynchronous clock input with system clock (Fosc)
 //                  x        Unimplemented
 //                   x       TMR1ON:  0=Timer1 is off
-// Timer1 tick rate = 48 MHz FOSC/4/8 = 1.5 MHz (667 ns)
-// Timer1 interrupt rate = 1.5 MHz / 65536 = 22.9 times per second
+// Timer1 tick rate = 48 MHz FOSC/4/8 = 1.5 MHz (667 ns), or 500 kHz (2 us) at 16 MHz
 
-  CAPSLOCK_LED = OFF;
+// Timer2 provides the 1 ms clock tick
+  PR2     = PR2_TICK;
+  T2CON   = T2CON_TICK;
+//          0b00010110
+//             xxxx          T2OUTPS: 0010=1:3 Postscaler
+//                 x         TMR2ON:  1=Timer2 is on
+//                  xx       T2CKPS:  10=Prescaler is 16
+// Timer2 interrupt rate = 48 MHz FOSC/4/16/(249+1)/3 = 1000 times per second
+// (setCpuClock() changes the postscaler to 1:1 while Fosc is 16 MHz)
+
+  if (!bWarmStart)
+  {
+    leds.byte = 0;        // The host has not told us its LED state yet
+  }
+  nLedFadeStep = LED_FADE_IDLE;
+  nLedFades = nLedFadeRequests;
+#if MOUSE_INTERFACE
+  nMouseReports = nMouseRequests;
+#endif
+  nLedLevel = leds.bits.CapsLock ? nLedBrightness : 0; // (still what the host last sent after a warm start)
+  nLedDuty = 0;
+#if LED_PWM1
+  PWM1DCL = 0;
+  PWM1DCH = ledGamma[nLedLevel];
+  PWM1CON = PWM1CON_ON;   // The CapsLock LED on RC5 (Timer2 must be running, see below)
+#else
+  nLedPwm = 0;            // interrupt() shows the LED on RA4 from its first tick
+#endif
+#if INDICATOR_LEDS
+  nIndicatorLeds = ~leds.byte; // interrupt() shows the indicators from its first tick
+  nIndicatorSlot = 0;
+#endif
 
 //----------------------------------------------------------------------------
 // Let the interrupts begin
 //----------------------------------------------------------------------------
 
-  TMR1IE_bit = 1;         // Enable Timer1 interrupts (for keepalive)
+  if (!bWarmStart)
+  {
+    nMillis = 0;
+  }
+  for (i = 0; i < TIMERS; i++)
+  {
+    if (!bWarmStart || i != TIMER_KEEPALIVE) // Keep the keepalive on schedule through a warm start
+    {
+      nTimerSeq[i] = 0;   // Stopped
+      nTimerExpired[i] = 0;
+    }
+  }
+  cTimerEvents = 0;
+  cTimerEventsTaken = 0;
+  TMR1ON_bit = 1;         // Start Timer1 (its interrupt is only enabled while suspended or tickless)
+  TMR2IE_bit = 1;         // Enable Timer2 interrupts (the 1 ms tick)
   PEIE_bit = 1;           // Enable peripheral interrupts
   GIE_bit = 1;            // Enable global interrupts
 
+  nBackoffMillis = USB_BACKOFF_MIN_MS;
   enableUSB();            // Enable USB interface
+  if (bKeepAlive && !timerRunning(TIMER_KEEPALIVE))
+  {
+    startTimer(TIMER_KEEPALIVE, SECONDS(nKeepAliveSeconds));
+  }
+
+  nPersistMagic[0] = PERSIST_MAGIC;  // A watchdog or stack reset can now carry on from here
+  nPersistMagic[1] = (uint8_t) ~PERSIST_MAGIC;
+}
+
+
+uint8_t pressKey (uint8_t key)
+{
+  if (reportQueueFree() < 2) return FALSE; // Never queue a key press without its release
+  queueReport(0, key);                   // Queue a "key pressed" report
+  queueReport(0, 0);                     // Queue a "no key pressed" report
+  return TRUE;
+}
+
+uint8_t textUsage (char c)               // The usage that types c, plus TEXT_SHIFT if it needs Shift (0 = none)
+{
+  uint8_t nUsage;
+
+  if (c == '\n') return ENTER_KEY;
+  if (c == '\t') return TAB_KEY;
+  if (c < ' ' || c > '~') return 0;
+  nUsage = textUsages[c - ' '];
+  if (leds.bits.CapsLock && (nUsage & ~TEXT_SHIFT) >= A_KEY && (nUsage & ~TEXT_SHIFT) <= Z_KEY)
+  {
+    nUsage ^= TEXT_SHIFT;                // The host shifts letters itself while CapsLock is on
+  }
+  return nUsage;
+}
+
+uint8_t findKey (uint8_t * pKeys, uint8_t nKeys, uint8_t key)
+{
+  while (nKeys--)
+  {
+    if (pKeys[nKeys] == key) return TRUE;
+  }
+  return FALSE;
+}
+
+void flushText()                         // Queue the keys gathered so far as one report (the caller has checked for room)
+{
+  uint8_t i;
+
+  queueKeys(nTextModifiers, textKeys, nTextKeys);
+  for (i = 0; i < nTextKeys; i++)
+  {
+    heldKeys[i] = textKeys[i];           // The host now holds these down
+  }
+  nHeldKeys = nTextKeys;
+  nHeldModifiers = nTextModifiers;
+  nTextKeys = 0;
+  nTextReports++;
 }
 
+void releaseText()                       // Queue a report releasing every key (the caller has checked for room)
+{
+  queueReport(0, 0);
+  nHeldKeys = 0;
+  nHeldModifiers = 0;
+  nTextReports++;
+}
+
+void queueTextReply()                    // Tell the host that the text has been queued (see TEXT_CMD_TYPE in telemetry.h)
+{
+  uint8_t * pReport;
+
+  pReport = startReply(bTextFeature, nTextCommand, TEXT_TAG);
+  if (!pReport) return;
+  pReport[3] = nTextString;
+  pReport[4] = Lo(nTextChars);
+  pReport[5] = Hi(nTextChars);
+  pReport[6] = Lo(nTextReports);
+  pReport[7] = Hi(nTextReports);
+  sendReply(bTextFeature);
+}
 
-void pressKey (uint8_t key)
+void typeText()                          // Queue as much of the text as the report queue has room for
 {
-  usbToHost[0] = 0x00;                   // Key modifier usages
-  usbToHost[1] = 0x00;                   // Reserved
-  usbToHost[2] = key;                    // Key usage code
-  while (!bUSBReady = HID_Write(&usbToHost, sizeof usbToHost)); // Send a "SCROLL LOCK key pressed" message to the host
-  usbToHost[2] = 0b00000000;             // No key pressed
-  while (!bUSBReady = HID_Write(&usbToHost, sizeof usbToHost)); // Send a "no key pressed" message to the host
+  char c;
+  uint8_t nKey;
+  uint8_t nModifiers;
+
+  while (reportQueueFree() >= 3)         // Each character needs at most two reports, and the end of the text three
+  {
+    c = textStrings[nTextNext];
+    if (c == 0)                          // If that was the whole string
+    {
+      if (nTextKeys) flushText();
+      if (nHeldKeys) releaseText();
+      queueTextReply();
+      nTextNext = TEXT_IDLE;
+      return;
+    }
+    nKey = textUsage(c);
+    if (nKey)
+    {
+      nModifiers = (nKey & TEXT_SHIFT) ? LEFT_SHIFT : 0;
+      nKey &= ~TEXT_SHIFT;
+      if (nKey == SPACE_KEY)             // (Shift makes no difference to Space alone)
+      {
+        nModifiers = nTextKeys ? nTextModifiers : nHeldModifiers;
+      }
+      if (nTextKeys && (nTextKeys == TEXT_KEYS || nModifiers != nTextModifiers ||
+                        findKey(textKeys, nTextKeys, nKey) || findKey(heldKeys, nHeldKeys, nKey)))
+      {
+        flushText();                     // The key has to go in the next report
+      }
+      if (!nTextKeys)                    // If it starts a report
+      {
+        if (nHeldKeys && (nModifiers != nHeldModifiers || findKey(heldKeys, nHeldKeys, nKey)))
+        {
+          releaseText();                 // The host has to see the key go up first (or Shift change with no key down)
+        }
+        nTextModifiers = nModifiers;
+      }
+      textKeys[nTextKeys++] = nKey;
+      nTextChars++;
+    }
+    nTextNext++;
+  }
 }
 
+uint16_t findText (uint8_t nString)      // Offset in textStrings of TEXT_STRINGS string nString (TEXT_IDLE = none)
+{
+  uint16_t nOffset;
 
-#define KEEP_ALIVE_INTERVAL 60
+  nOffset = 0;
+  for (; nString; nString--)
+  {
+    while (textStrings[nOffset]) nOffset++;
+    if (++nOffset >= sizeof textStrings) return TEXT_IDLE;
+  }
+  return nOffset;
+}
+
+void startTyping (uint8_t nString, uint16_t nOffset) // Start typing string nString, found at nOffset by findText()
+{
+  nTextString = nString;
+  nTextNext = nOffset;
+  nTextChars = 0;
+  nTextReports = 0;
+  nTextKeys = 0;
+  nHeldKeys = 0;                         // (each keepalive releases its key, so nothing is held down)
+  nHeldModifiers = 0;
+  typeText();
+}
+
+void suspend()
+{
+  // Everything that draws current is turned off and the PIC is put to sleep.
+  // Sleep stops HFINTOSC and the PLL, and USB bus activity (ACTVIF) wakes it.
+  holdTick();                            // (Timer1 is ours until we resume)
+#if LED_PWM1
+  PWM1CON = 0;                           // LED off: RC5 goes back to LATC5 (0), as PWM1 would stop mid-cycle
+#endif
+#if INDICATOR_LEDS
+  LATC &= ~INDICATOR_PINS;               // (interrupt() keeps them off until we resume)
+#endif
+  TMR1ON_bit = 0;
+#if REMOTE_WAKEUP
+  T1CON = T1CON_SUSPENDED;               // Keep the millisecond clock (roughly) going while asleep...
+  TMR1IF_bit = 0;
+  TMR1IE_bit = 1;
+  TMR1ON_bit = 1;
+#endif
+  nResumeStep = RESUME_IDLE;
+  while (bSuspended)
+  {
+    if (nResumeStep == RESUME_IDLE)
+    {
+      GIE_bit = 0;                       // Don't let interrupt() run until the clock is stable again
+      if (bSuspended)                    // (interrupt() may have resumed us just now)
+      {
+        CPU_SLEEP();                     // Zzzz...  (an enabled interrupt flag still wakes us)
+      }
+      while (!HFIOFS_bit);               // Wait for HFINTOSC to stabilise
+      while (!PLLRDY_bit);               // Wait for PLL to lock
+      GIE_bit = 1;                       // Now let interrupt() handle whatever woke us
+    }
+    else
+    {
+      HAL_SPIN();                        // Remote wakeup signalling is in progress
+    }
+#if REMOTE_WAKEUP
+    // If the keepalive has popped, wake up the host, but only if it has
+    // allowed us to (USB 2.0 section 9.4.5). Otherwise the keepalive waits
+    // until the host resumes the bus itself.
+    if (TIMER_EVENT_PENDING(EV_KEEPALIVE) && bSuspended && bRemoteWakeup && nResumeStep == RESUME_IDLE)
+    {
+      SUSPND_bit = 0;                    // Wake up the USB module...
+      nResumeStep = RESUME_SETTLING;
+      startTimer(TIMER_RESUME, 5);       // ...and let it settle
+    }
+    if (takeTimerEvent(EV_RESUME_TIMER))
+    {
+      if (nResumeStep == RESUME_SETTLING)
+      {
+        RESUME_bit = 1;                  // Drive resume signalling onto the bus...
+        nResumeStep = RESUME_SIGNALLING;
+        startTimer(TIMER_RESUME, 10);    // ...for 1 to 15 ms (USB 2.0 section 7.1.7.7)
+      }
+      else
+      {
+        RESUME_bit = 0;                  // The host now drives resume and interrupt() sees the activity
+        nResumeStep = RESUME_IDLE;
+        if (bSuspended)
+        {
+          SUSPND_bit = 1;                // The host ignored us, so go back to sleep...
+          takeTimerEvent(EV_KEEPALIVE);
+          startTimer(TIMER_KEEPALIVE, SECONDS(nKeepAliveSeconds)); // ...and try again later
+        }
+      }
+    }
+#else
+    takeTimerEvent(EV_KEEPALIVE);
+#endif
+  }
+  if (nResumeStep != RESUME_IDLE)        // If the host resumed while we were signalling
+  {
+    stopTimer(TIMER_RESUME);
+    takeTimerEvent(EV_RESUME_TIMER);
+    RESUME_bit = 0;
+    nResumeStep = RESUME_IDLE;
+  }
+  TMR1ON_bit = 0;
+  TMR1IE_bit = 0;
+  T1CON = T1CON_ACTIVE;
+  TMR1ON_bit = 1;
+  bHoldTick = FALSE;
+#if LED_PWM1
+  PWM1CON = PWM1CON_ON;                  // interrupt() shows the LED state again
+#endif
+}
+
+void waitForEvent()
+{
+  // The PIC16F1455 has no IDLE mode: SLEEP stops the system clock that both
+  // the USB module and Timer1 run from. So, while the bus is active, just
+  // wait here for interrupt() to post an event.
+  //
+  // The watchdog is fed once per main() loop, and each time interrupt() moves
+  // nMillis on, which it does every millisecond, or at least every 131 ms
+  // while tickless, so only while interrupt() is running too.
+  uint8_t nTick;
+
+  HAL_TRACE_LOOP();
+  CPU_CLRWDT();
+  nTick = Lo(nMillis);
+  while (cEvents == cEventsTaken && cTimerEvents == cTimerEventsTaken)
+  {
+    if (Lo(nMillis) != nTick)
+    {
+      nTick = Lo(nMillis);
+      CPU_CLRWDT();
+    }
+    HAL_IDLE();
+  }
+}
 
 void main()
 {
+  uint8_t i;
+  uint8_t bFeature;
+  uint16_t nOffset;
+
   Prolog();
-  nRemainingTimerTicks = INTERVAL_IN_SECONDS(KEEP_ALIVE_INTERVAL);
-  TMR1ON_bit = bKeepAlive;   // Enable keepalive interrupts
   while (1)
   {
-    if (bUSBReady)
+    waitForEvent();
+
+    if (takeEvent(EV_USB_RESET)) // If the host has reset the bus (e.g. after a dock switch)
+    {
+#if TELEMETRY
+      telemetry.nBusResets++;
+#endif
+      if (nUSBState != USB_STATE_DETACHED)
+      {
+        reattachUSB();       // Just wait to be enumerated again: don't tear down the USB interface
+      }
+    }
+
+    if (takeEvent(EV_USB_CONFIGURED)) // If the host has accepted a keyboard report
+    {
+      if (nUSBState == USB_STATE_ATTACHING)
+      {
+        nUSBState = USB_STATE_READY;
+        stopTimer(TIMER_USB);
+        takeTimerEvent(EV_USB_TIMER);
+        nBackoffMillis = USB_BACKOFF_MIN_MS;
+        bUSBReady = TRUE;
+        setCpuClock(TRUE);   // Enumeration is over, so slow the CPU down
+      }
+    }
+
+    if (takeTimerEvent(EV_USB_TIMER)) // If the USB attach timeout or backoff delay has expired
     {
-      if (HID_Read() == 1)   // If a (complete) host LED indication response is available
+      if (nUSBState == USB_STATE_ATTACHING)
+      {
+        disableUSB();        // The host has not configured us, so back off and try again
+      }
+      else if (nUSBState == USB_STATE_DETACHED)
       {
-        leds.byte = usbFromHost[0];   // Remember the most recent LED status change
-        CAPSLOCK_LED = leds.bits.CapsLock; // Make the CAPSLOCK light match the CAPSLOCK state
-        nRemainingTimerTicks = INTERVAL_IN_SECONDS(KEEP_ALIVE_INTERVAL); // User has pressed CAPSLOCK, so check again in a little while
+        enableUSB();
       }
+    }
 
-      if (nRemainingTimerTicks == 0)  // If the keepalive timer has popped
+    if (takeEvent(EV_LED_REPORT)) // If the host has changed the LED status (interrupt() has already updated the LED)
+    {
+      if (bKeepAlive)
       {
-        CAPSLOCK_LED ^= 1;            // Flash LED
-        pressKey(SCROLL_LOCK_KEY);    // Press harmless key (turns on Scroll Lock light on old keyboards)
-        pressKey(SCROLL_LOCK_KEY);    // Press harmless key (to reset Scroll Lock to its original state)
-        CAPSLOCK_LED ^= 1;            // Flash LED
-        nRemainingTimerTicks = INTERVAL_IN_SECONDS(KEEP_ALIVE_INTERVAL);  // Check again in a little while
+        startTimer(TIMER_KEEPALIVE, SECONDS(nKeepAliveSeconds)); // User has pressed CAPSLOCK, so check again in a little while
+        takeTimerEvent(EV_KEEPALIVE); // The user is active, so a keepalive that popped meanwhile is not needed
       }
     }
-    else
+
+    if (takeTimerEvent(EV_KEEPALIVE)) // If the keepalive timer has popped
     {
-      disableUSB();
-      enableUSB();
+      // Queue the whole keepalive or none of it: a lone Scroll Lock press would
+      // leave the host's Scroll Lock toggled. A full queue means that reports
+      // are going to the host anyway, so that keepalive is simply skipped.
+      if (bUSBReady && reportQueueFree() >= (nKeepAlivePayload == KEEPALIVE_SCROLL_LOCK ? 4 :
+                                             nKeepAlivePayload == KEEPALIVE_MOUSE ? 0 : 2))
+      {
+        nLedFadeRequests++;           // Fade the LED (interrupt() does it while we press keys)
+#if MOUSE_INTERFACE
+        if (nKeepAlivePayload == KEEPALIVE_MOUSE)
+        {
+          nMouseRequests++;           // Nudge the mouse without moving it (interrupt() sends it)
+          WAKE_TICK();
+        }
+        else
+#endif
+        if (nKeepAlivePayload == KEEPALIVE_F24)
+        {
+          pressKey(F24_KEY);          // Press a key that no real keyboard has
+        }
+        else if (nKeepAlivePayload == KEEPALIVE_RESERVED)
+        {
+          pressKey(RESERVED_KEY);     // Press a key that has no meaning at all
+        }
+        else
+        {
+          pressKey(SCROLL_LOCK_KEY);  // Press harmless key (turns on Scroll Lock light on old keyboards)
+          pressKey(SCROLL_LOCK_KEY);  // Press harmless key (to reset Scroll Lock to its original state)
+        }
+#if TELEMETRY
+        telemetry.nKeepAlives++;
+#endif
+      }
+      startTimer(TIMER_KEEPALIVE, SECONDS(nKeepAliveSeconds)); // Check again in a little while
+    }
+
+    if (takeEvent(EV_SUSPEND)) // If the host has suspended the bus
+    {
+      suspend();             // Sleep until the bus resumes
+    }
+
+    if (takeEvent(EV_USB_LOST)) // If the host has stopped accepting reports
+    {
+      if (nUSBState == USB_STATE_READY)
+      {
+#if TELEMETRY
+        telemetry.nStalls++;
+#endif
+        disableUSB();        // Reattach after a backoff delay
+      }
+    }
+
+    if (EVENT_PENDING(EV_HOST_COMMAND)) // If the host has sent a vendor command
+    {
+      bFeature = bFeatureCommand;  // (interrupt() leaves it alone until the command is taken)
+      switch (hostCommand[0])
+      {
+#if TELEMETRY
+        case TELEMETRY_CMD_READ:
+          if (hostCommand[1] < TELEMETRY_CHUNKS && bUSBReady)
+          {
+            queueTelemetry(hostCommand[1], bFeature, acceptCommand(bFeature));
+          }
+          break;
+#endif
+        case POLL_CMD_MEASURE:
+          if (bUSBReady && !bMeasuringPoll && nPollStarts == nPollRequests && reportQueueFree() > POLL_SAMPLES)
+          {
+            nPollRequests++;                   // (interrupt() starts measuring before the first probe goes)
+            bPollFeature = bFeature;
+            nPollCommand = acceptCommand(bFeature);
+            for (i = 0; i <= POLL_SAMPLES; i++)
+            {
+              queuePollReport(POLL_PROBE_TAG, FALSE, 0); // One more probe than periods to measure
+            }
+          }
+          break;
+#if BOOTLOADER
+        case BOOT_CMD_ENTER:
+          if (hostCommand[1] == 'O' && hostCommand[2] == 'O' && hostCommand[3] == 'T')
+          {
+            enterBootloader();
+          }
+          break;
+#endif
+        case TEXT_CMD_TYPE:
+          nOffset = findText(hostCommand[1]);
+          if (bUSBReady && nTextNext == TEXT_IDLE && nOffset != TEXT_IDLE)
+          {
+            bTextFeature = bFeature;
+            nTextCommand = acceptCommand(bFeature);
+            startTyping(hostCommand[1], nOffset);
+          }
+          break;
+        case SETTINGS_CMD_SET:
+          changeSettings();
+          // Fall through - report the settings now in effect
+        case SETTINGS_CMD_GET:
+          if (bUSBReady)
+          {
+            queueSettings(bFeature, acceptCommand(bFeature));
+          }
+          break;
+      }
+      takeEvent(EV_HOST_COMMAND);  // Only now may interrupt() replace hostCommand
+    }
+
+    if (takeEvent(EV_POLL_MEASURED)) // If interrupt() has timed enough polls of the IN endpoint
+    {
+      if (bUSBReady)
+      {
+        queuePollReport(POLL_TAG, bPollFeature, nPollCommand);
+      }
+    }
+
+    if (takeEvent(EV_REPORT_SENT)) // If interrupt() has made room in the report queue
+    {
+      if (nTextNext != TEXT_IDLE)
+      {
+        typeText();          // Queue more of the text
+      }
     }
   }
 }
 
-void interrupt()               // High priority interrupt service routine
+#if INDICATOR_LEDS
+void updateIndicators()        // Work out which indicator each scan slot lights, and show the slot now (interrupt() only)
+{
+  uint8_t s;
+  uint8_t i;
+
+  nIndicatorLeds = leds.byte;
+  for (s = 0; s < INDICATOR_SLOTS; s++)
+  {
+    i = s & 1;                 // Even slots are NumLock's, odd slots ScrollLock's
+    indicatorScan[s] = 0;
+    if ((nIndicatorLeds & indicatorLed[i]) && (s >> 1) < indicatorSlots[i])
+    {
+      indicatorScan[s] = indicatorPin[i];
+    }
+  }
+  LATC = (LATC & ~INDICATOR_PINS) | indicatorScan[nIndicatorSlot];
+}
+#endif
+
+#if !LED_PWM1
+void stepLed()                 // One millisecond of the LED's software PWM (interrupt() only)
+{
+  if (nLedPwm >= LED_DUTY_MAX - nLedDuty) // Lit for nLedDuty of every LED_DUTY_MAX ticks, as evenly spread as they go
+  {
+    nLedPwm -= LED_DUTY_MAX - nLedDuty;
+    CAPSLOCK_LED = ON;
+  }
+  else
+  {
+    nLedPwm += nLedDuty;
+    CAPSLOCK_LED = OFF;
+  }
+}
+#endif
+
+uint8_t tickNeeded()           // Would the 1 ms tick have anything to do? (interrupt() only)
+{
+  if (bHoldTick || !bSlowClock || !bUSBReady || bSuspended)
+  {
+    return TRUE;               // (Timer1 only counts TIMER1_TICKS_PER_MS at 16 MHz, and suspend() uses it)
+  }
+  if (nReportHead != nReportTail || (nIdleRate && bLastReportValid))
+  {
+    return TRUE;               // Reports to send (or to count the host stalling on), or to repeat
+  }
+  if (nLedFadeStep != LED_FADE_IDLE || nLedFades != nLedFadeRequests ||
+      nLedLevel != (leds.bits.CapsLock ? nLedBrightness : 0))
+  {
+    return TRUE;               // The LED is fading, or about to
+  }
+#if !LED_PWM1
+  if (nLedDuty != 0 && nLedDuty != LED_DUTY_MAX)
+  {
+    return TRUE;               // The LED is dimmed by the tick
+  }
+#endif
+#if INDICATOR_LEDS
+  if ((leds.byte & (LED_NUMLOCK | LED_SCROLLLOCK)) || leds.byte != nIndicatorLeds)
+  {
+    return TRUE;               // Indicators to scan
+  }
+#endif
+  return FALSE;
+}
+
+uint32_t readTimer1()          // Timer1, with nTimer1Overflows as its high word (interrupt() only, while tickless)
+{
+  uint16_t nTicks;
+
+  READ_TIMER1(nTicks);
+  if (TMR1IF_bit)              // If it has overflowed (perhaps just after that read)
+  {
+    TMR1IF_bit = 0;
+    nTimer1Overflows++;
+    READ_TIMER1(nTicks);
+  }
+  return ((uint32_t) nTimer1Overflows << 16) | nTicks;
+}
+
+uint8_t ticklessMillis()       // Milliseconds Timer1 has counted since nMillis last moved on (interrupt() only)
+{
+  uint32_t nNow;
+  uint32_t nTicks;
+  uint32_t nStep;
+  uint8_t nBit;
+  uint8_t nElapsed;
+
+  nNow = readTimer1();
+  nTicks = nNow - nTickBase;   // (not much more than one Timer1 period, as each overflow interrupts)
+  nElapsed = 0;
+  nStep = (uint32_t) TIMER1_TICKS_PER_MS << 7;
+  for (nBit = 0x80; nBit; nBit >>= 1) // Divide by TIMER1_TICKS_PER_MS (without the routine main() calls)
+  {
+    if (nTicks >= nStep)
+    {
+      nTicks -= nStep;
+      nElapsed |= nBit;
+    }
+    nStep >>= 1;
+  }
+  nTickBase = nNow - nTicks;   // The millisecond just begun
+  return nElapsed;
+}
+
+void scheduleWake()            // Move Timer1 on to overflow when the next timer expires, if that is sooner (interrupt() only)
 {
-  if (USBIF)
+  uint8_t i;
+  uint8_t nSeq;
+  uint8_t nWait;
+  int32_t nLeft;
+  uint16_t nNow;
+  uint16_t nTicks;
+  uint16_t nPast;
+
+  nWait = TIMER1_PERIOD_MS;
+  for (i = 0; i < TIMERS; i++)
+  {
+    nSeq = nTimerSeq[i];
+    if ((nSeq & 1) && nSeq != nTimerExpired[i]) // If timer i is running
+    {
+      nLeft = (int32_t)(nTimerDeadline[i] - nMillis);
+      if (nLeft < nWait)
+      {
+        nWait = nLeft < 1 ? 1 : (uint8_t) nLeft;
+      }
+    }
+  }
+  if (nWait == TIMER1_PERIOD_MS) return; // Timer1 overflows before then anyway
+  TMR1ON_bit = 0;              // (Timer1 stands still while it is moved on)
+  READ_TIMER1(nNow);
+  nPast = nNow - (uint16_t) nTickBase; // Ticks since the millisecond began
+  nTicks = TIMER1_MS_TO_TICKS(nWait);
+  nTicks = nPast < nTicks ? nTicks - nPast : 1; // Ticks until the timer expires
+  if (!TMR1IF_bit && nTicks < (uint16_t) (0 - nNow)) // If that is before Timer1 overflows
   {
-    USB_Interrupt_Proc();      // Always give the USB module first opportunity to process (resets USBIF)
+    nTicks = 0 - nTicks;       // Timer1 then overflows just as the timer expires...
+    nTickBase += (uint16_t) (nTicks - nNow); // ...and nTickBase stays the same moment
+    TMR1H = Hi(nTicks);
+    TMR1L = Lo(nTicks);
   }
-  if (TMR1IF_bit)              // Timer1 interrupt? (22.9 times/second)
+  TMR1ON_bit = 1;
+}
+
+void serviceInterrupt()        // Everything interrupt() does (see below)
+{
+  uint8_t i;
+  uint8_t nMask;
+  uint8_t * pReport;
+  uint16_t nElapsed;
+  uint8_t nReceived;
+  uint8_t bChanged;
+  uint16_t nFrame;
+  uint16_t nPeriod;
+  uint8_t nTarget;
+  uint8_t nSeq;
+#if TELEMETRY
+  uint16_t nBound;
+  uint32_t nFirstLed;
+#endif
+#if LED_LATENCY_PROFILE || TELEMETRY
+  uint16_t nEntryTime;
+  READ_TIMER1(nEntryTime);     // Timestamp the interrupt as early as possible
+#endif
+  if (USBIF_bit)
+  {
+    if (ACTVIE_bit && ACTVIF_bit)      // Bus activity while suspended?
+    {
+      SUSPND_bit = 0;                  // Resume the USB module
+      ACTVIE_bit = 0;
+      while (ACTVIF_bit)
+      {
+        ACTVIF_bit = 0;                // This only sticks once the USB clock is running again
+      }
+      bSuspended = 0;
+    }
+    if (URSTIF_bit)                    // Bus reset? (usbService() handles it, but tell main() too)
+    {
+      bLastReportValid = 0;
+      bMeasuringPoll = 0;              // The host may poll differently once it has enumerated us again
+      POST_EVENT(EV_USB_RESET);
+    }
+    if (nPollStarts != nPollRequests)  // If main() wants the host's polling period measured
+    {
+      nPollStarts = nPollRequests;
+      nPollCount = 0;
+      nPollMin = 0xFF;
+      nPollMax = 0;
+      nPollSum = 0;
+      bMeasuringPoll = 1;
+    }
+    if (TRNIF_bit && bMeasuringPoll && (USTAT & 0b01111100) == 0b00001100) // Endpoint 1 IN transaction while measuring?
+    {
+      Lo(nFrame) = UFRML;              // The host took a report in this frame
+      Hi(nFrame) = UFRMH;
+      if (nPollCount)
+      {
+        nPeriod = (nFrame - nPollFrame) & 0x07FF; // Frames since the last one (frame numbers are 11 bits)
+        if (Hi(nPeriod))
+        {
+          nPeriod = 0xFF;
+        }
+        if (Lo(nPeriod) < nPollMin)
+        {
+          nPollMin = Lo(nPeriod);
+        }
+        if (Lo(nPeriod) > nPollMax)
+        {
+          nPollMax = Lo(nPeriod);
+        }
+        nPollSum += nPeriod;
+      }
+      nPollFrame = nFrame;
+      nPollCount++;
+      if (nPollCount > POLL_SAMPLES)
+      {
+        bMeasuringPoll = 0;
+        POST_EVENT(EV_POLL_MEASURED);  // Tell main()
+      }
+    }
+    if (IDLEIE_bit && IDLEIF_bit)      // Bus idle for 3 ms?
+    {
+      IDLEIF_bit = 0;
+      ACTVIE_bit = 1;                  // Wake up on bus activity
+      SUSPND_bit = 1;                  // Suspend the USB module
+      bSuspended = 1;
+#if !LED_PWM1
+      nLedDuty = 0;                    // LED off until the tick runs again after the resume
+      CAPSLOCK_LED = OFF;
+#endif
+      POST_EVENT(EV_SUSPEND);          // Tell main()
+    }
+    nReceived = bUSBEnabled ? usbService(usbFromHost) : 0; // A bus reset or one transaction
+    if (bIdleRateSet)                  // SET_IDLE restarts the idle period
+    {
+      bIdleRateSet = 0;
+      nIdleMillis = 0;
+    }
+    if (nReceived == 1)                // If a (complete) host LED indication report has just arrived
+    {
+      leds.byte = usbFromHost[0];        // Remember the most recent LED status change
+      nLedFadeStep = LED_FADE_IDLE;      // (cancelling any keepalive fade)
+      nLedLevel = leds.bits.CapsLock ? nLedBrightness : 0;
+#if LED_PWM1
+      PWM1DCH = ledGamma[nLedLevel];     // Make the CAPSLOCK light match the CAPSLOCK state (from the next PWM period)
+#else
+      nLedDuty = ledGamma[nLedLevel];    // Make the CAPSLOCK light match the CAPSLOCK state...
+      nLedPwm = LED_DUTY_MAX - 1;        // ...at once (this millisecond is lit unless it is off)
+      stepLed();
+#endif
+#if INDICATOR_LEDS
+      updateIndicators();                // ...and the NumLock and ScrollLock indicators
+#endif
+#if LED_LATENCY_PROFILE || TELEMETRY
+      READ_TIMER1(nLedTimestamp);        // When the LED was updated...
+      nLedLatency = nLedTimestamp - nEntryTime; // ...and how long after the USB interrupt
+      if (bSlowClock)
+      {
+        nLedLatency += nLedLatency << 1; // Timer1 ran SLOW_CLOCK_DIVISOR (3) times slower
+      }
+#endif
+#if TELEMETRY
+      telemetry.nLedReports++;
+      for (i = 0, nBound = 16; i < TELEMETRY_LATENCY_BUCKETS - 1 && nLedLatency >= nBound; i++, nBound <<= 1);
+      telemetry.nLatency[i]++;
+      if (nLedAttachSeq != nAttachSeq)   // If this is the first LED report since we attached
+      {
+        nLedAttachSeq = nAttachSeq;
+        nFirstLed = nMillis - nAttachMillis; // Record how long it took to become useful
+        telemetry.nFirstLedMillis = nFirstLed > 0xFFFF ? 0xFFFF : (uint16_t) nFirstLed;
+      }
+      nTelemetrySeq++;
+#endif
+      POST_EVENT(EV_LED_REPORT);         // Tell main()
+    }
+    else if ((nReceived & ~USB_FEATURE_REPORT) == sizeof usbFromHost && !EVENT_PENDING(EV_HOST_COMMAND)) // If a vendor command has arrived
+    {                                    // (and main() has finished with the last one, see telemetry.h)
+      for (i = 0; i < sizeof hostCommand; i++)
+      {
+        hostCommand[i] = usbFromHost[i];
+      }
+      bFeatureCommand = (nReceived & USB_FEATURE_REPORT) != 0; // Reply the way it came
+      POST_EVENT(EV_HOST_COMMAND);       // Tell main()
+    }
+  }
+
+  nElapsed = 0;
+  if (TMR2IE_bit && TMR2IF_bit) // Timer2 interrupt? (every millisecond, unless tickless)
+  {
+    TMR2IF_bit = 0;            // Clear the Timer2 interrupt flag
+    nElapsed = 1;
+    if (nLedFadeStep == LED_FADE_IDLE)
+    {
+      if (nLedFades != nLedFadeRequests) // If main() wants a keepalive fade
+      {
+        nLedFades = nLedFadeRequests;
+        nLedFadeStep = LED_FADE_AWAY;
+      }
+      else
+      {
+        nLedLevel = leds.bits.CapsLock ? nLedBrightness : 0; // (main() may have changed the brightness)
+      }
+    }
+    if (nLedFadeStep != LED_FADE_IDLE)
+    {
+      nTarget = leds.bits.CapsLock ? nLedBrightness : 0;
+      if (nLedFadeStep == LED_FADE_AWAY)
+      {
+        nTarget = nTarget ? 0 : nLedBrightness;
+      }
+      if (nLedLevel < nTarget)
+      {
+        nLedLevel++;
+      }
+      else if (nLedLevel > nTarget)
+      {
+        nLedLevel--;
+      }
+      else                     // Got there, so turn round (or stop)
+      {
+        nLedFadeStep = nLedFadeStep == LED_FADE_AWAY ? LED_FADE_BACK : LED_FADE_IDLE;
+      }
+    }
+#if LED_PWM1
+    PWM1DCH = ledGamma[nLedLevel];
+#else
+    nLedDuty = bSuspended ? 0 : ledGamma[nLedLevel]; // (remote wakeup signalling: stay dark)
+    stepLed();
+#endif
+#if INDICATOR_LEDS
+    nIndicatorSlot = (nIndicatorSlot + 1) & (INDICATOR_SLOTS - 1);
+    if (bSuspended)
+    {
+      LATC &= ~INDICATOR_PINS; // (remote wakeup signalling: stay dark)
+    }
+    else if (leds.byte != nIndicatorLeds) // (after a warm start)
+    {
+      updateIndicators();
+    }
+    else
+    {
+      LATC = (LATC & ~INDICATOR_PINS) | indicatorScan[nIndicatorSlot];
+    }
+#endif
+  }
+  if (bTickless)               // Keeping time with Timer1? (main() may have just woken the tick)
+  {
+    nElapsed = ticklessMillis();
+  }
+  else if (TMR1IE_bit && TMR1IF_bit) // Timer1 interrupt? (otherwise only enabled while suspended: every 16.9 s)
   {
-    nRemainingTimerTicks--;    // Decrement delay count
     TMR1IF_bit = 0;            // Clear the Timer1 interrupt flag
+    nElapsed = SUSPENDED_TICK_MS;
+  }
+
+  if (!bUSBEnabled)            // If main() has detached (it empties the queue meanwhile)
+  {
+    bLastReportValid = 0;      // The next host has had no report yet...
+    bMeasuringPoll = 0;        // ...nor any probes
+    nPollStarts = nPollRequests;
+    nStalledMillis = 0;
+#if MOUSE_INTERFACE
+    nMouseReports = nMouseRequests; // (nor a keepalive)
+#endif
+  }
+  else if (nReportHead != nReportTail) // If there is a queued report to send
+  {
+    pReport = reportQueue[nReportHead];
+    bChanged = !bLastReportValid || pReport[2] == TELEMETRY_MARKER; // (vendor replies always go)
+    for (i = 0; i < sizeof usbToHost; i++)
+    {
+      usbToHost[i] = pReport[i];
+      if (pReport[i] != lastReport[i])
+      {
+        bChanged = 1;
+      }
+    }
+    if (!bChanged)             // If the host already has this report
+    {
+      nReportHead = (nReportHead + 1) & (REPORT_QUEUE_SIZE - 1); // Drop it (the IN endpoint keeps NAKing)
+      POST_EVENT(EV_REPORT_SENT);
+    }
+    else if (usbWrite(usbToHost, sizeof usbToHost)) // If an IN endpoint buffer was free
+    {
+      nReportHead = (nReportHead + 1) & (REPORT_QUEUE_SIZE - 1); // Release the slot to main()
+      POST_EVENT(EV_REPORT_SENT);
+      for (i = 0; i < sizeof lastReport; i++)
+      {
+        lastReport[i] = usbToHost[i];
+      }
+      bLastReportValid = 1;
+      nIdleMillis = 0;
+      nStalledMillis = 0;
+      if (!bUSBReady)
+      {
+        POST_EVENT(EV_USB_CONFIGURED); // Tell main() that the host is talking to us
+      }
+    }
+    else if (nElapsed && bUSBReady && !bSuspended) // The host is not polling for queued reports
+    {
+#if TELEMETRY
+      if (telemetry.nWriteBusyMillis != 0xFFFF)
+      {
+        telemetry.nWriteBusyMillis++;
+        nTelemetrySeq++;
+      }
+#endif
+      if (nStalledMillis == REPORT_STALL_MS)
+      {
+        POST_EVENT(EV_USB_LOST); // Tell main() (once)
+      }
+      if (nStalledMillis != 0xFFFF)
+      {
+        nStalledMillis++;
+      }
+    }
+  }
+  else if (nElapsed && nIdleRate && bLastReportValid && bUSBReady && !bSuspended) // If the host wants repeats
+  {
+    nIdleMillis += nElapsed;
+    if (nIdleMillis >= (uint16_t) nIdleRate << 2) // If nothing has been sent for the idle period
+    {
+      for (i = 0; i < sizeof usbToHost; i++)
+      {
+        usbToHost[i] = lastReport[i];
+      }
+      if (usbWrite(usbToHost, sizeof usbToHost)) // Resend the last report (or try again next tick)
+      {
+        nIdleMillis = 0;
+      }
+    }
+  }
+
+#if MOUSE_INTERFACE
+  if (nMouseReports != nMouseRequests) // If main() wants a mouse keepalive
+  {
+    nMouseReports = nMouseRequests;
+    usbWriteMouse();           // (dropped if the host has yet to collect the last two)
+  }
+#endif
+
+  if (nElapsed)                // If time has moved on
+  {
+    nMillis += nElapsed;
+    for (i = 0, nMask = 1; i < TIMERS; i++, nMask <<= 1)
+    {
+      nSeq = nTimerSeq[i];
+      if ((nSeq & 1) && nSeq != nTimerExpired[i] && (int32_t)(nMillis - nTimerDeadline[i]) >= 0) // If timer i has expired
+      {
+        nTimerExpired[i] = nSeq;
+        cTimerEvents ^= nMask & ~(cTimerEvents ^ cTimerEventsTaken); // Tell main()
+      }
+    }
+  }
+
+  if (bTickless)
+  {
+    if (TMR2IE_bit || tickNeeded()) // If main() has woken the tick, or there is something for it to do
+    {
+      bTickless = 0;
+      TMR1IE_bit = 0;
+      TMR2IF_bit = 0;          // (set long ago: Timer2 ends this millisecond in step with Timer1)
+      TMR2IE_bit = 1;
+    }
+    else
+    {
+      scheduleWake();
+    }
+  }
+  else if (nElapsed == 1 && !tickNeeded()) // If that tick had nothing to do
+  {
+    TMR2IE_bit = 0;            // Stop the tick...
+    TMR1IF_bit = 0;
+    nTimer1Overflows = 0;
+    nTickBase = readTimer1();  // ...and count Timer1 ticks from this millisecond instead
+    TMR1IE_bit = 1;
+    bTickless = 1;
+    scheduleWake();
   }
 }
+
+void interrupt()               // High priority interrupt service routine
+{
+  // mikroC puts interrupt() itself at the interrupt vector, 0x0004. With the
+  // bootloader, capslock-flash moves it from there to BOOT_APP_INTERRUPT, and
+  // the reset vector and interrupt() must fit in BOOT_APP_VECTORS words (see
+  // boot.h), so everything else is linked above them.
+  serviceInterrupt();
+}
\ No newline at end of file
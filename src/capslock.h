@@ -1,4 +1,4 @@
-#define VERSION "1.00"
+#define VERSION "3.00"              // (and USB_PRODUCT_VERSION in USBdsc.c)
 
 #define OUTPUT        0
 #define INPUT         1
@@ -17,8 +17,57 @@
 
 #define ELEMENTS(array) (sizeof(array)/sizeof(array[0]))
 #define CLOCK_FREQUENCY       (__FOSC__ * 1000)
-#define TIMER3_PRESCALER      8
-#define INTERVAL_IN_SECONDS(n) (n * CLOCK_FREQUENCY / 4 / TIMER3_PRESCALER / 65536)
+#define TIMER1_PRESCALER      8
+
+// Set LED_LATENCY_PROFILE to 1 to timestamp each host LED report with Timer1.
+// nLedTimestamp is the Timer1 value when the LED was updated and nLedLatency
+// is the number of Timer1 ticks (667 ns each) from USB interrupt entry to the
+// LED update. Timer1 counts three times slower while the CPU clock is slowed
+// down (see OSCCON_SLOW), so nLedLatency is scaled to 667 ns ticks then.
+// Inspect them with the debugger.
+#define LED_LATENCY_PROFILE   0
+
+// Set TELEMETRY to 0 to leave out the counters that tools/capslock-telemetry
+// reads from the device (see telemetry.h)
+#define TELEMETRY             1
+
+// Set BOOTLOADER to 0 for a PIC without the bootloader (boot.c). With it,
+// the firmware is linked above the bootloader and BOOT_CMD_ENTER restarts
+// the PIC in the bootloader so that tools/capslock-flash can update it.
+#define BOOTLOADER            1
+
+#define READ_TIMER1(t) \
+  do \
+  { \
+    Hi(t) = TMR1H; \
+    Lo(t) = TMR1L; \
+  } while (Hi(t) != TMR1H) /* Read again if TMR1L overflowed into TMR1H */
+
+// The CPU runs from the 48 MHz PLL output only while the host is enumerating
+// us. The rest of the time it runs directly from the 16 MHz HFINTOSC, while
+// the PLL keeps clocking the USB module at 48 MHz. (CPUDIV is a configuration
+// fuse, so switching the system clock source is the only way to slow the CPU
+// down at run time.)
+#define OSCCON_FAST           0b11111100 // PLL on, 3x, 16 MHz HFINTOSC, SCS=00: Fosc = 48 MHz PLL output
+#define OSCCON_SLOW           0b11111110 // PLL on, 3x, 16 MHz HFINTOSC, SCS=1x: Fosc = 16 MHz HFINTOSC
+#define SLOW_CLOCK_DIVISOR    3          // 48 MHz / 16 MHz
+
+// Timer2 provides the 1 ms tick at either clock by changing its postscaler:
+// 48 MHz FOSC/4 = 12 MHz, /16 prescale = 750 kHz, /(PR2+1) = 3 kHz, /3 postscale = 1 kHz
+// 16 MHz FOSC/4 =  4 MHz, /16 prescale = 250 kHz, /(PR2+1) = 1 kHz, /1 postscale = 1 kHz
+#define T2CON_TICK            0b00010110 // 1:3 postscale, on, 1:16 prescale
+#define T2CON_TICK_SLOW       0b00000110 // 1:1 postscale, on, 1:16 prescale
+#define PR2_TICK              249
+
+#define LFINTOSC_FREQUENCY    31000
+// While the bus is suspended Timer1 counts LFINTOSC (so that it keeps running
+// in Sleep) and each overflow advances the millisecond clock by this much
+#define SUSPENDED_TICK_MS     (65536UL * TIMER1_PRESCALER * 1000 / LFINTOSC_FREQUENCY)
+
+#define T1CON_ACTIVE          0b00110010 // Fosc/4, 1:8 prescale, synchronised, off
+#define T1CON_SUSPENDED       0b11110110 // LFINTOSC, 1:8 prescale, asynchronous (runs in Sleep), off
+
+#define SECONDS(n)            ((n) * 1000UL) // Convert seconds to milliseconds
 
 
 /*
@@ -31,23 +80,376 @@ typedef union
   uint8_t byte;
   struct
   {
-    NumLock:1;      // xxxxxxx1
-    CapsLock:1;     // xxxxxx1x
-    ScrollLock:1;   // xxxxx1xx
-    :5;             // Pad
+    BITFIELD NumLock:1;      // xxxxxxx1
+    BITFIELD CapsLock:1;     // xxxxxx1x
+    BITFIELD ScrollLock:1;   // xxxxx1xx
+    BITFIELD :5;             // Pad
   } bits;
 } t_ledIndicators;
 
-t_ledIndicators leds;
+typedef union       // Eight one-bit flags that can also be tested or reset together
+{
+  uint8_t byte;
+  struct
+  {
+    BITFIELD B0:1;
+    BITFIELD B1:1;
+    BITFIELD B2:1;
+    BITFIELD B3:1;
+    BITFIELD B4:1;
+    BITFIELD B5:1;
+    BITFIELD B6:1;
+    BITFIELD B7:1;
+  } bits;
+} t_flags;
+
+t_ledIndicators leds HAL_PERSISTENT;
 
+// The CapsLock LED is on RA4 (pin 3), as on the board in src/kicad. RA4 has
+// no PWM output, so interrupt() dims it itself from the 1 ms tick: each tick
+// adds the duty cycle (out of LED_DUTY_MAX) to nLedPwm and lights the LED for
+// that tick if nLedPwm overflows, which spreads the lit ticks as evenly as
+// they go. At the default brightness the LED changes at a few hundred Hz, but
+// levels below about 10 flicker (level 1 is lit for 1 ms in every 250).
+//
+// Set LED_PWM1 to 1 for a board with the LED on RC5 (pin 5) instead, where
+// PWM1 drives it. PWM1 shares Timer2 (and so its period) with the
+// millisecond tick: a 3 kHz PWM frequency with the CPU at 48 MHz and 1 kHz at
+// 16 MHz. A duty cycle of PWM1DCH/250 is enough resolution for an LED
+// (PWM1DCL, the 2 low bits, is left at 0).
+//
+// interrupt() owns the LED: it shows LED level nLedBrightness while CapsLock
+// is on, and, for each keepalive that main() asks for, fades it out and back
+// in (or in and back out when CapsLock is off), one level per millisecond.
+#ifndef LED_PWM1
+#define LED_PWM1             0
+#endif
 #define CAPSLOCK_LED         LATA4_bit
+#define PWM1CON_ON           0b11000000 // PWM1EN=1, PWM1OE=1 (PWM1 drives RC5), active high
+#define LED_DUTY_MAX         250        // ledGamma[] value that is always lit (PR2 + 1)
+#define LED_LEVELS           32         // Brightness levels (level 0 is off)
+#define LED_BRIGHTNESS       20         // Default level: a 38% duty cycle (the host can choose another)
+#define LED_FADE_IDLE        0
+#define LED_FADE_AWAY        1          // Fading towards the opposite of the CapsLock state
+#define LED_FADE_BACK        2          // Fading back
+
+uint8_t nLedBrightness;                 // Level to show while CapsLock is on (written by main() only)
+uint8_t nLedFadeRequests;               // Incremented by main() for each keepalive fade...
+uint8_t nLedFades;                      // ...and by interrupt() as it starts each one
+uint8_t nLedFadeStep;                   // LED_FADE_xxx (interrupt() only)
+uint8_t nLedLevel;                      // Level now showing (interrupt() only, once running)
+HAL_LED_DUTY;                           // Duty cycle RA4 shows now, 0 while suspended (interrupt() only, always 0 with LED_PWM1)
+uint8_t nLedPwm;                        // Software PWM accumulator for RA4 (interrupt() only)
+
+// Optional NumLock and ScrollLock indicators on RC2 and RC3 (each an LED and
+// resistor to 0V). interrupt() scans them, one slot per millisecond, so that
+// only one is ever lit at a time and together they never draw more than one
+// LED's current. Indicator n owns every INDICATORS'th slot of the scan and is
+// lit for the first xxx_SLOTS of them, which sets its duty cycle.
+#define INDICATOR_LEDS       1          // 0 = leave RC2 and RC3 alone
+#define INDICATORS           2          // (interrupt() relies on there being 2)
+#define INDICATOR_SLOTS      8          // One scan every 8 ms (125 Hz)
+#define INDICATOR_PINS       0b00001100 // RC2 and RC3
+#define NUMLOCK_PIN          0b00000100 // RC2
+#define SCROLLLOCK_PIN       0b00001000 // RC3
+#define NUMLOCK_SLOTS        2          // 2 of 8 ms: a 25% duty cycle
+#define SCROLLLOCK_SLOTS     2
+#define LED_NUMLOCK          0x01       // Host LED report bits (see t_ledIndicators)
+#define LED_SCROLLLOCK       0x04
+
+#if INDICATOR_LEDS
+uint8_t indicatorScan[INDICATOR_SLOTS]; // Indicator pins lit in each slot (interrupt() only)
+uint8_t nIndicatorLeds;                 // Host LED state that indicatorScan shows
+uint8_t nIndicatorSlot;                 // Slot now showing
+#endif
 
 #define SCROLL_LOCK_KEY      0x47
+#define F24_KEY              0x73
+#define RESERVED_KEY         0xA5 // First of the reserved Keyboard/Keypad page usages
+#define A_KEY                0x04 // (A to Z are 0x04 to 0x1D)
+#define Z_KEY                0x1D
+#define ENTER_KEY            0x28
+#define TAB_KEY              0x2B
+#define SPACE_KEY            0x2C
+#define LEFT_SHIFT           0x02 // Modifier bit
+
+// Keepalive payloads (KEEPALIVE_PAYLOAD is the default, the host can choose another):
+//   KEEPALIVE_SCROLL_LOCK  Scroll Lock pressed twice: 4 reports, and the host
+//                          toggles its Scroll Lock (and sends LED reports) twice
+//   KEEPALIVE_F24          F24 pressed once: 2 reports. No keyboard has F24,
+//                          so nothing happens, but Windows, macOS and Linux
+//                          desktops still count it as user input
+//   KEEPALIVE_RESERVED     A reserved usage pressed once: 2 reports. Linux
+//                          drops it without a key event, so only hosts that
+//                          count raw HID input as activity are kept awake
+//   KEEPALIVE_MOUSE        A mouse report with no movement and no buttons:
+//                          1 report on the mouse's own endpoint, and no
+//                          keyboard report at all. Windows counts it as
+//                          input; Linux drops it without an event, as it
+//                          does the reserved usage. Needs MOUSE_INTERFACE
+//                          (see USBdsc.h).
+#define KEEPALIVE_PAYLOAD     KEEPALIVE_SCROLL_LOCK
+#if MOUSE_INTERFACE
+#define KEEPALIVE_LAST        KEEPALIVE_MOUSE // The highest payload the host may choose
+#else
+#define KEEPALIVE_LAST        KEEPALIVE_RESERVED
+#endif
+#if KEEPALIVE_PAYLOAD > KEEPALIVE_LAST
+#error KEEPALIVE_MOUSE needs MOUSE_INTERFACE
+#endif
+#define KEEPALIVE_INTERVAL    60         // Default seconds between keepalives
+
+// TEXT_CMD_TYPE (see telemetry.h) types one of these strings as a US keyboard
+// would, \n as Enter and \t as Tab. Each ends in \0 (the last one's is the
+// compiler's). Characters with no key on a US keyboard are skipped.
+#define TEXT_STRINGS         "CAP-0421\n" "\0" \
+                             "I have read and accept the acceptable use policy.\n" \
+                             TEXT_STRINGS_SIM
+
+// The simulator's type scenario adds one more, to check that Tab and Enter
+// are never shifted
+#ifdef HOST_BUILD
+#define TEXT_STRINGS_SIM     "\0" "X\tY\n"
+#else
+#define TEXT_STRINGS_SIM
+#endif
+
+// main() queues the text a report at a time, as the report queue has room,
+// and each report presses up to TEXT_KEYS new keys at once (hosts press them
+// in the order they appear in the report). A key that the last report held
+// down would not be pressed again, so a character whose key is already in
+// the report, or in the last one, starts another report. Before that report,
+// or one that needs other modifiers, main() queues one releasing every key.
+// Space types the same with or without Shift, so it goes with whatever
+// modifiers the report has (Shift+Tab is back-tab, and applications may
+// treat Shift+Enter differently, so those are always typed unshifted).
+#define TEXT_KEYS            6          // Keys a report can hold down (see usbToHost)
+#define TEXT_SHIFT           0x80       // textUsages: the character needs Shift
+#define TEXT_IDLE            0xFFFF     // nTextNext: not typing
+
+uint16_t nTextNext;                     // Offset in textStrings of the next character (TEXT_IDLE = none)
+uint8_t  nTextString;                   // The string being typed...
+uint16_t nTextChars;                    // ...characters of it queued so far...
+uint16_t nTextReports;                  // ...in this many reports
+uint8_t  textKeys[TEXT_KEYS];           // Keys of the report being filled...
+uint8_t  nTextKeys;
+uint8_t  nTextModifiers;                // ...and its modifiers
+uint8_t  heldKeys[TEXT_KEYS];           // Keys the last report queued holds down...
+uint8_t  nHeldKeys;
+uint8_t  nHeldModifiers;                // ...and its modifiers
+
+// The keepalive and LED settings are kept in the high-endurance flash (HEF) block, one
+// byte in the low byte of each word. Prolog() reads them once and the host can
+// change them with SETTINGS_CMD_SET (see telemetry.h).
+#define HEF_ADDRESS           0x1F80     // First row of the PIC16F1455's 128-word HEF block
+#define FLASH_ROW_WORDS       32         // Erased and written together
+#define SETTINGS_MAGIC        0xC6
+#define SETTINGS_WORDS        7          // Magic, flags, interval (2), payload, brightness, checksum
+
+uint16_t nKeepAliveSeconds;
+uint8_t  nKeepAlivePayload;
+uint16_t flashRow[FLASH_ROW_WORDS];
+
+// main() and interrupt() share the variables below without main() ever
+// disabling interrupts to read them. Each has exactly one writer, noted beside
+// it, and the other side only reads it (Prolog() sets them all up before it
+// enables interrupts, and is the only exception):
+//   - Flags are kept in one byte per writer, as setting a bit field rewrites
+//     the whole byte
+//   - Events and timers are mailboxes of two bytes, one written by each side
+//   - Reports go from main() to interrupt() through reportQueue, a ring with
+//     one producer and one consumer
+//   - main() reads nMillis until two reads agree, and the telemetry block
+//     until interrupt()'s sequence number nTelemetrySeq has not changed
+// HAL_BARRIER() keeps the compiler from moving a write across the point where
+// it is handed to the other side.
+volatile t_flags             cFlags;          // (main() only)
+#define bUSBReady            cFlags.bits.B0
+#define bKeepAlive           cFlags.bits.B1
+#define bUSBEnabled          cFlags.bits.B2   // usbAttach() has completed, so interrupt() may call usbService()
+#define bSlowClock           cFlags.bits.B3   // The CPU is running from the 16 MHz HFINTOSC (see OSCCON_SLOW)
+#define bHoldTick            cFlags.bits.B4   // main() is changing Timer1 or the CPU clock (see holdTick())
+#define bPollFeature         cFlags.bits.B5   // The POLL_CMD_MEASURE being answered came as a feature report...
+#define bTextFeature         cFlags.bits.B6   // ...and so did the TEXT_CMD_TYPE
+
+volatile t_flags             cIsrFlags;       // (interrupt() only)
+#define bSuspended           cIsrFlags.bits.B0 // The host has suspended the bus
+#define bFeatureCommand      cIsrFlags.bits.B1 // hostCommand came as a feature report (see telemetry.h)
+#define bLastReportValid     cIsrFlags.bits.B2 // lastReport holds the report the host last received
+#define bMeasuringPoll       cIsrFlags.bits.B3 // interrupt() is timing the host's polls of the IN endpoint
+#define bTickless            cIsrFlags.bits.B4 // interrupt() has stopped the 1 ms tick and keeps time with Timer1
+
+// Events are posted by interrupt() and taken by main(). interrupt() toggles an
+// event's bit in cEvents to post it and main() toggles the same bit in
+// cEventsTaken to take it, so an event is pending while the two bits differ.
+volatile uint8_t             cEvents;         // (interrupt() only)
+volatile uint8_t             cEventsTaken;    // (main() only)
+#define EV_LED_REPORT        0x01  // A host LED report has been applied to the LED
+#define EV_USB_LOST          0x02  // The host has stopped accepting keyboard reports
+#define EV_SUSPEND           0x04  // The host has suspended the bus
+#define EV_USB_RESET         0x08  // The host has reset the bus
+#define EV_USB_CONFIGURED    0x10  // The host has accepted a keyboard report while attaching
+#define EV_HOST_COMMAND      0x20  // The host has sent a vendor command (hostCommand, see telemetry.h)
+#define EV_POLL_MEASURED     0x40  // interrupt() has timed POLL_SAMPLES polls of the IN endpoint
+#define EV_REPORT_SENT       0x80  // interrupt() has taken a report off the queue
+
+#define EVENT_PENDING(nMask) ((cEvents ^ cEventsTaken) & (nMask))
+#define POST_EVENT(nMask)    cEvents ^= (nMask) & ~(cEvents ^ cEventsTaken) // (interrupt() only: a pending event stays pending)
+
+// Millisecond clock and timers. nMillis is only written by interrupt(), so
+// main() must read it with getMillis(). Timers are started and stopped by
+// main() and expire in interrupt(), which then posts bit n of cTimerEvents
+// (a mailbox like cEvents). main() makes nTimerSeq[n] even while it changes
+// nTimerDeadline[n] and odd once timer n is running, and interrupt() sets
+// nTimerExpired[n] to nTimerSeq[n] when it expires, so a timer is running while
+// its sequence number is odd and has not expired.
+#define TIMER_KEEPALIVE      0    // Keepalive interval
+#define TIMER_USB            1    // USB attach timeout or backoff delay
+#define TIMER_RESUME         2    // Remote wakeup signalling
+#define TIMERS               3
+
+volatile uint32_t nMillis HAL_PERSISTENT; // Milliseconds since power-on (approximate while suspended)
+volatile uint32_t nTimerDeadline[TIMERS] HAL_PERSISTENT; // Value of nMillis at which each timer expires (main() only)
+volatile uint8_t  nTimerSeq[TIMERS] HAL_PERSISTENT;      // (main() only)
+volatile uint8_t  nTimerExpired[TIMERS] HAL_PERSISTENT;  // (interrupt() only)
+
+volatile uint8_t             cTimerEvents;      // (interrupt() only)
+volatile uint8_t             cTimerEventsTaken; // (main() only)
+#define EV_KEEPALIVE         (1 << TIMER_KEEPALIVE) // TIMER_KEEPALIVE has expired
+#define EV_USB_TIMER         (1 << TIMER_USB)       // TIMER_USB has expired
+#define EV_RESUME_TIMER      (1 << TIMER_RESUME)    // TIMER_RESUME has expired
+
+#define TIMER_EVENT_PENDING(nMask) ((cTimerEvents ^ cTimerEventsTaken) & (nMask))
+
+// interrupt() stops its 1 ms tick (TMR2IE) whenever a tick would find nothing
+// to do: the host has configured us and not suspended the bus, the CPU is at
+// 16 MHz, no report is queued or due to repeat, the LED is steady (on RA4,
+// where the tick drives its PWM, only when off or at full brightness) and no
+// indicator is lit. Timer1 then keeps nMillis instead. Each Timer1 overflow
+// (every 131 ms, often enough to feed the watchdog) and every other interrupt
+// brings nMillis up to date, and Timer1 is moved on so that it overflows just
+// as the next timer expires, so a 60 s keepalive interval takes about 590
+// interrupts (some 460 of them Timer1 overflows, see the tickless scenario)
+// rather than 60,000. That needs a steady LED: on RA4, at the default
+// brightness, the tick runs for as long as CapsLock is on (60,000 interrupts
+// an interval, as RA4 has no PWM peripheral to dim it), while PWM1 on an
+// LED_PWM1 board dims it with the tick stopped.
+// main() restarts the tick with WAKE_TICK() after it queues a report, starts a
+// timer or changes the brightness. TMR2IE is the one bit that both sides write:
+// main() only ever sets it and interrupt() only clears it when there is nothing
+// to tick for.
+#define TIMER1_TICKS_PER_MS  500  // At 16 MHz: FOSC/4/8 = 500 kHz
+#define TIMER1_PERIOD_MS     131  // 65536 ticks is 131.072 ms
+// n x 500, without the multiply routine (which main() calls too)
+#define TIMER1_MS_TO_TICKS(n) (((uint16_t) (n) << 9) - ((uint16_t) (n) << 3) - ((uint16_t) (n) << 2))
+#define WAKE_TICK()          TMR2IE_bit = 1
+
+uint16_t nTimer1Overflows;        // High word of Timer1 while tickless (interrupt() only)
+uint32_t nTickBase;               // Timer1 count (with nTimer1Overflows) when nMillis last moved on (interrupt() only)
+
+// USB attach state machine (driven by main() from the events above)
+#define USB_STATE_DETACHED    0   // USB interface disabled, waiting for the backoff delay to expire
+#define USB_STATE_ATTACHING   1   // USB interface enabled, waiting for the host to configure us
+#define USB_STATE_READY       2   // The host is accepting keyboard reports
+
+#define USB_ATTACH_MS         SECONDS(5) // How long the host gets to configure us
+#define USB_BACKOFF_MIN_MS    50         // First backoff delay...
+#define USB_BACKOFF_MAX_MS    6400       // ...doubling up to 6.4 seconds
+
+uint8_t nUSBState;
+uint16_t nBackoffMillis;          // Next backoff delay
+
+// Remote wakeup signalling steps (driven by TIMER_RESUME)
+#define RESUME_IDLE           0
+#define RESUME_SETTLING       1   // USB module woken, waiting 5 ms before signalling
+#define RESUME_SIGNALLING     2   // Driving resume onto the bus for 10 ms
+
+uint8_t nResumeStep;
+
+#if LED_LATENCY_PROFILE || TELEMETRY
+volatile uint16_t nLedTimestamp;  // Timer1 value when the LED was last updated
+volatile uint16_t nLedLatency;    // Timer1 ticks from USB interrupt entry to LED update
+#endif
+
+#if TELEMETRY
+t_telemetry telemetry HAL_PERSISTENT; // Counters (written by main() or by interrupt(), never both)
+volatile uint8_t nTelemetrySeq;   // Incremented by interrupt() each time it updates telemetry
+volatile uint32_t nAttachMillis;  // When enableUSB() last attached (main() only)...
+volatile uint8_t nAttachSeq;      // ...incremented by main() once nAttachMillis is set...
+uint8_t nLedAttachSeq;            // ...and by interrupt() at the first LED report after that attach
+t_telemetry telemetrySnapshot;    // The block as it was when the host last read chunk 0 (main() only)
+#endif
+volatile uint8_t hostCommand[8];  // The vendor command EV_HOST_COMMAND delivers (interrupt() only
+                                  // writes it, and only once main() has taken the last one)
+uint8_t nFeatureCommands;         // Feature commands accepted for a reply since the last attach (main() only)...
+uint8_t nPollCommand;             // ...the count when the POLL_CMD_MEASURE being answered was accepted...
+uint8_t nTextCommand;             // ...and the TEXT_CMD_TYPE (byte 0 of each feature reply, see telemetry.h)
+#if BOOTLOADER
+HAL_BOOT_REQUEST;                 // Set by enterBootloader() for the bootloader (see boot.h)
+#endif
+
+// The idle rate and protocol that the host asks for are in usb.h
+uint16_t nIdleMillis;             // Time since the last report was sent (only used by interrupt())
+uint8_t lastReport[1+1+6];        // The last report the host received (only used by interrupt())
+
+uint8_t usbFromHost[8];           // LED report (1 byte) or vendor command (8 bytes) (interrupt() only)
+uint8_t usbToHost[1+1+6];         // 1 byte modifiers, 1 byte pad, 6 keys (interrupt() only)
+
+// Keyboard reports are queued by main() and sent by interrupt() whenever the
+// IN endpoint is free. Only main() writes nReportTail and only interrupt()
+// writes nReportHead, and the slot at the head is never reused until
+// usbWrite() has copied it into an IN endpoint buffer, so a report is never
+// modified while in flight. main() fills a slot completely before it moves
+// nReportTail past it.
+#define REPORT_QUEUE_SIZE    8    // Must be a power of 2
+#define REPORT_STALL_MS      SECONDS(5) // Give up if the host does not poll for this long
+
+uint8_t reportQueue[REPORT_QUEUE_SIZE][1+1+6];
+volatile uint8_t nReportHead;     // Next report to be sent (written by interrupt())
+volatile uint8_t nReportTail;     // Next free slot (written by main())
+volatile uint16_t nStalledMillis; // How long a queued report has been waiting (interrupt() only)
+
+#if MOUSE_INTERFACE
+// A KEEPALIVE_MOUSE keepalive needs no queue slot: every mouse report is the
+// same. main() asks for one by incrementing nMouseRequests, and interrupt()
+// catches nMouseReports up as it hands one to usbWriteMouse(). A keepalive
+// the host has not collected room for is dropped, as a keyboard keepalive is
+// when the queue is full.
+volatile uint8_t nMouseRequests;  // (main() only)
+volatile uint8_t nMouseReports;   // (interrupt() only)
+#endif
+
+// POLL_CMD_MEASURE queues probe reports back to back so that the host takes
+// one at each poll of the IN endpoint, and interrupt() notes the USB frame
+// number of each IN transaction. The difference between consecutive frame
+// numbers is the polling period the host actually granted.
+// main() asks for a measurement by incrementing nPollRequests and interrupt()
+// starts it when it sees nPollStarts differ.
+volatile uint8_t  nPollRequests;  // (main() only)
+volatile uint8_t  nPollStarts;    // (interrupt() only, as are the rest)
+volatile uint8_t  nPollCount;     // IN transactions seen while measuring
+volatile uint16_t nPollFrame;     // Frame number of the last one
+volatile uint8_t  nPollMin;       // Shortest period seen (frames)
+volatile uint8_t  nPollMax;       // Longest period seen (frames)
+volatile uint16_t nPollSum;       // Total of the periods seen (frames)
+
+// The watchdog (CONFIG1 WDTE=10: on while running, off in Sleep) resets the
+// PIC if main() or interrupt() stops running for WDT_PERIOD_MS. After such a
+// reset, or a stack overflow or underflow reset (CONFIG2 STVREN=1), Prolog()
+// keeps the millisecond clock, the keepalive timer, the LED state and the
+// telemetry counters (all HAL_PERSISTENT) and goes straight back onto the bus.
+#define WDTCON_PERIOD        0b00010000 // WDTPS=01000: LFINTOSC/8192 = 256 ms
+#define WDT_PERIOD_MS        256
+
+#define PCON_STKOVF          0x80       // 1 = Stack overflow reset
+#define PCON_STKUNF          0x40       // 1 = Stack underflow reset
+#define PCON_RWDT            0x10       // 0 = Watchdog reset
+#define PCON_RMCLR           0x08       // 0 = MCLR reset
+#define PCON_RI              0x04       // 0 = RESET instruction
+#define PCON_POR             0x02       // 0 = Power-on reset
+#define PCON_BOR             0x01       // 0 = Brown-out reset
+#define PCON_REARM           (PCON_RWDT | PCON_RMCLR | PCON_RI | PCON_POR | PCON_BOR)
 
-volatile uint16_t nRemainingTimerTicks;
-volatile uint8_t             cFlags;
-#define bUSBReady            cFlags.B0
-#define bKeepAlive           cFlags.B1
+#define PERSIST_MAGIC        0xA5
 
-uint8_t usbFromHost[1];
-uint8_t usbToHost[1+1+6]; // 1 byte modifiers, 1 byte pad, 6 keys
\ No newline at end of file
+uint8_t nPersistMagic[2] HAL_PERSISTENT; // PERSIST_MAGIC and its complement once the persistent state is valid
\ No newline at end of file
@@ -0,0 +1,87 @@
+/*
+  CAP! CapsLock Light
+  Copyright (C) 2017 Andrew J. Armstrong
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+  02111-1307  USA
+
+  Author:
+  Andrew J. Armstrong <androidarmstrong@gmail.com>
+
+*/
+
+/*
+  Hardware abstraction layer
+
+  The firmware is written against the PIC16F1455 special function registers
+  (PWM1DCH, TMR1IF_bit, OSCCON, USBEN_bit...) and the mikroC flash library
+  (FLASH_Read, FLASH_Write...). For mikroC those names come from the
+  compiler's device definitions and libraries, so this file only supplies the
+  few constructs that differ between compilers.
+
+  When HOST_BUILD is defined (see host/Makefile) the same names are provided
+  by a simulated PIC and USB host, so that capslock.c compiles with gcc and
+  runs on Linux against a simulated clock.
+*/
+
+#ifdef HOST_BUILD
+#include "host/hal_host.h"
+#else
+#include <built_in.h>
+
+#define BITFIELD                 // mikroC bit fields do not need a type
+
+#define CPU_SLEEP()      asm SLEEP; asm NOP
+#define CPU_CLRWDT()     asm CLRWDT
+
+// mikroC only sets the globals that have initialisers at start-up, so the
+// others keep their contents across a watchdog or stack reset
+#define HAL_PERSISTENT
+
+#define HAL_LINEAR(a)    ((uint8_t *) (a)) // Linear data memory (e.g. the USB buffer descriptors at 0x2000)
+
+// The USB module's buffer descriptors and buffers (usb.c) are at the start of
+// bank 0, linear 0x2000, so the compiler must not put its own variables there
+#define HAL_USB_RAM(size)        uint8_t usbRam[size] absolute 0x20
+
+#define HAL_USB_PPB_RESET()      PPBRST_bit = 1; PPBRST_bit = 0 // Every ping-pong pointer back to the even buffer
+
+// The USB buffers of the bootloader (boot.c) and of usb.c continue into bank 1,
+// linear 0x2050
+#define HAL_USB_RAM_BANK1(size)  uint8_t usbRam1[size] absolute 0xA0
+
+// The firmware asks the bootloader to stay with these two bytes (see boot.h)
+#define HAL_BOOT_REQUEST         uint8_t nBootRequest[2] absolute BOOT_REQUEST_ADDRESS
+#define HAL_LED_DUTY             uint8_t nLedDuty
+
+#define CPU_RESET()              asm RESET
+
+// Jump to the firmware's relocated reset and interrupt vectors (BOOT_APP_START
+// and BOOT_APP_INTERRUPT): PCLATH 0x08 selects the 2K page at 0x0800
+#define HAL_RUN_APP()            asm MOVLP 0x08; asm GOTO 0
+#define HAL_RUN_APP_INTERRUPT()  asm MOVLP 0x08; asm GOTO 4
+
+// Read one program memory word into PMDATH:PMDATL without using any RAM, so
+// that the bootloader can look for the firmware without disturbing the
+// firmware's persistent variables
+#define HAL_FLASH_READ_SFR(address) \
+  PMADRL = (uint8_t) (address); PMADRH = (uint8_t) ((address) >> 8); CFGS_bit = 0; RD_bit = 1; asm NOP; asm NOP
+
+#define HAL_BARRIER()            // (mikroC keeps memory accesses in program order)
+
+#define HAL_IDLE()               // Called while main() waits for an event
+#define HAL_SPIN()               // Called while main() busy-waits on the hardware
+#define HAL_TRACE_LOOP()         // Called once per main() loop iteration
+#endif
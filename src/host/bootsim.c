@@ -0,0 +1,289 @@
+/*
+  CAP! CapsLock Light
+  Copyright (C) 2017 Andrew J. Armstrong
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+  02111-1307  USA
+
+  Author:
+  Andrew J. Armstrong <androidarmstrong@gmail.com>
+
+*/
+
+/*
+  Scenarios for the Linux build of the bootloader (boot.c).
+
+  Usage: boot-sim [scenario...]
+
+  The simulated host sends the reports tools/capslock-flash would, one
+  after another as the bootloader takes them. The firmware itself is not
+  simulated: the scenario ends when the bootloader jumps to it.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "sim.h"
+#include "boot.h"
+
+#define SENT_AT         (500 * SIM_MS) // (the host has configured the bootloader by then)
+#define BROKEN_ROWS     20             // Rows written before the "interrupted" update stops
+
+typedef struct
+{
+  const char *name;
+  const char *description;
+  void (*setup)(void);
+  void (*report)(void);
+  uint64_t duration;
+} t_scenario;
+
+static uint16_t image[BOOT_APP_END];   // The firmware being written (by word address)
+
+static double ms(uint64_t us)
+{
+  return us / 1000.0;
+}
+
+static void makeImage(void)
+{
+  uint32_t n = 12345;
+  uint16_t i;
+
+  for (i = BOOT_APP_START; i < BOOT_APP_END; i++)
+  {
+    n = n * 1103515245 + 12345;
+    image[i] = (uint16_t) (n >> 16) & 0x3FFF;
+  }
+}
+
+static void sendRow(uint8_t nRow, uint8_t bBlank)
+{
+  uint8_t report[BOOT_REPORT_SIZE];
+  uint16_t nWord;
+  unsigned nBit;
+  unsigned i;
+
+  memset(report, 0, sizeof report);
+  report[0] = BOOT_CMD_WRITE;
+  report[1] = nRow;
+  for (i = 0, nBit = 0; i < BOOT_ROW_WORDS; i++, nBit += 14) // Pack 14 bits at a time, LSB first
+  {
+    nWord = bBlank ? 0x3FFF : image[nRow * BOOT_ROW_WORDS + i];
+    report[2 + nBit / 8] |= (uint8_t) (nWord << (nBit % 8));
+    report[3 + nBit / 8] |= (uint8_t) (nWord >> (8 - nBit % 8));
+    if (nBit % 8 > 2)
+    {
+      report[4 + nBit / 8] |= (uint8_t) (nWord >> (16 - nBit % 8));
+    }
+  }
+  sim_output(SENT_AT, report, sizeof report);
+}
+
+static void sendCommand(uint8_t nCommand)
+{
+  uint8_t report[BOOT_REPORT_SIZE];
+
+  memset(report, 0, sizeof report);
+  report[0] = nCommand;
+  sim_output(SENT_AT, report, sizeof report);
+}
+
+static size_t countReplies(uint8_t nCommand, uint8_t nStatus)
+{
+  size_t i;
+  size_t n = 0;
+
+  for (i = 0; i < sim.nIn; i++)
+  {
+    if (sim.in[i].report[0] == nCommand && sim.in[i].report[2] == nStatus) n++;
+  }
+  return n;
+}
+
+static uint64_t lastReplyAt(uint8_t nCommand)
+{
+  size_t i;
+  uint64_t at = 0;
+
+  for (i = 0; i < sim.nIn; i++)
+  {
+    if (sim.in[i].report[0] == nCommand) at = sim.in[i].at;
+  }
+  return at;
+}
+
+static uint64_t firstReplyAt(uint8_t nCommand)
+{
+  size_t i;
+
+  for (i = 0; i < sim.nIn; i++)
+  {
+    if (sim.in[i].report[0] == nCommand) return sim.in[i].at;
+  }
+  return 0;
+}
+
+// Upload: a blank dongle gets a whole firmware image
+
+static void setupUpload(void)
+{
+  uint8_t nRow;
+
+  makeImage();
+  sendCommand(BOOT_CMD_QUERY);
+  sendRow(BOOT_FIRST_ROW, 1);               // As capslock-flash does: the first row goes last
+  for (nRow = BOOT_FIRST_ROW + 1; nRow < BOOT_END_ROW; nRow++)
+  {
+    sendRow(nRow, 0);
+  }
+  sendRow(BOOT_FIRST_ROW, 0);
+  sendCommand(BOOT_CMD_RUN);
+}
+
+static void reportUpload(void)
+{
+  size_t nRows = BOOT_END_ROW - BOOT_FIRST_ROW + 1;
+  size_t nBad = 0;
+  uint64_t t0 = firstReplyAt(BOOT_CMD_QUERY);
+  uint64_t t1 = lastReplyAt(BOOT_CMD_WRITE);
+  uint16_t i;
+
+  for (i = BOOT_APP_START; i < BOOT_APP_END; i++)
+  {
+    if (sim_flash(i) != image[i]) nBad++;
+  }
+  printf("  rows written            %zu of %zu, %zu words differ from the image\n",
+         countReplies(BOOT_CMD_WRITE, BOOT_STATUS_OK), nRows, nBad);
+  printf("  per row                 %.2f ms\n", ms(t1 - t0) / nRows);
+  printf("  whole image             %.1f ms, %.1f ms after power-on\n", ms(t1 - t0), ms(t1));
+  printf("  resets, firmware run at %u, %.1f ms\n", sim.nResets, ms(sim.nAppStartedAt));
+  if (nBad || countReplies(BOOT_CMD_WRITE, BOOT_STATUS_OK) != nRows || !sim.nAppStartedAt ||
+      !sim.bDetachedBeforeReset)
+  {
+    exit(1);
+  }
+}
+
+// Interrupted: the update stops partway, so the bootloader keeps control
+
+static void setupInterrupted(void)
+{
+  uint8_t nRow;
+
+  makeImage();
+  sendRow(BOOT_FIRST_ROW, 1);
+  for (nRow = BOOT_FIRST_ROW + 1; nRow < BOOT_FIRST_ROW + BROKEN_ROWS; nRow++)
+  {
+    sendRow(nRow, 0);
+  }
+  sendCommand(BOOT_CMD_RUN);                 // The first row was never written
+  sendRow(BOOT_END_ROW, 1);                  // The HEF block
+  sendCommand(0x00);
+}
+
+static void reportInterrupted(void)
+{
+  printf("  rows written            %zu\n", countReplies(BOOT_CMD_WRITE, BOOT_STATUS_OK));
+  printf("  RUN answered            %s\n", countReplies(BOOT_CMD_RUN, BOOT_STATUS_NO_APP) ? "no firmware" : "?");
+  printf("  bad row, unknown        %zu, %zu\n",
+         countReplies(BOOT_CMD_WRITE, BOOT_STATUS_BAD_ROW), countReplies(0x00, BOOT_STATUS_UNKNOWN));
+  if (sim.nAppStartedAt || sim.nResets || countReplies(BOOT_CMD_RUN, BOOT_STATUS_NO_APP) != 1)
+  {
+    exit(1);
+  }
+}
+
+// Start: a dongle with firmware goes straight to it
+
+static void setupStart(void)
+{
+  sim_program(BOOT_APP_START, 0x3180);
+}
+
+static void reportStart(void)
+{
+  printf("  firmware run at         %.1f ms\n", ms(sim.nAppStartedAt));
+  printf("  attaches                %u\n", sim.nAttaches);
+  if (sim.nAttaches || sim.nAppStartedAt > SIM_MS) exit(1);
+}
+
+static const t_scenario scenarios[] =
+{
+  {"upload",      "A blank dongle is sent a whole firmware image",   setupUpload,      reportUpload,      3 * SIM_SECONDS},
+  {"interrupted", "An update stops partway through",                 setupInterrupted, reportInterrupted, 2 * SIM_SECONDS},
+  {"start",       "A dongle with firmware runs it straight away",    setupStart,       reportStart,       SIM_SECONDS},
+};
+
+#define SCENARIOS (sizeof scenarios / sizeof scenarios[0])
+
+static int runScenario(const t_scenario *s)
+{
+  pid_t pid;
+  int status;
+
+  printf("%s: %s\n", s->name, s->description);
+  fflush(stdout);
+  pid = fork();
+  if (pid == 0)
+  {
+    sim.nEnumerationMs = 15;
+    sim.nHostIdleRate = -1;                  // (hid-generic sends SET_IDLE to keyboards only)
+    s->setup();
+    sim_run(s->duration);
+    s->report();
+    printf("  busy-waiting            %.1f ms in total\n", ms(sim.nBlockedUs));
+    if (sim.nUsbErrors)
+    {
+      printf("  USB errors              %u: %s\n", sim.nUsbErrors, sim.usbError);
+    }
+    fflush(stdout);
+    _exit(sim.nUsbErrors != 0);
+  }
+  if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+  {
+    printf("  failed\n");
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  size_t i;
+  int n;
+  int rc = 0;
+
+  if (argc == 1)
+  {
+    for (i = 0; i < SCENARIOS; i++)
+    {
+      rc |= runScenario(&scenarios[i]);
+    }
+    return rc;
+  }
+  for (n = 1; n < argc; n++)
+  {
+    for (i = 0; i < SCENARIOS && strcmp(argv[n], scenarios[i].name) != 0; i++);
+    if (i == SCENARIOS)
+    {
+      fprintf(stderr, "Unknown scenario: %s\n", argv[n]);
+      return 2;
+    }
+    rc |= runScenario(&scenarios[i]);
+  }
+  return rc;
+}
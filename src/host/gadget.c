@@ -0,0 +1,632 @@
+/*
+  CAP! CapsLock Light
+  Copyright (C) 2017 Andrew J. Armstrong
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+  02111-1307  USA
+
+  Author:
+  Andrew J. Armstrong <androidarmstrong@gmail.com>
+
+*/
+
+/*
+  An emulated dongle for the Linux USB host on the same machine, and a
+  CapsLock round-trip benchmark.
+
+  Usage: capslock-gadget [-n toggles] [-d driver] [-u device]
+
+    sudo modprobe dummy_hcd
+    sudo modprobe raw_gadget
+    sudo src/host/capslock-gadget
+
+  The unmodified firmware runs against the simulated PIC16F1455 (hal_host.c)
+  at wall-clock speed, with sim.pHost handing the simulated USB module to
+  the real host through raw-gadget and dummy_hcd. So the host enumerates the
+  descriptors in USBdsc.c through the firmware's own endpoint 0 code, the
+  keyboard driver receives its keepalive reports, and the LED reports the
+  input layer sends reach capslock.c.
+
+  Once the host has configured the dongle, capslock-gadget toggles CapsLock
+  through the dongle's /dev/input/event node, as the console or a desktop
+  would, and times each toggle until the simulated PWM turns the LED on or
+  off. -d and -u pick another UDC (by default dummy_udc and dummy_udc.0).
+*/
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/input.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/raw_gadget.h>
+#include "sim.h"
+
+// Events that newer kernels also queue (raw_gadget.h may predate them)
+#define EVENT_SUSPEND       3
+#define EVENT_RESUME        4
+#define EVENT_RESET         5
+#define EVENT_DISCONNECT    6
+
+#define OUT_QUEUE           16
+#define CONTROL_TIMEOUT_S   2
+#define CONFIGURED_S        10     // How long the host gets to configure the dongle
+#define MAX_TOGGLES         10000
+
+typedef struct
+{
+  struct usb_raw_ep_io io;
+  uint8_t data[512];
+} t_io;
+
+static int fd;                                // /dev/raw-gadget
+static int nEpIn = -1;                        // raw-gadget endpoint handles
+static int nEpOut = -1;
+static struct timespec t0;                    // When the simulation started
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  changed = PTHREAD_COND_INITIALIZER;
+
+static struct                                 // Shared by the threads (under lock)
+{
+  uint8_t  bConfigured;
+  uint8_t  bReset;                            // Events from the host for the simulation
+  uint8_t  bSuspend;
+  uint8_t  bResume;
+
+  uint8_t  bRequest;                          // A control request for the firmware...
+  uint8_t  bRequestSent;
+  uint8_t  bRequestDone;                      // ...and how it ended
+  uint8_t  setup[8];
+  uint8_t  data[8];
+  uint8_t  nStatus;
+  uint8_t  reply[512];
+  uint16_t nReply;
+
+  uint8_t  bInFull;                           // An EP1 IN report for the host
+  uint8_t  in[64];
+  uint8_t  nIn;
+  uint32_t nInReports;
+
+  struct
+  {
+    uint8_t len;
+    uint8_t data[64];
+  }        out[OUT_QUEUE];                    // EP1 OUT reports for the firmware
+  uint8_t  nOutHead;
+  uint8_t  nOutTail;
+
+  uint8_t  bLit;                              // The CapsLock LED...
+  uint64_t nLitAtNs;                          // ...and when it last changed
+
+  uint32_t nUsbErrors;
+  char     usbError[96];
+} g;
+
+static uint8_t  config[512];                  // The configuration descriptor the host read
+static uint16_t nConfig;
+static uint16_t nVendor, nProduct;            // From the device descriptor
+
+static uint64_t wallNs(void)                  // Since the simulation started
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t) ((t.tv_sec - t0.tv_sec) * 1000000000LL + (t.tv_nsec - t0.tv_nsec));
+}
+
+// The simulation's side (sim.pHost, called with the simulation running)
+
+static void gadgetStep(void)
+{
+  uint64_t nWallUs = wallNs() / 1000;
+
+  if (sim.now > nWallUs + SIM_MS)             // Keep the simulated clock within 1 ms of the wall clock
+  {
+    usleep((useconds_t) (sim.now - nWallUs));
+  }
+  pthread_mutex_lock(&lock);
+  if (g.bReset)
+  {
+    g.bReset = 0;
+    sim_act(SIM_BUS_RESET, 0, NULL, NULL);
+  }
+  if (g.bSuspend)
+  {
+    g.bSuspend = 0;
+    sim_act(SIM_SUSPEND, 0, NULL, NULL);
+  }
+  if (g.bResume)
+  {
+    g.bResume = 0;
+    sim_act(SIM_RESUME, 0, NULL, NULL);
+  }
+  if (g.bRequest && !g.bRequestSent)
+  {
+    g.bRequestSent = 1;
+    sim_act(SIM_CONTROL, 0, g.data, g.setup);
+  }
+  while (g.nOutHead != g.nOutTail)
+  {
+    sim_act(SIM_OUTPUT, g.out[g.nOutHead].len, g.out[g.nOutHead].data, NULL);
+    g.nOutHead = (g.nOutHead + 1) % OUT_QUEUE;
+  }
+  if (sim.nUsbErrors != g.nUsbErrors)
+  {
+    g.nUsbErrors = sim.nUsbErrors;
+    memcpy(g.usbError, sim.usbError, sizeof g.usbError);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+static int gadgetInReady(void)                // The host only polls once the last report has gone
+{
+  int bReady;
+
+  pthread_mutex_lock(&lock);
+  bReady = g.bConfigured && !g.bInFull;
+  pthread_mutex_unlock(&lock);
+  return bReady;
+}
+
+static void gadgetIn(const uint8_t *data, uint8_t n)
+{
+  pthread_mutex_lock(&lock);
+  memcpy(g.in, data, n);
+  g.nIn = n;
+  g.bInFull = 1;
+  g.nInReports++;
+  pthread_cond_broadcast(&changed);
+  pthread_mutex_unlock(&lock);
+}
+
+static void gadgetControl(uint8_t nStatus, const uint8_t *reply, uint16_t nReply)
+{
+  pthread_mutex_lock(&lock);
+  g.nStatus = nStatus;
+  g.nReply = nReply < sizeof g.reply ? nReply : sizeof g.reply;
+  memcpy(g.reply, reply, g.nReply);
+  g.bRequestDone = 1;
+  pthread_cond_broadcast(&changed);
+  pthread_mutex_unlock(&lock);
+}
+
+static void gadgetLed(uint8_t bLit)
+{
+  pthread_mutex_lock(&lock);
+  g.bLit = bLit;
+  g.nLitAtNs = wallNs();
+  pthread_cond_broadcast(&changed);
+  pthread_mutex_unlock(&lock);
+}
+
+static const t_simHost gadgetHost = {gadgetStep, gadgetInReady, gadgetIn, gadgetControl, gadgetLed};
+
+// The host's side (raw-gadget)
+
+static int request(uint8_t *setup, uint8_t *data, uint8_t *reply, uint16_t *nReply) // Pass a control request to the firmware
+{
+  struct timespec deadline;
+  int rc = 0;
+
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += CONTROL_TIMEOUT_S;
+  pthread_mutex_lock(&lock);
+  memcpy(g.setup, setup, 8);
+  memcpy(g.data, data, 8);
+  g.bRequest = 1;
+  g.bRequestSent = g.bRequestDone = 0;
+  while (!g.bRequestDone && rc == 0)
+  {
+    rc = pthread_cond_timedwait(&changed, &lock, &deadline);
+  }
+  g.bRequest = 0;
+  *nReply = g.nReply;
+  memcpy(reply, g.reply, g.nReply);
+  rc = g.bRequestDone && g.nStatus == SIM_CONTROL_DONE ? 0 : -1;
+  pthread_mutex_unlock(&lock);
+  return rc;
+}
+
+static void enableEndpoints(void)             // SET_CONFIGURATION: the endpoints the host read about
+{
+  struct usb_endpoint_descriptor ep;
+  uint16_t n;
+  int h;
+
+  if (nEpIn >= 0) return;                     // (raw-gadget keeps them across a reset)
+  for (n = 0; n + 2 <= nConfig && config[n] != 0; n += config[n])
+  {
+    if (config[n + 1] != USB_DT_ENDPOINT || config[n] < USB_DT_ENDPOINT_SIZE) continue;
+    memcpy(&ep, &config[n], USB_DT_ENDPOINT_SIZE);
+    h = ioctl(fd, USB_RAW_IOCTL_EP_ENABLE, &ep);
+    if (h < 0)
+    {
+      perror("USB_RAW_IOCTL_EP_ENABLE");
+      continue;
+    }
+    if (ep.bEndpointAddress == (USB_DIR_IN | 1)) nEpIn = h; // (EP2 IN, the vendor interface's, is enabled but never written)
+    if (ep.bEndpointAddress == 1) nEpOut = h;
+  }
+}
+
+static void control(const struct usb_ctrlrequest *c)
+{
+  uint8_t setup[8];
+  uint8_t data[8] = {0};
+  uint16_t nLength = c->wLength;
+  uint16_t nReply = 0;
+  t_io io;
+
+  memcpy(setup, c, 8);
+  memset(&io, 0, sizeof io);
+  if (!(c->bRequestType & USB_DIR_IN) && nLength)
+  {
+    io.io.length = nLength < sizeof data ? nLength : sizeof data; // Take the data stage first
+    if (ioctl(fd, USB_RAW_IOCTL_EP0_READ, &io) < 0) return;
+    memcpy(data, io.data, io.io.length);
+  }
+  if (request(setup, data, io.data, &nReply) < 0)
+  {
+    ioctl(fd, USB_RAW_IOCTL_EP0_STALL, 0);
+    return;
+  }
+  if (c->bRequestType == (USB_DIR_IN | USB_TYPE_STANDARD | USB_RECIP_DEVICE) && c->bRequest == USB_REQ_GET_DESCRIPTOR)
+  {
+    if ((c->wValue >> 8) == USB_DT_DEVICE && nReply >= 12)
+    {
+      nVendor = (uint16_t) (io.data[8] | io.data[9] << 8);
+      nProduct = (uint16_t) (io.data[10] | io.data[11] << 8);
+    }
+    if ((c->wValue >> 8) == USB_DT_CONFIG && nReply >= 4 && nReply == (io.data[2] | io.data[3] << 8))
+    {
+      memcpy(config, io.data, nReply);
+      nConfig = nReply;
+    }
+  }
+  if (c->bRequestType == USB_RECIP_DEVICE && c->bRequest == USB_REQ_SET_CONFIGURATION)
+  {
+    enableEndpoints();
+    ioctl(fd, USB_RAW_IOCTL_VBUS_DRAW, nConfig >= 9 ? config[8] : 50);
+    ioctl(fd, USB_RAW_IOCTL_CONFIGURE, 0);
+    pthread_mutex_lock(&lock);
+    g.bConfigured = c->wValue != 0;
+    pthread_cond_broadcast(&changed);
+    pthread_mutex_unlock(&lock);
+  }
+  if (c->bRequestType & USB_DIR_IN)
+  {
+    io.io.length = nReply < nLength ? nReply : nLength;
+    ioctl(fd, USB_RAW_IOCTL_EP0_WRITE, &io);
+  }
+  else if (!nLength)
+  {
+    io.io.length = 0;                         // The status stage
+    ioctl(fd, USB_RAW_IOCTL_EP0_READ, &io);
+  }
+}
+
+static void *ep0Thread(void *arg)
+{
+  struct
+  {
+    struct usb_raw_event event;
+    uint8_t data[sizeof(struct usb_ctrlrequest)];
+  } e;
+
+  for (;;)
+  {
+    memset(&e, 0, sizeof e);
+    e.event.length = sizeof e.data;
+    if (ioctl(fd, USB_RAW_IOCTL_EVENT_FETCH, &e) < 0)
+    {
+      perror("USB_RAW_IOCTL_EVENT_FETCH");
+      exit(1);
+    }
+    pthread_mutex_lock(&lock);
+    switch (e.event.type)
+    {
+      case EVENT_RESET:
+      case EVENT_DISCONNECT:
+        g.bConfigured = 0;
+        g.bReset = 1;
+        break;
+      case EVENT_SUSPEND:
+        g.bSuspend = 1;
+        break;
+      case EVENT_RESUME:
+        g.bResume = 1;
+        break;
+    }
+    pthread_mutex_unlock(&lock);
+    if (e.event.type == USB_RAW_EVENT_CONTROL)
+    {
+      control((const struct usb_ctrlrequest *) e.data);
+    }
+  }
+  return arg;
+}
+
+static void *inThread(void *arg)              // EP1 IN: blocks until the host has polled
+{
+  t_io io;
+
+  for (;;)
+  {
+    pthread_mutex_lock(&lock);
+    while (!g.bInFull)
+    {
+      pthread_cond_wait(&changed, &lock);
+    }
+    memset(&io, 0, sizeof io);
+    io.io.ep = (uint16_t) nEpIn;
+    io.io.length = g.nIn;
+    memcpy(io.data, g.in, g.nIn);
+    pthread_mutex_unlock(&lock);
+    if (nEpIn < 0 || ioctl(fd, USB_RAW_IOCTL_EP_WRITE, &io) < 0)
+    {
+      usleep(10000);                          // (not configured, or reset meanwhile: the report is lost)
+    }
+    pthread_mutex_lock(&lock);
+    g.bInFull = 0;
+    pthread_mutex_unlock(&lock);
+  }
+  return arg;
+}
+
+static void *outThread(void *arg)             // EP1 OUT: LED reports and vendor commands
+{
+  t_io io;
+
+  for (;;)
+  {
+    pthread_mutex_lock(&lock);
+    while (!g.bConfigured || nEpOut < 0)
+    {
+      pthread_cond_wait(&changed, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+    memset(&io, 0, sizeof io);
+    io.io.ep = (uint16_t) nEpOut;
+    io.io.length = 64;
+    if (ioctl(fd, USB_RAW_IOCTL_EP_READ, &io) < 0)
+    {
+      usleep(10000);
+      continue;
+    }
+    pthread_mutex_lock(&lock);
+    if ((g.nOutTail + 1) % OUT_QUEUE != g.nOutHead)
+    {
+      g.out[g.nOutTail].len = (uint8_t) io.io.length;
+      memcpy(g.out[g.nOutTail].data, io.data, io.io.length);
+      g.nOutTail = (g.nOutTail + 1) % OUT_QUEUE;
+    }
+    pthread_mutex_unlock(&lock);
+  }
+  return arg;
+}
+
+// The benchmark
+
+static int findEventNode(char *path, size_t size) // The dongle's /dev/input/eventN
+{
+  char name[300];
+  unsigned nId[2];
+  struct dirent *entry;
+  DIR *dir;
+  FILE *f;
+  int bFound = 0;
+  int i;
+
+  dir = opendir("/sys/class/input");
+  if (!dir) return 0;
+  while (!bFound && (entry = readdir(dir)) != NULL)
+  {
+    if (strncmp(entry->d_name, "event", 5) != 0) continue;
+    for (i = 0; i < 2; i++)
+    {
+      snprintf(name, sizeof name, "/sys/class/input/%s/device/id/%s", entry->d_name, i ? "product" : "vendor");
+      f = fopen(name, "r");
+      if (!f || fscanf(f, "%x", &nId[i]) != 1) nId[i] = 0;
+      if (f) fclose(f);
+    }
+    if (nId[0] == nVendor && nId[1] == nProduct)
+    {
+      snprintf(path, size, "/dev/input/%s", entry->d_name);
+      bFound = 1;
+    }
+  }
+  closedir(dir);
+  return bFound;
+}
+
+static int setCapsLock(int nInput, int bOn)  // As the console does when CapsLock is pressed
+{
+  struct input_event ev[2];
+
+  memset(ev, 0, sizeof ev);
+  ev[0].type = EV_LED;
+  ev[0].code = LED_CAPSL;
+  ev[0].value = bOn;
+  ev[1].type = EV_SYN;
+  ev[1].code = SYN_REPORT;
+  return write(nInput, ev, sizeof ev) == (ssize_t) sizeof ev ? 0 : -1;
+}
+
+static int isConfigured(void)
+{
+  int bConfigured;
+
+  pthread_mutex_lock(&lock);
+  bConfigured = g.bConfigured;
+  pthread_mutex_unlock(&lock);
+  return bConfigured;
+}
+
+static int compareUs(const void *a, const void *b)
+{
+  double x = *(const double *) a;
+  double y = *(const double *) b;
+
+  return (x > y) - (x < y);
+}
+
+static void benchmark(int nToggles)
+{
+  static double latency[MAX_TOGGLES];
+  struct timespec deadline;
+  char path[300];
+  uint64_t nSentNs;
+  double nTotal = 0;
+  int nInput;
+  int nDone = 0;
+  int nLost = 0;
+  int bOn;
+  int i;
+
+  for (i = 0; i < CONFIGURED_S * 10 && !(isConfigured() && findEventNode(path, sizeof path)); i++)
+  {
+    usleep(100000);
+  }
+  if (i == CONFIGURED_S * 10)
+  {
+    pthread_mutex_lock(&lock);
+    fprintf(stderr, "The host did not configure the dongle as a keyboard (%u USB errors%s%s)\n",
+            g.nUsbErrors, g.nUsbErrors ? ": " : "", g.usbError);
+    exit(1);
+  }
+  nInput = open(path, O_RDWR);
+  if (nInput < 0)
+  {
+    perror(path);
+    exit(1);
+  }
+  printf("%s: %04X:%04X configured, toggling CapsLock %d times\n", path, nVendor, nProduct, nToggles);
+  usleep(500000);                             // Let the host finish with the dongle
+
+  for (i = 0; i < nToggles; i++)
+  {
+    pthread_mutex_lock(&lock);
+    bOn = !g.bLit;
+    pthread_mutex_unlock(&lock);
+    nSentNs = wallNs();
+    if (setCapsLock(nInput, bOn) < 0)
+    {
+      perror(path);
+      exit(1);
+    }
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += 1;
+    pthread_mutex_lock(&lock);
+    while (g.bLit != bOn && pthread_cond_timedwait(&changed, &lock, &deadline) == 0);
+    if (g.bLit == bOn)
+    {
+      latency[nDone] = (g.nLitAtNs - nSentNs) / 1000.0;
+      nTotal += latency[nDone++];
+    }
+    else
+    {
+      nLost++;
+    }
+    pthread_mutex_unlock(&lock);
+    usleep(50000 + (useconds_t) (rand() % 100) * 1000); // Not in step with the host's polling
+  }
+  close(nInput);
+
+  pthread_mutex_lock(&lock);
+  qsort(latency, (size_t) nDone, sizeof latency[0], compareUs);
+  printf("  CapsLock to LED         %d toggles, %d lost\n", nDone, nLost);
+  if (nDone)
+  {
+    printf("  round trip (us)         min %.0f, median %.0f, 90%% %.0f, 99%% %.0f, max %.0f, mean %.0f\n",
+           latency[0], latency[nDone / 2], latency[nDone * 9 / 10], latency[nDone * 99 / 100],
+           latency[nDone - 1], nTotal / nDone);
+  }
+  printf("  IN reports to the host  %u\n", g.nInReports);
+  printf("  USB errors              %u%s%s\n", g.nUsbErrors, g.nUsbErrors ? ": " : "", g.usbError);
+  exit(nLost || g.nUsbErrors);
+}
+
+static void *benchThread(void *arg)
+{
+  benchmark(*(int *) arg);
+  return arg;
+}
+
+int main(int argc, char *argv[])
+{
+  struct usb_raw_init init;
+  const char *driver = "dummy_udc";
+  const char *device = "dummy_udc.0";
+  pthread_t thread;
+  static int nToggles = 200;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:d:u:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'n':
+        nToggles = atoi(optarg);
+        break;
+      case 'd':
+        driver = optarg;
+        break;
+      case 'u':
+        device = optarg;
+        break;
+      default:
+        nToggles = -1;
+    }
+  }
+  if (nToggles < 1 || nToggles > MAX_TOGGLES || optind < argc)
+  {
+    fprintf(stderr, "Usage: capslock-gadget [-n toggles] [-d driver] [-u device]\n");
+    return 2;
+  }
+
+  fd = open("/dev/raw-gadget", O_RDWR);
+  if (fd < 0)
+  {
+    perror("/dev/raw-gadget (modprobe dummy_hcd raw_gadget)");
+    return 1;
+  }
+  memset(&init, 0, sizeof init);
+  snprintf((char *) init.driver_name, sizeof init.driver_name, "%s", driver);
+  snprintf((char *) init.device_name, sizeof init.device_name, "%s", device);
+  init.speed = USB_SPEED_FULL;
+  if (ioctl(fd, USB_RAW_IOCTL_INIT, &init) < 0 || ioctl(fd, USB_RAW_IOCTL_RUN, 0) < 0)
+  {
+    perror("raw-gadget");
+    return 1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  pthread_create(&thread, NULL, ep0Thread, NULL);
+  pthread_create(&thread, NULL, inThread, NULL);
+  pthread_create(&thread, NULL, outThread, NULL);
+  pthread_create(&thread, NULL, benchThread, &nToggles);
+
+  sim.pHost = &gadgetHost;
+  sim.nEnumerationMs = 1;                     // (the simulated host only resets the bus and sets the address)
+  sim.nHostIdleRate = -1;
+  sim_run(24 * 3600 * SIM_SECONDS);           // Until the benchmark exits
+  return 0;
+}
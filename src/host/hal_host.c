@@ -0,0 +1,1342 @@
+/*
+  CAP! CapsLock Light
+  Copyright (C) 2017 Andrew J. Armstrong
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+  02111-1307  USA
+
+  Author:
+  Andrew J. Armstrong <androidarmstrong@gmail.com>
+
+*/
+
+/*
+  Simulated PIC16F1455 peripherals and USB host for the Linux build.
+
+  Time only moves on when the firmware waits (HAL_IDLE, HAL_SPIN or
+  CPU_SLEEP), one SIM_STEP_US at a time. Each step runs Timer1, Timer2 and the
+  USB host, and then calls interrupt() if an enabled interrupt is pending, so
+  the firmware code between two waits takes no simulated time at all.
+  (With sim.bPreempt set, every instruction of main() takes a step too, so
+  that interrupt() can run between any two of them.)
+
+  The USB module is simulated at the level of its buffer descriptors: each
+  step the host runs at most one transaction (a SETUP, IN or OUT token) and,
+  if the firmware has handed the buffer descriptor to the USB module, the
+  transaction completes and sets TRNIF. The host enumerates the device with
+  real control transfers and checks every reply and data toggle.
+*/
+
+#include <setjmp.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "hal_host.h"
+#include "sim.h"
+#include "telemetry.h"
+#include "boot.h"
+
+volatile uint8_t ANSELA, ANSELC, LATA, LATC, TRISA, TRISC;
+volatile uint8_t OSCCON, T1CON, T2CON, PR2, TMR1H, TMR1L;
+volatile uint8_t USTAT, UCFG, UFRMH, UFRML, UADDR, UEP0, UEP1, UEP2, UEP3;
+volatile uint8_t PCON, WDTCON, PMDATH, PMDATL;
+volatile uint8_t PWM1CON, PWM1DCH, PWM1DCL;
+uint8_t hostUsbRam[512];
+uint16_t hostFlash[0x2000];                  // Program memory (the code itself is not simulated)
+uint8_t nBootRequest[2];
+uint8_t nLedDuty;                            // The firmware's software PWM duty for RA4 (see capslock.h)
+volatile uint8_t LATA4_bit;
+volatile uint8_t NOT_WPUEN_bit;
+volatile uint8_t HFIOFS_bit = 1, PLLRDY_bit = 1, ACTEN_bit, ACTSRC_bit;
+volatile uint8_t GIE_bit, PEIE_bit;
+volatile uint8_t TMR1ON_bit, TMR1IE_bit, TMR1IF_bit, TMR2IE_bit, TMR2IF_bit;
+volatile uint8_t USBIE_bit, USBIF_bit, USBEN_bit, PKTDIS_bit, PPBRST_bit, SUSPND_bit, RESUME_bit;
+volatile uint8_t URSTIE_bit, URSTIF_bit, IDLEIE_bit, IDLEIF_bit, ACTVIE_bit, ACTVIF_bit, TRNIE_bit, TRNIF_bit;
+
+t_sim sim;
+
+static jmp_buf   simExit;
+static jmp_buf   simReset;                   // Back to the reset vector
+static uint64_t  nEndUs;
+static uint8_t   bSleeping;
+
+static struct
+{
+  uint64_t at;
+  uint8_t  action;
+  uint8_t  arg;
+  uint8_t  data[64];                         // SIM_VENDOR_COMMAND, SIM_OUTPUT and SIM_CONTROL's data stage
+  uint8_t  setup[8];                         // SIM_CONTROL only
+}                 actions[SIM_MAX_ACTIONS];
+static size_t     nActions;
+static size_t     nNextAction;
+
+static uint64_t  nTimer1Acc;                 // Timer1 input clock cycles x 1,000,000
+static uint16_t  nTimer1;
+static uint64_t  nTimer2Acc;                 // Timer2 input clock cycles x 1,000,000
+static uint32_t  nTimer2;                    // Timer2 counts since the last interrupt
+static uint64_t  nWdtUs;                     // Time since the watchdog was last cleared
+static uint8_t   bHung;                      // main() is stuck (SIM_HANG)
+static uint8_t   bFlashProgrammed;           // sim_program() has set up program memory
+static uint8_t   bHostLit;                   // The LED as sim.pHost last heard
+
+enum { SIE_ACK, SIE_NAK, SIE_STALL };        // Outcome of a transaction
+
+enum                                         // Control transfer stages (host side)
+{
+  HOST_SETUP,
+  HOST_DATA_IN,
+  HOST_DATA_OUT,
+  HOST_STATUS_IN,
+  HOST_STATUS_OUT
+};
+
+#define PID_OUT             0x01
+#define PID_IN              0x09
+#define PID_SETUP           0x0D
+#define EP0_SIZE            8                // bMaxPacketSize0
+#define FLASH_STALL_US      (2 * SIM_MS)     // The CPU stalls this long for a row erase or write
+#define CONTROL_TIMEOUT_US  (50 * SIM_MS)    // A control transfer stage NAKed for this long has failed
+#define PENDING             256              // (a whole firmware image, for the bootloader)
+#define CONTROLS            16
+
+typedef struct
+{
+  uint8_t setup[8];
+  uint8_t data[8];                           // The OUT data stage (8 bytes at most)
+  uint8_t bScript;                           // Part of the enumeration, so it must succeed
+} t_request;
+
+static struct                                // What the host wants to send (kept across a detach)
+{
+  struct
+  {
+    uint8_t len;
+    uint8_t data[64];
+  }         pending[PENDING];                // Output reports waiting to be delivered
+  uint8_t   nPendingHead;
+  uint8_t   nPendingTail;
+  t_request control[CONTROLS];               // Control requests waiting to be made
+  uint8_t   nControlHead;
+  uint8_t   nControlTail;
+  uint8_t   nNextAddress;                    // The address the host will assign next
+} host;
+
+static struct                                // The device as the host and the USB module see it
+{
+  uint8_t   bAttached;                       // USBEN is set
+  uint8_t   bConfigured;                     // SET_CONFIGURATION(1) has completed
+  uint8_t   bSuspended;                      // The host has suspended the bus
+  uint8_t   bRemoteWakeup;                   // The host has enabled remote wakeup (SET_FEATURE(DEVICE_REMOTE_WAKEUP))
+  uint8_t   bStalled;                        // The host is not polling the IN endpoint
+  uint64_t  nResetAt;                        // When the host will reset the bus (0=not pending)
+  uint64_t  nEnumerateAt;                    // When the host will start enumerating us (0=not pending)
+  uint64_t  nIdleAt;                         // When the bus will have been idle for 3 ms (0=not pending)
+  uint64_t  nResumeAt;                       // When the host will resume the bus (0=not pending)
+  uint64_t  nFrameUs;                        // Time into the current 1 ms frame
+  uint32_t  nFrame;
+  uint8_t   nAddress;                        // The address the host uses
+  uint8_t   bInDue;                          // The host polls EP1 IN (or OUT) as soon as the bus is free
+  uint8_t   bOutDue;
+  uint8_t   bMouseDue;                       // (and EP3 IN, if there is a mouse interface)
+  uint8_t   nInInterval;                     // Polling periods granted (ms)
+  uint8_t   nOutInterval;
+  uint8_t   nMouseInterval;                  // (0 = no EP3 IN)
+  uint8_t   nInPacketSize;                   // wMaxPacketSize of EP1 IN...
+  uint8_t   nMousePacketSize;                // ...and EP3 IN
+  uint8_t   bPingPong;                       // UCFG.PPB=11: EP1 and EP3 have even and odd buffer descriptors
+  uint8_t   nInOdd;                          // The USB module's ping-pong pointers for EP1 (0=even)...
+  uint8_t   nOutOdd;
+  uint8_t   nMouseOdd;                       // ...and EP3 IN
+  uint8_t   nInToggle;                       // The data toggles the host expects next on EP1...
+  uint8_t   nOutToggle;
+  uint8_t   nMouseToggle;                    // ...and EP3 IN
+  uint8_t   lastIn[8];                       // The last report the host received
+
+  // Enumeration and control transfers
+  uint8_t   nScriptStep;                     // Next enumeration request (0=not enumerating)
+  uint8_t   iProduct;                        // From the device descriptor
+  uint16_t  nConfigLength;                   // wTotalLength from the configuration descriptor
+  uint16_t  nReportLength[3];                // wDescriptorLength from the HID descriptor of interfaces 0 to 2
+  uint8_t   bInterval[3];                    // bInterval of EP1 IN, EP1 OUT and EP3 IN (0 = none)
+  uint8_t   bControl;                        // A control transfer is under way...
+  t_request request;                         // ...this one
+  uint8_t   nStage;
+  uint8_t   nToggle;                         // The data toggle of its next packet
+  uint16_t  nLength;                         // Its wLength
+  uint8_t   reply[512];
+  uint16_t  nReply;
+  uint64_t  nStageAt;                        // When the current stage started
+  uint64_t  nNextControlAt;                  // The host waits until then before its next request
+} usb;
+
+static size_t addAction(uint64_t at, int action, uint8_t arg)
+{
+  size_t i;
+
+  for (i = nActions; i > 0 && actions[i-1].at > at; i--) // Keep the actions in time order
+  {
+    actions[i] = actions[i-1];
+  }
+  memset(&actions[i], 0, sizeof actions[i]);
+  actions[i].at = at;
+  actions[i].action = (uint8_t) action;
+  actions[i].arg = arg;
+  nActions++;
+  return i;
+}
+
+void sim_schedule(uint64_t at, int action, uint8_t arg)
+{
+  if (nActions < SIM_MAX_ACTIONS)
+  {
+    addAction(at, action, arg);
+  }
+}
+
+void sim_command(uint64_t at, const uint8_t command[8])
+{
+  if (nActions < SIM_MAX_ACTIONS)
+  {
+    memcpy(actions[addAction(at, SIM_VENDOR_COMMAND, 0)].data, command, TELEMETRY_REQUEST_SIZE);
+  }
+}
+
+void sim_output(uint64_t at, const uint8_t *data, uint8_t len)
+{
+  if (nActions < SIM_MAX_ACTIONS && len <= 64)
+  {
+    memcpy(actions[addAction(at, SIM_OUTPUT, len)].data, data, len);
+  }
+}
+
+void sim_control(uint64_t at, const uint8_t setup[8], const uint8_t *data)
+{
+  size_t i;
+
+  if (nActions < SIM_MAX_ACTIONS)
+  {
+    i = addAction(at, SIM_CONTROL, 0);
+    memcpy(actions[i].setup, setup, 8);
+    if (data)
+    {
+      memcpy(actions[i].data, data, setup[6] < 8 ? setup[6] : 8);
+    }
+  }
+}
+
+static void logEvent(t_simEvent *log, size_t *n, uint8_t value)
+{
+  if (*n == SIM_MAX_LOG) return;
+  log[*n].at = sim.now;
+  log[*n].value = value;
+  (*n)++;
+}
+
+static void usbError(const char *format, ...)
+{
+  va_list args;
+
+  if (sim.nUsbErrors++ == 0)                 // Keep the first
+  {
+    va_start(args, format);
+    vsnprintf(sim.usbError, sizeof sim.usbError, format, args);
+    va_end(args);
+  }
+}
+
+static void sendOutput(const uint8_t *data, uint8_t len)
+{
+  host.pending[host.nPendingTail].len = len;
+  memcpy(host.pending[host.nPendingTail].data, data, len);
+  host.nPendingTail = (host.nPendingTail + 1) % PENDING;
+}
+
+static void sendLeds(uint8_t leds)
+{
+  sim.cHostLeds = leds;
+  sendOutput(&leds, 1);
+}
+
+static void queueControl(const uint8_t setup[8], const uint8_t data[8])
+{
+  t_request *r = &host.control[host.nControlTail];
+
+  memset(r, 0, sizeof *r);
+  memcpy(r->setup, setup, 8);
+  memcpy(r->data, data, 8);
+  host.nControlTail = (host.nControlTail + 1) % CONTROLS;
+}
+
+static uint8_t grantInterval(uint8_t bInterval)
+{
+  uint8_t n = 1;
+
+  if (!sim.bRoundInterval) return bInterval;
+  while (n * 2 <= bInterval && n < 32)       // Round down to a power of 2 (up to 32 ms), as xHCI does
+  {
+    n *= 2;
+  }
+  return n;
+}
+
+static void updateUSBIF(void)
+{
+  USBIF_bit = (TRNIE_bit && TRNIF_bit) || (URSTIE_bit && URSTIF_bit) ||
+              (IDLEIE_bit && IDLEIF_bit) || (ACTVIE_bit && ACTVIF_bit);
+}
+
+// The USB module
+
+static uint8_t *bdBuffer(const uint8_t *bd)  // The buffer a buffer descriptor points at
+{
+  return &hostUsbRam[(((bd[3] << 8) | bd[2]) - 0x2000) & 0x1FF];
+}
+
+static void transactionComplete(uint8_t ustat)
+{
+  USTAT = ustat;
+  TRNIF_bit = 1;
+}
+
+static int sieIn(uint8_t ep, uint8_t *data, uint8_t *n, uint8_t *dts) // The host sends an IN token (EP0, EP1 or EP3)
+{
+  uint8_t *pOdd = ep == 3 ? &usb.nMouseOdd : &usb.nInOdd;
+  uint8_t odd = ep && usb.bPingPong ? *pOdd : 0; // (PPB=11: ping-pong on every endpoint but EP0)
+  uint8_t *bd = &hostUsbRam[(ep ? (usb.bPingPong ? 4 * ep + odd : 2 * ep + 1) : 1) * 4];
+  uint8_t uep = ep == 3 ? UEP3 : ep ? UEP1 : UEP0;
+  uint8_t nMax = ep == 3 ? usb.nMousePacketSize : ep ? usb.nInPacketSize : EP0_SIZE;
+
+  if (PKTDIS_bit || UADDR != usb.nAddress || !(uep & 0x02)) return SIE_NAK; // (or no answer at all)
+  if (!(bd[0] & 0x80)) return SIE_NAK;       // UOWN: the firmware has not armed it
+  if ((bd[0] & 0x04) || (uep & 0x01)) return SIE_STALL;
+  *n = bd[1];
+  if (*n > nMax)
+  {
+    usbError("EP%u IN: %u bytes is more than wMaxPacketSize", ep, *n);
+    *n = nMax;
+  }
+  memcpy(data, bdBuffer(bd), *n);
+  *dts = (bd[0] >> 6) & 1;
+  bd[0] = (uint8_t) ((bd[0] & 0x40) | PID_IN << 2); // Back to the firmware, with the PID
+  if (ep) *pOdd ^= 1;
+  transactionComplete((uint8_t) (ep << 3 | 0x04 | odd << 1));
+  return SIE_ACK;
+}
+
+static int sieOut(uint8_t ep, uint8_t pid, const uint8_t *data, uint8_t n, uint8_t dts) // The host sends an OUT or SETUP token
+{
+  uint8_t odd = ep && usb.bPingPong ? usb.nOutOdd : 0;
+  uint8_t *bd = &hostUsbRam[(ep ? 2 + odd : 0) * 4];
+  uint8_t uep = ep ? UEP1 : UEP0;
+
+  if (PKTDIS_bit || UADDR != usb.nAddress || !(uep & 0x04)) return SIE_NAK;
+  if (pid == PID_SETUP && (uep & 0x08)) return SIE_NAK; // EPCONDIS
+  if (!(bd[0] & 0x80)) return SIE_NAK;
+  if (pid != PID_SETUP && ((bd[0] & 0x04) || (uep & 0x01))) return SIE_STALL; // (a SETUP is always taken)
+  if (pid != PID_SETUP && (bd[0] & 0x08) && ((bd[0] >> 6) & 1) != dts)
+  {
+    usbError("EP%u OUT: DATA%u sent, the buffer descriptor expects DATA%u", ep, dts, (bd[0] >> 6) & 1);
+    return SIE_ACK;                          // The USB module acknowledges the packet but drops it
+  }
+  if (n > bd[1])
+  {
+    usbError("EP%u OUT: %u byte packet for a %u byte buffer", ep, n, bd[1]);
+    return SIE_ACK;
+  }
+  if (n) memcpy(bdBuffer(bd), data, n);
+  bd[1] = n;
+  bd[0] = (uint8_t) (dts << 6 | pid << 2);
+  if (pid == PID_SETUP) PKTDIS_bit = 1;     // No more transactions until the firmware has seen it
+  if (ep) usb.nOutOdd ^= 1;
+  transactionComplete((uint8_t) (ep << 3 | odd << 1));
+  return SIE_ACK;
+}
+
+// The host: enumeration and control transfers
+
+static void setup(t_request *r, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint16_t wLength)
+{
+  memset(r, 0, sizeof *r);
+  r->setup[0] = bmRequestType;
+  r->setup[1] = bRequest;
+  r->setup[2] = (uint8_t) wValue;
+  r->setup[3] = (uint8_t) (wValue >> 8);
+  r->setup[4] = (uint8_t) wIndex;
+  r->setup[5] = (uint8_t) (wIndex >> 8);
+  r->setup[6] = (uint8_t) wLength;
+  r->setup[7] = (uint8_t) (wLength >> 8);
+  r->bScript = 1;
+}
+
+static int nextScriptRequest(t_request *r)   // The next request enumerating the device, as Linux makes them
+{
+  switch (usb.nScriptStep++)
+  {
+    case 1:
+      setup(r, 0x80, 0x06, 0x0100, 0, 64);   // GET_DESCRIPTOR device (asking for 64 bytes first)
+      return 1;
+    case 2:
+      host.nNextAddress = (uint8_t) (host.nNextAddress % 127 + 1);
+      setup(r, 0x00, 0x05, host.nNextAddress, 0, 0); // SET_ADDRESS
+      return 1;
+    case 3:
+      if (sim.pHost) break;                  // The real host enumerates the device itself
+      setup(r, 0x80, 0x06, 0x0100, 0, 18);   // GET_DESCRIPTOR device
+      return 1;
+    case 4:
+      setup(r, 0x80, 0x06, 0x0200, 0, 9);    // GET_DESCRIPTOR configuration (for wTotalLength)...
+      return 1;
+    case 5:
+      setup(r, 0x80, 0x06, 0x0200, 0, usb.nConfigLength); // ...and all of it
+      return 1;
+    case 6:
+      setup(r, 0x80, 0x06, 0x0300, 0, 255);  // GET_DESCRIPTOR string 0 (language ids)
+      return 1;
+    case 7:
+      setup(r, 0x80, 0x06, (uint16_t) (0x0300 | usb.iProduct), 0x0409, 255); // GET_DESCRIPTOR product string
+      return 1;
+    case 8:
+      setup(r, 0x00, 0x09, 1, 0, 0);         // SET_CONFIGURATION
+      return 1;
+    case 9:
+      if (sim.nHostIdleRate < 0) return nextScriptRequest(r);
+      setup(r, 0x21, 0x0A, (uint16_t) (sim.nHostIdleRate << 8), 0, 0); // SET_IDLE (hosts set it while configuring a keyboard)
+      return 1;
+    case 10:
+      setup(r, 0x81, 0x06, 0x2200, 0, usb.nReportLength[0]); // GET_DESCRIPTOR report (the keyboard's)...
+      return 1;
+    case 11:
+      setup(r, 0x81, 0x06, 0x2200, 1, usb.nReportLength[1]); // ...the vendor interface's...
+      return 1;
+    case 12:
+      if (!usb.nReportLength[2]) break;
+      setup(r, 0x81, 0x06, 0x2200, 2, usb.nReportLength[2]); // ...and the mouse's
+      return 1;
+  }
+  usb.nScriptStep = 0;
+  return 0;
+}
+
+static void readConfiguration(void)          // Walk the configuration descriptor the way the host does
+{
+  const uint8_t *d;
+  uint16_t n;
+  uint8_t nInterface = 0;
+
+  memset(usb.nReportLength, 0, sizeof usb.nReportLength);
+  memset(usb.bInterval, 0, sizeof usb.bInterval);
+  for (n = 0; n + 2 <= usb.nReply && usb.reply[n] != 0; n += usb.reply[n])
+  {
+    d = &usb.reply[n];
+    if (d[1] == 0x05 && (d[2] == 0x81 || d[2] == 0x01 || d[2] == 0x83)) // EP1 IN, EP1 OUT or EP3 IN
+    {
+      usb.bInterval[d[2] == 0x81 ? 0 : d[2] == 0x01 ? 1 : 2] = d[6];
+    }
+    if (d[1] == 0x05 && d[2] == 0x81)
+    {
+      usb.nInPacketSize = d[4] <= 64 ? d[4] : 64;
+    }
+    if (d[1] == 0x05 && d[2] == 0x83)
+    {
+      usb.nMousePacketSize = d[4] <= 64 ? d[4] : 64;
+    }
+    if (d[1] == 0x04)
+    {
+      nInterface = d[2];
+    }
+    if (d[1] == 0x21 && nInterface < 3)
+    {
+      usb.nReportLength[nInterface] = (uint16_t) (d[7] | d[8] << 8);
+    }
+  }
+  if (n != usb.nReply)
+  {
+    usbError("configuration descriptor: the descriptors add up to %u bytes, not %u", n, usb.nReply);
+  }
+}
+
+static void controlDone(void)                // A control transfer has completed
+{
+  const uint8_t *s = usb.request.setup;
+  uint16_t nTotal;
+  uint16_t nExpected;
+
+  if (s[0] == 0x80 && s[1] == 0x06)          // GET_DESCRIPTOR (device)
+  {
+    nTotal = usb.nReply >= 4 && s[3] == 0x02 ? (uint16_t) (usb.reply[2] | usb.reply[3] << 8) : usb.reply[0];
+    nExpected = nTotal < usb.nLength ? nTotal : usb.nLength;
+    if (usb.nReply < 2 || usb.reply[1] != s[3] || usb.nReply != nExpected)
+    {
+      usbError("GET_DESCRIPTOR 0x%02X%02X: %u bytes, expected %u", s[3], s[2], usb.nReply, nExpected);
+    }
+    if (s[3] == 0x01 && usb.nReply >= 16)
+    {
+      if (usb.reply[7] != EP0_SIZE) usbError("bMaxPacketSize0 %u", usb.reply[7]);
+      usb.iProduct = usb.reply[15];
+    }
+    if (s[3] == 0x02)
+    {
+      usb.nConfigLength = nTotal;
+      if (usb.nReply == nTotal) readConfiguration();
+    }
+  }
+  else if (s[0] == 0x81 && s[1] == 0x06 && s[3] == 0x22 && (s[4] > 2 || usb.nReply != usb.nReportLength[s[4]]))
+  {
+    usbError("report descriptor of interface %u: %u bytes, wDescriptorLength %u", s[4], usb.nReply, s[4] > 2 ? 0 : usb.nReportLength[s[4]]);
+  }
+  else if (s[0] == 0x00 && s[1] == 0x05)     // SET_ADDRESS
+  {
+    usb.nAddress = s[2];
+    usb.nNextControlAt = sim.now + 2 * SIM_MS; // The device gets 2 ms to take it on
+  }
+  else if (s[0] == 0x00 && s[1] == 0x09)     // SET_CONFIGURATION
+  {
+    usb.bConfigured = s[2] != 0;
+    usb.nInToggle = usb.nOutToggle = usb.nMouseToggle = 0;
+    usb.bInDue = usb.bOutDue = usb.bMouseDue = 0;
+    usb.nInInterval = grantInterval(usb.bInterval[0] ? usb.bInterval[0] : 1);
+    usb.nOutInterval = grantInterval(usb.bInterval[1] ? usb.bInterval[1] : 1);
+    usb.nMouseInterval = usb.bInterval[2] ? grantInterval(usb.bInterval[2]) : 0;
+    sim.nInIntervalMs = usb.nInInterval;
+    sim.nOutIntervalMs = usb.nOutInterval;
+    sim.nMouseIntervalMs = usb.nMouseInterval;
+    if (usb.bConfigured) logEvent(sim.configured, &sim.nConfigured, 1);
+  }
+  else if (s[0] == 0x00 && (s[1] == 0x01 || s[1] == 0x03) && s[2] == 1) // CLEAR_ or SET_FEATURE(DEVICE_REMOTE_WAKEUP)
+  {
+    usb.bRemoteWakeup = s[1] == 0x03;
+  }
+  else if (s[0] == 0x02 && s[1] == 0x01 && s[2] == 0) // CLEAR_FEATURE(ENDPOINT_HALT)
+  {
+    if (s[4] == 0x81) usb.nInToggle = 0;
+    if (s[4] == 0x01) usb.nOutToggle = 0;
+  }
+}
+
+static void endControl(int rc)
+{
+  t_simControl *c;
+  uint8_t nStatus = rc == SIE_ACK ? SIM_CONTROL_DONE : rc == SIE_STALL ? SIM_CONTROL_STALLED : SIM_CONTROL_TIMED_OUT;
+
+  usb.bControl = 0;
+  if (sim.nControls < SIM_MAX_LOG)
+  {
+    c = &sim.control[sim.nControls++];
+    c->at = sim.now;
+    memcpy(c->setup, usb.request.setup, 8);
+    c->nStatus = nStatus;
+    c->nReply = usb.nReply;
+    memcpy(c->reply, usb.reply, sizeof c->reply);
+  }
+  if (sim.pHost && !usb.request.bScript)
+  {
+    sim.pHost->control(nStatus, usb.reply, usb.nReply);
+  }
+  if (rc == SIE_ACK)
+  {
+    controlDone();
+  }
+  else if (rc == SIE_NAK || usb.request.bScript) // (a stall is a fair answer to a request outside the enumeration)
+  {
+    usbError("request %02X %02X %02X%02X %s", usb.request.setup[0], usb.request.setup[1],
+             usb.request.setup[3], usb.request.setup[2], rc == SIE_STALL ? "stalled" : "timed out");
+    usb.nScriptStep = 0;                     // Enumeration failed
+  }
+}
+
+static void stepControl(void)                // Run the next transaction of a control transfer
+{
+  const uint8_t *s;
+  uint8_t data[8];
+  uint8_t n = 0;
+  uint8_t dts = 0;
+  int rc;
+
+  if (!usb.bControl)
+  {
+    if (sim.now < usb.nNextControlAt) return;
+    if (usb.nScriptStep)
+    {
+      if (!nextScriptRequest(&usb.request))
+      {
+        if (sim.bLedOnConfigure)             // Enumeration is over
+        {
+          sendLeds(sim.cHostLeds);
+        }
+        return;
+      }
+    }
+    else if (host.nControlHead != host.nControlTail && (usb.bConfigured || (sim.pHost && usb.nAddress)))
+    {
+      usb.request = host.control[host.nControlHead];
+      host.nControlHead = (host.nControlHead + 1) % CONTROLS;
+    }
+    else
+    {
+      return;
+    }
+    usb.bControl = 1;
+    usb.nStage = HOST_SETUP;
+    usb.nReply = 0;
+    usb.nLength = (uint16_t) (usb.request.setup[6] | usb.request.setup[7] << 8);
+    usb.nStageAt = sim.now;
+  }
+
+  s = usb.request.setup;
+  switch (usb.nStage)
+  {
+    case HOST_SETUP:
+      rc = sieOut(0, PID_SETUP, s, 8, 0);
+      if (rc == SIE_ACK)
+      {
+        usb.nToggle = 1;
+        usb.nStage = usb.nLength == 0 ? HOST_STATUS_IN : (s[0] & 0x80) ? HOST_DATA_IN : HOST_DATA_OUT;
+      }
+      break;
+    case HOST_DATA_IN:
+      rc = sieIn(0, data, &n, &dts);
+      if (rc == SIE_ACK)
+      {
+        if (dts != usb.nToggle) usbError("request %02X %02X: DATA%u in the data stage, expected DATA%u", s[0], s[1], dts, usb.nToggle);
+        usb.nToggle ^= 1;
+        if (usb.nReply + n > usb.nLength || usb.nReply + n > sizeof usb.reply)
+        {
+          usbError("request %02X %02X: more than wLength %u", s[0], s[1], usb.nLength);
+          n = 0;
+        }
+        memcpy(&usb.reply[usb.nReply], data, n);
+        usb.nReply = (uint16_t) (usb.nReply + n);
+        if (n < EP0_SIZE || usb.nReply >= usb.nLength)
+        {
+          usb.nStage = HOST_STATUS_OUT;      // A short packet (or wLength bytes) ends the data stage
+        }
+      }
+      break;
+    case HOST_DATA_OUT:
+      rc = sieOut(0, PID_OUT, usb.request.data, (uint8_t) (usb.nLength < 8 ? usb.nLength : 8), usb.nToggle);
+      if (rc == SIE_ACK)
+      {
+        usb.nStage = HOST_STATUS_IN;
+      }
+      break;
+    case HOST_STATUS_IN:
+      rc = sieIn(0, data, &n, &dts);
+      if (rc == SIE_ACK)
+      {
+        if (n || dts != 1) usbError("request %02X %02X: status stage of %u bytes, DATA%u", s[0], s[1], n, dts);
+        endControl(rc);
+        return;
+      }
+      break;
+    default:                                 // HOST_STATUS_OUT
+      rc = sieOut(0, PID_OUT, NULL, 0, 1);
+      if (rc == SIE_ACK)
+      {
+        endControl(rc);
+        return;
+      }
+      break;
+  }
+  if (rc == SIE_ACK)
+  {
+    usb.nStageAt = sim.now;
+  }
+  else if (rc == SIE_STALL || sim.now - usb.nStageAt >= CONTROL_TIMEOUT_US)
+  {
+    endControl(rc);
+  }
+}
+
+// The host: the keyboard and mouse endpoints
+
+static void pollIn(void)
+{
+  uint8_t data[64];
+  uint8_t n = 0;
+  uint8_t dts = 0;
+  int rc;
+
+  usb.bInDue = 0;
+  rc = sieIn(1, data, &n, &dts);
+  if (rc == SIE_STALL)
+  {
+    sim.nInStalls++;
+  }
+  if (rc != SIE_ACK) return;
+  if (dts != usb.nInToggle)                  // The host would take it for a repeat and drop it
+  {
+    usbError("EP1 IN: DATA%u, the host expected DATA%u", dts, usb.nInToggle);
+    return;
+  }
+  usb.nInToggle ^= 1;
+  memset(&data[n], 0, sizeof data - n);
+  if (sim.nIn < SIM_MAX_LOG)
+  {
+    sim.in[sim.nIn].at = sim.now;
+    memcpy(sim.in[sim.nIn].report, data, sizeof sim.in[0].report);
+    sim.nIn++;
+  }
+  if (!sim.pHost && n == 8 && data[2] != TELEMETRY_MARKER && // (keyboard drivers ignore vendor replies)
+      memchr(&data[2], 0x47, 6) && !memchr(&usb.lastIn[2], 0x47, 6))
+  {
+    sendLeds(sim.cHostLeds ^ 0x04);          // Scroll Lock pressed: the host toggles its Scroll Lock LED
+  }
+  memcpy(usb.lastIn, data, sizeof usb.lastIn);
+  if (sim.pHost) sim.pHost->in(data, n);
+}
+
+static void pollMouse(void)
+{
+  uint8_t data[64];
+  uint8_t n = 0;
+  uint8_t dts = 0;
+
+  usb.bMouseDue = 0;
+  if (sieIn(3, data, &n, &dts) != SIE_ACK) return;
+  if (dts != usb.nMouseToggle)
+  {
+    usbError("EP3 IN: DATA%u, the host expected DATA%u", dts, usb.nMouseToggle);
+    return;
+  }
+  usb.nMouseToggle ^= 1;
+  memset(&data[n], 0, sizeof data - n);
+  if (sim.nMouse < SIM_MAX_LOG)
+  {
+    sim.mouse[sim.nMouse].at = sim.now;
+    memcpy(sim.mouse[sim.nMouse].report, data, sizeof sim.mouse[0].report);
+    sim.nMouse++;
+  }
+}
+
+static void pollOut(void)
+{
+  int rc;
+
+  usb.bOutDue = 0;
+  if (host.nPendingHead == host.nPendingTail) return;
+  rc = sieOut(1, PID_OUT, host.pending[host.nPendingHead].data, host.pending[host.nPendingHead].len, usb.nOutToggle);
+  if (rc != SIE_ACK) return;                 // NAK: try again next interval
+  usb.nOutToggle ^= 1;
+  if (host.pending[host.nPendingHead].len == 1)
+  {
+    logEvent(sim.out, &sim.nOut, host.pending[host.nPendingHead].data[0]);
+  }
+  host.nPendingHead = (host.nPendingHead + 1) % PENDING;
+}
+
+static void attach(void)                     // USBEN has been set: the host sees the pull-up
+{
+  memset(&usb, 0, sizeof usb);
+  usb.bAttached = 1;
+  usb.nResetAt = sim.now + 10 * SIM_MS;      // ...and resets the bus
+  usb.bPingPong = (UCFG & 0x03) == 0x03;
+  if ((UCFG & ~0x03) != 0x14 || (UCFG & 0x03) == 0x01 || (UCFG & 0x03) == 0x02)
+  {
+    usbError("UCFG 0x%02X is not UPUEN, FSEN, PPB=00 or PPB=11", UCFG);
+  }
+  sim.nAttaches++;
+}
+
+static void detach(void)                     // USBEN has been cleared
+{
+  memset(&usb, 0, sizeof usb);               // (the reports and requests still to send stay queued)
+  URSTIF_bit = TRNIF_bit = 0;
+  updateUSBIF();
+}
+
+void sim_act(int action, uint8_t arg, const uint8_t *data, const uint8_t *setup)
+{
+  uint8_t command[TELEMETRY_REQUEST_SIZE];
+
+  switch (action)
+  {
+    case SIM_LED_REPORT:
+      sendLeds(arg);
+      break;
+    case SIM_TELEMETRY_READ:
+      memset(command, 0, sizeof command);
+      command[0] = TELEMETRY_CMD_READ;
+      command[1] = arg;
+      sendOutput(command, sizeof command);
+      break;
+    case SIM_VENDOR_COMMAND:
+      sendOutput(data, TELEMETRY_REQUEST_SIZE);
+      break;
+    case SIM_OUTPUT:
+      sendOutput(data, arg);
+      break;
+    case SIM_CONTROL:
+      queueControl(setup, data);
+      break;
+    case SIM_BUS_RESET:
+      if (usb.bAttached)
+      {
+        usb.bConfigured = 0;
+        usb.nResetAt = sim.now;
+      }
+      break;
+    case SIM_HOST_STALL:
+      usb.bStalled = 1;
+      break;
+    case SIM_HOST_UNSTALL:
+      usb.bStalled = 0;
+      break;
+    case SIM_SUSPEND:
+      usb.bSuspended = 1;
+      usb.nIdleAt = sim.now + 3 * SIM_MS;
+      break;
+    case SIM_RESUME:
+      usb.nResumeAt = sim.now;
+      break;
+    case SIM_HANG:
+      bHung = 1;
+      break;
+  }
+}
+
+static void doAction(size_t n)
+{
+  sim_act(actions[n].action, actions[n].arg, actions[n].data, actions[n].setup);
+}
+
+static void stepUSB(void)
+{
+  if (USBEN_bit && !usb.bAttached)
+  {
+    attach();
+  }
+  else if (!USBEN_bit && usb.bAttached)
+  {
+    detach();
+  }
+  if (!usb.bAttached) return;
+  if (!(OSCCON & 0x80)) return;              // SPLLEN: no 48 MHz USB clock without the PLL
+
+  if (usb.nResetAt && sim.now >= usb.nResetAt)
+  {
+    usb.nResetAt = 0;
+    usb.bConfigured = 0;
+    usb.bControl = 0;
+    usb.nScriptStep = 0;
+    usb.nAddress = 0;
+    usb.bRemoteWakeup = 0;
+    usb.bInDue = usb.bOutDue = usb.bMouseDue = 0;
+    UADDR = 0;                               // (the USB module clears it)
+    URSTIF_bit = 1;
+    usb.nEnumerateAt = sim.now + sim.nEnumerationMs * SIM_MS;
+  }
+  if (usb.nEnumerateAt && sim.now >= usb.nEnumerateAt)
+  {
+    usb.nEnumerateAt = 0;
+    usb.nScriptStep = 1;
+  }
+
+  if (usb.bSuspended)
+  {
+    if (usb.nIdleAt && sim.now >= usb.nIdleAt)
+    {
+      usb.nIdleAt = 0;
+      IDLEIF_bit = 1;
+    }
+    if (RESUME_bit && !usb.nResumeAt)        // Remote wakeup: the host takes over driving resume within
+    {                                        // 1 ms (USB 2.0 section 7.1.7.7), which the USB module sees as activity
+      if (!usb.bRemoteWakeup) usbError("resume signalled, but the host has not enabled remote wakeup");
+      usb.nResumeAt = sim.now + SIM_MS;
+      sim.nRemoteWakeups++;
+    }
+    if (usb.nResumeAt && sim.now >= usb.nResumeAt)
+    {
+      usb.nResumeAt = 0;
+      usb.bSuspended = 0;
+      ACTVIF_bit = 1;
+    }
+    return;
+  }
+
+  usb.nFrameUs += SIM_STEP_US;
+  if (usb.nFrameUs >= SIM_MS)
+  {
+    usb.nFrameUs -= SIM_MS;
+    usb.nFrame++;                            // Start of frame
+    UFRML = (uint8_t) usb.nFrame;
+    UFRMH = (uint8_t) (usb.nFrame >> 8) & 0x07;
+    if (usb.bConfigured)
+    {
+      usb.bInDue |= usb.nFrame % usb.nInInterval == 0 && !usb.bStalled && (!sim.pHost || sim.pHost->inReady());
+      usb.bOutDue |= usb.nFrame % usb.nOutInterval == 0;
+      usb.bMouseDue |= usb.nMouseInterval && usb.nFrame % usb.nMouseInterval == 0 && !sim.pHost;
+    }
+  }
+  if (TRNIF_bit) return;                     // One transaction at a time (the USTAT FIFO is not simulated)
+
+  if (usb.bInDue)                            // Interrupt endpoints first, as the host schedules them
+  {
+    pollIn();
+  }
+  else if (usb.bMouseDue)
+  {
+    pollMouse();
+  }
+  else if (usb.bOutDue)
+  {
+    pollOut();
+  }
+  else
+  {
+    stepControl();
+  }
+}
+
+static uint64_t fosc(void)                   // System clock (Hz) as selected by OSCCON.SCS
+{
+  return (OSCCON & 0x02) ? 16000000ULL : __FOSC__ * 1000ULL;
+}
+
+static void stepTimers(void)
+{
+  static const uint8_t prescale[4] = {1, 4, 16, 64};
+  uint64_t nRate = 0;
+  uint32_t nCounts;
+  uint32_t nPeriod;
+
+  if ((T2CON & 0x04) && !bSleeping)          // TMR2ON (Timer2 runs from Fosc/4, so not in Sleep)
+  {
+    nTimer2Acc += fosc() / 4 / prescale[T2CON & 0x03] * SIM_STEP_US;
+    nTimer2 += (uint32_t) (nTimer2Acc / 1000000);
+    nTimer2Acc %= 1000000;
+    nPeriod = (PR2 + 1U) * (((T2CON >> 3) & 0x0F) + 1U); // (PR2+1) x postscale
+    if (nTimer2 >= nPeriod)
+    {
+      nTimer2 %= nPeriod;
+      TMR2IF_bit = 1;
+    }
+  }
+  if (TMR1ON_bit)
+  {
+    nTimer1 = (uint16_t) (TMR1H << 8 | TMR1L); // (the firmware may have moved it on)
+    switch (T1CON >> 6)
+    {
+      case 0:                                // Fosc/4 with 1:8 prescale
+        nRate = bSleeping ? 0 : fosc() / 4 / 8;
+        break;
+      case 3:                                // LFINTOSC with 1:8 prescale (runs in Sleep)
+        nRate = 31000 / 8;
+        break;
+    }
+    nTimer1Acc += nRate * SIM_STEP_US;
+    nCounts = (uint32_t) (nTimer1Acc / 1000000);
+    nTimer1Acc %= 1000000;
+    if ((uint32_t) nTimer1 + nCounts > 0xFFFF)
+    {
+      TMR1IF_bit = 1;
+    }
+    nTimer1 = (uint16_t) (nTimer1 + nCounts);
+    TMR1H = (uint8_t) (nTimer1 >> 8);
+    TMR1L = (uint8_t) nTimer1;
+  }
+}
+
+static void resetSFRs(void)
+{
+  OSCCON = 0b00111100;                       // 500 kHz HFINTOSC, no PLL
+  T1CON = T2CON = 0;
+  PR2 = 0xFF;
+  TRISA = TRISC = 0xFF;                      // (LATA and LATC keep their values)
+  WDTCON = 0b00010110;                       // 2 s
+  PWM1CON = 0;
+  UCFG = UEP0 = UEP1 = UEP2 = UEP3 = UADDR = 0;
+  GIE_bit = PEIE_bit = 0;
+  TMR1ON_bit = TMR1IE_bit = TMR1IF_bit = TMR2IE_bit = TMR2IF_bit = 0;
+  USBEN_bit = USBIE_bit = PKTDIS_bit = 0;
+  URSTIE_bit = TRNIE_bit = IDLEIE_bit = ACTVIE_bit = ACTEN_bit = 0;
+  nTimer1Acc = nTimer1 = 0;
+  nTimer2Acc = nTimer2 = 0;
+  nWdtUs = 0;
+}
+
+// The firmware's variables (see the Makefile) get what they would on a PIC
+// at each reset: mikroC's start-up code sets the ones with initialisers, and
+// the rest keep whatever was in RAM. Here that is garbage that changes from
+// one reset to the next, so that a variable the firmware forgets to set does
+// not quietly start at 0. HAL_PERSISTENT variables are left alone.
+
+extern uint8_t __start_firmware_bss[] __attribute__((weak));
+extern uint8_t __stop_firmware_bss[] __attribute__((weak));
+extern uint8_t __start_firmware_data[] __attribute__((weak));
+extern uint8_t __stop_firmware_data[] __attribute__((weak));
+
+static void resetRam(void)
+{
+  static uint8_t initial[4096];              // The initialised variables as linked
+  static size_t nInitial = SIZE_MAX;
+  static uint32_t nGarbage = 0x2545F491;
+  uint8_t *p;
+
+  if (nInitial == SIZE_MAX)                  // (before the firmware first runs)
+  {
+    nInitial = (size_t) (__stop_firmware_data - __start_firmware_data);
+    if (nInitial > sizeof initial)
+    {
+      fprintf(stderr, "firmware_data is %zu bytes, more than resetRam() keeps\n", nInitial);
+      exit(2);
+    }
+    memcpy(initial, __start_firmware_data, nInitial);
+  }
+  memcpy(__start_firmware_data, initial, nInitial);
+  for (p = __start_firmware_bss; p < __stop_firmware_bss; p++)
+  {
+    nGarbage ^= nGarbage << 13;              // (xorshift32)
+    nGarbage ^= nGarbage >> 17;
+    nGarbage ^= nGarbage << 5;
+    *p = (uint8_t) nGarbage;
+  }
+  nLedDuty = (uint8_t) nGarbage;             // (hal_host.c holds it for the firmware)
+}
+
+static void watchdogReset(void)
+{
+  resetSFRs();
+  detach();                                  // The USB module is reset too, so the host sees a detach
+  PCON &= ~0x10;                             // RWDT=0
+  bHung = 0;
+  sim.nWatchdogResets++;
+  sim.nWatchdogResetAt = sim.now;
+  longjmp(simReset, 1);
+}
+
+static void watchLatc(void)
+{
+  uint8_t n = 0;
+  int i;
+
+  if (LATA4_bit)
+  {
+    sim.nLedPinHighUs += SIM_STEP_US;
+  }
+
+  for (i = 0; i < 8; i++)
+  {
+    if (LATC & (1 << i))
+    {
+      sim.nLatcHighUs[i] += SIM_STEP_US;
+      n++;
+    }
+  }
+  if (n > sim.nMostLatcHigh) sim.nMostLatcHigh = n;
+}
+
+static void step(void)
+{
+  sim.now += SIM_STEP_US;
+  if (sim.pHost) sim.pHost->step();
+  watchLatc();
+  while (nNextAction < nActions && actions[nNextAction].at <= sim.now)
+  {
+    doAction(nNextAction);
+    nNextAction++;
+  }
+  if (!bSleeping && (OSCCON & 0x02))
+  {
+    sim.nSlowClockUs += SIM_STEP_US;
+  }
+  stepTimers();
+  stepUSB();
+  updateUSBIF();
+  if (!bSleeping)                            // (CONFIG1 WDTE=10: the watchdog is off in Sleep)
+  {
+    nWdtUs += SIM_STEP_US;
+    if (nWdtUs >= SIM_MS << ((WDTCON >> 1) & 0x1F)) // WDTPS: 1 ms (LFINTOSC/32) x 2^WDTPS
+    {
+      watchdogReset();
+    }
+  }
+}
+
+static int interruptPending(void)
+{
+  return (TMR2IE_bit && TMR2IF_bit) || (TMR1IE_bit && TMR1IF_bit) || (USBIE_bit && USBIF_bit);
+}
+
+static void watchLed(void)
+{
+  uint8_t nDuty = (PWM1CON & 0xC0) == 0xC0 ? PWM1DCH : nLedDuty; // PWM1EN and PWM1OE (PWM1DCH/250 of each period)
+  uint8_t bLit = nDuty != 0;
+
+  if (sim.nLed == 0 ? bLit : bLit != sim.led[sim.nLed-1].value)
+  {
+    logEvent(sim.led, &sim.nLed, bLit);
+  }
+  if (sim.pHost && bLit != bHostLit)         // (sim.led stops at SIM_MAX_LOG events)
+  {
+    bHostLit = bLit;
+    sim.pHost->led(bLit);
+  }
+  if (sim.nDuty == 0 ? nDuty != 0 : nDuty != sim.duty[sim.nDuty-1].value)
+  {
+    logEvent(sim.duty, &sim.nDuty, nDuty);
+  }
+}
+
+static void deliverInterrupts(void)
+{
+  struct timespec t0, t1;
+  int i;
+
+  for (i = 0; i < 4 && GIE_bit && PEIE_bit && interruptPending(); i++)
+  {
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t0);
+    interrupt();
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t1);
+    sim.nIsrEntries++;
+    sim.nIsrEntriesCapsLock += (sim.cHostLeds & 0x02) != 0;
+    sim.nIsrNs += (uint64_t) ((t1.tv_sec - t0.tv_sec) * 1000000000LL + (t1.tv_nsec - t0.tv_nsec));
+    updateUSBIF();
+  }
+  watchLed();
+}
+
+// With sim.bPreempt set, the x86 trap flag stops main() after every
+// instruction and preempt() takes a step and delivers the interrupts that are
+// then pending, as if interrupt() could arrive at any instruction boundary.
+// The simulator itself runs with the flag clear (preemptOff() to preemptOn()).
+
+static int nSimDepth;                        // Simulator calls under way (main() is only stepped at 0)
+
+static void setTrapFlag(int bOn)
+{
+#if defined(__x86_64__)
+  if (bOn)                                   // (clear of the red zone below rsp, which the caller may be using)
+  {
+    __asm__ volatile ("lea -128(%%rsp), %%rsp\n\tpushfq\n\torq $0x100, (%%rsp)\n\tpopfq\n\tlea 128(%%rsp), %%rsp" ::: "memory", "cc");
+  }
+  else
+  {
+    __asm__ volatile ("lea -128(%%rsp), %%rsp\n\tpushfq\n\tandq $~0x100, (%%rsp)\n\tpopfq\n\tlea 128(%%rsp), %%rsp" ::: "memory", "cc");
+  }
+#endif
+}
+
+static void preempt(int nSignal)             // SIGTRAP: main() has run one more instruction
+{
+  sim.nPreemptions++;
+  nSimDepth++;                               // (the trap flag is clear until we return)
+  step();
+  deliverInterrupts();
+  nSimDepth--;
+}
+
+static void preemptOff(void)                 // Entering the simulator (which may call back into the firmware)
+{
+  if (sim.bPreempt && nSimDepth++ == 0) setTrapFlag(0);
+}
+
+static void preemptOn(void)                  // Leaving it
+{
+  if (sim.bPreempt && --nSimDepth == 0) setTrapFlag(1);
+}
+
+static void checkEnd(void)
+{
+  if (sim.now >= nEndUs)
+  {
+    longjmp(simExit, 1);
+  }
+}
+
+void host_idle(void)
+{
+  preemptOff();
+  watchLed();                                // (main() may have changed it)
+  step();
+  sim.nIdleUs += SIM_STEP_US;
+  deliverInterrupts();
+  checkEnd();
+  while (bHung)                              // Only interrupt() runs now, until the watchdog bites
+  {
+    step();
+    deliverInterrupts();
+    checkEnd();
+  }
+  preemptOn();
+}
+
+void host_spin(void)
+{
+  preemptOff();
+  watchLed();
+  step();
+  sim.nBlockedUs += SIM_STEP_US;
+  deliverInterrupts();
+  checkEnd();
+  preemptOn();
+}
+
+void host_sleep(void)
+{
+  uint8_t bGIE;
+
+  preemptOff();
+  watchLed();
+  bSleeping = 1;
+  while (!interruptPending())                // An enabled interrupt flag wakes the PIC (even with GIE=0)
+  {
+    step();
+    sim.nSleepUs += SIM_STEP_US;
+    if (sim.now >= nEndUs) break;
+  }
+  bSleeping = 0;
+  bGIE = GIE_bit;                            // The firmware sets GIE again as soon as the PLL has locked...
+  GIE_bit = 1;
+  deliverInterrupts();                       // ...so let interrupt() see whatever woke us now
+  GIE_bit = bGIE;
+  checkEnd();
+  preemptOn();
+}
+
+void host_clrwdt(void)
+{
+  nWdtUs = 0;
+}
+
+void host_trace_loop(void)
+{
+  sim.nLoops++;
+}
+
+void host_ppbrst(void)                       // UCON.PPBRST: every ping-pong pointer back to even
+{
+  preemptOff();
+  usb.nInOdd = usb.nOutOdd = usb.nMouseOdd = 0;
+  preemptOn();
+}
+
+void host_reset(void)                        // The RESET instruction
+{
+  preemptOff();
+  sim.nResets++;
+  sim.nResetAt = sim.now;
+  sim.bBootRequested = nBootRequest[0] == BOOT_REQUEST_MAGIC && nBootRequest[1] == (uint8_t) ~BOOT_REQUEST_MAGIC;
+  sim.bDetachedBeforeReset = !USBEN_bit;
+  resetSFRs();
+  detach();
+  PCON &= ~0x04;                             // RI=0
+  longjmp(simReset, 1);
+}
+
+void host_run_app(void)                      // The bootloader jumps to BOOT_APP_START
+{
+  sim.nAppStartedAt = sim.now;               // (the firmware is not simulated here)
+  longjmp(simExit, 1);
+}
+
+void host_flash_read_sfr(uint16_t address)   // PMADR, CFGS=0, RD=1
+{
+  PMDATH = (uint8_t) (hostFlash[address & 0x1FFF] >> 8);
+  PMDATL = (uint8_t) hostFlash[address & 0x1FFF];
+}
+
+void sim_program(uint16_t address, uint16_t word)
+{
+  size_t i;
+
+  if (!bFlashProgrammed)
+  {
+    for (i = 0; i < sizeof hostFlash / sizeof hostFlash[0]; i++)
+    {
+      hostFlash[i] = 0x3FFF;
+    }
+    bFlashProgrammed = 1;
+  }
+  hostFlash[address & 0x1FFF] = word & 0x3FFF;
+}
+
+uint16_t sim_flash(uint16_t address)
+{
+  return hostFlash[address & 0x1FFF];
+}
+
+static void flashStall(void)                 // The CPU stops while a row is erased or written
+{
+  uint64_t nUntil = sim.now + FLASH_STALL_US;
+
+  preemptOff();
+  while (sim.now < nUntil)
+  {
+    step();
+    sim.nBlockedUs += SIM_STEP_US;
+  }
+  preemptOn();
+}
+
+uint16_t FLASH_Read(uint16_t address)
+{
+  return hostFlash[address & 0x1FFF];
+}
+
+void FLASH_Erase(uint16_t address)
+{
+  uint16_t i;
+
+  for (i = 0; i < 32; i++)                   // One 32-word row
+  {
+    hostFlash[((address & ~31) + i) & 0x1FFF] = 0x3FFF;
+  }
+  sim.nFlashWrites++;
+  flashStall();
+}
+
+void FLASH_Write(uint16_t address, uint16_t *data)
+{
+  uint16_t i;
+
+  for (i = 0; i < 32; i++)                   // Programming can only clear bits
+  {
+    hostFlash[((address & ~31) + i) & 0x1FFF] &= data[i] & 0x3FFF;
+  }
+  flashStall();
+}
+
+void sim_run(uint64_t duration)
+{
+  struct sigaction action;
+  size_t i;
+
+  for (i = 0; !bFlashProgrammed && i < sizeof hostFlash / sizeof hostFlash[0]; i++)
+  {
+    hostFlash[i] = 0x3FFF;                   // A freshly programmed PIC
+  }
+  nEndUs = duration;
+  if (sim.bPreempt)
+  {
+    memset(&action, 0, sizeof action);
+    action.sa_handler = preempt;
+    action.sa_flags = SA_NODEFER;            // (the watchdog may longjmp() out of preempt())
+    sigaction(SIGTRAP, &action, NULL);
+  }
+  resetSFRs();
+  PCON = 0b00011100;                         // POR=0: a power-on reset
+  if (setjmp(simExit) == 0)
+  {
+    (void) setjmp(simReset);
+    nSimDepth = 1;                           // (a reset arrives here from the simulator, with the trap flag clear)
+    resetRam();
+    preemptOn();
+    firmware_main();                         // Never returns: checkEnd() jumps back here
+  }
+}
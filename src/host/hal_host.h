@@ -0,0 +1,104 @@
+/*
+  CAP! CapsLock Light
+  Copyright (C) 2017 Andrew J. Armstrong
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+  02111-1307  USA
+
+  Author:
+  Andrew J. Armstrong <androidarmstrong@gmail.com>
+
+*/
+
+/*
+  Host (Linux) implementation of the hardware abstraction layer.
+
+  Each PIC16F1455 register or register bit used by the firmware is a plain
+  variable here. The simulator in hal_host.c reads and writes them as the
+  real peripherals would, including the USB module's buffer descriptors,
+  which a simulated USB host reads and writes.
+*/
+#include <stdint.h>
+
+#define __FOSC__         48000   // Oscillator frequency in kHz (as mikroC defines it)
+
+#define Lo(param)        ((uint8_t *)&(param))[0]
+#define Hi(param)        ((uint8_t *)&(param))[1]
+
+#define BITFIELD         uint8_t
+
+#define CPU_SLEEP()      host_sleep()
+#define CPU_CLRWDT()     host_clrwdt()
+
+#define HAL_PERSISTENT   __attribute__((section("firmware_persistent"))) // Kept by a simulated reset (see resetRam())
+
+#define HAL_LINEAR(a)    (&hostUsbRam[(a) - 0x2000]) // Only the USB RAM is simulated
+extern uint8_t hostUsbRam[512];
+#define HAL_USB_RAM(size) extern uint8_t hostUsbRam[512] // (sized for all 512 bytes of USB RAM)
+
+#define HAL_USB_PPB_RESET() host_ppbrst()
+#define HAL_USB_RAM_BANK1(size) extern uint8_t hostUsbRam[512]
+
+#define HAL_BOOT_REQUEST extern uint8_t nBootRequest[2] // (hal_host.c looks at it when the PIC resets)
+#define HAL_LED_DUTY     extern uint8_t nLedDuty // (hal_host.c shows it as the LED's duty cycle when PWM1 is off)
+
+#define CPU_RESET()      host_reset()
+
+#define HAL_RUN_APP()    host_run_app()   // Ends the simulation: only one program runs at a time
+#define HAL_RUN_APP_INTERRUPT()           // (the bootloader never enables interrupts)
+#define HAL_FLASH_READ_SFR(address) host_flash_read_sfr(address)
+
+#define HAL_BARRIER()    __asm__ volatile ("" ::: "memory") // (gcc would move other writes past a volatile one)
+
+#define HAL_IDLE()       host_idle()
+#define HAL_SPIN()       host_spin()
+#define HAL_TRACE_LOOP() host_trace_loop()
+
+#define main             firmware_main // The simulator has its own main()
+
+void host_sleep(void);
+void host_clrwdt(void);
+void host_ppbrst(void);
+void host_reset(void);
+void host_run_app(void);
+void host_flash_read_sfr(uint16_t address);
+void host_idle(void);
+void host_spin(void);
+void host_trace_loop(void);
+
+void firmware_main(void);
+void interrupt(void);
+
+// Special function registers
+extern volatile uint8_t ANSELA, ANSELC, LATA, LATC, TRISA, TRISC;
+extern volatile uint8_t OSCCON, T1CON, T2CON, PR2, TMR1H, TMR1L;
+extern volatile uint8_t USTAT, UCFG, UFRMH, UFRML, UADDR, UEP0, UEP1, UEP2, UEP3;
+extern volatile uint8_t PCON, WDTCON, PMDATH, PMDATL;
+extern volatile uint8_t PWM1CON, PWM1DCH, PWM1DCL;
+
+// Special function register bits
+extern volatile uint8_t LATA4_bit;
+extern volatile uint8_t NOT_WPUEN_bit;
+extern volatile uint8_t HFIOFS_bit, PLLRDY_bit, ACTEN_bit, ACTSRC_bit;
+extern volatile uint8_t GIE_bit, PEIE_bit;
+extern volatile uint8_t TMR1ON_bit, TMR1IE_bit, TMR1IF_bit, TMR2IE_bit, TMR2IF_bit;
+extern volatile uint8_t USBIE_bit, USBIF_bit, USBEN_bit, PKTDIS_bit, PPBRST_bit, SUSPND_bit, RESUME_bit;
+extern volatile uint8_t URSTIE_bit, URSTIF_bit, IDLEIE_bit, IDLEIF_bit, ACTVIE_bit, ACTVIF_bit, TRNIE_bit, TRNIF_bit;
+
+// mikroC flash memory library
+uint16_t FLASH_Read(uint16_t address);
+void     FLASH_Erase(uint16_t address);
+void     FLASH_Write(uint16_t address, uint16_t *data);
+extern uint16_t hostFlash[0x2000];
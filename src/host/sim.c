@@ -0,0 +1,1401 @@
+/*
+  CAP! CapsLock Light
+  Copyright (C) 2017 Andrew J. Armstrong
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+  02111-1307  USA
+
+  Author:
+  Andrew J. Armstrong <androidarmstrong@gmail.com>
+
+*/
+
+/*
+  Scenarios for the Linux build of the firmware.
+
+  Usage: capslock-sim [scenario...]
+
+  Each scenario runs the firmware from power-on in a child process (so that
+  it starts with fresh globals, as it would after a reset) and prints what
+  the simulated host saw, followed by how the firmware spent its time.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "sim.h"
+#include "USBdsc.h"
+#include "telemetry.h"
+
+#define LED_CAPS_LOCK   0x02
+#define KEY_F24         0x73
+
+typedef struct
+{
+  const char *name;
+  const char *description;
+  void (*setup)(void);
+  void (*report)(void);
+  uint64_t duration;
+} t_scenario;
+
+static double ms(uint64_t us)
+{
+  return us / 1000.0;
+}
+
+static void reportTiming(void)
+{
+  double seconds = sim.now / (double) SIM_SECONDS;
+
+  printf("  main() loop iterations  %.1f/s\n", sim.nLoops / seconds);
+  printf("  waiting for events      %.1f%%\n", 100.0 * sim.nIdleUs / sim.now);
+  printf("  asleep                  %.1f%%\n", 100.0 * sim.nSleepUs / sim.now);
+  printf("  CPU at 48 MHz, 16 MHz   %.1f%%, %.1f%%\n",
+         100.0 * (sim.now - sim.nSleepUs - sim.nSlowClockUs) / sim.now, 100.0 * sim.nSlowClockUs / sim.now);
+  printf("  busy-waiting            %.1f ms in total\n", ms(sim.nBlockedUs));
+  printf("  interrupts              %.1f/s, %.2f us each on this machine\n",
+         sim.nIsrEntries / seconds, sim.nIsrEntries ? sim.nIsrNs / 1000.0 / sim.nIsrEntries : 0.0);
+}
+
+static uint64_t firstConfigured(uint64_t after)
+{
+  size_t i;
+
+  for (i = 0; i < sim.nConfigured; i++)
+  {
+    if (sim.configured[i].at >= after) return sim.configured[i].at;
+  }
+  return 0;
+}
+
+// Boot: power-on to configured
+
+static void setupBoot(void)
+{
+}
+
+static void reportBoot(void)
+{
+  uint64_t t = firstConfigured(0);
+
+  printf("  configured after        %.1f ms\n", ms(t));
+  printf("  IN reports              %zu\n", sim.nIn);
+  if (!t || t > 100 * SIM_MS) exit(1);
+}
+
+// LED: CapsLock LED follows the host
+
+static void setupLed(void)
+{
+  int i;
+
+  for (i = 0; i < 20; i++)
+  {
+    sim_schedule(2 * SIM_SECONDS + i * 250 * SIM_MS + (i * 37 % 11) * SIM_MS,
+                 SIM_LED_REPORT, i % 2 == 0 ? LED_CAPS_LOCK : 0);
+  }
+}
+
+static void reportLed(void)
+{
+  size_t i, j;
+  uint64_t worst = 0;
+  uint64_t total = 0;
+  size_t n = 0;
+  size_t changes = 0;
+  uint8_t was = 0;
+
+  for (i = 0; i < sim.nOut; i++)
+  {
+    uint8_t on = (sim.out[i].value & LED_CAPS_LOCK) != 0;
+    if (on == was) continue;                  // Only reports that change the LED can be timed
+    was = on;
+    changes++;
+    for (j = 0; j < sim.nLed; j++)
+    {
+      if (sim.led[j].at >= sim.out[i].at && sim.led[j].value == on)
+      {
+        uint64_t latency = sim.led[j].at - sim.out[i].at;
+        if (latency > worst) worst = latency;
+        total += latency;
+        n++;
+        break;
+      }
+    }
+  }
+  printf("  LED reports delivered   %zu, %zu changing the LED, LED followed %zu\n", sim.nOut, changes, n);
+  if (n)
+  {
+    printf("  OUT packet to LED       %.1f us mean, %.1f us worst (resolution %d us)\n",
+           (double) total / n, (double) worst, SIM_STEP_US);
+  }
+  if (n != changes || worst > SIM_MS) exit(1); // The LED missed a change, or took more than a tick
+}
+
+// Keepalive: keystrokes while the host is quiet, none after CapsLock is used
+
+static void setupKeepAlive(void)
+{
+  sim_schedule(150 * SIM_SECONDS, SIM_LED_REPORT, LED_CAPS_LOCK);
+  sim_schedule(151 * SIM_SECONDS, SIM_LED_REPORT, 0);
+}
+
+#define KEEPALIVE_SLACK  (50 * SIM_MS)       // Ticks and polls either way, and a Scroll Lock keepalive's four reports
+
+// Print each keepalive, and how long after the host was last active (which
+// restarts the keepalive interval) it came: the previous keepalive, an LED
+// report, being configured, or nRestart (a settings change, or 0). Returns
+// how many keepalives were not nInterval after that, and their number.
+static size_t printKeepAlives(uint64_t nInterval, uint64_t nRestart, size_t *pCount)
+{
+  size_t i;
+  size_t j;
+  size_t nWrong = 0;
+  uint64_t last = 0;
+  uint64_t since;
+  const char *pSince;
+
+  *pCount = 0;
+  for (i = 0; i < sim.nIn; i++)
+  {
+    if (sim.in[i].report[2] != 0 && sim.in[i].report[2] != TELEMETRY_MARKER &&
+        (last == 0 || sim.in[i].at - last > SIM_SECONDS))
+    {
+      since = last;
+      pSince = "the last keepalive";
+      for (j = 0; j < sim.nConfigured && sim.configured[j].at < sim.in[i].at; j++)
+      {
+        if (sim.configured[j].at > since) since = sim.configured[j].at, pSince = "being configured";
+      }
+      for (j = 0; j < sim.nOut && sim.out[j].at < sim.in[i].at; j++)
+      {
+        if (sim.out[j].at > since) since = sim.out[j].at, pSince = "an LED report";
+      }
+      if (nRestart < sim.in[i].at && nRestart > since) since = nRestart, pSince = "the settings change";
+      printf("  keepalive at            %8.3f s (+%.3f s after %s)\n", sim.in[i].at / (double) SIM_SECONDS,
+             (sim.in[i].at - since) / (double) SIM_SECONDS, pSince);
+      if (sim.in[i].at + KEEPALIVE_SLACK < since + nInterval || sim.in[i].at > since + nInterval + KEEPALIVE_SLACK) nWrong++;
+      last = sim.in[i].at;
+      (*pCount)++;
+    }
+  }
+  return nWrong;
+}
+
+static void reportKeepAlive(void)
+{
+  size_t nKeepAlives;
+  size_t nWrong;
+
+  nWrong = printKeepAlives(60 * SIM_SECONDS, 0, &nKeepAlives);
+  printf("  IN reports              %zu\n", sim.nIn);
+  printf("  LED reports from host   %zu\n", sim.nOut);
+  if (nWrong || nKeepAlives != 4) exit(1); // At 60 s and 120 s, then 60 s after CapsLock at 150 s and 151 s
+}
+
+// Reconnect: bus reset, then a host that stops polling
+
+static void setupReconnect(void)
+{
+  sim_schedule(10 * SIM_SECONDS, SIM_BUS_RESET, 0);
+  sim_schedule(65 * SIM_SECONDS, SIM_HOST_STALL, 0); // The keepalive due at 70 s cannot be sent
+  sim_schedule(85 * SIM_SECONDS, SIM_HOST_UNSTALL, 0);
+}
+
+static void reportReconnect(void)
+{
+  uint64_t t;
+
+  t = firstConfigured(10 * SIM_SECONDS);
+  printf("  after bus reset         configured %.1f ms later\n", t ? ms(t - 10 * SIM_SECONDS) : -1.0);
+  if (!t || t > 10 * SIM_SECONDS + 100 * SIM_MS) exit(1);
+  t = firstConfigured(65 * SIM_SECONDS);
+  printf("  after host stall        configured again at %.3f s (stall from 65 s)\n", t / (double) SIM_SECONDS);
+  printf("  attaches                %u\n", sim.nAttaches);
+  printf("  configurations          %zu\n", sim.nConfigured);
+  // The keepalive at 70 s goes unpolled for REPORT_STALL_MS (5 s), then the
+  // dongle backs off for USB_BACKOFF_MIN_MS (50 ms) and attaches again
+  if (!t || t > 75 * SIM_SECONDS + 250 * SIM_MS || sim.nAttaches != 2 || sim.nConfigured != 3) exit(1);
+}
+
+// Suspend: the bus is suspended for a minute
+
+static void setupSuspend(void)
+{
+  sim_schedule(5 * SIM_SECONDS, SIM_SUSPEND, 0);
+  sim_schedule(65 * SIM_SECONDS, SIM_RESUME, 0);
+  sim_schedule(66 * SIM_SECONDS, SIM_LED_REPORT, LED_CAPS_LOCK);
+}
+
+static void reportSuspend(void)
+{
+  size_t i;
+  size_t nSuspended = 0;
+  size_t nDark = 0;
+
+  for (i = 0; i < sim.nIn; i++)
+  {
+    if (sim.in[i].at > 5 * SIM_SECONDS && sim.in[i].at < 65 * SIM_SECONDS) nSuspended++;
+  }
+  for (i = 0; i < sim.nLed; i++)
+  {
+    if (sim.led[i].at > 5 * SIM_SECONDS && sim.led[i].at < 65 * SIM_SECONDS) nDark++;
+  }
+  printf("  remote wakeups          %u\n", sim.nRemoteWakeups);
+  printf("  IN reports while asleep %zu\n", nSuspended);
+  printf("  LED changes             %zu (%zu while asleep), last %s\n", sim.nLed, nDark,
+         sim.nLed && sim.led[sim.nLed-1].value ? "on" : "off");
+  // The host never enabled remote wakeup, so a keepalive due meanwhile waits
+  // for the resume (and its fade may light the LED briefly then)
+  if (sim.nRemoteWakeups || nSuspended || nDark || !sim.nLed || !sim.led[sim.nLed-1].value ||
+      sim.led[sim.nLed-1].at < 66 * SIM_SECONDS) exit(1);
+}
+
+// Telemetry: read the counters back after some activity
+
+static void setupTelemetry(void)
+{
+  int i;
+
+  for (i = 0; i < 10; i++)
+  {
+    sim_schedule(1 * SIM_SECONDS + i * 100 * SIM_MS, SIM_LED_REPORT, i % 2 == 0 ? LED_CAPS_LOCK : 0);
+  }
+  sim_schedule(5 * SIM_SECONDS, SIM_BUS_RESET, 0);
+  for (i = 0; i < TELEMETRY_CHUNKS; i++)
+  {
+    sim_schedule(75 * SIM_SECONDS + i * 20 * SIM_MS, SIM_TELEMETRY_READ, (uint8_t) i);
+  }
+}
+
+static int readTelemetry(t_telemetry *t)  // Returns the number of chunks the host received
+{
+  uint8_t block[TELEMETRY_CHUNKS * TELEMETRY_CHUNK_SIZE];
+  size_t i;
+  int chunks = 0;
+
+  memset(block, 0, sizeof block);
+  for (i = 0; i < sim.nIn; i++)
+  {
+    if (sim.in[i].report[2] == TELEMETRY_MARKER && sim.in[i].report[1] < TELEMETRY_CHUNKS)
+    {
+      memcpy(&block[sim.in[i].report[1] * TELEMETRY_CHUNK_SIZE], &sim.in[i].report[3], TELEMETRY_CHUNK_SIZE);
+      chunks++;
+    }
+  }
+  memcpy(t, block, sizeof *t);
+  return chunks;
+}
+
+static void reportTelemetry(void)
+{
+  t_telemetry t;
+  int n;
+  int chunks;
+  unsigned nLatencies = 0;
+  size_t nKeepAlives;
+
+  printKeepAlives(60 * SIM_SECONDS, 0, &nKeepAlives);
+  chunks = readTelemetry(&t);
+  printf("  chunks received         %d of %d\n", chunks, TELEMETRY_CHUNKS);
+  printf("  version                 %u\n", t.nVersion);
+  printf("  uptime                  %.3f s\n", t.nUptimeMillis / 1000.0);
+  printf("  attaches, bus resets    %u, %u\n", t.nAttaches, t.nBusResets);
+  printf("  keepalives, stalls      %u, %u\n", t.nKeepAlives, t.nStalls);
+  printf("  write busy              %u ms\n", t.nWriteBusyMillis);
+  printf("  warm starts             %u\n", t.nWarmStarts);
+  printf("  first LED report        %u ms after the last attach\n", t.nFirstLedMillis);
+  printf("  LED reports             %u, latency histogram", t.nLedReports);
+  for (n = 0; n < TELEMETRY_LATENCY_BUCKETS; n++)
+  {
+    printf(" %u", t.nLatency[n]);
+    nLatencies += t.nLatency[n];
+  }
+  printf("\n");
+  // The counters must agree with what the host saw: two enumerations (at
+  // power-on and the bus reset at 5 s) on one attach, and every LED report
+  // (the ten at 1 s, and those the host sends when it configures us)
+  if (chunks != TELEMETRY_CHUNKS || t.nVersion != TELEMETRY_VERSION || t.nAttaches != sim.nAttaches ||
+      t.nBusResets != 2 || t.nKeepAlives != nKeepAlives || t.nStalls || t.nWarmStarts ||
+      t.nLedReports != sim.nOut || nLatencies != t.nLedReports ||
+      t.nFirstLedMillis + 1 < ms(sim.out[0].at) || t.nFirstLedMillis > ms(sim.out[0].at) + 1 || // (attached at 0)
+      t.nUptimeMillis < 75000 || t.nUptimeMillis > 75010) exit(1); // (as chunk 0 was read, at 75 s)
+}
+
+// Idle: a host that never sends SET_IDLE gets the default repeat rate
+
+static void setupIdle(void)
+{
+  sim.nHostIdleRate = -1;
+}
+
+#define IDLE_DEFAULT_MS 500                  // HID_IDLE_DEFAULT (125 x 4 ms, see usb.h)
+
+static void reportIdle(void)
+{
+  size_t i;
+  size_t nWrong = 0;
+
+  for (i = 1; i < sim.nIn; i++)
+  {
+    if (sim.in[i].at - sim.in[i-1].at < (IDLE_DEFAULT_MS - 10) * SIM_MS ||
+        sim.in[i].at - sim.in[i-1].at > (IDLE_DEFAULT_MS + 10) * SIM_MS) nWrong++;
+  }
+  printf("  IN reports              %zu in %.0f s, %zu not %u ms apart\n", sim.nIn, sim.now / (double) SIM_SECONDS,
+         nWrong, IDLE_DEFAULT_MS);
+  if (nWrong || sim.nIn < 19) exit(1);
+}
+
+// Settings: the host changes the keepalive interval and payload
+
+static void setupSettings(void)
+{
+  static const uint8_t set[8] = {SETTINGS_CMD_SET, SETTINGS_ENABLED, 15, 0, KEEPALIVE_F24};
+  static const uint8_t get[8] = {SETTINGS_CMD_GET};
+
+  sim_command(1 * SIM_SECONDS, set);
+  sim_command(2 * SIM_SECONDS, set);         // Unchanged, so not written to flash again
+  sim_command(3 * SIM_SECONDS, get);
+}
+
+static void reportSettings(void)
+{
+  size_t i;
+  size_t nKeepAlives;
+  size_t nWrong;
+  size_t nReplies = 0;
+  size_t nBadReplies = 0;
+  size_t nF24 = 0;
+  int n;
+
+  nWrong = printKeepAlives(15 * SIM_SECONDS, 2 * SIM_SECONDS, &nKeepAlives);
+  for (i = 0; i < sim.nIn; i++)
+  {
+    if (sim.in[i].report[1] == SETTINGS_TAG && sim.in[i].report[2] == TELEMETRY_MARKER)
+    {
+      printf("  settings reply at       %.3f s: flags %u, interval %u s, payload %u, brightness %u\n",
+             sim.in[i].at / (double) SIM_SECONDS, sim.in[i].report[3],
+             sim.in[i].report[4] | sim.in[i].report[5] << 8, sim.in[i].report[6], sim.in[i].report[7]);
+      nReplies++;
+      if (sim.in[i].report[3] != SETTINGS_ENABLED || sim.in[i].report[4] != 15 || sim.in[i].report[5] != 0 ||
+          sim.in[i].report[6] != KEEPALIVE_F24) nBadReplies++;
+    }
+    else if (sim.in[i].report[2] == KEY_F24)
+    {
+      nF24++;
+    }
+  }
+  printf("  flash rows written      %u\n", sim.nFlashWrites);
+  printf("  HEF                    ");
+  for (n = 0; n < 7; n++)
+  {
+    printf(" %04X", sim_flash(0x1F80 + n));
+  }
+  printf("\n");
+  // Every keepalive 15 s apart and sending F24, each command answered with
+  // the new settings, and only the first (changing) one written to flash
+  if (nWrong || nKeepAlives != 4 || nF24 != nKeepAlives || nReplies != 3 || nBadReplies ||
+      sim.nFlashWrites != 1 || sim_flash(0x1F80 + 2) != 15 || sim_flash(0x1F80 + 4) != KEEPALIVE_F24) exit(1);
+}
+
+// Fade: the keepalive fades the LED, and the host dims it
+
+static void setupFade(void)
+{
+  static const uint8_t every5s[8] = {SETTINGS_CMD_SET, SETTINGS_ENABLED, 5, 0, KEEPALIVE_F24};
+  static const uint8_t dim[8] = {SETTINGS_CMD_SET, SETTINGS_ENABLED, 5, 0, KEEPALIVE_F24, 8};
+
+  sim_schedule(1 * SIM_SECONDS, SIM_LED_REPORT, LED_CAPS_LOCK);
+  sim_command(2 * SIM_SECONDS, every5s);     // A keepalive at 7 s
+  sim_command(8 * SIM_SECONDS, dim);          // (which restarts the interval: the next is at 13 s)
+  sim_schedule(15 * SIM_SECONDS, SIM_LED_REPORT, 0);
+}
+
+#define FADE_BRIGHTNESS  20                  // LED_BRIGHTNESS, until the host dims it to 8 at 8 s
+
+extern const uint8_t ledGamma[];             // Duty for each brightness level (capslock.c)
+
+static uint8_t dutyAt(uint64_t at)          // PWM1DCH at a given time
+{
+  uint8_t nDuty = 0;
+  size_t i;
+
+  for (i = 0; i < sim.nDuty && sim.duty[i].at <= at; i++)
+  {
+    nDuty = sim.duty[i].value;
+  }
+  return nDuty;
+}
+
+static void reportFade(void)
+{
+  static const uint64_t from[] = {7 * SIM_SECONDS, 13 * SIM_SECONDS};
+  static const uint8_t level[] = {FADE_BRIGHTNESS, 8};
+  size_t i, j;
+  size_t nSteps;
+  size_t nWrong = 0;
+  uint64_t nStart, nEnd;
+  uint8_t nLowest;
+
+  printf("  CapsLock on             duty %u/250 at the default brightness\n", dutyAt(6 * SIM_SECONDS));
+  for (i = 0; i < sizeof from / sizeof from[0]; i++)
+  {
+    nSteps = 0;
+    nStart = nEnd = 0;
+    nLowest = 250;
+    for (j = 0; j < sim.nDuty; j++)
+    {
+      if (sim.duty[j].at < from[i] || sim.duty[j].at >= from[i] + SIM_SECONDS) continue;
+      if (nSteps == 0) nStart = sim.duty[j].at;
+      nEnd = sim.duty[j].at;
+      if (sim.duty[j].value < nLowest) nLowest = sim.duty[j].value;
+      nSteps++;
+    }
+    printf("  keepalive fade at       %.3f s: %zu steps over %.0f ms, down to %u/250, back to %u/250\n",
+           nStart / (double) SIM_SECONDS, nSteps, ms(nEnd - nStart), nLowest, dutyAt(from[i] + SIM_SECONDS));
+    // One level a millisecond down to off and back, about 4 ms after the keepalive
+    if (nSteps != 2u * level[i] || nStart > from[i] + 10 * SIM_MS || nLowest != 0 ||
+        dutyAt(from[i] + SIM_SECONDS) != ledGamma[level[i]]) nWrong++;
+  }
+  printf("  CapsLock off            duty %u/250\n", dutyAt(16 * SIM_SECONDS));
+  if (nWrong || dutyAt(6 * SIM_SECONDS) != ledGamma[FADE_BRIGHTNESS] || dutyAt(16 * SIM_SECONDS) != 0) exit(1);
+}
+
+// Tickless: interrupt() stops its 1 ms tick between keepalives, so each
+// keepalive takes a Timer1 overflow every 131 ms rather than 60,000 ticks,
+// and must still fade the LED within a millisecond of when it is due. The LED
+// stays at its default brightness: on RA4 the tick keeps running while
+// CapsLock is on, as the tick is what dims it (see capslock.h)
+
+#define TICKLESS_INTERVAL  (60 * SIM_SECONDS)
+
+static void setupTickless(void)
+{
+  static const uint8_t f24[8] = {SETTINGS_CMD_SET, SETTINGS_ENABLED, TICKLESS_INTERVAL / SIM_SECONDS, 0, KEEPALIVE_F24};
+
+  sim_command(1 * SIM_SECONDS, f24);         // (no Scroll Lock, so no LED reports from the host)
+  sim_schedule(2 * SIM_SECONDS, SIM_LED_REPORT, LED_CAPS_LOCK); // A keepalive at 62 s...
+  sim_schedule(100 * SIM_SECONDS, SIM_LED_REPORT, 0);           // ...and one at 160 s, not 122 s
+}
+
+static uint64_t fadeAfter(uint64_t at)       // When the LED next changed brightness
+{
+  size_t i;
+
+  for (i = 0; i < sim.nDuty; i++)
+  {
+    if (sim.duty[i].at >= at) return sim.duty[i].at;
+  }
+  return 0;
+}
+
+static void reportTickless(void)
+{
+  uint64_t due[2];
+  uint64_t at;
+  uint64_t nCapsLockUs;
+  double nOff;
+  double nWorst = 0;
+  double nCapsLock;
+  double nOther;
+  size_t i;
+
+  if (sim.nOut < 2) exit(1);
+  due[0] = sim.out[sim.nOut-2].at + TICKLESS_INTERVAL;
+  due[1] = sim.out[sim.nOut-1].at + TICKLESS_INTERVAL;
+  for (i = 0; i < 2; i++)
+  {
+    at = fadeAfter(due[i] - 50 * SIM_MS);     // (the fade starts at once: no LED report is near)
+    nOff = at ? ms(at) - ms(due[i]) : 1e9;
+    printf("  keepalive due at        %.3f s, faded at %.3f s (%+.1f ms)\n",
+           due[i] / (double) SIM_SECONDS, at / (double) SIM_SECONDS, nOff);
+    if (nOff < 0) nOff = -nOff;
+    if (nOff > nWorst) nWorst = nOff;
+  }
+  nCapsLockUs = sim.out[sim.nOut-1].at - sim.out[sim.nOut-2].at;
+  nCapsLock = sim.nIsrEntriesCapsLock * (double) TICKLESS_INTERVAL / nCapsLockUs;
+  nOther = (sim.nIsrEntries - sim.nIsrEntriesCapsLock) * (double) TICKLESS_INTERVAL / (sim.now - nCapsLockUs);
+  printf("  interrupts per interval %.0f with CapsLock on, %.0f with it off (60000 ticks without tickless)\n",
+         nCapsLock, nOther);
+  if (nWorst > 1.0) exit(1);                 // Not within a millisecond
+  if (nOther > 1000) exit(1);                // The tick did not stop
+#if LED_PWM1
+  if (nCapsLock > 1000) exit(1);             // (PWM1 dims the LED without the tick)
+#endif
+}
+
+// Type: the host has the dongle type each of its strings, one with CapsLock on
+
+#define TYPE_CAPS_LOCK_AT  (3 * SIM_SECONDS)  // CapsLock goes on then
+
+static const struct
+{
+  uint64_t at;
+  uint8_t  nString;
+  uint8_t  bMeasure;                         // Count it in the throughput (not just a check of the text)
+} typing[] =
+{
+  {1 * SIM_SECONDS, 0, 1},
+  {2 * SIM_SECONDS, 2, 0},                   // Shift must not stay down for Tab or Enter
+  {4 * SIM_SECONDS, 1, 1},                   // (with CapsLock on)
+};
+
+extern const char textStrings[];
+
+static void setupType(void)
+{
+  static uint8_t type[sizeof typing / sizeof typing[0]][8];
+  size_t i;
+
+  for (i = 0; i < sizeof typing / sizeof typing[0]; i++)
+  {
+    type[i][0] = TEXT_CMD_TYPE;
+    type[i][1] = typing[i].nString;
+    sim_command(typing[i].at, type[i]);
+  }
+  sim_schedule(TYPE_CAPS_LOCK_AT, SIM_LED_REPORT, LED_CAPS_LOCK);
+}
+
+static char typed(uint8_t usage, int bShift, int bCapsLock) // The character a US keyboard types (0 = none)
+{
+  static const char plain[]   = "1234567890\n\0\0\t -=[]\\\0;'`,./";  // Usages 0x1E to 0x38
+  static const char shifted[] = "!@#$%^&*()\0\0\0\0 _+{}|\0:\"~<>?";  // (Shift+Enter and back-tab are not text)
+
+  if (usage >= 0x04 && usage <= 0x1D)        // A to Z
+  {
+    return (bShift != bCapsLock ? 'A' : 'a') + usage - 0x04;
+  }
+  if (usage >= 0x1E && usage <= 0x38)
+  {
+    return (bShift ? shifted : plain)[usage - 0x1E];
+  }
+  return 0;
+}
+
+static int capsLockAt(uint64_t at)           // Was CapsLock on at the host then?
+{
+  size_t i;
+  int bOn = 0;
+
+  for (i = 0; i < sim.nOut && sim.out[i].at <= at; i++)
+  {
+    bOn = (sim.out[i].value & LED_CAPS_LOCK) != 0;
+  }
+  return bOn;
+}
+
+static const char *textString(int n)        // TEXT_STRINGS string n
+{
+  const char *pString = textStrings;
+
+  while (n--)
+  {
+    pString += strlen(pString) + 1;
+  }
+  return pString;
+}
+
+static void printText(const char *pText)     // Print typed text with Tab and Enter visible
+{
+  for (; *pText; pText++)
+  {
+    if (*pText == '\t') printf("\\t");
+    else if (*pText == '\n') printf("\\n");
+    else putchar(*pText);
+  }
+}
+
+static void reportType(void)
+{
+  const char *pString;
+  const uint8_t *pLast;
+  const uint8_t *r;
+  static const uint8_t none[8];
+  char text[256];
+  char c;
+  size_t nText;
+  size_t nReports;
+  size_t i;
+  size_t t;
+  int n;
+  int j;
+  int k;
+  int bFailed = 0;
+  double nPerReport;
+  double nWorst = 1e9;
+  uint64_t done;
+
+  for (t = 0; t < sizeof typing / sizeof typing[0]; t++)
+  {
+    n = typing[t].nString;
+    pString = textString(n);
+    nText = 0;
+    nReports = 0;
+    done = 0;
+    pLast = none;
+    for (i = 0; i < sim.nIn && !done; i++)   // Decode the reports as Linux does: keys go down in array order
+    {
+      r = sim.in[i].report;
+      if (sim.in[i].at < typing[t].at) continue;
+      if (r[2] == TELEMETRY_MARKER)
+      {
+        if (r[1] == TEXT_TAG && r[3] == n)
+        {
+          done = sim.in[i].at;
+          printf("  string %d reply at       %.3f s: %u characters in %u reports\n", n,
+                 done / (double) SIM_SECONDS, r[4] | r[5] << 8, r[6] | r[7] << 8);
+          if ((size_t) (r[4] | r[5] << 8) != strlen(pString) || (size_t) (r[6] | r[7] << 8) != nReports)
+          {
+            bFailed = 1;                     // The reply does not agree with what the host saw
+          }
+        }
+        continue;
+      }
+      nReports++;
+      for (j = 2; j < 8; j++)
+      {
+        if (!r[j]) continue;
+        for (k = 2; k < 8 && pLast[k] != r[j]; k++);
+        if (k < 8) continue;                 // Still held down from the last report
+        c = typed(r[j], (r[0] & 0x22) != 0, capsLockAt(sim.in[i].at));
+        if (nText < sizeof text - 1)
+        {
+          text[nText++] = c ? c : '?';       // (a key that types no text)
+        }
+      }
+      pLast = r;
+    }
+    text[nText] = 0;
+    if (!done || strcmp(text, pString) != 0)
+    {
+      printf("  string %d typed as       \"", n);
+      printText(text);
+      printf("\", not \"");
+      printText(pString);
+      printf("\"\n");
+      bFailed = 1;
+      continue;
+    }
+    nPerReport = nText / (double) nReports;
+    printf("  string %d (CapsLock %-3s) %zu characters, %zu reports, %.1f ms: %.2f characters per report,"
+           " %.0f per second\n", n, capsLockAt(done) ? "on" : "off", nText, nReports, ms(done - typing[t].at),
+           nPerReport, nText / ((done - typing[t].at) / (double) SIM_SECONDS));
+    if (typing[t].bMeasure && nPerReport < nWorst) nWorst = nPerReport;
+  }
+  printf("  pressing and releasing each key would take 2 reports per character (%.0f characters per second)\n",
+         1000.0 / (2 * sim.nInIntervalMs));
+  if (bFailed || nWorst < 3 * 0.5) exit(1); // Not at least three times faster
+}
+
+// Indicators: NumLock and ScrollLock on RC2 and RC3
+
+#define LED_NUM_LOCK    0x01
+#define LED_SCROLL_LOCK 0x04
+#define INDICATOR_DUTY  25.0                 // Percent: NUMLOCK_SLOTS (and SCROLLLOCK_SLOTS) of INDICATOR_SLOTS
+
+static void setupIndicators(void)
+{
+  sim_schedule(1 * SIM_SECONDS, SIM_LED_REPORT, LED_NUM_LOCK | LED_CAPS_LOCK | LED_SCROLL_LOCK);
+  sim_schedule(3 * SIM_SECONDS, SIM_LED_REPORT, LED_NUM_LOCK);
+  sim_schedule(5 * SIM_SECONDS, SIM_LED_REPORT, 0);
+}
+
+static void reportIndicators(void)
+{
+  double nNumLock = 100.0 * sim.nLatcHighUs[2] / (4 * SIM_SECONDS);
+  double nScrollLock = 100.0 * sim.nLatcHighUs[3] / (2 * SIM_SECONDS);
+#if !LED_PWM1                                // (set on the make command line, see capslock.h)
+  uint8_t nDuty = sim.nDuty ? sim.duty[0].value : 0; // (CapsLock's first and only level)
+  double nPin;
+#endif
+
+  // NumLock is on for 4 s, and CapsLock and ScrollLock for 2 s, of the 6 s run
+  printf("  NumLock (RC2)           %.1f%% duty cycle while on\n", nNumLock);
+  printf("  ScrollLock (RC3)        %.1f%% duty cycle while on\n", nScrollLock);
+#if !LED_PWM1
+  nPin = 100.0 * sim.nLedPinHighUs / (2 * SIM_SECONDS);
+  printf("  CapsLock (RA4)          %.1f%% duty cycle while on (%.1f%% asked for)\n", nPin, nDuty / 2.5);
+  if (nPin < nDuty / 2.5 - 0.5 || nPin > nDuty / 2.5 + 0.5) exit(1); // The software PWM is off
+#endif
+  printf("  most lit at once        %u\n", sim.nMostLatcHigh);
+  printf("  LED changes (CapsLock)  %zu, last %s\n", sim.nLed,
+         sim.nLed && sim.led[sim.nLed-1].value ? "on" : "off");
+  if (nNumLock < INDICATOR_DUTY - 0.5 || nNumLock > INDICATOR_DUTY + 0.5 ||
+      nScrollLock < INDICATOR_DUTY - 0.5 || nScrollLock > INDICATOR_DUTY + 0.5 ||
+      sim.nMostLatcHigh > 1 || sim.nLed != 2 || sim.led[1].value) exit(1); // (never two LEDs' current at once)
+}
+
+// Polling: measure the polling period that the host granted
+
+static void setupPolling(void)
+{
+  static const uint8_t measure[8] = {POLL_CMD_MEASURE};
+
+  sim.bRoundInterval = 1;                    // As an xHCI host does
+  sim_command(1 * SIM_SECONDS, measure);
+  sim_command(2 * SIM_SECONDS, measure);
+}
+
+static void reportPolling(void)
+{
+  size_t i;
+  size_t nReplies = 0;
+  size_t nWrong = 0;
+  const uint8_t *r;
+
+  for (i = 0; i < sim.nIn; i++)
+  {
+    r = sim.in[i].report;
+    if (r[1] == POLL_TAG && r[2] == TELEMETRY_MARKER)
+    {
+      printf("  poll reply at           %.3f s: asked %u ms, min %u, max %u, mean %u ms over %u polls\n",
+             sim.in[i].at / (double) SIM_SECONDS, r[3], r[4], r[5], r[6], r[7]);
+      nReplies++;
+      if (r[4] != sim.nInIntervalMs || r[5] != sim.nInIntervalMs || r[6] != sim.nInIntervalMs ||
+          r[7] != POLL_SAMPLES || r[3] <= sim.nInIntervalMs) nWrong++; // (the host rounded 5 ms down to 4 ms)
+    }
+  }
+  printf("  host polled every       %u ms (IN), %u ms (OUT)\n", sim.nInIntervalMs, sim.nOutIntervalMs);
+  if (nReplies != 2 || nWrong) exit(1);
+}
+
+// Descriptors: check the descriptor lengths and report their footprint
+
+static void setupDescriptors(void)
+{
+}
+
+static void reportDescriptors(void)
+{
+  const t_dscFootprint *d;
+  const uint8_t *config = NULL;
+  unsigned nReport[3] = {0, 0, 0};           // The report descriptors of interfaces 0 to 2
+  unsigned nInterface = 0;
+  unsigned nRom = 0;
+  unsigned nRam = 0;
+  unsigned nTotal;
+  unsigned n;
+  int bOk = 1;
+
+  for (d = usbDscFootprint; d->name; d++)
+  {
+    printf("  %-22s  %3u bytes ROM, %u bytes RAM\n", d->name, d->nRom, d->nRam);
+    nRom += d->nRom;
+    nRam += d->nRam;
+    if (d->p && strcmp(d->name, "configuration") == 0) config = d->p;
+    if (d->p && strcmp(d->name, "report") == 0) nReport[0] = d->nRom;
+    if (d->p && strcmp(d->name, "vendor report") == 0) nReport[1] = d->nRom;
+    if (d->p && strcmp(d->name, "mouse report") == 0) nReport[2] = d->nRom;
+    if (d->p && !strstr(d->name, "report") && strcmp(d->name, "configuration") != 0 && d->p[0] != d->nRom)
+    {
+      printf("  %s: bLength %u is not its size\n", d->name, d->p[0]);
+      bOk = 0;
+    }
+  }
+  printf("  total                   %3u bytes ROM, %u bytes RAM\n", nRom, nRam);
+
+  nTotal = config[2] | config[3] << 8;       // Walk the configuration the way the host does
+  for (n = 0; n < nTotal && config[n] != 0; n += config[n])
+  {
+    if (config[n + 1] == 0x04)
+    {
+      nInterface = config[n + 2] < 3 ? config[n + 2] : 0;
+    }
+    if (config[n + 1] == 0x21 && (unsigned) (config[n + 7] | config[n + 8] << 8) != nReport[nInterface])
+    {
+      printf("  wDescriptorLength %u is not the size %u of interface %u's report descriptor\n",
+             config[n + 7] | config[n + 8] << 8, nReport[nInterface], nInterface);
+      bOk = 0;
+    }
+  }
+  for (d = usbDscFootprint; d->name && strcmp(d->name, "configuration") != 0; d++);
+  if (n != nTotal || nTotal != d->nRom)
+  {
+    printf("  wTotalLength %u does not match the descriptors (%u bytes, sizeof %u)\n", nTotal, n, d->nRom);
+    bOk = 0;
+  }
+  printf("  descriptor lengths      %s\n", bOk ? "consistent" : "INCONSISTENT");
+  if (!bOk) exit(1);
+}
+
+// Control: class and standard requests on endpoint 0 once configured
+
+static void request(uint64_t at, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+                    uint16_t wLength, const uint8_t *data)
+{
+  uint8_t setup[8] = {bmRequestType, bRequest, (uint8_t) wValue, (uint8_t) (wValue >> 8),
+                      (uint8_t) wIndex, (uint8_t) (wIndex >> 8), (uint8_t) wLength, (uint8_t) (wLength >> 8)};
+
+  sim_control(at, setup, data);
+}
+
+static void setupControl(void)
+{
+  static const uint8_t capsLock = LED_CAPS_LOCK;
+
+  sim.bLedOnConfigure = 0;
+  request(1000 * SIM_MS, 0x21, 0x09, 0x0200, 0, 1, &capsLock); // SET_REPORT(output): the LED report on endpoint 0
+  request(1100 * SIM_MS, 0xA1, 0x01, 0x0100, 0, 8, NULL);     // GET_REPORT(input)
+  request(1200 * SIM_MS, 0xA1, 0x02, 0, 0, 1, NULL);          // GET_IDLE
+  request(1300 * SIM_MS, 0xA1, 0x03, 0, 0, 1, NULL);          // GET_PROTOCOL
+  request(1400 * SIM_MS, 0x21, 0x0B, 0, 0, 0, NULL);          // SET_PROTOCOL(boot)
+  request(1500 * SIM_MS, 0xA1, 0x03, 0, 0, 1, NULL);          // GET_PROTOCOL
+  request(1600 * SIM_MS, 0x80, 0x08, 0, 0, 1, NULL);          // GET_CONFIGURATION
+  request(1700 * SIM_MS, 0x80, 0x00, 0, 0, 2, NULL);          // GET_STATUS(device)
+  request(1800 * SIM_MS, 0xC0, 0x42, 0, 0, 4, NULL);          // An unknown vendor request...
+  request(1900 * SIM_MS, 0x80, 0x00, 0, 0, 2, NULL);          // ...and endpoint 0 still works
+  request(2000 * SIM_MS, 0x02, 0x03, 0, 0x81, 0, NULL);       // SET_FEATURE(ENDPOINT_HALT) on EP1 IN
+  request(2100 * SIM_MS, 0x82, 0x00, 0, 0x81, 2, NULL);       // GET_STATUS(EP1 IN)
+  request(2500 * SIM_MS, 0x02, 0x01, 0, 0x81, 0, NULL);       // CLEAR_FEATURE(ENDPOINT_HALT)
+  request(2600 * SIM_MS, 0x82, 0x00, 0, 0x81, 2, NULL);
+#if MOUSE_INTERFACE
+  request(2700 * SIM_MS, 0x21, 0x0A, 0, USB_MOUSE_INTERFACE, 0, NULL); // SET_IDLE to the mouse, as Linux sends
+  request(2800 * SIM_MS, 0xA1, 0x01, 0x0100, USB_MOUSE_INTERFACE, 8, NULL); // GET_REPORT(input) from the mouse
+  request(2900 * SIM_MS, 0x82, 0x00, 0, EP3_IN_ADDRESS, 2, NULL); // GET_STATUS(EP3 IN)
+#endif
+  sim_schedule(3000 * SIM_MS, SIM_LED_REPORT, 0);             // The keyboard endpoints still work
+}
+
+static void reportControl(void)
+{
+  static const char *status[] = {"done", "stalled", "timed out"};
+  static const struct
+  {
+    uint8_t  nStatus;
+    uint16_t nReply;
+    uint8_t  reply[8];
+  } expected[] =                             // What each request in setupControl() should get, in order
+  {
+    {SIM_CONTROL_DONE,    0, {0}},           // SET_REPORT(output)
+    {SIM_CONTROL_DONE,    8, {0}},           // GET_REPORT(input): no keys down
+    {SIM_CONTROL_DONE,    1, {0}},           // GET_IDLE: the host never set one
+    {SIM_CONTROL_DONE,    1, {1}},           // GET_PROTOCOL: report
+    {SIM_CONTROL_DONE,    0, {0}},           // SET_PROTOCOL(boot)
+    {SIM_CONTROL_DONE,    1, {0}},           // GET_PROTOCOL: boot
+    {SIM_CONTROL_DONE,    1, {1}},           // GET_CONFIGURATION
+    {SIM_CONTROL_DONE,    2, {0, 0}},        // GET_STATUS(device)
+    {SIM_CONTROL_STALLED, 0, {0}},           // The unknown vendor request
+    {SIM_CONTROL_DONE,    2, {0, 0}},        // GET_STATUS(device)
+    {SIM_CONTROL_DONE,    0, {0}},           // SET_FEATURE(ENDPOINT_HALT)
+    {SIM_CONTROL_DONE,    2, {1, 0}},        // GET_STATUS(EP1 IN): halted
+    {SIM_CONTROL_DONE,    0, {0}},           // CLEAR_FEATURE(ENDPOINT_HALT)
+    {SIM_CONTROL_DONE,    2, {0, 0}},        // GET_STATUS(EP1 IN): running
+#if MOUSE_INTERFACE
+    {SIM_CONTROL_DONE,    0, {0}},           // SET_IDLE (mouse)
+    {SIM_CONTROL_DONE,    3, {0, 0, 0}},     // GET_REPORT(input) (mouse): no buttons, no movement
+    {SIM_CONTROL_DONE,    2, {0, 0}},        // GET_STATUS(EP3 IN)
+#endif
+  };
+  const t_simControl *c;
+  size_t nEnumeration = 0;
+  size_t nRequests = 0;
+  size_t nWrong = 0;
+  size_t i;
+  unsigned j;
+
+  for (i = 0; i < sim.nControls; i++)
+  {
+    c = &sim.control[i];
+    if (c->at < SIM_SECONDS)                 // (the enumeration)
+    {
+      nEnumeration++;
+      continue;
+    }
+    printf("  %02X %02X %02X%02X %02X%02X      %s", c->setup[0], c->setup[1], c->setup[3], c->setup[2],
+           c->setup[5], c->setup[4], status[c->nStatus]);
+    for (j = 0; j < c->nReply && j < sizeof c->reply; j++)
+    {
+      printf(" %02X", c->reply[j]);
+    }
+    printf("\n");
+    if (nRequests >= sizeof expected / sizeof expected[0] || c->nStatus != expected[nRequests].nStatus ||
+        c->nReply != expected[nRequests].nReply || memcmp(c->reply, expected[nRequests].reply, c->nReply) != 0)
+    {
+      nWrong++;
+    }
+    nRequests++;
+  }
+  printf("  enumeration requests    %zu\n", nEnumeration);
+  printf("  LED changes             %zu, last %s\n", sim.nLed, sim.nLed && sim.led[sim.nLed-1].value ? "on" : "off");
+  printf("  IN polls stalled        %u\n", sim.nInStalls);
+  printf("  LED reports on EP1 OUT  %zu\n", sim.nOut);
+  // The LED went on from endpoint 0 and off from EP1 OUT, and the IN
+  // endpoint was halted only between SET_ and CLEAR_FEATURE
+  if (nWrong || nRequests != sizeof expected / sizeof expected[0] || sim.nLed != 2 || sim.led[1].value ||
+      !sim.nInStalls || sim.nInStalls > 500u / sim.nInIntervalMs + 1 || sim.nOut != 1) exit(1);
+}
+
+// Feature: vendor commands as SET_REPORT(Feature) on endpoint 0 to the vendor
+// interface, with the replies read back by GET_REPORT(Feature) (see
+// telemetry.h)
+
+static void setFeature(uint64_t at, const uint8_t command[8])
+{
+  request(at, 0x21, 0x09, 0x0300, USB_VENDOR_INTERFACE, 8, command); // SET_REPORT(Feature)
+}
+
+static void getFeature(uint64_t at)
+{
+  request(at, 0xA1, 0x01, 0x0300, USB_VENDOR_INTERFACE, 8, NULL);    // GET_REPORT(Feature)
+}
+
+static void setupFeature(void)
+{
+  static const uint8_t read[8] = {TELEMETRY_CMD_READ, 0};
+  static const uint8_t readNone[8] = {TELEMETRY_CMD_READ, TELEMETRY_CHUNKS};
+  static const uint8_t get[8] = {SETTINGS_CMD_GET};
+  static const uint8_t measure[8] = {POLL_CMD_MEASURE};
+  static const uint8_t typeNone[8] = {TEXT_CMD_TYPE, 200};
+  static const uint8_t type[8] = {TEXT_CMD_TYPE, 1};
+  static const uint8_t bootNot[8] = {BOOT_CMD_ENTER, 'B', 'A', 'D'};
+
+  getFeature(1000 * SIM_MS);                 // Nothing yet
+  setFeature(1100 * SIM_MS, read);
+  getFeature(1200 * SIM_MS);
+  setFeature(1300 * SIM_MS, get);
+  getFeature(1400 * SIM_MS);
+  setFeature(1500 * SIM_MS, measure);        // The probes still go as input reports...
+  getFeature(2000 * SIM_MS);                 // ...but the result comes back here
+  setFeature(2100 * SIM_MS, typeNone);       // Ignored commands take no number...
+  setFeature(2200 * SIM_MS, bootNot);
+  setFeature(2300 * SIM_MS, readNone);
+  getFeature(2400 * SIM_MS);
+  setFeature(2500 * SIM_MS, read);           // ...so this is answered as the next one
+  getFeature(2600 * SIM_MS);
+  setFeature(2700 * SIM_MS, type);           // Answered once the text has been typed...
+  setFeature(2720 * SIM_MS, get);            // ...so this one is answered first
+  getFeature(2740 * SIM_MS);
+  getFeature(4000 * SIM_MS);
+  request(4100 * SIM_MS, 0xA1, 0x01, 0x0300, USB_KEYBOARD_INTERFACE, 8, NULL); // The keyboard has no feature report
+  sim_command(4500 * SIM_MS, get);           // A command on EP1 OUT is still answered on EP1 IN
+}
+
+static void reportFeature(void)
+{
+  static const char *status[] = {"done", "stalled", "timed out"};
+  static const struct
+  {
+    uint8_t nCommand;
+    uint8_t nTag;
+    uint8_t nMarker;
+  } expected[] =                             // What each GET_REPORT(Feature) in setupFeature() should get
+  {
+    {0, 0,            0},                    // (all zeros)
+    {1, 0,            TELEMETRY_MARKER},     // Chunk 0
+    {2, SETTINGS_TAG, TELEMETRY_MARKER},
+    {3, POLL_TAG,     TELEMETRY_MARKER},
+    {3, POLL_TAG,     TELEMETRY_MARKER},     // (the ignored commands changed nothing)
+    {4, 0,            TELEMETRY_MARKER},
+    {6, SETTINGS_TAG, TELEMETRY_MARKER},     // (sent while the text was being typed)
+    {5, TEXT_TAG,     TELEMETRY_MARKER},
+  };
+  const t_simControl *c;
+  size_t nReplies = 0;
+  size_t nWrong = 0;
+  size_t nProbes = 0;
+  size_t nOther = 0;
+  size_t nSettings = 0;
+  size_t nKeyboardStalls = 0;
+  size_t i;
+  unsigned j;
+
+  for (i = 0; i < sim.nControls; i++)
+  {
+    c = &sim.control[i];
+    if (c->at < SIM_SECONDS) continue;       // (the enumeration)
+    printf("  %02X %02X %02X%02X           %s", c->setup[0], c->setup[1], c->setup[3], c->setup[2],
+           status[c->nStatus]);
+    for (j = 0; j < c->nReply && j < sizeof c->reply; j++)
+    {
+      printf(" %02X", c->reply[j]);
+    }
+    printf("\n");
+    if (c->setup[4] == USB_KEYBOARD_INTERFACE)
+    {
+      nKeyboardStalls += c->nStatus == SIM_CONTROL_STALLED;
+      continue;
+    }
+    if (c->nStatus != SIM_CONTROL_DONE) nWrong++;
+    if (c->setup[0] != 0xA1) continue;
+    if (nReplies >= sizeof expected / sizeof expected[0] || c->nReply != 8 ||
+        c->reply[0] != expected[nReplies].nCommand || c->reply[1] != expected[nReplies].nTag ||
+        c->reply[2] != expected[nReplies].nMarker)
+    {
+      nWrong++;
+    }
+    else if ((c->reply[1] == 0 && c->reply[2] && c->reply[3] != TELEMETRY_VERSION) ||
+             (c->reply[1] == POLL_TAG && c->reply[7] != POLL_SAMPLES) ||
+             (c->reply[1] == TEXT_TAG && (c->reply[3] != 1 || c->reply[4] + (c->reply[5] << 8) != (int) strlen(textString(1)))))
+    {
+      nWrong++;
+    }
+    nReplies++;
+  }
+  for (i = 0; i < sim.nIn; i++)
+  {
+    if (sim.in[i].report[2] != TELEMETRY_MARKER) continue;
+    if (sim.in[i].report[1] == POLL_PROBE_TAG)
+    {
+      nProbes++;
+    }
+    else if (sim.in[i].report[1] == SETTINGS_TAG && sim.in[i].at >= 4500 * SIM_MS)
+    {
+      nSettings++;
+    }
+    else
+    {
+      nOther++;
+    }
+  }
+  printf("  feature replies read    %zu, %zu wrong\n", nReplies, nWrong);
+  printf("  keyboard interface      %s\n", nKeyboardStalls == 1 ? "stalled GET_REPORT(Feature)" : "ANSWERED GET_REPORT(Feature)");
+  printf("  input reports           %zu probes, %zu settings reply, %zu others\n", nProbes, nSettings, nOther);
+  if (nWrong || nReplies != sizeof expected / sizeof expected[0] || nProbes != POLL_SAMPLES + 1 || nSettings != 1 ||
+      nOther || nKeyboardStalls != 1) exit(1);
+}
+
+#if REMOTE_WAKEUP
+// Wakeup: the keepalive wakes a suspended host only once the host has
+// allowed it to (the simulated host fails the scenario otherwise)
+
+static void setupWakeup(void)
+{
+  static const uint8_t every5s[8] = {SETTINGS_CMD_SET, SETTINGS_ENABLED, 5, 0, KEEPALIVE_F24};
+
+  sim_command(1 * SIM_SECONDS, every5s);     // A keepalive at 6 s...
+  sim_schedule(3 * SIM_SECONDS, SIM_SUSPEND, 0); // ...while the host has not enabled remote wakeup
+  sim_schedule(20 * SIM_SECONDS, SIM_RESUME, 0); // (so it is pressed now, and the next is due at 25 s)
+  request(21 * SIM_SECONDS, 0x00, 0x03, 1, 0, 0, NULL); // SET_FEATURE(DEVICE_REMOTE_WAKEUP), as Linux sends before suspending
+  sim_schedule(22 * SIM_SECONDS, SIM_SUSPEND, 0); // The keepalive at 25 s wakes the host
+}
+
+static void reportWakeup(void)
+{
+  size_t i;
+  size_t nWoken = 0;
+
+  for (i = 0; i < sim.nIn; i++)
+  {
+    if (sim.in[i].report[2] == KEY_F24)
+    {
+      printf("  keepalive at            %.3f s\n", sim.in[i].at / (double) SIM_SECONDS);
+      if (sim.in[i].at > 22 * SIM_SECONDS) nWoken++;
+    }
+  }
+  printf("  remote wakeups          %u\n", sim.nRemoteWakeups);
+  if (sim.nRemoteWakeups != 1 || !nWoken) exit(1); // (Timer1 only roughly keeps time while the PIC sleeps)
+}
+#endif
+
+#if MOUSE_INTERFACE
+// Mouse: the host chooses the mouse keepalive, which only ever sends a
+// zero-movement report on EP3 IN
+
+static void setupMouse(void)
+{
+  static const uint8_t every5s[8] = {SETTINGS_CMD_SET, SETTINGS_ENABLED, 5, 0, KEEPALIVE_MOUSE};
+
+  sim_command(1 * SIM_SECONDS, every5s);     // Keepalives at 6, 11, 16 and 21 s
+}
+
+static void reportMouse(void)
+{
+  size_t i;
+  size_t n;
+  size_t nKeys = 0;
+  size_t nWrong = 0;
+  uint64_t last = 1 * SIM_SECONDS;
+
+  for (i = 0; i < sim.nMouse; i++)
+  {
+    printf("  mouse report at         %8.3f s (+%.3f s):", sim.mouse[i].at / (double) SIM_SECONDS,
+           (sim.mouse[i].at - last) / (double) SIM_SECONDS);
+    for (n = 0; n < HID_MOUSE_REPORT_SIZE; n++)
+    {
+      printf(" %02X", sim.mouse[i].report[n]);
+      if (sim.mouse[i].report[n]) nWrong++;
+    }
+    printf("\n");
+    if (sim.mouse[i].at + KEEPALIVE_SLACK < last + 5 * SIM_SECONDS || sim.mouse[i].at > last + 5 * SIM_SECONDS + KEEPALIVE_SLACK) nWrong++;
+    last = sim.mouse[i].at;
+  }
+  for (i = 0; i < sim.nIn; i++)
+  {
+    if (sim.in[i].report[2] != 0 && sim.in[i].report[2] != TELEMETRY_MARKER) nKeys++;
+  }
+  printf("  mouse polled every      %u ms\n", sim.nMouseIntervalMs);
+  printf("  keyboard reports        %zu with a key down\n", nKeys);
+  if (sim.nMouse != 4 || nWrong || nKeys) exit(1);
+}
+#endif
+
+// Bootloader: the host asks for the bootloader (which is not simulated here,
+// so the firmware starts again after the reset)
+
+static void setupBootloader(void)
+{
+  static const uint8_t wrong[TELEMETRY_REQUEST_SIZE] = {BOOT_CMD_ENTER, 'O', 'O', 'X'};
+  static const uint8_t enter[TELEMETRY_REQUEST_SIZE] = {BOOT_CMD_ENTER, 'O', 'O', 'T'};
+
+  sim_command(1 * SIM_SECONDS, wrong);
+  sim_command(2 * SIM_SECONDS, enter);
+}
+
+static void reportBootloader(void)
+{
+  uint64_t t = firstConfigured(sim.nResetAt);
+
+  printf("  RESET instructions      %u, at %.3f s (asked at 1 s and 2 s)\n", sim.nResets, sim.nResetAt / (double) SIM_SECONDS);
+  printf("  boot request set        %s\n", sim.bBootRequested ? "yes" : "no");
+  printf("  detached first          %s\n", sim.bDetachedBeforeReset ? "yes" : "no");
+  printf("  configured again        %.1f ms after the reset\n", t ? ms(t - sim.nResetAt) : -1.0);
+  if (sim.nResets != 1 || !sim.bBootRequested || !sim.bDetachedBeforeReset) exit(1);
+}
+
+// Watchdog: main() hangs with the CapsLock LED on
+
+static void setupWatchdog(void)
+{
+  int i;
+
+  sim_schedule(1 * SIM_SECONDS, SIM_LED_REPORT, LED_CAPS_LOCK);
+  sim_schedule(20 * SIM_SECONDS, SIM_HANG, 0);
+  for (i = 0; i < TELEMETRY_CHUNKS; i++)
+  {
+    sim_schedule(125 * SIM_SECONDS + i * 20 * SIM_MS, SIM_TELEMETRY_READ, (uint8_t) i);
+  }
+}
+
+static void reportWatchdog(void)
+{
+  t_telemetry t;
+  uint64_t t0 = sim.nWatchdogResetAt;
+  uint64_t t1;
+  size_t i;
+  size_t nLedChanges = 0;
+  size_t nKeepAlives;
+  size_t nWrong;
+  uint64_t nDark = 0;
+
+  t1 = firstConfigured(t0);
+  printf("  watchdog resets         %u, at %.3f s (hung at 20 s)\n", sim.nWatchdogResets, t0 / (double) SIM_SECONDS);
+  printf("  configured again        %.1f ms after the reset, %.1f ms after the hang\n",
+         t1 ? ms(t1 - t0) : -1.0, t1 ? ms(t1 - 20 * SIM_SECONDS) : -1.0);
+  for (i = 0; i < sim.nLed; i++)
+  {
+    if (sim.led[i].at >= 20 * SIM_SECONDS && sim.led[i].at <= t1) nLedChanges++;
+    if (i && !sim.led[i-1].value) nDark += sim.led[i].at - sim.led[i-1].at;
+  }
+  printf("  LED changes meanwhile   %zu (on since 1 s), dark for %.1f ms\n", nLedChanges, ms(nDark));
+  nWrong = printKeepAlives(60 * SIM_SECONDS, 0, &nKeepAlives);
+  readTelemetry(&t);
+  printf("  uptime, warm starts     %.3f s, %u\n", t.nUptimeMillis / 1000.0, t.nWarmStarts);
+  // Sub-second recovery. The LED may only blink while the reset makes its pin
+  // an input again, and the clock and keepalive carry on through the warm start
+  if (sim.nWatchdogResets != 1 || !t1 || t1 > 20 * SIM_SECONDS + 500 * SIM_MS || nDark > 10 * SIM_MS ||
+      !sim.nLed || !sim.led[sim.nLed-1].value || nWrong || nKeepAlives != 1 || t.nWarmStarts != 1 ||
+      t.nUptimeMillis < 125000 || t.nUptimeMillis > 125010) exit(1);
+}
+
+// Preempt: interrupt() runs after every instruction of main() while the host
+// keeps it busy, and nothing either of them hands the other may go missing
+
+#define PREEMPT_LEDS    30                   // LED reports, 150 ms apart from 1.5 s
+#define PREEMPT_READS   22                   // Reads of telemetry chunk 3 (nWriteBusyMillis and nLedReports)
+#define PREEMPT_CHUNK   3                    // (each after chunk 0, which takes the snapshot...
+#define PREEMPT_SNAPSHOT (40 * SIM_MS)       // ...and takes main() some 25 ms here, stepped as it is)
+
+static void setupPreempt(void)
+{
+  static const uint8_t every1s[8] = {SETTINGS_CMD_SET, SETTINGS_ENABLED, 1, 0, KEEPALIVE_F24};
+  static const uint8_t measure[8] = {POLL_CMD_MEASURE};
+  int i;
+
+  sim.bPreempt = 1;
+  sim_command(1 * SIM_SECONDS, every1s);
+  sim_command(6300 * SIM_MS, measure);
+  for (i = 0; i < PREEMPT_LEDS; i++)         // Each restarts the keepalive interval, so none is sent until 6.9 s
+  {
+    sim_schedule(1500 * SIM_MS + i * 150 * SIM_MS + (i * 37 % 11) * SIM_MS,
+                 SIM_LED_REPORT, i % 2 == 0 ? LED_CAPS_LOCK : 0);
+  }
+  for (i = 0; i < PREEMPT_READS; i++)
+  {
+    sim_schedule(1600 * SIM_MS - PREEMPT_SNAPSHOT + i * 200 * SIM_MS + (i * 13 % 7) * SIM_MS, SIM_TELEMETRY_READ, 0);
+    sim_schedule(1600 * SIM_MS + i * 200 * SIM_MS + (i * 13 % 7) * SIM_MS, SIM_TELEMETRY_READ, PREEMPT_CHUNK);
+  }
+  sim_schedule(9500 * SIM_MS - PREEMPT_SNAPSHOT, SIM_TELEMETRY_READ, 0);
+  sim_schedule(9500 * SIM_MS, SIM_TELEMETRY_READ, PREEMPT_CHUNK);
+}
+
+static void reportPreempt(void)
+{
+  size_t i, j;
+  size_t nReplies = 0;
+  size_t nSettings = 0;
+  size_t nPolls = 0;
+  size_t nKeepAlives = 0;
+  size_t nEarly = 0;
+  size_t nUnreleased = 0;
+  size_t nAhead = 0;
+  size_t nDelivered;
+  uint16_t nLedReports = 0;
+  uint16_t nLast = 0;
+  int bBackwards = 0;
+  uint64_t nLastLed = 0;
+
+  for (i = 0; i < sim.nOut; i++)
+  {
+    nLastLed = sim.out[i].at;
+  }
+  for (i = 0; i < sim.nIn; i++)
+  {
+    const uint8_t *r = sim.in[i].report;
+
+    if (r[2] == TELEMETRY_MARKER && r[1] == PREEMPT_CHUNK)
+    {
+      nReplies++;
+      nLedReports = (uint16_t) (r[6] | r[7] << 8);
+      if (nLedReports < nLast) bBackwards = 1;
+      nLast = nLedReports;
+      for (j = 0, nDelivered = 0; j < sim.nOut && sim.out[j].at <= sim.in[i].at; j++, nDelivered++);
+      if (nLedReports > nDelivered) nAhead++;
+    }
+    else if (r[2] == TELEMETRY_MARKER && r[1] == SETTINGS_TAG)
+    {
+      nSettings++;
+    }
+    else if (r[2] == TELEMETRY_MARKER && r[1] == POLL_TAG && r[7] == POLL_SAMPLES)
+    {
+      nPolls++;
+    }
+    else if (r[2] == KEY_F24)
+    {
+      nKeepAlives++;
+      if (sim.in[i].at < nLastLed + SIM_SECONDS) nEarly++;
+      if (i + 1 == sim.nIn || sim.in[i+1].report[2] != 0) nUnreleased++;
+    }
+  }
+  printf("  main() instructions     %llu, each followed by a step and any interrupts\n",
+         (unsigned long long) sim.nPreemptions);
+  printf("  LED reports             %zu sent, %u counted, LED %s (last sent %s)\n", sim.nOut, nLedReports,
+         sim.nLed && sim.led[sim.nLed-1].value ? "on" : "off",
+         sim.nOut && (sim.out[sim.nOut-1].value & LED_CAPS_LOCK) ? "on" : "off");
+  printf("  commands answered       %zu of %d reads, %zu of 1 settings, %zu of 1 polling\n",
+         nReplies, PREEMPT_READS + 1, nSettings, nPolls);
+  printf("  telemetry snapshots     %s, %zu ahead of the host\n", bBackwards ? "went backwards" : "in order", nAhead);
+  printf("  keepalives              %zu, %zu early, %zu without a release\n", nKeepAlives, nEarly, nUnreleased);
+  printf("  attaches, watchdog      %u, %u\n", sim.nAttaches, sim.nWatchdogResets);
+#if defined(__x86_64__)
+  if (nLedReports != sim.nOut || !sim.nLed || sim.led[sim.nLed-1].value != ((sim.out[sim.nOut-1].value & LED_CAPS_LOCK) != 0) ||
+      nReplies != PREEMPT_READS + 1 || nSettings != 1 || nPolls != 1 || bBackwards || nAhead ||
+      nKeepAlives < 3 || nEarly || nUnreleased || sim.nAttaches != 1 || sim.nWatchdogResets)
+  {
+    exit(1);
+  }
+#endif
+}
+
+static const t_scenario scenarios[] =
+{
+  {"boot",      "Power-on until the host has configured the device",  setupBoot,      reportBoot,      2 * SIM_SECONDS},
+  {"led",       "CapsLock LED follows LED reports from the host",     setupLed,       reportLed,       10 * SIM_SECONDS},
+  {"keepalive", "Keepalive on a quiet host",                         setupKeepAlive, reportKeepAlive, 300 * SIM_SECONDS},
+  {"reconnect", "Bus reset, then a host that stops polling", setupReconnect, reportReconnect, 90 * SIM_SECONDS},
+  {"suspend",   "Host suspends the bus for 60 s",                     setupSuspend,   reportSuspend,   70 * SIM_SECONDS},
+  {"idle",      "Host never sends SET_IDLE, so unchanged reports repeat", setupIdle, reportIdle,      10 * SIM_SECONDS},
+  {"settings",  "Host sets a 15 s interval and the F24 payload",      setupSettings,  reportSettings,  63 * SIM_SECONDS},
+  {"telemetry", "Read the telemetry counters after some activity",    setupTelemetry, reportTelemetry, 76 * SIM_SECONDS},
+  {"descriptors", "Descriptor lengths and footprint",                setupDescriptors, reportDescriptors, SIM_MS},
+  {"polling",   "Measure the polling period the host granted",        setupPolling,   reportPolling,   3 * SIM_SECONDS},
+  {"fade",      "Keepalive fades the LED, then the host dims it",     setupFade,      reportFade,      16 * SIM_SECONDS},
+  {"tickless",  "1 ms tick stops between keepalives, which stay on time", setupTickless, reportTickless, 165 * SIM_SECONDS},
+  {"type",      "Host has the dongle type its strings, six keys per report", setupType, reportType, 6 * SIM_SECONDS},
+  {"indicators", "NumLock and ScrollLock indicators share one LED's current", setupIndicators, reportIndicators, 6 * SIM_SECONDS},
+  {"control",   "Class and standard requests on endpoint 0",         setupControl,   reportControl,   4 * SIM_SECONDS},
+  {"feature",   "Vendor commands and replies as feature reports on endpoint 0", setupFeature, reportFeature, 5 * SIM_SECONDS},
+#if MOUSE_INTERFACE
+  {"mouse",     "Host chooses the mouse keepalive: zero-movement reports on EP3 IN", setupMouse, reportMouse, 23 * SIM_SECONDS},
+#endif
+#if REMOTE_WAKEUP
+  {"wakeup",    "Keepalive wakes a suspended host only once allowed", setupWakeup,    reportWakeup,    32 * SIM_SECONDS},
+#endif
+  {"bootloader", "Host asks for the bootloader",                     setupBootloader, reportBootloader, 3 * SIM_SECONDS},
+  {"watchdog",  "main() hangs, the watchdog resets the PIC",          setupWatchdog,  reportWatchdog,  126 * SIM_SECONDS},
+  {"preempt",   "interrupt() can run after any instruction of main()", setupPreempt,  reportPreempt,   10 * SIM_SECONDS},
+};
+
+#define SCENARIOS (sizeof scenarios / sizeof scenarios[0])
+
+static int runScenario(const t_scenario *s)
+{
+  pid_t pid;
+  int status;
+
+  printf("%s: %s\n", s->name, s->description);
+  fflush(stdout);
+  pid = fork();
+  if (pid == 0)
+  {
+    sim.nEnumerationMs = 15;
+    sim.bLedOnConfigure = 1;
+    sim.nHostIdleRate = 0;                   // As Linux, Windows and macOS do
+    s->setup();
+    sim_run(s->duration);
+    s->report();
+    reportTiming();
+    if (sim.nUsbErrors)
+    {
+      printf("  USB errors              %u: %s\n", sim.nUsbErrors, sim.usbError);
+    }
+    fflush(stdout);
+    _exit(sim.nUsbErrors != 0);
+  }
+  if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+  {
+    printf("  failed\n");
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  size_t i;
+  int n;
+  int rc = 0;
+
+  if (argc == 1)
+  {
+    for (i = 0; i < SCENARIOS; i++)
+    {
+      rc |= runScenario(&scenarios[i]);
+    }
+    return rc;
+  }
+  for (n = 1; n < argc; n++)
+  {
+    for (i = 0; i < SCENARIOS && strcmp(argv[n], scenarios[i].name) != 0; i++);
+    if (i == SCENARIOS)
+    {
+      fprintf(stderr, "Unknown scenario: %s\n", argv[n]);
+      return 2;
+    }
+    rc |= runScenario(&scenarios[i]);
+  }
+  return rc;
+}
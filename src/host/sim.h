@@ -0,0 +1,167 @@
+/*
+  CAP! CapsLock Light
+  Copyright (C) 2017 Andrew J. Armstrong
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+  02111-1307  USA
+
+  Author:
+  Andrew J. Armstrong <androidarmstrong@gmail.com>
+
+*/
+
+/*
+  Simulated PIC16F1455 and USB host used by the Linux build of the firmware.
+
+  A scenario schedules host actions (LED reports, bus resets, suspend...) with
+  sim_schedule() and then calls sim_run(), which runs the unmodified firmware
+  main() against a simulated clock until the scenario ends. Everything the
+  host sees, and how the firmware spent its time, is recorded in sim.
+
+  With sim.pHost set, a real USB host takes the simulated host's place (see
+  gadget.c): after the simulated host has reset the bus and set the address,
+  it makes every control request and sends every output report through
+  sim_act(), decides when EP1 IN is polled, and paces the simulated clock.
+*/
+#include <stdint.h>
+#include <stddef.h>
+
+#define SIM_STEP_US          100    // Resolution of the simulated clock
+#define SIM_MS               1000ULL
+#define SIM_SECONDS          1000000ULL
+
+#define SIM_MAX_ACTIONS      256
+#define SIM_MAX_LOG          4096
+
+enum
+{
+  SIM_LED_REPORT,                   // Host sends an LED output report (arg = LED bits)
+  SIM_BUS_RESET,                    // Host resets the bus (e.g. a dock switch) and re-enumerates
+  SIM_HOST_STALL,                   // Host stops polling the IN endpoint (e.g. a wedged hub)
+  SIM_HOST_UNSTALL,                 // Host polls the IN endpoint again
+  SIM_SUSPEND,                      // Host suspends the bus
+  SIM_RESUME,                       // Host resumes the bus
+  SIM_TELEMETRY_READ,               // Host asks for a telemetry chunk (arg = chunk number)
+  SIM_VENDOR_COMMAND,               // Host sends a vendor command (see sim_command)
+  SIM_HANG,                         // main() stops running (only interrupt() runs) until the watchdog resets the PIC
+  SIM_CONTROL,                      // Host makes a control request once configured (see sim_control)
+  SIM_OUTPUT                        // Host sends an output report of any length (see sim_output)
+};
+
+enum                                // How a control request ended
+{
+  SIM_CONTROL_DONE,
+  SIM_CONTROL_STALLED,
+  SIM_CONTROL_TIMED_OUT
+};
+
+typedef struct
+{
+  uint64_t at;                      // Simulated time (us)
+  uint8_t  report[8];
+} t_simReport;
+
+typedef struct
+{
+  uint64_t at;
+  uint8_t  value;
+} t_simEvent;
+
+typedef struct
+{
+  uint64_t at;                      // When the status stage completed
+  uint8_t  setup[8];
+  uint8_t  nStatus;                 // SIM_CONTROL_DONE...
+  uint16_t nReply;                  // Length of the IN data stage
+  uint8_t  reply[8];                // (its first 8 bytes)
+} t_simControl;
+
+typedef struct
+{
+  void (*step)(void);               // Every step (before the host's actions are taken)
+  int  (*inReady)(void);            // The host will poll EP1 IN this frame
+  void (*in)(const uint8_t *data, uint8_t n); // The host received an EP1 IN report
+  void (*control)(uint8_t nStatus, const uint8_t *reply, uint16_t nReply); // A request made with SIM_CONTROL ended
+  void (*led)(uint8_t bLit);        // The CapsLock LED went on or off
+} t_simHost;
+
+typedef struct
+{
+  uint64_t now;                     // Simulated time since power-on (us)
+  const t_simHost *pHost;           // A real host instead of the simulated one (or NULL)
+  uint32_t nEnumerationMs;          // How long the host takes to configure the device after a reset
+  uint8_t  bLedOnConfigure;         // Host sends the current LED state once configured (as Linux does)
+  uint8_t  cHostLeds;               // LED state the host last sent
+  int      nHostIdleRate;           // SET_IDLE duration the host sends when configuring (-1=none)
+  uint8_t  bRoundInterval;          // Host rounds bInterval down to a power of 2 (as xHCI does)
+  uint8_t  bPreempt;                // interrupt() may run after any instruction of main() (x86-64 only)
+
+  // What the host saw
+  t_simReport in[SIM_MAX_LOG];      // IN reports accepted by the host
+  size_t      nIn;
+  t_simReport mouse[SIM_MAX_LOG];   // EP3 IN reports accepted by the host (MOUSE_INTERFACE)
+  size_t      nMouse;
+  t_simEvent  out[SIM_MAX_LOG];     // LED reports delivered to the OUT endpoint
+  size_t      nOut;
+  t_simEvent  led[SIM_MAX_LOG];     // The CapsLock LED going on or off
+  size_t      nLed;
+  t_simEvent  duty[SIM_MAX_LOG];    // Changes of its PWM duty cycle (PWM1DCH: 250 is always on)
+  size_t      nDuty;
+  t_simEvent  configured[SIM_MAX_LOG]; // Times the host finished configuring the device
+  size_t      nConfigured;
+  t_simControl control[SIM_MAX_LOG]; // Control transfers (enumeration included)
+  size_t      nControls;
+  uint32_t    nAttaches;            // USBEN rising edges
+  uint32_t    nRemoteWakeups;       // Resume signalling seen while suspended
+  uint32_t    nFlashWrites;         // Flash rows erased
+  uint8_t     nInIntervalMs;        // Polling periods the host granted
+  uint8_t     nOutIntervalMs;
+  uint8_t     nMouseIntervalMs;     // (0 = no mouse interface)
+  uint64_t    nLatcHighUs[8];       // Time each PORTC latch bit has been high (the indicator LEDs)
+  uint64_t    nLedPinHighUs;        // Time RA4 (the CapsLock LED) has been high
+  uint8_t     nMostLatcHigh;        // The most PORTC latch bits high at once
+  uint32_t    nInStalls;            // IN polls answered with STALL
+  uint32_t    nUsbErrors;           // Protocol errors the host saw (see usbError)
+  char        usbError[96];         // The first of them
+  uint32_t    nWatchdogResets;
+  uint64_t    nWatchdogResetAt;     // When the watchdog last reset the PIC
+  uint32_t    nResets;              // RESET instructions
+  uint64_t    nResetAt;             // When the last one ran
+  uint8_t     bBootRequested;       // It left a valid bootloader request (see boot.h)
+  uint8_t     bDetachedBeforeReset; // USBEN was already clear
+  uint64_t    nAppStartedAt;        // When the bootloader jumped to the firmware (0=never)
+
+  // How the firmware spent its time
+  uint64_t nLoops;                  // main() loop iterations
+  uint64_t nIdleUs;                 // Waiting for an event
+  uint64_t nBlockedUs;              // Busy-waiting on the hardware
+  uint64_t nSleepUs;                // In Sleep
+  uint64_t nSlowClockUs;            // Awake with the CPU at 16 MHz (the rest of the time awake is at 48 MHz)
+  uint64_t nIsrEntries;             // interrupt() calls
+  uint64_t nIsrEntriesCapsLock;     // ...made while the host's CapsLock LED was on
+  uint64_t nIsrNs;                  // Host CPU time spent in interrupt()
+  uint64_t nPreemptions;            // Instructions main() ran with bPreempt set
+} t_sim;
+
+extern t_sim sim;
+
+void sim_schedule(uint64_t at, int action, uint8_t arg);
+void sim_command(uint64_t at, const uint8_t command[8]);
+void sim_control(uint64_t at, const uint8_t setup[8], const uint8_t *data); // data: the OUT data stage (or NULL)
+void sim_output(uint64_t at, const uint8_t *data, uint8_t len);
+void sim_act(int action, uint8_t arg, const uint8_t *data, const uint8_t *setup); // Take an action now (from pHost->step)
+void sim_program(uint16_t address, uint16_t word); // Before sim_run: program memory starts blank but for these words
+uint16_t sim_flash(uint16_t address);
+void sim_run(uint64_t duration);
@@ -0,0 +1,171 @@
+/*
+  CAP! CapsLock Light
+  Copyright (C) 2017 Andrew J. Armstrong
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+  02111-1307  USA
+
+  Author:
+  Andrew J. Armstrong <androidarmstrong@gmail.com>
+
+*/
+
+/*
+  Vendor command protocol (shared by the firmware and the tools in tools/)
+
+  Vendor commands travel as the 8-byte feature report of a HID interface
+  of their own, interface 1 (usage page 0xFF00), on endpoint 0 and out of
+  the way of the keyboard reports. A host that keeps the keyboard's
+  interface to itself still lets the tools open this one. Firmware 3.00
+  (bcdDevice 0x0300) is the first to take them; the 2.01 before it has no
+  vendor commands.
+
+  Host --> PIC: SET_REPORT(Feature) to interface 1. An 8-byte output report
+                written to the keyboard's interrupt OUT endpoint is also
+                accepted (LED reports are only 1 byte, so the length tells
+                them apart). Byte 0 is the command:
+
+                TELEMETRY_CMD_READ  Read a chunk of the telemetry block
+                  byte 1    Chunk number (0 to TELEMETRY_CHUNKS-1)
+                            Reading chunk 0 takes a snapshot of the
+                            block, and every chunk comes from the latest
+                            snapshot, so read chunk 0 first
+
+                SETTINGS_CMD_GET    Read the keepalive and LED settings
+
+                SETTINGS_CMD_SET    Change the keepalive and LED settings
+                                    (and save them in high-endurance flash)
+                  byte 1    SETTINGS_ENABLED or 0
+                  bytes 2-3 Keepalive interval in seconds (1 to 65535)
+                  byte 4    Keepalive payload (KEEPALIVE_SCROLL_LOCK,
+                            KEEPALIVE_F24, KEEPALIVE_RESERVED, or
+                            KEEPALIVE_MOUSE if the firmware has a mouse)
+                  byte 5    LED brightness (1 to SETTINGS_BRIGHTNESS_MAX,
+                            or 0 to leave it unchanged)
+
+                POLL_CMD_MEASURE    Measure the host's polling period
+                                    of the IN endpoint
+
+                TEXT_CMD_TYPE       Type one of the strings built into the
+                                    firmware (TEXT_STRINGS in capslock.h)
+                  byte 1    String number (0 for the first)
+
+                BOOT_CMD_ENTER      Detach and restart in the bootloader
+                                    (see boot.h). It is not answered.
+                  bytes 1-3 'O', 'O', 'T'
+
+                Unused bytes should be 0. A command sent before the last
+                one has been acted on is ignored, so send the next one
+                after the reply.
+
+  PIC --> Host: GET_REPORT(Feature) returns the reply to the last command
+                sent as a feature report (all zeros before the first).
+                A command sent as an output report is answered with an
+                8-byte input report instead. Either way:
+                  byte 0    Feature reports: the number of the command
+                            answered. Each feature command that will get
+                            a reply is numbered one more than the last,
+                            counting from 1 after each attach (modulo
+                            256), when it is accepted. A command that is
+                            ignored, or never answered (BOOT_CMD_ENTER),
+                            takes no number. So the reply to the next
+                            command is one more than byte 0 now, unless
+                            a bus reset cut short a POLL_CMD_MEASURE,
+                            which then goes unanswered.
+                            Input reports: 0 (no modifier keys)
+                  byte 1    Chunk number, or SETTINGS_TAG
+                  byte 2    TELEMETRY_MARKER
+                  bytes 3-7 TELEMETRY_CHUNK_SIZE bytes of the telemetry
+                            block, or the settings in the layout of
+                            SETTINGS_CMD_SET bytes 1-5
+
+                Both settings commands are answered with the settings now
+                in effect.
+
+                TEXT_CMD_TYPE is answered (byte 1 TEXT_TAG) once the last
+                keyboard report of the text has been queued:
+                  byte 3    String number
+                  bytes 4-5 Characters typed
+                  bytes 6-7 Keyboard reports they took
+                A string number with no string, or a command that arrives
+                while text is still being typed, is ignored.
+
+                POLL_CMD_MEASURE is answered with POLL_SAMPLES + 1 probe
+                input reports (byte 1 POLL_PROBE_TAG, however the command
+                came) sent back to back, so the
+                host takes one at every poll, and then with the result
+                (byte 1 POLL_TAG). All periods are in 1 ms USB frames:
+                  byte 3    bInterval the device asked for
+                  byte 4    Shortest period seen (255 = 255 or more)
+                  byte 5    Longest period seen
+                  byte 6    Mean period
+                  byte 7    POLL_SAMPLES
+
+  TELEMETRY_MARKER is the ErrorRollOver usage, so keyboard drivers discard
+  the report while hidraw readers still receive it.
+
+  The telemetry block is little-endian (as is the PIC), with each field
+  aligned to its size so that it has the same layout on every compiler.
+*/
+
+#define TELEMETRY_VERSION        1
+
+#define TELEMETRY_REQUEST_SIZE   8
+#define TELEMETRY_CMD_READ       0x54 // 'T'
+#define TELEMETRY_MARKER         0x01 // Keyboard ErrorRollOver usage
+#define TELEMETRY_CHUNK_SIZE     5
+
+#define SETTINGS_CMD_GET         0x47 // 'G'
+#define SETTINGS_CMD_SET         0x53 // 'S'
+#define SETTINGS_TAG             0x80
+#define SETTINGS_ENABLED         0x01 // Keepalive is enabled
+#define SETTINGS_BRIGHTNESS_MAX  31
+
+#define POLL_CMD_MEASURE         0x50 // 'P'
+#define POLL_TAG                 0x81
+#define POLL_PROBE_TAG           0x82
+#define POLL_SAMPLES             4    // Polling periods measured per POLL_CMD_MEASURE
+
+#define BOOT_CMD_ENTER           0x42 // 'B'
+
+#define TEXT_CMD_TYPE            0x58 // 'X'
+#define TEXT_TAG                 0x83
+
+#define KEEPALIVE_SCROLL_LOCK    0    // Keepalive payloads (see capslock.h)
+#define KEEPALIVE_F24            1
+#define KEEPALIVE_RESERVED       2
+#define KEEPALIVE_MOUSE          3    // (MOUSE_INTERFACE builds only)
+
+#define TELEMETRY_LATENCY_BUCKETS 8   // Bucket n counts latencies below (16 << n) Timer1 ticks (the last bucket counts the rest)
+#define TELEMETRY_TICK_NS        667  // One Timer1 tick (Fosc/4 with 1:8 prescale)
+
+typedef struct
+{
+  uint8_t  nVersion;                  //  0 TELEMETRY_VERSION
+  uint8_t  nWarmStarts;               //  1 Restarts after a watchdog or stack reset (see Prolog())
+  uint16_t nFirstLedMillis;           //  2 Milliseconds from the last attach to the host's first LED report
+                                      //    after it (0xFFFF = longer, 0 = none since power-on)
+  uint32_t nUptimeMillis;             //  4 Milliseconds since power-on (wraps after 49.7 days)
+  uint16_t nAttaches;                 //  8 enableUSB() calls (the first is at power-on)
+  uint16_t nBusResets;                // 10 Bus resets, i.e. enumerations by the host (including the first)
+  uint16_t nKeepAlives;               // 12 Keepalive keystrokes sent
+  uint16_t nStalls;                   // 14 Times the host stopped polling for REPORT_STALL_MS
+  uint16_t nWriteBusyMillis;          // 16 Milliseconds a queued report waited for usbWrite()
+  uint16_t nLedReports;               // 18 LED reports received
+  uint16_t nLatency[TELEMETRY_LATENCY_BUCKETS]; // 20 Host LED report to LED update latency histogram
+} t_telemetry;                        // 36
+
+#define TELEMETRY_SIZE           36
+#define TELEMETRY_CHUNKS         ((TELEMETRY_SIZE + TELEMETRY_CHUNK_SIZE - 1) / TELEMETRY_CHUNK_SIZE)
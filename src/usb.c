@@ -0,0 +1,648 @@
+/*
+  CAP! CapsLock Light
+  Copyright (C) 2017 Andrew J. Armstrong
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+  02111-1307  USA
+
+  Author:
+  Andrew J. Armstrong <androidarmstrong@gmail.com>
+
+*/
+#include <stdint.h>
+#include "hal.h"
+#include "USBdsc.h"
+#include "usb.h"
+
+#define TRUE  1
+#define FALSE 0
+
+#define BD_STAT(n)           HAL_LINEAR(USB_BDT + ((n) << 2))     // STAT, CNT, ADRL, ADRH
+#define BD_BUFFER(n)         HAL_LINEAR(USB_BUFFERS + ((n) << 3))
+
+#define HALT_OUT             0x01       // nHalted bits
+#define HALT_IN              0x02
+
+#define REPLY_STALL          0xFF       // usbSetup() outcomes (other than the length of a reply in RAM)
+#define REPLY_ROM            0xFE
+#define REPLY_DATA_OUT       0xFD
+
+STATIC_ASSERT(usb_buffer_size, USB_BUFFER_SIZE == 8 && EP0_PACKET_SIZE <= USB_BUFFER_SIZE &&
+                               EP_IN_PACKET_SIZE <= USB_BUFFER_SIZE && EP_OUT_PACKET_SIZE <= USB_BUFFER_SIZE &&
+                               EP_MOUSE_PACKET_SIZE <= USB_BUFFER_SIZE);
+STATIC_ASSERT(usb_ram_banks, USB_RAM_SIZE > USB_RAM_BANK0 && USB_RAM_SIZE <= 2 * USB_RAM_BANK0); // Linear 0x2000 to 0x209F
+
+HAL_USB_RAM(USB_RAM_BANK0);             // Keep the compiler's own variables out of the BDs and buffers
+HAL_USB_RAM_BANK1(USB_RAM_SIZE - USB_RAM_BANK0);
+
+volatile uint8_t nIdleRate;
+volatile uint8_t nProtocol;
+volatile uint8_t bIdleRateSet;
+volatile uint8_t bRemoteWakeup;
+volatile uint8_t nConfiguration;
+uint8_t usbFeature[2][HID_FEATURE_REPORT_SIZE];
+volatile uint8_t nUsbFeature;
+
+// Everything below is only used by interrupt()
+uint8_t nCtrlStage;                     // CTRL_IDLE...
+uint8_t nCtrlDts;                       // Data toggle (BD_DTS) of the next endpoint 0 IN packet
+uint8_t bCtrlZlp;                       // The reply is a multiple of 8 bytes but shorter than asked for, so end it with an empty packet
+uint16_t nCtrlRemaining;                // Bytes of a reply from ROM still to send...
+const uint8_t * pCtrlData;              // ...from here
+uint8_t nNewAddress;                    // SET_ADDRESS only takes effect after its status stage
+uint8_t bCtrlFeature;                   // The SET_REPORT data being received is a feature report
+uint8_t nHalted;                        // HALT_OUT and HALT_IN: EP1 endpoints halted by SET_FEATURE
+uint8_t nInOdd;                         // Next EP1 IN buffer to fill (0=even, 1=odd)
+uint8_t nInDts;                         // Data toggle (BD_DTS) of the next EP1 IN report
+uint8_t nOutOdd;                        // Next EP1 OUT buffer the USB module will fill
+#if MOUSE_INTERFACE
+uint8_t nMouseOdd;                      // Next EP3 IN BD to arm (0=even, 1=odd)
+uint8_t nMouseDts;                      // Data toggle (BD_DTS) of the next mouse report
+#endif
+
+void usbArm(uint8_t nBD, uint8_t nCount, uint8_t nStat) // Hand buffer descriptor nBD (and its buffer) to the USB module
+{
+  uint8_t * pBD;
+  uint16_t nBuffer;
+
+  pBD = BD_STAT(nBD);
+  nBuffer = USB_BUFFERS + (nBD << 3);
+#if MOUSE_INTERFACE
+  if (nBD >= BD_EP3_IN)
+  {
+    nBuffer = USB_MOUSE_BUFFER;
+  }
+#endif
+  pBD[1] = nCount;
+  pBD[2] = Lo(nBuffer);
+  pBD[3] = Hi(nBuffer);
+  pBD[0] = nStat;              // Last, because BD_UOWN hands it over
+}
+
+void usbAttach()
+{
+  uint8_t i;
+  uint8_t * pBDT;
+
+  pBDT = HAL_LINEAR(USB_BDT);
+  for (i = 0; i < 4 * USB_BDS; i++)
+  {
+    pBDT[i] = 0;               // The USB module owns no BD until the bus reset
+  }
+  nConfiguration = 0;          // (interrupt() cannot be using it: the USB interrupts are still off)
+  nUsbFeature = 0;             // GET_REPORT(Feature) answers with zeros until main() has a reply
+  for (i = 0; i < HID_FEATURE_REPORT_SIZE; i++)
+  {
+    usbFeature[0][i] = 0;
+  }
+  URSTIE_bit = 1;
+  TRNIE_bit = 1;
+  USBEN_bit = 1;               // Connect the pull-up: the host resets the bus and usbService() arms endpoint 0
+  USBIE_bit = 1;
+}
+
+void usbDetach()
+{
+  TRNIE_bit = 0;
+  URSTIE_bit = 0;
+  IDLEIE_bit = 0;
+  ACTVIE_bit = 0;
+  SUSPND_bit = 0;
+  USBEN_bit = 0;               // Disconnect the pull-up: the host sees the keyboard unplugged
+  nConfiguration = 0;
+}
+
+void usbReset()                // The host has reset the bus: back to the default state, at address 0
+{
+  uint8_t i;
+
+  UEP1 = 0;
+  UEP2 = 0;
+  UEP3 = 0;
+  for (i = BD_EP0_IN; i < USB_BDS; i++)
+  {
+    *BD_STAT(i) = 0;           // Take back every BD
+  }
+  HAL_USB_PPB_RESET();
+#if MOUSE_INTERFACE
+  nMouseOdd = 0;
+#endif
+  while (TRNIF_bit)
+  {
+    TRNIF_bit = 0;             // Discard any transactions still in the USTAT FIFO (4 at most)
+  }
+  UADDR = 0;
+  nConfiguration = 0;
+  nHalted = 0;
+  bRemoteWakeup = 0;
+  bIdleRateSet = 0;
+  nNewAddress = 0;
+  nCtrlStage = CTRL_IDLE;
+  nIdleRate = HID_IDLE_DEFAULT; // The host will set these again if it cares
+  nProtocol = HID_PROTOCOL_REPORT;
+  UEP0 = UEP_CONTROL;
+  usbArm(BD_EP0_OUT, EP0_PACKET_SIZE, BD_UOWN | BD_DTSEN); // Ready for the first SETUP packet
+  PKTDIS_bit = 0;
+}
+
+void usbStartEp1(uint8_t nOutDts) // Arm EP1 with both ping-pong pointers back at the even buffers
+{
+  uint8_t i;
+
+  for (i = BD_EP1_OUT; i <= BD_EP1_IN + 1; i++)
+  {
+    *BD_STAT(i) = 0;           // (any reports still staged are lost, as the host expects after a halt)
+  }
+  HAL_USB_PPB_RESET();
+  nInOdd = 0;
+  nOutOdd = 0;
+#if MOUSE_INTERFACE
+  for (i = BD_EP3_IN; i <= BD_EP3_IN + 1; i++) // PPBRST moves EP3 IN back to its even BD too...
+  {
+    if (*BD_STAT(i) & BD_UOWN)
+    {
+      nMouseDts ^= BD_DTS;     // ...so a report staged there is lost, and its toggle is not used up
+    }
+    *BD_STAT(i) = 0;
+  }
+  nMouseOdd = 0;
+#endif
+  UEP1 = UEP_INTERRUPT;
+  if (nHalted & HALT_OUT)
+  {
+    usbArm(BD_EP1_OUT, EP_OUT_PACKET_SIZE, BD_UOWN | BD_BSTALL);
+    usbArm(BD_EP1_OUT + 1, EP_OUT_PACKET_SIZE, BD_UOWN | BD_BSTALL);
+  }
+  else
+  {
+    usbArm(BD_EP1_OUT, EP_OUT_PACKET_SIZE, BD_UOWN | BD_DTSEN | nOutDts);
+    usbArm(BD_EP1_OUT + 1, EP_OUT_PACKET_SIZE, BD_UOWN | BD_DTSEN | (nOutDts ^ BD_DTS));
+  }
+  if (nHalted & HALT_IN)
+  {
+    usbArm(BD_EP1_IN, 0, BD_UOWN | BD_BSTALL);
+    usbArm(BD_EP1_IN + 1, 0, BD_UOWN | BD_BSTALL);
+  }
+}
+
+uint8_t usbFindDescriptor(uint8_t nType, uint8_t nIndex) // Point pCtrlData at a descriptor (FALSE if there is none)
+{
+  uint8_t i;
+
+  for (i = 0; i < USB_DESCRIPTORS; i++)
+  {
+    if (usbDescriptors[i].bType == nType && usbDescriptors[i].bIndex == nIndex)
+    {
+      pCtrlData = usbDescriptors[i].p;
+      nCtrlRemaining = usbDescriptors[i].nLength;
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+void usbSendChunk()            // Send the next packet of a reply from ROM (or the empty packet that ends it)
+{
+  uint8_t i;
+  uint8_t n;
+  uint8_t * pBuffer;
+
+  n = EP0_PACKET_SIZE;
+  if (nCtrlRemaining < EP0_PACKET_SIZE)
+  {
+    n = Lo(nCtrlRemaining);
+  }
+  pBuffer = BD_BUFFER(BD_EP0_IN);
+  for (i = 0; i < n; i++)
+  {
+    pBuffer[i] = pCtrlData[i];
+  }
+  pCtrlData += n;
+  nCtrlRemaining -= n;
+  usbArm(BD_EP0_IN, n, BD_UOWN | BD_DTSEN | nCtrlDts);
+  nCtrlDts ^= BD_DTS;
+}
+
+void usbSetup()                // Answer the SETUP packet in the endpoint 0 OUT buffer
+{
+  uint8_t * pSetup;
+  uint8_t * pReply;
+  uint8_t bmRequestType;
+  uint8_t bRequest;
+  uint8_t wValueL;
+  uint8_t wValueH;
+  uint8_t wIndexL;
+  uint16_t wLength;
+  uint8_t nReply;
+  uint8_t nHalt;
+  uint8_t i;
+
+  pSetup = BD_BUFFER(BD_EP0_OUT);
+  pReply = BD_BUFFER(BD_EP0_IN);
+  bmRequestType = pSetup[0];
+  bRequest = pSetup[1];
+  wValueL = pSetup[2];
+  wValueH = pSetup[3];
+  wIndexL = pSetup[4];
+  Lo(wLength) = pSetup[6];
+  Hi(wLength) = pSetup[7];
+  *BD_STAT(BD_EP0_IN) = 0;     // Take back endpoint 0 IN (a new SETUP abandons any transfer still going)
+  nCtrlStage = CTRL_IDLE;
+  nReply = REPLY_STALL;
+  nHalt = wIndexL == EP1_IN_ADDRESS ? HALT_IN : wIndexL == EP1_OUT_ADDRESS ? HALT_OUT : 0;
+
+  switch (bmRequestType)
+  {
+    case 0x80:                 // Standard, device to host, device
+      if (bRequest == USB_GET_STATUS)
+      {
+        pReply[0] = bRemoteWakeup ? 0x02 : 0x00; // (bus powered)
+        pReply[1] = 0;
+        nReply = 2;
+      }
+      else if (bRequest == USB_GET_DESCRIPTOR && usbFindDescriptor(wValueH, wValueL))
+      {
+        nReply = REPLY_ROM;
+      }
+      else if (bRequest == USB_GET_CONFIGURATION)
+      {
+        pReply[0] = nConfiguration;
+        nReply = 1;
+      }
+      break;
+    case 0x81:                 // Standard, device to host, interface
+      if (bRequest == USB_GET_STATUS && wIndexL < USB_INTERFACES)
+      {
+        pReply[0] = 0;
+        pReply[1] = 0;
+        nReply = 2;
+      }
+      else if (bRequest == USB_GET_DESCRIPTOR && usbFindDescriptor(wValueH, wIndexL)) // HID or report descriptor of interface wIndexL
+      {
+        nReply = REPLY_ROM;
+      }
+      else if (bRequest == USB_GET_INTERFACE && wIndexL < USB_INTERFACES && nConfiguration)
+      {
+        pReply[0] = 0;
+        nReply = 1;
+      }
+      break;
+    case 0x82:                 // Standard, device to host, endpoint
+      if (bRequest == USB_GET_STATUS && (nHalt || (wIndexL & 0x7F) == 0 || wIndexL == EP2_IN_ADDRESS ||
+                                         (MOUSE_INTERFACE && wIndexL == EP3_IN_ADDRESS)))
+      {
+        pReply[0] = (nHalted & nHalt) ? 1 : 0;
+        pReply[1] = 0;
+        nReply = 2;
+      }
+      break;
+    case 0x00:                 // Standard, host to device, device
+      if (bRequest == USB_SET_ADDRESS)
+      {
+        nNewAddress = wValueL;
+        nReply = 0;
+      }
+      else if (bRequest == USB_SET_CONFIGURATION && wValueL <= 1)
+      {
+        nConfiguration = wValueL;
+        nHalted = 0;
+        if (nConfiguration)
+        {
+          nInDts = 0;
+          usbStartEp1(0);      // Both keyboard endpoints start at DATA0
+          UEP2 = UEP_INTERRUPT_IN; // (its BDs stay with the CPU, so the USB module NAKs every IN)
+#if MOUSE_INTERFACE
+          nMouseDts = 0;
+          UEP3 = UEP_INTERRUPT_IN;
+#endif
+        }
+        else
+        {
+          UEP1 = 0;
+          UEP2 = 0;
+          UEP3 = 0;
+        }
+        nReply = 0;
+      }
+      else if ((bRequest == USB_SET_FEATURE || bRequest == USB_CLEAR_FEATURE) && wValueL == USB_FEATURE_REMOTE_WAKEUP)
+      {
+        bRemoteWakeup = bRequest == USB_SET_FEATURE;
+        nReply = 0;
+      }
+      break;
+    case 0x01:                 // Standard, host to device, interface
+      if (bRequest == USB_SET_INTERFACE && wValueL == 0 && wIndexL < USB_INTERFACES && nConfiguration)
+      {
+        nReply = 0;
+      }
+      break;
+    case 0x02:                 // Standard, host to device, endpoint
+      if (wValueL == USB_FEATURE_ENDPOINT_HALT && nHalt && nConfiguration)
+      {
+        if (bRequest == USB_SET_FEATURE)
+        {
+          nHalted |= nHalt;
+          usbStartEp1(*BD_STAT(BD_EP1_OUT + nOutOdd) & BD_DTS);
+          nReply = 0;
+        }
+        else if (bRequest == USB_CLEAR_FEATURE)
+        {
+          nHalted &= ~nHalt;
+          if (nHalt == HALT_IN)
+          {
+            nInDts = 0;
+            usbStartEp1(*BD_STAT(BD_EP1_OUT + nOutOdd) & BD_DTS);
+          }
+          else
+          {
+            usbStartEp1(0);
+          }
+          nReply = 0;
+        }
+      }
+      break;
+    case 0xA1:                 // HID class, device to host, interface
+      if (wIndexL == USB_VENDOR_INTERFACE)
+      {
+        if (bRequest == HID_GET_REPORT && wValueH == HID_REPORT_FEATURE)
+        {
+          for (i = 0; i < HID_FEATURE_REPORT_SIZE; i++)
+          {
+            pReply[i] = usbFeature[nUsbFeature][i]; // The last reply main() finished
+          }
+          nReply = HID_FEATURE_REPORT_SIZE;
+        }
+      }
+      else if (wIndexL == USB_KEYBOARD_INTERFACE)
+      {
+        if (bRequest == HID_GET_REPORT && wValueH == HID_REPORT_INPUT)
+        {
+          for (i = 0; i < EP_IN_PACKET_SIZE; i++)
+          {
+            pReply[i] = BD_BUFFER(BD_EP1_IN + (nInOdd ^ 1))[i]; // The last report written
+          }
+          nReply = EP_IN_PACKET_SIZE;
+        }
+        else if (bRequest == HID_GET_IDLE)
+        {
+          pReply[0] = nIdleRate;
+          nReply = 1;
+        }
+        else if (bRequest == HID_GET_PROTOCOL)
+        {
+          pReply[0] = nProtocol;
+          nReply = 1;
+        }
+      }
+#if MOUSE_INTERFACE
+      else if (wIndexL == USB_MOUSE_INTERFACE)
+      {
+        if (bRequest == HID_GET_REPORT && wValueH == HID_REPORT_INPUT)
+        {
+          for (i = 0; i < EP_MOUSE_PACKET_SIZE; i++)
+          {
+            pReply[i] = 0;     // (the only report it ever sends)
+          }
+          nReply = EP_MOUSE_PACKET_SIZE;
+        }
+        else if (bRequest == HID_GET_IDLE)
+        {
+          pReply[0] = 0;       // (it never repeats a report)
+          nReply = 1;
+        }
+      }
+#endif
+      break;
+    case 0x21:                 // HID class, host to device, interface
+      if (wIndexL == USB_VENDOR_INTERFACE)
+      {
+        if (bRequest == HID_SET_REPORT && wValueH == HID_REPORT_FEATURE && wLength == HID_FEATURE_REPORT_SIZE)
+        {
+          bCtrlFeature = TRUE; // (a vendor command, see telemetry.h)
+          nReply = REPLY_DATA_OUT;
+        }
+      }
+      else if (wIndexL == USB_KEYBOARD_INTERFACE)
+      {
+        if (bRequest == HID_SET_REPORT && wValueH == HID_REPORT_OUTPUT && wLength && wLength <= EP_OUT_PACKET_SIZE)
+        {
+          bCtrlFeature = FALSE;
+          nReply = REPLY_DATA_OUT;
+        }
+        else if (bRequest == HID_SET_IDLE && wValueL == 0) // (report id 0 = all reports)
+        {
+          nIdleRate = wValueH; // wValue high byte = duration
+          bIdleRateSet = 1;
+          nReply = 0;
+        }
+        else if (bRequest == HID_SET_PROTOCOL)
+        {
+          nProtocol = wValueL; // Both protocols use the boot report format, so just remember it
+          nReply = 0;
+        }
+      }
+#if MOUSE_INTERFACE
+      else if (wIndexL == USB_MOUSE_INTERFACE)
+      {
+        if (bRequest == HID_SET_IDLE)
+        {
+          nReply = 0;          // Accepted and ignored: the mouse only reports when a keepalive is due
+        }
+      }
+#endif
+      break;
+  }
+
+  if (nReply == REPLY_STALL)   // Unsupported: stall both directions until the next SETUP
+  {
+    usbArm(BD_EP0_IN, 0, BD_UOWN | BD_BSTALL);
+    usbArm(BD_EP0_OUT, EP0_PACKET_SIZE, BD_UOWN | BD_BSTALL);
+  }
+  else if (nReply == REPLY_DATA_OUT)
+  {
+    nCtrlStage = CTRL_DATA_OUT;
+    usbArm(BD_EP0_OUT, EP0_PACKET_SIZE, BD_UOWN | BD_DTSEN | BD_DTS);
+  }
+  else if (nReply == 0)        // No data stage: send the status packet now
+  {
+    nCtrlStage = CTRL_STATUS_IN;
+    usbArm(BD_EP0_IN, 0, BD_UOWN | BD_DTSEN | BD_DTS);
+    usbArm(BD_EP0_OUT, EP0_PACKET_SIZE, BD_UOWN | BD_DTSEN);
+  }
+  else                         // Reply (the data stage starts with DATA1)
+  {
+    nCtrlStage = CTRL_DATA_IN;
+    nCtrlDts = BD_DTS;
+    if (nReply != REPLY_ROM)
+    {
+      nCtrlRemaining = nReply;
+      pCtrlData = 0;
+    }
+    if (nCtrlRemaining > wLength)
+    {
+      nCtrlRemaining = wLength;
+    }
+    bCtrlZlp = nCtrlRemaining < wLength && (Lo(nCtrlRemaining) & (EP0_PACKET_SIZE - 1)) == 0;
+    if (nReply == REPLY_ROM)
+    {
+      usbSendChunk();
+    }
+    else
+    {
+      usbArm(BD_EP0_IN, Lo(nCtrlRemaining), BD_UOWN | BD_DTSEN | BD_DTS); // (already in the buffer)
+      nCtrlRemaining = 0;
+      nCtrlDts = 0;
+    }
+    usbArm(BD_EP0_OUT, EP0_PACKET_SIZE, BD_UOWN | BD_DTS); // Ready for the status packet (or a new SETUP)
+  }
+  PKTDIS_bit = 0;              // The USB module held off further transactions until now
+}
+
+uint8_t usbService(uint8_t * pOut)
+{
+  uint8_t i;
+  uint8_t n;
+  uint8_t nUstat;
+  uint8_t nBD;
+  uint8_t * pBD;
+  uint8_t * pBuffer;
+
+  if (URSTIF_bit)
+  {
+    usbReset();
+    URSTIF_bit = 0;
+    return 0;
+  }
+  if (!TRNIF_bit)
+  {
+    return 0;
+  }
+  nUstat = USTAT;
+  TRNIF_bit = 0;               // (the next transaction in the USTAT FIFO, if any, moves up)
+  n = 0;
+
+  if (nUstat & 0b01111000)     // EP1 (EP2 IN never completes a transaction, and EP3 IN needs nothing)
+  {
+    if (!(nUstat & 0b00000100)) // OUT: an output report or a vendor command (EP1 IN needs nothing: its buffer is free again)
+    {
+      nBD = BD_EP1_OUT + ((nUstat >> 1) & 1);
+      nOutOdd = ((nUstat >> 1) & 1) ^ 1;
+      pBD = BD_STAT(nBD);
+      pBuffer = BD_BUFFER(nBD);
+      n = pBD[1];
+      for (i = 0; i < n; i++)
+      {
+        pOut[i] = pBuffer[i];
+      }
+      usbArm(nBD, EP_OUT_PACKET_SIZE, BD_UOWN | BD_DTSEN | (pBD[0] & BD_DTS)); // Two packets on, the same toggle
+    }
+  }
+  else if (nUstat & 0b00000100) // EP0 IN
+  {
+    if (nCtrlStage == CTRL_DATA_IN && (nCtrlRemaining || bCtrlZlp))
+    {
+      if (!nCtrlRemaining)
+      {
+        bCtrlZlp = 0;
+      }
+      usbSendChunk();
+    }
+    else if (nCtrlStage == CTRL_STATUS_IN)
+    {
+      if (nNewAddress)
+      {
+        UADDR = nNewAddress;
+        nNewAddress = 0;
+      }
+      nCtrlStage = CTRL_IDLE;
+    }
+  }
+  else if (BD_PID(*BD_STAT(BD_EP0_OUT)) == PID_SETUP)
+  {
+    usbSetup();
+  }
+  else                         // EP0 OUT: SET_REPORT data, or the status packet ending a reply
+  {
+    *BD_STAT(BD_EP0_IN) = 0;   // (the host may have ended a reply early)
+    if (nCtrlStage == CTRL_DATA_OUT)
+    {
+      pBD = BD_STAT(BD_EP0_OUT);
+      pBuffer = BD_BUFFER(BD_EP0_OUT);
+      n = pBD[1];
+      for (i = 0; i < n; i++)
+      {
+        pOut[i] = pBuffer[i];
+      }
+      if (bCtrlFeature)
+      {
+        n |= USB_FEATURE_REPORT;
+      }
+      nCtrlStage = CTRL_STATUS_IN;
+      usbArm(BD_EP0_IN, 0, BD_UOWN | BD_DTSEN | BD_DTS);
+    }
+    else
+    {
+      nCtrlStage = CTRL_IDLE;
+    }
+    usbArm(BD_EP0_OUT, EP0_PACKET_SIZE, BD_UOWN | BD_DTSEN); // Ready for the next SETUP
+  }
+  return n;
+}
+
+uint8_t usbWrite(uint8_t * pReport, uint8_t nLength)
+{
+  uint8_t i;
+  uint8_t nBD;
+  uint8_t * pBuffer;
+
+  nBD = BD_EP1_IN + nInOdd;
+  if (!nConfiguration || (nHalted & HALT_IN) || (*BD_STAT(nBD) & BD_UOWN))
+  {
+    return FALSE;
+  }
+  pBuffer = BD_BUFFER(nBD);
+  for (i = 0; i < nLength; i++)
+  {
+    pBuffer[i] = pReport[i];
+  }
+  usbArm(nBD, nLength, BD_UOWN | BD_DTSEN | nInDts);
+  nInDts ^= BD_DTS;
+  nInOdd ^= 1;
+  return TRUE;
+}
+
+#if MOUSE_INTERFACE
+uint8_t usbWriteMouse()
+{
+  uint8_t i;
+  uint8_t nBD;
+  uint8_t * pBuffer;
+
+  nBD = BD_EP3_IN + nMouseOdd;
+  if (!nConfiguration || (*BD_STAT(nBD) & BD_UOWN))
+  {
+    return FALSE;
+  }
+  pBuffer = HAL_LINEAR(USB_MOUSE_BUFFER); // (shared by both BDs: the report is always the same)
+  for (i = 0; i < EP_MOUSE_PACKET_SIZE; i++)
+  {
+    pBuffer[i] = 0;            // No buttons, no movement
+  }
+  usbArm(nBD, EP_MOUSE_PACKET_SIZE, BD_UOWN | BD_DTSEN | nMouseDts);
+  nMouseDts ^= BD_DTS;
+  nMouseOdd ^= 1;
+  return TRUE;
+}
+#endif
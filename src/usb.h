@@ -0,0 +1,142 @@
+/*
+  CAP! CapsLock Light
+  Copyright (C) 2017 Andrew J. Armstrong
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+  02111-1307  USA
+
+  Author:
+  Andrew J. Armstrong <androidarmstrong@gmail.com>
+
+*/
+
+/*
+  USB device stack: endpoint 0 (standard and HID class requests) and the
+  keyboard's interrupt endpoints, EP1 IN and EP1 OUT. The vendor commands of
+  telemetry.h travel as feature reports on endpoint 0, to a second HID
+  interface of their own. Its interrupt endpoint, EP2 IN, only ever NAKs.
+  With MOUSE_INTERFACE (see USBdsc.h), a third interface is a mouse, whose
+  EP3 IN only carries the zero-movement reports of the mouse keepalive.
+
+  The descriptors are the tables in USBdsc.c. EP1 IN and EP1 OUT each have an
+  even and an odd buffer (UCFG.PPB=11), so one report can be staged while the
+  host is still to collect the previous one. The USB module alternates
+  between the two on each transaction just as the data toggle alternates, so
+  each buffer keeps its toggle: from SET_CONFIGURATION on, the even buffers
+  carry DATA0 and the odd ones DATA1.
+
+  main() only calls usbAttach() and usbDetach(). Everything else runs in
+  interrupt(): usbService() handles a bus reset or one transaction each time
+  it is called, and never waits for the host.
+*/
+
+// USB RAM (linear 0x2000): ten 4-byte buffer descriptors (BDs), then one
+// 8-byte buffer for each of the first six. EP2 has no buffers: its OUT
+// direction is off and its IN BDs are never armed. With MOUSE_INTERFACE
+// there are fourteen BDs, and both EP3 IN BDs share one more buffer, as
+// every mouse report is the same. The last buffers spill over from bank 0
+// (linear 0x2000 to 0x204F) into bank 1.
+#define USB_BDT              0x2000
+#define BD_EP0_OUT           0
+#define BD_EP0_IN            1
+#define BD_EP1_OUT           2          // Even, and BD_EP1_OUT + 1 is odd
+#define BD_EP1_IN            4          // Even, and BD_EP1_IN + 1 is odd
+#define BD_EP2_IN            8          // Even, and BD_EP2_IN + 1 is odd (6 and 7 are EP2 OUT)
+#define BD_EP3_IN            12         // Even, and BD_EP3_IN + 1 is odd (10 and 11 are EP3 OUT)
+#define USB_BDS              (MOUSE_INTERFACE ? 14 : 10)
+#define USB_BUFFERED_BDS     6          // BD_EP0_OUT to BD_EP1_IN + 1
+#define USB_BUFFER_SIZE      8
+#define USB_BUFFERS          (USB_BDT + 4 * USB_BDS)
+#define USB_MOUSE_BUFFER     (USB_BUFFERS + USB_BUFFERED_BDS * USB_BUFFER_SIZE)
+#define USB_RAM_SIZE         (4 * USB_BDS + (USB_BUFFERED_BDS + MOUSE_INTERFACE) * USB_BUFFER_SIZE)
+#define USB_RAM_BANK0        80         // Bytes of it in bank 0
+
+// Buffer descriptor STAT bits
+#define BD_UOWN              0x80       // The USB module owns the BD
+#define BD_DTS               0x40       // DATA1 (else DATA0)
+#define BD_DTSEN             0x08       // The USB module checks the data toggle of OUT packets
+#define BD_BSTALL            0x04       // Answer with STALL
+#define BD_PID(stat)         (((stat) >> 2) & 0x0F) // Token of the completed transaction
+
+#define PID_OUT              0x01
+#define PID_IN               0x09
+#define PID_SETUP            0x0D
+
+#define EP1_IN_ADDRESS       0x81       // (wIndex of endpoint requests)
+#define EP1_OUT_ADDRESS      0x01
+
+#define UCFG_FULL_SPEED      0b00010111 // UPUEN, FSEN, PPB=11: ping-pong buffers on all endpoints except EP0
+#define UEP_CONTROL          0b00010110 // EPHSHK, EPOUTEN, EPINEN (SETUP allowed)
+#define UEP_INTERRUPT        0b00011110 // EPHSHK, EPCONDIS, EPOUTEN, EPINEN
+#define UEP_INTERRUPT_IN     0b00011010 // EPHSHK, EPCONDIS, EPINEN
+
+// Standard requests (bRequest)
+#define USB_GET_STATUS       0x00
+#define USB_CLEAR_FEATURE    0x01
+#define USB_SET_FEATURE      0x03
+#define USB_SET_ADDRESS      0x05
+#define USB_GET_DESCRIPTOR   0x06
+#define USB_GET_CONFIGURATION 0x08
+#define USB_SET_CONFIGURATION 0x09
+#define USB_GET_INTERFACE    0x0A
+#define USB_SET_INTERFACE    0x0B
+
+#define USB_FEATURE_ENDPOINT_HALT  0
+#define USB_FEATURE_REMOTE_WAKEUP  1
+
+// HID class requests (bRequest)
+#define HID_GET_REPORT       0x01
+#define HID_GET_IDLE         0x02
+#define HID_GET_PROTOCOL     0x03
+#define HID_SET_REPORT       0x09
+#define HID_SET_IDLE         0x0A
+#define HID_SET_PROTOCOL     0x0B
+
+#define HID_REPORT_INPUT     1          // GET_REPORT and SET_REPORT wValue high byte
+#define HID_REPORT_OUTPUT    2
+#define HID_REPORT_FEATURE   3
+
+#define USB_FEATURE_REPORT   0x80       // usbService() adds this to the length of a SET_REPORT(Feature)
+
+#define HID_PROTOCOL_BOOT    0
+#define HID_PROTOCOL_REPORT  1
+#define HID_IDLE_DEFAULT     125        // 500 ms: the HID specification's recommended default for keyboards
+
+// Control transfer stages
+#define CTRL_IDLE            0          // Waiting for a SETUP packet
+#define CTRL_DATA_IN         1          // Sending the reply
+#define CTRL_DATA_OUT        2          // Receiving SET_REPORT data
+#define CTRL_STATUS_IN       3          // Sending the zero length status packet
+
+// Set by interrupt() only (after usbAttach() has enabled the USB interrupts)
+extern volatile uint8_t nIdleRate;      // Resend an unchanged report this often (4 ms units, 0=never)
+extern volatile uint8_t nProtocol;      // HID_PROTOCOL_BOOT or HID_PROTOCOL_REPORT
+extern volatile uint8_t bIdleRateSet;   // SET_IDLE has arrived (interrupt() clears it)
+extern volatile uint8_t nConfiguration; // 0 until the host has configured the device
+extern volatile uint8_t bRemoteWakeup;  // The host has enabled remote wakeup (SET_FEATURE(DEVICE_REMOTE_WAKEUP))
+
+// Set by main() only: GET_REPORT(Feature) answers with usbFeature[nUsbFeature].
+// main() builds the next answer in the other one and then flips nUsbFeature,
+// so the host never gets one half built.
+extern uint8_t usbFeature[2][HID_FEATURE_REPORT_SIZE];
+extern volatile uint8_t nUsbFeature;
+
+void usbAttach();                       // (main() only) Switch the USB module on and connect the pull-up
+void usbDetach();                       // (main() only) Disconnect from the host
+uint8_t usbService(uint8_t * pOut);     // (interrupt() only) Returns the length of any output or feature report copied to pOut
+uint8_t usbWrite(uint8_t * pReport, uint8_t nLength); // (interrupt() only) FALSE if both EP1 IN buffers are still waiting for the host
+#if MOUSE_INTERFACE
+uint8_t usbWriteMouse();                // (interrupt() only) Send a mouse report with no movement: FALSE if the host has two waiting
+#endif
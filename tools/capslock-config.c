@@ -0,0 +1,180 @@
+/*
+  CAP! CapsLock Light
+  Copyright (C) 2017 Andrew J. Armstrong
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+  02111-1307  USA
+
+  Author:
+  Andrew J. Armstrong <androidarmstrong@gmail.com>
+
+*/
+
+/*
+  Show or change the keepalive and LED settings of capslock dongles via Linux hidraw.
+
+  Usage: capslock-config [-e|-d] [-i seconds] [-p scrolllock|f24|reserved|mouse] [-b level] [-t string] [/dev/hidrawN...]
+
+    -e  Enable the keepalive
+    -d  Disable the keepalive
+    -i  Seconds between keepalives (1 to 65535)
+    -p  Keepalive payload: Scroll Lock twice, F24 once, a reserved usage once,
+        or a mouse report with no movement (firmware built with MOUSE_INTERFACE)
+    -b  LED brightness (1 to 31, perceptually even steps)
+    -t  Type one of the strings built into the firmware (0 for the first)
+
+  With no options the settings are just shown. Options that are not given
+  keep their current values. The dongle saves changed settings in its
+  high-endurance flash, so they survive unplugging. With no device names,
+  every dongle found is used.
+*/
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "dongle.h"
+#include "../src/telemetry.h"
+
+static const char *payloads[] = {"scrolllock", "f24", "reserved", "mouse"};
+
+static int nEnable = -1;              // -1 = unchanged
+static long nSeconds = -1;
+static int nPayload = -1;
+static long nBrightness = 0;          // 0 = unchanged
+static long nString = -1;             // -1 = type nothing
+
+static int configure(const char *path)
+{
+  uint8_t command[TELEMETRY_REQUEST_SIZE] = {SETTINGS_CMD_GET};
+  uint8_t reply[8];
+  unsigned nInterval;
+  int fd;
+
+  fd = open(path, O_RDWR);
+  if (fd < 0)
+  {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  if (nString >= 0)
+  {
+    command[0] = TEXT_CMD_TYPE;
+    command[1] = (uint8_t) nString;
+    if (dongleRequest(fd, command, TEXT_TAG, reply) < 0)
+    {
+      fprintf(stderr, "%s: string %ld not typed (%s)\n", path, nString, strerror(errno));
+      close(fd);
+      return 1;
+    }
+    printf("%s: typed %u characters in %u keyboard reports\n", path,
+           reply[4] | reply[5] << 8, reply[6] | reply[7] << 8);
+    command[0] = SETTINGS_CMD_GET;
+    command[1] = 0;
+  }
+  if (dongleRequest(fd, command, SETTINGS_TAG, reply) < 0)
+  {
+    fprintf(stderr, "%s: no reply (%s)\n", path, strerror(errno));
+    close(fd);
+    return 1;
+  }
+  if (nEnable >= 0 || nSeconds >= 0 || nPayload >= 0 || nBrightness > 0)
+  {
+    command[0] = SETTINGS_CMD_SET;
+    command[1] = nEnable >= 0 ? (nEnable ? SETTINGS_ENABLED : 0) : reply[3];
+    command[2] = nSeconds >= 0 ? (uint8_t) nSeconds : reply[4];
+    command[3] = nSeconds >= 0 ? (uint8_t) (nSeconds >> 8) : reply[5];
+    command[4] = nPayload >= 0 ? (uint8_t) nPayload : reply[6];
+    command[5] = (uint8_t) nBrightness;
+    if (dongleRequest(fd, command, SETTINGS_TAG, reply) < 0)
+    {
+      fprintf(stderr, "%s: no reply (%s)\n", path, strerror(errno));
+      close(fd);
+      return 1;
+    }
+    if (nPayload >= 0 && reply[6] != nPayload) // The dongle ignores settings it cannot take
+    {
+      fprintf(stderr, "%s: payload %s not supported, settings unchanged\n", path, payloads[nPayload]);
+    }
+  }
+  close(fd);
+
+  nInterval = reply[4] | reply[5] << 8;
+  printf("%s: keepalive %s, every %u s, payload %s, LED brightness %u\n", path,
+         reply[3] & SETTINGS_ENABLED ? "enabled" : "disabled", nInterval,
+         reply[6] < sizeof payloads / sizeof payloads[0] ? payloads[reply[6]] : "unknown", reply[7]);
+  return 0;
+}
+
+static void usage(void)
+{
+  fprintf(stderr, "Usage: capslock-config [-e|-d] [-i seconds] [-p scrolllock|f24|reserved|mouse] [-b level] [-t string] [/dev/hidrawN...]\n");
+  exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+  int rc = 0;
+  int opt;
+  int i;
+
+  while ((opt = getopt(argc, argv, "edi:p:b:t:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'e':
+        nEnable = 1;
+        break;
+      case 'd':
+        nEnable = 0;
+        break;
+      case 'i':
+        nSeconds = strtol(optarg, NULL, 10);
+        if (nSeconds < 1 || nSeconds > 65535) usage();
+        break;
+      case 'p':
+        for (i = 0; i < (int) (sizeof payloads / sizeof payloads[0]) && strcmp(optarg, payloads[i]) != 0; i++);
+        if (i == (int) (sizeof payloads / sizeof payloads[0])) usage();
+        nPayload = i;
+        break;
+      case 'b':
+        nBrightness = strtol(optarg, NULL, 10);
+        if (nBrightness < 1 || nBrightness > SETTINGS_BRIGHTNESS_MAX) usage();
+        break;
+      case 't':
+        nString = strtol(optarg, NULL, 10);
+        if (nString < 0 || nString > 255) usage();
+        break;
+      default:
+        usage();
+    }
+  }
+  if (optind < argc)
+  {
+    for (i = optind; i < argc; i++)
+    {
+      rc |= configure(argv[i]);
+    }
+    return rc;
+  }
+  rc = dongleForEach(configure);
+  if (rc < 0)
+  {
+    fprintf(stderr, "No capslock dongle found\n");
+    return 1;
+  }
+  return rc;
+}
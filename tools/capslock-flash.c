@@ -0,0 +1,376 @@
+/*
+  CAP! CapsLock Light
+  Copyright (C) 2017 Andrew J. Armstrong
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+  02111-1307  USA
+
+  Author:
+  Andrew J. Armstrong <androidarmstrong@gmail.com>
+
+*/
+
+/*
+  Update the firmware of every capslock dongle plugged in, via Linux hidraw.
+
+  Usage: capslock-flash capslock.hex
+
+  capslock.hex must be built with BOOTLOADER set (see capslock.h). Dongles
+  running the firmware are sent BOOT_CMD_ENTER and come back as bootloaders
+  (see src/boot.h), as do dongles left in the bootloader by an earlier
+  update that failed. Each bootloader is then updated by a process of its
+  own, so a hub full of dongles takes no longer than one.
+*/
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "dongle.h"
+#include "../src/telemetry.h"
+#include "../src/boot.h"
+
+#define MAX_DONGLES     64
+#define ARRIVAL_MS      5000  // How long to wait for the bootloaders to enumerate
+#define WRITE_MS        1000  // Per row (the bootloader answers in a few ms)
+#define MOVLP_MASK      0x3F80 // MOVLP k (PCLATH = k)
+#define MOVLP           0x3180
+
+static uint16_t image[BOOT_APP_END];           // Words by address (0x3FFF = erased)
+static uint8_t  bRowUsed[BOOT_END_ROW];         // The hex file has words in this row
+static char     bootloaders[MAX_DONGLES][300];
+static int      nBootloaders;
+static int      nEntered;
+
+static double elapsedMs(const struct timespec *t0)
+{
+  struct timespec t1;
+
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  return (t1.tv_sec - t0->tv_sec) * 1000.0 + (t1.tv_nsec - t0->tv_nsec) / 1e6;
+}
+
+static int hexByte(const char *s)
+{
+  unsigned n;
+
+  return sscanf(s, "%2x", &n) == 1 ? (int) n : -1;
+}
+
+static int loadHex(const char *name)      // Intel hex (INHX32) from mikroC into image[]
+{
+  char line[600];
+  uint8_t data[256];
+  uint32_t nBase = 0;
+  uint32_t nWord;
+  unsigned nLine = 0;
+  int nCount, nAddress, nType, nSum, n, i;
+  FILE *f;
+
+  f = fopen(name, "r");
+  if (!f)
+  {
+    fprintf(stderr, "%s: %s\n", name, strerror(errno));
+    return -1;
+  }
+  for (i = 0; i < BOOT_APP_END; i++)
+  {
+    image[i] = 0x3FFF;
+  }
+  while (fgets(line, sizeof line, f))
+  {
+    nLine++;
+    if (line[0] != ':' || (nCount = hexByte(&line[1])) < 0 || strlen(line) < 11 + 2 * (size_t) nCount)
+    {
+      fprintf(stderr, "%s:%u: not an Intel hex record\n", name, nLine);
+      fclose(f);
+      return -1;
+    }
+    nSum = 0;
+    for (i = 0; i < 4 + nCount + 1; i++)   // Count, address, type, data, checksum
+    {
+      n = hexByte(&line[1 + 2 * i]);
+      if (n < 0) break;
+      if (i >= 4 && i < 4 + nCount) data[i - 4] = (uint8_t) n;
+      nSum += n;
+    }
+    if (i < 4 + nCount + 1 || (nSum & 0xFF) != 0)
+    {
+      fprintf(stderr, "%s:%u: bad checksum\n", name, nLine);
+      fclose(f);
+      return -1;
+    }
+    nAddress = hexByte(&line[3]) << 8 | hexByte(&line[5]);
+    nType = hexByte(&line[7]);
+    if (nType == 1) break;                  // End of file
+    if (nType == 4 && nCount == 2)          // Extended linear address
+    {
+      nBase = (uint32_t) (data[0] << 8 | data[1]) << 16;
+      continue;
+    }
+    if (nType != 0) continue;
+    for (i = 0; i + 1 < nCount; i += 2)     // Byte addresses, little-endian words
+    {
+      nWord = (nBase + (uint32_t) nAddress + (uint32_t) i) / 2;
+      if (nWord >= 0x8000) continue;        // Configuration words: the bootloader's own stay
+      if (nWord < BOOT_APP_VECTORS)
+      {
+        nWord += BOOT_APP_START;            // Relocate the reset vector and interrupt() (see boot.h)
+      }
+      else if (nWord < BOOT_APP_START + BOOT_APP_VECTORS || nWord >= BOOT_APP_END)
+      {
+        fprintf(stderr, "%s: code at 0x%04X, which the bootloader cannot write (build with BOOTLOADER 1)\n",
+                name, (unsigned) nWord);
+        fclose(f);
+        return -1;
+      }
+      image[nWord] = (uint16_t) ((data[i] | data[i + 1] << 8) & 0x3FFF);
+      bRowUsed[nWord / BOOT_ROW_WORDS] = 1;
+    }
+  }
+  fclose(f);
+  if (!bRowUsed[BOOT_FIRST_ROW])
+  {
+    fprintf(stderr, "%s: no reset vector\n", name);
+    return -1;
+  }
+  for (i = BOOT_APP_INTERRUPT; i < BOOT_APP_START + BOOT_APP_VECTORS; i++)
+  {
+    // Its GOTOs and CALLs move a page up with it (they leave the page to
+    // PCLATH), but one that sets PCLATH to page 0 would jump into the bootloader
+    if ((image[i] & MOVLP_MASK) == MOVLP && (image[i] & 0x7F) < (BOOT_APP_START >> 8))
+    {
+      fprintf(stderr, "%s: interrupt() selects page 0 at 0x%04X, which is the bootloader's\n",
+              name, (unsigned) (i - BOOT_APP_START));
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int bootRequest(int fd, uint8_t report[BOOT_REPORT_SIZE], int nTimeoutMs) // Send a report and wait for its reply
+{
+  uint8_t request[1 + BOOT_REPORT_SIZE];
+  uint8_t reply[BOOT_REPORT_SIZE];
+  struct pollfd pfd;
+  ssize_t n;
+
+  request[0] = 0;                           // No report id
+  memcpy(&request[1], report, BOOT_REPORT_SIZE);
+  if (write(fd, request, sizeof request) < 0) return -1;
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  do
+  {
+    if (poll(&pfd, 1, nTimeoutMs) <= 0)
+    {
+      errno = ETIMEDOUT;
+      return -1;
+    }
+    n = read(fd, reply, sizeof reply);
+    if (n < 0) return -1;
+  } while (n < 3 || reply[0] != report[0] || reply[1] != report[1]); // (a reply left over from an earlier run)
+  memcpy(report, reply, (size_t) n);
+  return 0;
+}
+
+static int writeRow(int fd, uint8_t nRow, int bBlank)
+{
+  uint8_t report[BOOT_REPORT_SIZE];
+  uint16_t nWord;
+  unsigned nBit;
+  unsigned i;
+
+  memset(report, 0, sizeof report);
+  report[0] = BOOT_CMD_WRITE;
+  report[1] = nRow;
+  for (i = 0, nBit = 0; i < BOOT_ROW_WORDS; i++, nBit += 14) // Pack 14 bits at a time, LSB first
+  {
+    nWord = bBlank ? 0x3FFF : image[nRow * BOOT_ROW_WORDS + i];
+    report[2 + nBit / 8] |= (uint8_t) (nWord << (nBit % 8));
+    report[3 + nBit / 8] |= (uint8_t) (nWord >> (8 - nBit % 8));
+    if (nBit % 8 > 2)
+    {
+      report[4 + nBit / 8] |= (uint8_t) (nWord >> (16 - nBit % 8));
+    }
+  }
+  if (bootRequest(fd, report, WRITE_MS) < 0) return -1;
+  if (report[2] != BOOT_STATUS_OK)
+  {
+    errno = report[2] == BOOT_STATUS_VERIFY ? EIO : EINVAL;
+    return -1;
+  }
+  return 0;
+}
+
+static int update(const char *path)        // Write the image to one bootloader (in a process of its own)
+{
+  uint8_t report[BOOT_REPORT_SIZE];
+  struct timespec t0;
+  unsigned nRows = 0;
+  int nRow;
+  int fd;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  fd = open(path, O_RDWR);
+  if (fd < 0)
+  {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  memset(report, 0, sizeof report);
+  report[0] = BOOT_CMD_QUERY;
+  if (bootRequest(fd, report, WRITE_MS) < 0)
+  {
+    fprintf(stderr, "%s: no reply (%s)\n", path, strerror(errno));
+    close(fd);
+    return 1;
+  }
+  if (report[3] != BOOT_VERSION || report[4] != BOOT_FIRST_ROW || report[5] != BOOT_END_ROW ||
+      report[6] != BOOT_ROW_WORDS)
+  {
+    fprintf(stderr, "%s: bootloader version %u, rows %u to %u: not what this capslock-flash expects\n",
+            path, report[3], report[4], report[5]);
+    close(fd);
+    return 1;
+  }
+
+  // Erase the first row before anything else and write it last, so that the
+  // dongle stays in the bootloader until the whole image is there
+  if (writeRow(fd, BOOT_FIRST_ROW, 1) < 0)
+  {
+    fprintf(stderr, "%s: erasing row %u failed (%s)\n", path, BOOT_FIRST_ROW, strerror(errno));
+    close(fd);
+    return 1;
+  }
+  for (nRow = BOOT_FIRST_ROW + 1; nRow <= BOOT_END_ROW; nRow++)
+  {
+    if (nRow < BOOT_END_ROW && !bRowUsed[nRow]) continue;
+    if (nRow == BOOT_END_ROW) nRow = BOOT_FIRST_ROW; // (the first row is the last one written)
+    if (writeRow(fd, (uint8_t) nRow, 0) < 0)
+    {
+      fprintf(stderr, "%s: writing row %u failed (%s)\n", path, nRow, strerror(errno));
+      close(fd);
+      return 1;
+    }
+    nRows++;
+    if (nRow == BOOT_FIRST_ROW) break;
+  }
+
+  memset(report, 0, sizeof report);
+  report[0] = BOOT_CMD_RUN;
+  if (bootRequest(fd, report, WRITE_MS) < 0 || report[2] != BOOT_STATUS_OK)
+  {
+    fprintf(stderr, "%s: the firmware did not start\n", path);
+    close(fd);
+    return 1;
+  }
+  close(fd);
+  printf("%s: %u rows written in %.0f ms\n", path, nRows, elapsedMs(&t0));
+  return 0;
+}
+
+static int enter(const char *path)         // Ask a dongle running the firmware for its bootloader
+{
+  static const uint8_t command[TELEMETRY_REQUEST_SIZE] = {BOOT_CMD_ENTER, 'O', 'O', 'T'};
+  int fd;
+  int rc;
+
+  fd = open(path, O_RDWR);
+  if (fd < 0)
+  {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  rc = dongleSend(fd, command);
+  if (rc < 0) fprintf(stderr, "%s: %s\n", path, strerror(errno));
+  close(fd);
+  if (rc == 0) nEntered++;
+  return rc < 0;
+}
+
+static int found(const char *path)
+{
+  if (nBootloaders < MAX_DONGLES)
+  {
+    snprintf(bootloaders[nBootloaders++], sizeof bootloaders[0], "%s", path);
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  struct timespec t0;
+  int nWaiting;
+  int nFailed = 0;
+  int status;
+  int rc = 0;
+  int i;
+
+  if (argc != 2)
+  {
+    fprintf(stderr, "Usage: capslock-flash capslock.hex\n");
+    return 2;
+  }
+  if (loadHex(argv[1]) < 0) return 1;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  nBootloaders = 0;
+  (void) dongleForEachProduct(BOOT_PRODUCT_ID, found); // Left there by an update that failed
+  nWaiting = nBootloaders;
+  (void) dongleForEach(enter);
+  nWaiting += nEntered;
+  if (nWaiting == 0)
+  {
+    fprintf(stderr, "No capslock dongle found\n");
+    return 1;
+  }
+  do                                        // Until every dongle has come back as a bootloader
+  {
+    usleep(100000);
+    nBootloaders = 0;
+    (void) dongleForEachProduct(BOOT_PRODUCT_ID, found);
+  } while (nBootloaders < nWaiting && elapsedMs(&t0) < ARRIVAL_MS);
+  if (nBootloaders < nWaiting)
+  {
+    fprintf(stderr, "Only %d of %d dongles came back as bootloaders (check the permissions of /dev/hidraw*)\n",
+            nBootloaders, nWaiting);
+    rc = 1;
+  }
+
+  for (i = 0; i < nBootloaders; i++)
+  {
+    fflush(stdout);
+    switch (fork())
+    {
+      case 0:
+        _exit(update(bootloaders[i]));
+      case -1:
+        fprintf(stderr, "%s: %s\n", bootloaders[i], strerror(errno));
+        nFailed++;
+        break;
+    }
+  }
+  while (wait(&status) > 0)
+  {
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) nFailed++;
+  }
+  printf("%d of %d dongles updated in %.0f ms\n", nBootloaders - nFailed, nBootloaders, elapsedMs(&t0));
+  return rc || nFailed;
+}
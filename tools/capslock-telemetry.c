@@ -0,0 +1,222 @@
+/*
+  CAP! CapsLock Light
+  Copyright (C) 2017 Andrew J. Armstrong
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+  02111-1307  USA
+
+  Author:
+  Andrew J. Armstrong <androidarmstrong@gmail.com>
+
+*/
+
+/*
+  Read the telemetry counters from capslock dongles via Linux hidraw.
+
+  Usage: capslock-telemetry [-c] [-p] [/dev/hidrawN...]
+
+  With no device names, every hidraw device with the dongle's vendor and
+  product id is read. -c prints one comma-separated line per device (with a
+  heading) so that the output of many machines can be collected together.
+  -p measures the polling period that the host granted the dongle's IN
+  endpoint instead (compare it with the POLLING_PROFILE it was built with).
+
+  Reading /dev/hidraw* usually needs root, or a udev rule such as:
+    SUBSYSTEM=="hidraw", ATTRS{idVendor}=="04b3", ATTRS{idProduct}=="3019", MODE="0664", GROUP="plugdev"
+*/
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "dongle.h"
+#include "../src/telemetry.h"
+
+static int bCsv;
+static int bPoll;
+
+static unsigned get16(const uint8_t *p)
+{
+  return p[0] | p[1] << 8;
+}
+
+static unsigned long get32(const uint8_t *p)
+{
+  return (unsigned long) get16(p) | (unsigned long) get16(p + 2) << 16;
+}
+
+static int readChunk(int fd, uint8_t nChunk, uint8_t *block)
+{
+  uint8_t command[TELEMETRY_REQUEST_SIZE] = {TELEMETRY_CMD_READ};
+  uint8_t reply[8];
+
+  command[1] = nChunk;
+  if (dongleRequest(fd, command, nChunk, reply) < 0) return -1;
+  memcpy(&block[nChunk * TELEMETRY_CHUNK_SIZE], &reply[3], TELEMETRY_CHUNK_SIZE);
+  return 0;
+}
+
+static int readDevice(const char *path)
+{
+  uint8_t block[TELEMETRY_CHUNKS * TELEMETRY_CHUNK_SIZE];
+  uint8_t nChunk;
+  int fd;
+  int i;
+
+  fd = open(path, O_RDWR);
+  if (fd < 0)
+  {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  for (nChunk = 0; nChunk < TELEMETRY_CHUNKS; nChunk++)
+  {
+    if (readChunk(fd, nChunk, block) < 0)
+    {
+      fprintf(stderr, "%s: no telemetry (%s)\n", path, strerror(errno));
+      close(fd);
+      return 1;
+    }
+  }
+  close(fd);
+  if (block[0] != TELEMETRY_VERSION)
+  {
+    fprintf(stderr, "%s: unsupported telemetry version %u\n", path, block[0]);
+    return 1;
+  }
+
+  if (bCsv)
+  {
+    printf("%s,%.3f,%u,%u,%u,%u,%u,%u", path, get32(&block[4]) / 1000.0,
+           get16(&block[8]), get16(&block[10]), get16(&block[12]),
+           get16(&block[14]), get16(&block[16]), get16(&block[18]));
+    for (i = 0; i < TELEMETRY_LATENCY_BUCKETS; i++)
+    {
+      printf(",%u", get16(&block[20 + 2 * i]));
+    }
+    printf(",%u,%u\n", block[1], get16(&block[2]));
+    return 0;
+  }
+
+  printf("%s\n", path);
+  printf("  Uptime              %.3f s\n", get32(&block[4]) / 1000.0);
+  printf("  Attaches            %u\n", get16(&block[8]));
+  printf("  Bus resets          %u\n", get16(&block[10]));
+  printf("  Keepalives sent     %u\n", get16(&block[12]));
+  printf("  Host stalls         %u\n", get16(&block[14]));
+  printf("  Write busy          %u ms\n", get16(&block[16]));
+  printf("  LED reports         %u\n", get16(&block[18]));
+  printf("  First LED report    %u ms after the last attach\n", get16(&block[2]));
+  printf("  Warm starts         %u\n", block[1]);
+  printf("  LED latency\n");
+  for (i = 0; i < TELEMETRY_LATENCY_BUCKETS; i++)
+  {
+    unsigned long nLimit = (16UL << i) * TELEMETRY_TICK_NS / 1000;
+    if (i < TELEMETRY_LATENCY_BUCKETS - 1)
+    {
+      printf("    < %5lu us       %u\n", nLimit, get16(&block[20 + 2 * i]));
+    }
+    else
+    {
+      printf("    >= %4lu us       %u\n", nLimit / 2, get16(&block[20 + 2 * i]));
+    }
+  }
+  return 0;
+}
+
+static int measurePoll(const char *path)
+{
+  uint8_t command[TELEMETRY_REQUEST_SIZE] = {POLL_CMD_MEASURE};
+  uint8_t reply[8];
+  int fd;
+
+  fd = open(path, O_RDWR);
+  if (fd < 0)
+  {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  if (dongleRequest(fd, command, POLL_TAG, reply) < 0)
+  {
+    fprintf(stderr, "%s: no polling measurement (%s)\n", path, strerror(errno));
+    close(fd);
+    return 1;
+  }
+  close(fd);
+
+  if (bCsv)
+  {
+    printf("%s,%u,%u,%u,%u,%u\n", path, reply[3], reply[4], reply[5], reply[6], reply[7]);
+    return 0;
+  }
+  printf("%s\n", path);
+  printf("  bInterval           %u ms\n", reply[3]);
+  printf("  Polling period      %u ms mean, %u to %u ms over %u polls\n", reply[6], reply[4], reply[5], reply[7]);
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  int rc = 0;
+  int n = 0;
+  int i = 1;
+
+  for (; i < argc && argv[i][0] == '-'; i++)
+  {
+    if (strcmp(argv[i], "-c") == 0)
+    {
+      bCsv = 1;
+    }
+    else if (strcmp(argv[i], "-p") == 0)
+    {
+      bPoll = 1;
+    }
+    else
+    {
+      fprintf(stderr, "Usage: capslock-telemetry [-c] [-p] [/dev/hidrawN...]\n");
+      return 2;
+    }
+  }
+  if (bCsv && bPoll)
+  {
+    printf("device,interval_ms,poll_min_ms,poll_max_ms,poll_mean_ms,polls\n");
+  }
+  else if (bCsv)
+  {
+    printf("device,uptime_s,attaches,bus_resets,keepalives,stalls,write_busy_ms,led_reports");
+    for (n = 0; n < TELEMETRY_LATENCY_BUCKETS; n++)
+    {
+      printf(",latency%d", n);
+    }
+    printf(",warm_starts,first_led_ms\n");
+    n = 0;
+  }
+  if (i < argc)
+  {
+    for (; i < argc; i++)
+    {
+      rc |= bPoll ? measurePoll(argv[i]) : readDevice(argv[i]);
+    }
+    return rc;
+  }
+
+  rc = dongleForEach(bPoll ? measurePoll : readDevice);
+  if (rc < 0)
+  {
+    fprintf(stderr, "No capslock dongle found\n");
+    return 1;
+  }
+  return rc;
+}
@@ -0,0 +1,314 @@
+#!/usr/bin/env python3
+#   Copyright (C) 2026 Andrew J. Armstrong
+#
+#   This program is free software; you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation; either version 2 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program; if not, write to the Free Software
+#   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+#
+#   Author:
+#   Andrew J. Armstrong <androidarmstrong@gmail.com>
+
+"""
+Cycle-accurate profile of the capslock firmware under the MPLAB X simulator.
+
+Loads the capslock.hex built by mikroC into the PIC16F1455 simulator (via
+the MPLAB X command line debugger, mdb) and uses the mikroC listing file
+(capslock.lst) to put breakpoints on the entry and every RETURN/RETFIE of
+each profiled function, and on the first instruction of each profiled
+source region. The simulator's stopwatch is read at every breakpoint, so
+each call and each pass through a region is measured in instruction cycles.
+
+The simulator does not model the USB serial interface engine, so a
+stimulus (SCL) file raises the USB interrupt flags instead:
+
+  - a bus reset (URSTIF) shortly after power-on
+  - a transaction complete interrupt (TRNIF) every millisecond, as a host
+    polling the endpoints would
+
+usbService() therefore finds an empty EP0 OUT buffer descriptor at each
+TRNIF and takes its status stage path. Its cycle counts are for that short
+path, not for a SETUP transaction. Timer1 and Timer2 are modelled by the simulator itself.
+
+The worst-case interrupt latency seen by the USB engine is reported as the
+longest interrupt() call plus the interrupt entry (a USB interrupt raised
+just after interrupt() starts is not serviced until it returns). The cycle
+counts do not depend on the CPU clock, so the latency is given both at
+48 MHz (while enumerating) and at 16 MHz (the rest of the time).
+
+Usage:
+  cycleprofile.py [--hex capslock.hex] [--lst capslock.lst] [--seconds 2]
+                  [--json profile.json] [--baseline old.json]
+
+pressKey() and queueReport() are first called by the keepalive, which is
+due KEEP_ALIVE_INTERVAL seconds after power-on, so use --seconds 61 (and be
+patient) to include them. enableUSB() and Prolog() run once at power-on.
+
+The report can be saved with --json and compared with a later build using
+--baseline, so firmware changes can be judged by cycle counts.
+"""
+
+import argparse
+import json
+import os
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+
+DEVICE = 'PIC16F1455'
+FOSC = 48000000                     # Must match the project's oscillator setting
+FOSC_SLOW = 16000000                # Once configured, the firmware runs from HFINTOSC (OSCCON_SLOW)
+CYCLES_PER_MS = FOSC // 4 // 1000   # One instruction cycle is four oscillator clocks
+FRAME_US = 1000                     # interrupt() must keep up with the 1 ms tick and USB frame
+INTERRUPT_ENTRY_CYCLES = 5          # Worst case: synchronisation plus the jump to 0x0004
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+SRC = os.path.join(HERE, '..', 'src')
+
+# Functions to profile (mikroC prefixes C names with an underscore)
+FUNCTIONS = ['interrupt', 'usbService', 'usbSetup', 'usbWrite',
+             'pressKey', 'queueReport', 'enableUSB', 'disableUSB', 'Prolog']
+
+# Regions of interrupt() to profile, located by source text so that they
+# follow the code when it moves. Each runs from the line matching 'start'
+# up to (but not including) the next line matching 'end'.
+REGIONS = [
+    {'name': 'USB branch',    'start': r'if \(USBIF_bit\)',           'end': r'nElapsed = 0;'},
+    {'name': 'Timer2 branch', 'start': r'if \(TMR2IF_bit\)',          'end': r'Timer1 interrupt\?'},
+    {'name': 'Timer1 branch', 'start': r'Timer1 interrupt\?',         'end': r'if \(bUSBEnabled && nReportHead'},
+    {'name': 'Report queue',  'start': r'if \(bUSBEnabled && nReportHead', 'end': r'if \(nElapsed\)'},
+    {'name': 'Timer expiry',  'start': r'if \(nElapsed\)',            'end': None},
+]
+
+RE_LABEL = re.compile(r'^_(\w+):\s*$')
+RE_SOURCE = re.compile(r'^;(\w+\.c),(\d+) ::')
+RE_INSTRUCTION = re.compile(r'^0x([0-9A-Fa-f]+)\s+0x[0-9A-Fa-f]+\s+(\w+)')
+RE_STOPWATCH = re.compile(r'cycle count\s*=\s*(\d+)', re.I)
+RE_STOPPED = re.compile(r'(?:address|breakpoint)\D*0x([0-9A-Fa-f]+)', re.I)
+
+
+def parse_listing(lst):
+    """Return {function: (entry, [exits])} and {(file, line): first address}."""
+    functions = {}
+    lines = {}
+    current = None
+    pending_label = None
+    pending_line = None
+    with open(lst, errors='replace') as f:
+        for text in f:
+            text = text.rstrip()
+            m = RE_LABEL.match(text)
+            if m:
+                pending_label = m.group(1)
+                continue
+            m = RE_SOURCE.match(text)
+            if m:
+                pending_line = (m.group(1), int(m.group(2)))
+                continue
+            m = RE_INSTRUCTION.match(text)
+            if not m:
+                continue
+            address = int(m.group(1), 16)
+            mnemonic = m.group(2).upper()
+            if pending_label:
+                current = pending_label
+                functions[current] = (address, [])
+                pending_label = None
+            if pending_line:
+                lines.setdefault(pending_line, address)
+                pending_line = None
+            if current and mnemonic in ('RETURN', 'RETFIE', 'RETLW'):
+                functions[current][1].append(address)
+    return functions, lines
+
+
+def find_regions(source, lines):
+    """Return [(name, start address, [end addresses])] for REGIONS in source."""
+    name = os.path.basename(source)
+    with open(source) as f:
+        text = f.read().splitlines()
+    body = next((i for i, t in enumerate(text) if re.match(r'void interrupt\(\)', t)), 0)
+
+    def line_of(pattern, after):
+        for i in range(after, len(text)):
+            if re.search(pattern, text[i]):
+                return i + 1
+        return None
+
+    def address_from(line):
+        for n in range(line, len(text) + 1):
+            if (name, n) in lines:
+                return lines[(name, n)]
+        return None
+
+    regions = []
+    for r in REGIONS:
+        start = line_of(r['start'], body)
+        if start is None:
+            print(f"warning: region '{r['name']}' not found in {name}", file=sys.stderr)
+            continue
+        end = line_of(r['end'], start) if r['end'] else None
+        a = address_from(start)
+        b = address_from(end) if end else None
+        if a is None:
+            continue
+        regions.append((r['name'], a, [b] if b is not None else []))
+    return regions
+
+
+def write_stimulus(path, seconds):
+    """Raise URSTIF once and TRNIF every millisecond (UIR bits 0 and 3, PIR2 bit 2)."""
+    ticks = int(seconds * 1000)
+    with open(path, 'w') as f:
+        f.write(f'configuration for "{DEVICE.lower()}" is\nend configuration;\n\n')
+        f.write(f'testbench for "{DEVICE.lower()}" is\nbegin\n')
+        f.write('  process is\n  begin\n')
+        f.write(f'    wait for {20 * CYCLES_PER_MS} ic;\n')
+        f.write('    UIR <= 16#01#;           -- bus reset\n')
+        f.write('    PIR2 <= 16#04#;\n')
+        f.write(f'    for i in 1 to {ticks} loop\n')
+        f.write(f'      wait for {CYCLES_PER_MS} ic;\n')
+        f.write('      UIR <= 16#08#;         -- transaction complete\n')
+        f.write('      PIR2 <= 16#04#;\n')
+        f.write('    end loop;\n')
+        f.write('    wait;\n  end process;\nend testbench;\n')
+
+
+def write_commands(path, hexfile, stimulus, breakpoints, stops):
+    with open(path, 'w') as f:
+        f.write(f'device {DEVICE}\nhwtool SIM\n')
+        f.write(f'program "{hexfile}"\n')
+        f.write(f'stim "{stimulus}"\n')
+        for address in sorted(breakpoints):
+            f.write(f'break *0x{address:X}\n')
+        f.write('reset\nstopwatch\nrun\n')
+        for _ in range(stops):
+            f.write('wait 5000\nstopwatch\ncontinue\n')
+        f.write('halt\nquit\n')
+
+
+def run_mdb(commands):
+    mdb = shutil.which('mdb') or shutil.which('mdb.sh')
+    if not mdb:
+        sys.exit('mdb (the MPLAB X command line debugger) is not on the PATH')
+    result = subprocess.run([mdb, commands], capture_output=True, text=True)
+    return result.stdout
+
+
+def analyse(output, functions, regions):
+    """Pair each entry with the next exit of the same function or region."""
+    entries = {}                  # address -> [names]
+    exits = {}                    # address -> [names]
+    samples = {}
+    for name, (entry, rets) in functions.items():
+        entries.setdefault(entry, []).append(name)
+        for r in rets:
+            exits.setdefault(r, []).append(name)
+        samples[name] = []
+    for name, start, ends in regions:
+        entries.setdefault(start, []).append(name)
+        for e in ends:
+            exits.setdefault(e, []).append(name)
+        samples[name] = []
+
+    open_at = {}
+    address = None
+    for text in output.splitlines():
+        m = RE_STOPPED.search(text)
+        if m:
+            address = int(m.group(1), 16)
+            continue
+        m = RE_STOPWATCH.search(text)
+        if not m or address is None:
+            continue
+        cycles = int(m.group(1))
+        for name in exits.get(address, []):   # Exits first: a region may end where another starts
+            if name in open_at:
+                samples[name].append(cycles - open_at.pop(name))
+        for name in entries.get(address, []):
+            open_at[name] = cycles
+        address = None
+    return samples
+
+
+def report(samples, baseline):
+    result = {}
+    print(f"{'':24} {'calls':>7} {'min':>7} {'mean':>9} {'max':>7}  cycles")
+    for name, s in samples.items():
+        if not s:
+            print(f'{name:24} {0:7}')
+            continue
+        result[name] = {'calls': len(s), 'min': min(s), 'mean': sum(s) / len(s), 'max': max(s)}
+        line = f"{name:24} {len(s):7} {min(s):7} {sum(s) / len(s):9.1f} {max(s):7}"
+        if baseline and name in baseline:
+            line += f"  (max {max(s) - baseline[name]['max']:+d})"
+        print(line)
+    if 'interrupt' in result:
+        latency = result['interrupt']['max'] + INTERRUPT_ENTRY_CYCLES
+        result['usb latency'] = {'max': latency}
+        print(f"\nWorst-case USB interrupt latency: {latency} cycles")
+        for fosc in (FOSC, FOSC_SLOW):
+            us = latency * 4e6 / fosc
+            print(f"  at {fosc // 1000000} MHz: {us:7.2f} us, {100 * us / FRAME_US:.1f}% of a 1 ms frame")
+    return result
+
+
+def main():
+    p = argparse.ArgumentParser(description='Cycle-accurate profile of the capslock firmware')
+    p.add_argument('--hex', default=os.path.join(SRC, 'capslock.hex'))
+    p.add_argument('--lst', default=os.path.join(SRC, 'capslock.lst'))
+    p.add_argument('--source', default=os.path.join(SRC, 'capslock.c'))
+    p.add_argument('--seconds', type=float, default=2.0, help='simulated time to run for')
+    p.add_argument('--json', help='save the report here')
+    p.add_argument('--baseline', help='compare with a report saved by --json')
+    args = p.parse_args()
+
+    functions, lines = parse_listing(args.lst)
+    missing = [f for f in FUNCTIONS if f not in functions]
+    if missing:
+        print(f"warning: not in {args.lst}: {', '.join(missing)}", file=sys.stderr)
+    functions = {f: functions[f] for f in FUNCTIONS if f in functions}
+    regions = find_regions(args.source, lines)
+
+    breakpoints = set()
+    for entry, rets in functions.values():
+        breakpoints.add(entry)
+        breakpoints.update(rets)
+    for _, start, ends in regions:
+        breakpoints.add(start)
+        breakpoints.update(ends)
+
+    # Every millisecond: interrupt() entry and exit, its regions, plus the
+    # USB stack calls. Allow for twice that.
+    stops = int(args.seconds * 1000) * 2 * (2 + 2 * len(regions) + 4)
+
+    with tempfile.TemporaryDirectory() as tmp:
+        stimulus = os.path.join(tmp, 'usb.scl')
+        commands = os.path.join(tmp, 'profile.mdb')
+        write_stimulus(stimulus, args.seconds)
+        write_commands(commands, os.path.abspath(args.hex), stimulus, breakpoints, stops)
+        output = run_mdb(commands)
+
+    baseline = None
+    if args.baseline:
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+    result = report(analyse(output, functions, regions), baseline)
+    if args.json:
+        with open(args.json, 'w') as f:
+            json.dump(result, f, indent=2)
+
+
+if __name__ == '__main__':
+    main()
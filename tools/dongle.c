@@ -0,0 +1,160 @@
+/*
+  CAP! CapsLock Light
+  Copyright (C) 2017 Andrew J. Armstrong
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+  02111-1307  USA
+
+  Author:
+  Andrew J. Armstrong <androidarmstrong@gmail.com>
+
+*/
+
+#define _GNU_SOURCE                 // memmem()
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/hidraw.h>
+#include "dongle.h"
+#include "../src/telemetry.h"
+
+static int readSysfs(const char *name, const char *file, unsigned *value) // One hex number from the hidraw device's sysfs
+{
+  char path[300];
+  FILE *f;
+  int n;
+
+  snprintf(path, sizeof path, "/sys/class/hidraw/%s/device/%s", name, file);
+  f = fopen(path, "r");
+  if (!f) return 0;
+  n = fscanf(f, " %x", value);
+  fclose(f);
+  return n == 1;
+}
+
+static int hasVendorPage(const char *name) // The report descriptor has a vendor-defined usage page (0xFF00)
+{
+  static const uint8_t page[] = {0x06, 0x00, 0xFF}; // USAGE_PAGE 0xFF00
+  char path[300];
+  uint8_t descriptor[4096];
+  size_t n;
+  FILE *f;
+
+  snprintf(path, sizeof path, "/sys/class/hidraw/%s/device/report_descriptor", name);
+  f = fopen(path, "rb");
+  if (!f) return 0;
+  n = fread(descriptor, 1, sizeof descriptor, f);
+  fclose(f);
+  return memmem(descriptor, n, page, sizeof page) != NULL;
+}
+
+static int isDongle(const char *name, unsigned product, unsigned interface, unsigned version)
+{
+  char path[300];
+  char line[256];
+  unsigned bus, vendor, id;
+  unsigned number, bcdDevice;
+  int found = 0;
+  FILE *f;
+
+  snprintf(path, sizeof path, "/sys/class/hidraw/%s/device/uevent", name);
+  f = fopen(path, "r");
+  if (!f) return 0;
+  while (fgets(line, sizeof line, f))
+  {
+    if (sscanf(line, "HID_ID=%x:%x:%x", &bus, &vendor, &id) == 3)
+    {
+      found = vendor == VENDOR_ID && id == product;
+    }
+  }
+  fclose(f);
+  if (!found || !hasVendorPage(name)) return 0; // (a real keyboard with the same ids has none)
+  if (!readSysfs(name, "../bInterfaceNumber", &number)) return 1; // (not on USB)
+  return number == interface && readSysfs(name, "../../bcdDevice", &bcdDevice) && bcdDevice >= version;
+}
+
+static int forEach(unsigned product, unsigned interface, unsigned version, int (*fn)(const char *path))
+{
+  char path[300];
+  struct dirent *entry;
+  DIR *dir;
+  int rc = 0;
+  int n = 0;
+
+  dir = opendir("/sys/class/hidraw");
+  if (dir)
+  {
+    while ((entry = readdir(dir)) != NULL)
+    {
+      if (entry->d_name[0] != '.' && isDongle(entry->d_name, product, interface, version))
+      {
+        snprintf(path, sizeof path, "/dev/%s", entry->d_name);
+        rc |= fn(path);
+        n++;
+      }
+    }
+    closedir(dir);
+  }
+  return n ? rc : -1;
+}
+
+int dongleForEach(int (*fn)(const char *path))
+{
+  return forEach(PRODUCT_ID, VENDOR_INTERFACE, FIRMWARE_VERSION, fn);
+}
+
+int dongleForEachProduct(unsigned product, int (*fn)(const char *path))
+{
+  return forEach(product, 0, 0, fn);
+}
+
+static int getFeature(int fd, uint8_t reply[8])
+{
+  uint8_t report[1 + TELEMETRY_REQUEST_SIZE];
+
+  report[0] = 0;                      // No report id (so the data follows it)
+  if (ioctl(fd, HIDIOCGFEATURE(sizeof report), report) < (int) sizeof report) return -1;
+  memcpy(reply, &report[1], TELEMETRY_REQUEST_SIZE);
+  return 0;
+}
+
+int dongleSend(int fd, const uint8_t command[8])
+{
+  uint8_t request[1 + TELEMETRY_REQUEST_SIZE];
+
+  request[0] = 0;                     // No report id
+  memcpy(&request[1], command, TELEMETRY_REQUEST_SIZE);
+  return ioctl(fd, HIDIOCSFEATURE(sizeof request), request) < 0 ? -1 : 0;
+}
+
+int dongleRequest(int fd, const uint8_t command[8], uint8_t tag, uint8_t reply[8])
+{
+  uint8_t last[8];
+  int waited;
+
+  if (getFeature(fd, last) < 0) return -1; // Byte 0 is the number of the last command answered
+  if (dongleSend(fd, command) < 0) return -1;
+  for (waited = 0; waited < TIMEOUT_MS; waited += FEATURE_POLL_MS) // Until the answer to this one is there
+  {
+    usleep(FEATURE_POLL_MS * 1000);
+    if (getFeature(fd, reply) < 0) return -1;
+    if ((int8_t) (reply[0] - last[0]) > 0 && reply[1] == tag && reply[2] == TELEMETRY_MARKER) return 0; // (normally last[0] + 1)
+  }
+  errno = ETIMEDOUT;
+  return -1;
+}
@@ -0,0 +1,56 @@
+/*
+  CAP! CapsLock Light
+  Copyright (C) 2017 Andrew J. Armstrong
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+  02111-1307  USA
+
+  Author:
+  Andrew J. Armstrong <androidarmstrong@gmail.com>
+
+*/
+
+/*
+  Finding capslock dongles and talking to them via Linux hidraw
+  (see src/telemetry.h for the vendor command protocol)
+*/
+#include <stdint.h>
+
+#define VENDOR_ID    0x04B3   // Must match USB_VENDOR_ID in USBdsc.c
+#define PRODUCT_ID   0x3019   // Must match USB_PRODUCT_ID in USBdsc.c
+#define VENDOR_INTERFACE 1    // Must match USB_VENDOR_INTERFACE in USBdsc.h
+#define FIRMWARE_VERSION 0x0300 // bcdDevice (USB_PRODUCT_VERSION in USBdsc.c) of the first firmware with vendor commands
+#define TIMEOUT_MS   500      // Per request (the dongle only answers while attached)
+#define FEATURE_POLL_MS 2     // How often dongleRequest() reads the feature report while it waits
+
+// Call fn for each dongle's hidraw device for the vendor commands (that of
+// its vendor interface); returns -1 if there are none, otherwise the results
+// of fn ORed together. A real keyboard has the same ids, so only a device
+// whose report descriptor has the vendor-defined usage page 0xFF00 counts,
+// and only with firmware FIRMWARE_VERSION or later (its bcdDevice).
+int dongleForEach(int (*fn)(const char *path));
+
+// The same, for the devices with another product id and a single interface
+// (BOOT_PRODUCT_ID for dongles running the bootloader)
+int dongleForEachProduct(unsigned product, int (*fn)(const char *path));
+
+// Send an 8-byte vendor command that is not answered, as a feature report;
+// returns 0, or -1 with errno set
+int dongleSend(int fd, const uint8_t command[8]);
+
+// Send an 8-byte vendor command and wait for the reply whose byte 1 is tag:
+// the feature report once its byte 0 has moved on from the last reply;
+// returns 0, or -1 with errno set
+int dongleRequest(int fd, const uint8_t command[8], uint8_t tag, uint8_t reply[8]);